@@ -0,0 +1,728 @@
+#include "bench.h"
+#include "../pl2w.h"
+#include <psapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Prints one JSON document with a result per benchmark: the best of
+   `reps` runs, as ns per op and ops per second, MB/s where the op
+   consumes source text, and how far the working set of the process
+   grew past what it was when the benchmark started, sampled after each
+   run while its data is still held. Run from the directory holding
+   libbenchstub.dll and libbenchez.dll, as `language` loads ./lib*.dll */
+
+typedef struct {
+  DWORD reps;
+  DWORD threads;
+  GENOPTIONS gen;
+  FILE *out;
+  int first;
+  SIZE_T workingSet;  /* when the current benchmark started */
+} BENCH;
+
+typedef struct {
+  const char *name;
+  double ops;       /* ops per run */
+  double bytes;     /* source bytes per run, or 0 */
+  double seconds;   /* best run */
+  long long workingSetDelta; /* largest sampled growth */
+} RESULT;
+
+static LARGE_INTEGER g_frequency;
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: bench [-N reps] [-j threads] [-o out.json] [generator options]\n"
+    "  -N  runs per benchmark, the best one is reported, default 5\n"
+    "  -j  threads for parse_parallel and dispatch_shared, default one per\n"
+    "      processor\n"
+    "  -o  write the JSON results to out.json instead of standard output\n");
+  genUsage();
+}
+
+static double now(void) {
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)g_frequency.QuadPart;
+}
+
+static SIZE_T workingSet(void) {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.WorkingSetSize;
+}
+
+/* the peak working set belongs to the whole process and only ever
+   grows, so each benchmark measures against its own starting point */
+static void begin(BENCH *bench) {
+  bench->workingSet = workingSet();
+}
+
+static void sample(BENCH *bench, RESULT *result) {
+  long long delta = (long long)workingSet() - (long long)bench->workingSet;
+  if (delta > result->workingSetDelta) {
+    result->workingSetDelta = delta;
+  }
+}
+
+static void check(LPERROR error, const char *what) {
+  if (IsError(error)) {
+    fprintf(stderr, "%s: error %d: line %llu: %s\n",
+            what,
+            error->nLine,
+            (unsigned long long)error->srcInfo.nLine,
+            ErrorReason(error));
+    exit(-1);
+  }
+}
+
+static void report(BENCH *bench, const RESULT *result) {
+  double ns = result->seconds * 1e9 / result->ops;
+  fprintf(bench->out,
+          "%s\n    {\"name\": \"%s\", \"ops\": %.0f, \"ns_per_op\": %.2f, "
+          "\"ops_per_sec\": %.0f",
+          bench->first ? "" : ",",
+          result->name,
+          result->ops,
+          ns,
+          result->ops / result->seconds);
+  if (result->bytes > 0) {
+    fprintf(bench->out, ", \"mb_per_sec\": %.2f",
+            result->bytes / result->seconds / (1024.0 * 1024.0));
+  }
+  fprintf(bench->out, ", \"working_set_delta_bytes\": %lld}",
+          result->workingSetDelta);
+  bench->first = 0;
+  fprintf(stderr, "%-20s %12.2f ns/op\n", result->name, ns);
+}
+
+static char *generate(BENCH *bench, const char *language, size_t *size) {
+  GENOPTIONS options = bench->gen;
+  options.language = language;
+  char *text = generateProgram(&options, size);
+  if (text == NULL) {
+    fprintf(stderr, "cannot allocate memory for the generated program\n");
+    exit(-1);
+  }
+  return text;
+}
+
+static LPPROGRAM parse(char *copy, const char *text, size_t size,
+                       DWORD threads, LPERROR error) {
+  memcpy(copy, text, size + 1);
+  LPPROGRAM program = threads == 1
+    ? ParseProgram(copy, 512, error)
+    : ParseProgramParallel(copy, size, 512, threads, error);
+  if (program == NULL) {
+    fprintf(stderr, "cannot allocate memory for parsing\n");
+    exit(-1);
+  }
+  check(error, "parse");
+  return program;
+}
+
+static void dropProgram(LPPROGRAM program) {
+  DropProgram(program);
+  free(program);
+}
+
+/* ParseProgram, ParseProgramParallel and DropProgram on one program */
+static void benchParse(BENCH *bench) {
+  begin(bench);
+  size_t size;
+  char *text = generate(bench, NULL, &size);
+  char *copy = (char*)malloc(size + 1);
+  LPERROR error = ErrorBuffer(512);
+  if (copy == NULL || error == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+
+  RESULT parseResult = { "parse", bench->gen.lines, (double)size, 1e30, 0 };
+  RESULT parallelResult = { "parse_parallel", bench->gen.lines,
+                            (double)size, 1e30, 0 };
+  RESULT dropResult = { "drop_program", bench->gen.lines, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    memcpy(copy, text, size + 1);
+    double start = now();
+    LPPROGRAM program = ParseProgram(copy, 512, error);
+    double elapsed = now() - start;
+    if (program == NULL) {
+      fprintf(stderr, "cannot allocate memory for parsing\n");
+      exit(-1);
+    }
+    check(error, "parse");
+    if (elapsed < parseResult.seconds) {
+      parseResult.seconds = elapsed;
+    }
+    sample(bench, &parseResult);
+    sample(bench, &dropResult);
+
+    start = now();
+    dropProgram(program);
+    elapsed = now() - start;
+    if (elapsed < dropResult.seconds) {
+      dropResult.seconds = elapsed;
+    }
+
+    memcpy(copy, text, size + 1);
+    start = now();
+    program = ParseProgramParallel(copy, size, 512, bench->threads, error);
+    elapsed = now() - start;
+    if (program == NULL) {
+      fprintf(stderr, "cannot allocate memory for parsing\n");
+      exit(-1);
+    }
+    check(error, "parse_parallel");
+    if (elapsed < parallelResult.seconds) {
+      parallelResult.seconds = elapsed;
+    }
+    sample(bench, &parallelResult);
+    dropProgram(program);
+  }
+  report(bench, &parseResult);
+  report(bench, &parallelResult);
+  report(bench, &dropResult);
+
+  DropError(error);
+  free(copy);
+  free(text);
+}
+
+/* ReparseProgram keeping a program of the generated source up to date
+   with edits to a line in the middle of it, alternately appending ` z'
+   to the line and taking it off again */
+static void benchReparse(BENCH *bench) {
+  enum { EDITS = 1000 };
+  begin(bench);
+  size_t size;
+  char *text = generate(bench, NULL, &size);
+  char *edited = (char*)realloc(text, size + 3);
+  LPERROR error = ErrorBuffer(512);
+  if (edited == NULL || error == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+  text = edited;
+  char *lineEnd = strchr(text + size / 2, '\n');
+  size_t at = lineEnd != NULL ? (size_t)(lineEnd - text) : size;
+
+  RESULT result = { "reparse_edit", EDITS, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    LPPROGRAM program = ParseProgramCopy(text, 512, error);
+    if (program == NULL) {
+      fprintf(stderr, "cannot allocate memory for parsing\n");
+      exit(-1);
+    }
+    check(error, "reparse_edit");
+    double elapsed = 0;
+    for (int i = 0; i < EDITS; i++) {
+      int insert = i % 2 == 0;
+      double start = now();
+      ReparseProgram(program, text, at, insert ? 0 : 2,
+                     " z", insert ? 2 : 0, 512, error);
+      elapsed += now() - start;
+      check(error, "reparse_edit");
+      if (insert) {
+        memmove(text + at + 2, text + at, size - at + 1);
+        memcpy(text + at, " z", 2);
+      } else {
+        memmove(text + at, text + at + 2, size - at + 1);
+      }
+    }
+    if (elapsed < result.seconds) {
+      result.seconds = elapsed;
+    }
+    sample(bench, &result);
+    dropProgram(program);
+  }
+  report(bench, &result);
+
+  DropError(error);
+  free(text);
+}
+
+/* RunProgramEx over the generated program, which goes through language
+   loading once and then one handler call per command */
+static void benchDispatch(BENCH *bench, const char *name,
+                          const char *language, const char *batch,
+                          const char *fuse, int flatten, int threaded) {
+  begin(bench);
+  static char batchVar[64];
+  static char fuseVar[64];
+  snprintf(batchVar, sizeof(batchVar), "%s=%s", STUB_ENV_BATCH, batch);
+  putenv(batchVar);
+  snprintf(fuseVar, sizeof(fuseVar), "%s=%s", STUB_ENV_FUSE, fuse);
+  putenv(fuseVar);
+  /* the stub reads the variable when it is loaded */
+  EvictLanguages(NULL);
+
+  size_t size;
+  char *text = generate(bench, language, &size);
+  char *copy = (char*)malloc(size + 1);
+  LPERROR error = ErrorBuffer(512);
+  if (copy == NULL || error == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+
+  RUNOPTIONS options;
+  options.cbSize = sizeof(RUNOPTIONS);
+  options.lpszProfileFile = NULL;
+  options.bSharedProgram = FALSE;
+  options.bLazyEasyLoad = FALSE;
+  options.bThreadedCode = threaded;
+
+  RESULT result = { name, bench->gen.lines, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    LPPROGRAM program = parse(copy, text, size, 1, error);
+    if (flatten) {
+      FlattenProgram(program, error);
+      check(error, "flatten");
+    }
+    double start = now();
+    RunProgramEx(program, &options, error);
+    double elapsed = now() - start;
+    check(error, name);
+    if (elapsed < result.seconds) {
+      result.seconds = elapsed;
+    }
+    sample(bench, &result);
+    dropProgram(program);
+  }
+  report(bench, &result);
+
+  DropError(error);
+  free(copy);
+  free(text);
+}
+
+typedef struct {
+  LPPROGRAM program;
+  DWORD runs;
+  LPERROR error;
+} SHAREDRUNS;
+
+static DWORD WINAPI sharedRuns(LPVOID param) {
+  SHAREDRUNS *shared = (SHAREDRUNS*)param;
+  RUNOPTIONS options;
+  options.cbSize = sizeof(RUNOPTIONS);
+  options.lpszProfileFile = NULL;
+  options.bSharedProgram = TRUE;
+  options.bLazyEasyLoad = FALSE;
+  options.bThreadedCode = FALSE;
+  for (DWORD i = 0; i < shared->runs && !IsError(shared->error); i++) {
+    RunProgramEx(shared->program, &options, shared->error);
+  }
+  return 0;
+}
+
+/* SHARED_RUNS runs of one program spread over the threads, all of them
+   loading the language and dispatching on the program at the same time */
+static void benchShared(BENCH *bench, const char *name, int flatten) {
+  enum { SHARED_RUNS = 256, MAX_THREADS = 64 };
+  begin(bench);
+  putenv((char*)STUB_ENV_BATCH "=0");
+  putenv((char*)STUB_ENV_FUSE "=0");
+  EvictLanguages(NULL);
+
+  DWORD threads = bench->threads;
+  if (threads == 0) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    threads = info.dwNumberOfProcessors;
+  }
+  if (threads > MAX_THREADS) {
+    threads = MAX_THREADS;
+  }
+
+  size_t size;
+  char *text = generate(bench, "benchstub 0.1", &size);
+  char *copy = (char*)malloc(size + 1);
+  LPERROR error = ErrorBuffer(512);
+  if (copy == NULL || error == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+  LPPROGRAM program = parse(copy, text, size, 1, error);
+  if (flatten) {
+    FlattenProgram(program, error);
+    check(error, "flatten");
+  }
+
+  SHAREDRUNS runs[MAX_THREADS];
+  HANDLE handles[MAX_THREADS];
+  RESULT result = { name, (double)bench->gen.lines * SHARED_RUNS, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    double start = now();
+    for (DWORD i = 0; i < threads; i++) {
+      runs[i].program = program;
+      runs[i].runs = SHARED_RUNS / threads + (i < SHARED_RUNS % threads);
+      runs[i].error = ErrorBuffer(512);
+      if (runs[i].error == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        exit(-1);
+      }
+      handles[i] = CreateThread(NULL, 0, sharedRuns, &runs[i], 0, NULL);
+      if (handles[i] == NULL) {
+        fprintf(stderr, "cannot create thread\n");
+        exit(-1);
+      }
+    }
+    for (DWORD i = 0; i < threads; i++) {
+      WaitForSingleObject(handles[i], INFINITE);
+      CloseHandle(handles[i]);
+    }
+    double elapsed = now() - start;
+    for (DWORD i = 0; i < threads; i++) {
+      check(runs[i].error, name);
+      DropError(runs[i].error);
+    }
+    if (elapsed < result.seconds) {
+      result.seconds = elapsed;
+    }
+    sample(bench, &result);
+  }
+  report(bench, &result);
+
+  dropProgram(program);
+  DropError(error);
+  free(copy);
+  free(text);
+}
+
+/* SCHEDULED_RUNS runs of one program of WAITS `wait 1' lines on one
+   scheduler, ideally taking little more than WAITS milliseconds where
+   running them one after another takes SCHEDULED_RUNS times that */
+static void benchSchedule(BENCH *bench) {
+  enum { SCHEDULED_RUNS = 1000, WAITS = 10 };
+  begin(bench);
+  putenv((char*)STUB_ENV_BATCH "=0");
+  putenv((char*)STUB_ENV_FUSE "=0");
+  EvictLanguages(NULL);
+
+  char text[256];
+  char copy[256];
+  int length = snprintf(text, sizeof(text), "language benchstub 0.1\n");
+  for (int i = 0; i < WAITS; i++) {
+    length += snprintf(text + length, sizeof(text) - length, "wait 1\n");
+  }
+  LPERROR error = ErrorBuffer(512);
+  LPERROR *errors = (LPERROR*)calloc(SCHEDULED_RUNS, sizeof(LPERROR));
+  if (error == NULL || errors == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+  LPPROGRAM program = parse(copy, text, (size_t)length, 1, error);
+  RUNOPTIONS options;
+  options.cbSize = sizeof(RUNOPTIONS);
+  options.lpszProfileFile = NULL;
+  options.bSharedProgram = TRUE;
+  options.bLazyEasyLoad = FALSE;
+  options.bThreadedCode = FALSE;
+
+  RESULT result = { "schedule_wait", SCHEDULED_RUNS * WAITS, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    LPSCHEDULER scheduler = CreateScheduler(error);
+    check(error, "schedule_wait");
+    for (DWORD i = 0; i < SCHEDULED_RUNS; i++) {
+      if (errors[i] == NULL && (errors[i] = ErrorBuffer(512)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        exit(-1);
+      }
+      ScheduleProgram(scheduler, program, &options, errors[i]);
+      check(errors[i], "schedule_wait");
+    }
+    double start = now();
+    RunScheduler(scheduler);
+    double elapsed = now() - start;
+    sample(bench, &result);
+    DropScheduler(scheduler);
+    for (DWORD i = 0; i < SCHEDULED_RUNS; i++) {
+      check(errors[i], "schedule_wait");
+    }
+    if (elapsed < result.seconds) {
+      result.seconds = elapsed;
+    }
+  }
+  report(bench, &result);
+
+  for (DWORD i = 0; i < SCHEDULED_RUNS; i++) {
+    if (errors[i] != NULL) {
+      DropError(errors[i]);
+    }
+  }
+  free(errors);
+  dropProgram(program);
+  DropError(error);
+}
+
+/* a program consisting of the `language` command alone: LoadLibrary,
+   LoadLanguageExtension or EasyLoad, dispatch table, FreeLibrary, or
+   just the dispatch table when the language stays cached; a lazy
+   EasyLoad looks up no handler at all */
+static void benchLoad(BENCH *bench, const char *name, const char *language,
+                      int cached, int lazy) {
+  begin(bench);
+  RUNOPTIONS options;
+  options.cbSize = sizeof(RUNOPTIONS);
+  options.lpszProfileFile = NULL;
+  options.bSharedProgram = FALSE;
+  options.bLazyEasyLoad = lazy;
+  options.bThreadedCode = FALSE;
+  enum { LOADS = 200 };
+  char text[64];
+  char copy[64];
+  snprintf(text, sizeof(text), "language %s 0.1\n", language);
+  LPERROR error = ErrorBuffer(512);
+  if (error == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+
+  RESULT result = { name, LOADS, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    double elapsed = 0;
+    for (int i = 0; i < LOADS; i++) {
+      LPPROGRAM program = parse(copy, text, strlen(text), 1, error);
+      double start = now();
+      RunProgramEx(program, &options, error);
+      if (!cached) {
+        EvictLanguages(NULL);
+      }
+      elapsed += now() - start;
+      check(error, name);
+      sample(bench, &result);
+      dropProgram(program);
+    }
+    if (elapsed < result.seconds) {
+      result.seconds = elapsed;
+    }
+  }
+  report(bench, &result);
+  DropError(error);
+}
+
+static void benchSemVer(BENCH *bench) {
+  static const char *versions[] = {
+    "0.1.1", "^1.2.3", "2", "10.4", "3.0.0-alpha", "1.22.333-halley"
+  };
+  enum { COUNT = sizeof(versions) / sizeof(versions[0]), ROUNDS = 100000 };
+  begin(bench);
+  LPERROR error = ErrorBuffer(512);
+  if (error == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+
+  volatile WORD sink = 0;
+  RESULT result = { "parse_semver", (double)COUNT * ROUNDS, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    double start = now();
+    for (int i = 0; i < ROUNDS; i++) {
+      for (int j = 0; j < COUNT; j++) {
+        sink += ParseSemVer(versions[j], error).nPatch;
+      }
+    }
+    double elapsed = now() - start;
+    check(error, "parse_semver");
+    if (elapsed < result.seconds) {
+      result.seconds = elapsed;
+    }
+    sample(bench, &result);
+  }
+  (void)sink;
+  report(bench, &result);
+  DropError(error);
+}
+
+/* versions looked up in a search path directory of 1000 modules, all
+   but the first scan served by the in-memory index */
+static void benchResolve(BENCH *bench) {
+  enum { MAJORS = 10, MINORS = 10, PATCHES = 10, ROUNDS = 100000 };
+  begin(bench);
+  static const char *dir = "benchlangs";
+  static const char *cacheName = "benchlangs.cache";
+  char path[MAX_PATH];
+  CreateDirectoryA(dir, NULL);
+  for (int i = 0; i < MAJORS * MINORS * PATCHES; i++) {
+    snprintf(path, sizeof(path), "%s/libbenchv-%d.%d.%d.dll", dir,
+             i / (MINORS * PATCHES), i / PATCHES % MINORS, i % PATCHES);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "cannot create %s\n", path);
+      exit(-1);
+    }
+    fclose(fp);
+  }
+  LPERROR error = ErrorBuffer(512);
+  if (error == NULL || !SetLanguagePath(dir, cacheName)) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+  SEMVER versions[MAJORS];
+  for (int i = 0; i < MAJORS; i++) {
+    snprintf(path, sizeof(path), "%d.%d", i, i % MINORS);
+    versions[i] = ParseSemVer(path, error);
+    check(error, "resolve_language");
+  }
+
+  volatile DWORD found = 0;
+  RESULT result = { "resolve_language", (double)MAJORS * ROUNDS, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    double start = now();
+    for (int i = 0; i < ROUNDS; i++) {
+      for (int j = 0; j < MAJORS; j++) {
+        found += ResolveLanguage("benchv", versions[j], path, NULL);
+      }
+    }
+    double elapsed = now() - start;
+    if (elapsed < result.seconds) {
+      result.seconds = elapsed;
+    }
+    sample(bench, &result);
+  }
+  (void)found;
+  report(bench, &result);
+  DropError(error);
+
+  SetLanguagePath(NULL, NULL);
+  for (int i = 0; i < MAJORS * MINORS * PATCHES; i++) {
+    snprintf(path, sizeof(path), "%s/libbenchv-%d.%d.%d.dll", dir,
+             i / (MINORS * PATCHES), i / PATCHES % MINORS, i % PATCHES);
+    DeleteFileA(path);
+  }
+  RemoveDirectoryA(dir);
+  DeleteFileA(cacheName);
+}
+
+/* a language probing a version that may not parse, as with fallbacks:
+   the error is only tested and cleared, never read */
+static void benchErrorProbe(BENCH *bench, const char *name, int lazy) {
+  static const char *versions[] = { "1.x", "1.2x", "v1", "3.0.0-alpha" };
+  enum { COUNT = sizeof(versions) / sizeof(versions[0]), ROUNDS = 100000 };
+  begin(bench);
+  LONGLONG space[(ERROR_BUFFER_SIZE(512) + 7) / 8];
+  LPERROR error = lazy ? InitError(space, sizeof(space), TRUE)
+                       : ErrorBuffer(512);
+  if (error == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    exit(-1);
+  }
+
+  volatile DWORD failed = 0;
+  RESULT result = { name, (double)COUNT * ROUNDS, 0, 1e30, 0 };
+  for (DWORD rep = 0; rep < bench->reps; rep++) {
+    double start = now();
+    for (int i = 0; i < ROUNDS; i++) {
+      for (int j = 0; j < COUNT; j++) {
+        ParseSemVer(versions[j], error);
+        if (IsError(error)) {
+          failed++;
+          error->nLine = 0;
+        }
+      }
+    }
+    double elapsed = now() - start;
+    if (elapsed < result.seconds) {
+      result.seconds = elapsed;
+    }
+    sample(bench, &result);
+  }
+  (void)failed;
+  report(bench, &result);
+  if (!lazy) {
+    DropError(error);
+  }
+}
+
+int main(int argc, const char *argv[]) {
+  BENCH bench;
+  bench.reps = 5;
+  bench.threads = 0;
+  bench.out = stdout;
+  bench.first = 1;
+  defaultGenOptions(&bench.gen);
+
+  const char *outName = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-N") && i + 1 < argc) {
+      bench.reps = (DWORD)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      bench.threads = (DWORD)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      outName = argv[++i];
+    } else if (!parseGenOption(&bench.gen, argc, argv, &i)) {
+      usage();
+      return -1;
+    }
+  }
+  if (bench.reps == 0) {
+    bench.reps = 1;
+  }
+  if (bench.gen.handlers > STUB_MAX_HANDLERS) {
+    bench.gen.handlers = STUB_MAX_HANDLERS;
+  }
+  if (outName != NULL && (bench.out = fopen(outName, "w")) == NULL) {
+    fprintf(stderr, "cannot open output file %s\n", outName);
+    return -1;
+  }
+
+  static char handlersVar[64];
+  snprintf(handlersVar, sizeof(handlersVar), "%s=%u",
+           STUB_ENV_HANDLERS, (unsigned)bench.gen.handlers);
+  putenv(handlersVar);
+  QueryPerformanceFrequency(&g_frequency);
+
+  fprintf(bench.out,
+          "{\n  \"edition\": \"%s\",\n"
+          "  \"version\": \"%u.%u.%u-%s\",\n"
+          "  \"reps\": %u,\n"
+          "  \"program\": {\"lines\": %u, \"args\": %u, \"string_pct\": %u, "
+          "\"escape_pct\": %u, \"begin_pct\": %u, \"comment_pct\": %u, "
+          "\"handlers\": %u, \"seed\": %u},\n"
+          "  \"results\": [",
+          PL2_EDITION,
+          PL2W_VER_MAJOR, PL2W_VER_MINOR, PL2W_VER_PATCH, PL2W_VER_POSTFIX,
+          (unsigned)bench.reps,
+          (unsigned)bench.gen.lines, (unsigned)bench.gen.args,
+          (unsigned)bench.gen.stringPct, (unsigned)bench.gen.escapePct,
+          (unsigned)bench.gen.beginPct, (unsigned)bench.gen.commentPct,
+          (unsigned)bench.gen.handlers, (unsigned)bench.gen.seed);
+
+  benchParse(&bench);
+  benchReparse(&bench);
+  benchDispatch(&bench, "dispatch", "benchstub 0.1", "0", "0", 0, 0);
+  benchDispatch(&bench, "dispatch_flat", "benchstub 0.1", "0", "0", 1, 0);
+  benchDispatch(&bench, "dispatch_batch", "benchstub 0.1", "1", "0", 0, 0);
+  benchDispatch(&bench, "dispatch_fused", "benchstub 0.1", "0", "1", 0, 0);
+  benchDispatch(&bench, "dispatch_fused_flat", "benchstub 0.1",
+                "0", "1", 1, 0);
+  benchDispatch(&bench, "dispatch_threaded", "benchstub 0.1",
+                "0", "0", 0, 1);
+  benchDispatch(&bench, "dispatch_threaded_flat", "benchstub 0.1",
+                "0", "0", 1, 1);
+  benchDispatch(&bench, "dispatch_easyload", "benchez 0.1", "0", "0", 0, 0);
+  benchShared(&bench, "dispatch_shared", 0);
+  benchShared(&bench, "dispatch_shared_flat", 1);
+  benchSchedule(&bench);
+  benchLoad(&bench, "load_language", "benchstub", 0, 0);
+  benchLoad(&bench, "load_easyload", "benchez", 0, 0);
+  benchLoad(&bench, "load_easyload_lazy", "benchez", 0, 1);
+  benchLoad(&bench, "load_language_cached", "benchstub", 1, 0);
+  benchLoad(&bench, "load_easyload_cached", "benchez", 1, 0);
+  benchSemVer(&bench);
+  benchResolve(&bench);
+  benchErrorProbe(&bench, "error_probe", 0);
+  benchErrorProbe(&bench, "error_probe_lazy", 1);
+
+  fprintf(bench.out, "\n  ]\n}\n");
+  if (bench.out != stdout) {
+    fclose(bench.out);
+  }
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef PL2W_BENCH_H
+#define PL2W_BENCH_H
+
+#include <stddef.h>
+#include <windows.h>
+
+/* the stub language registers handlers h0..h<n-1> */
+#define STUB_MAX_HANDLERS 100
+#define STUB_ENV_HANDLERS "PL2W_BENCH_HANDLERS"
+#define STUB_ENV_BATCH    "PL2W_BENCH_BATCH"
+#define STUB_ENV_FUSE     "PL2W_BENCH_FUSE"
+
+typedef struct {
+  DWORD lines;          /* lines, comments and ?begin blocks included */
+  DWORD args;           /* arguments per command */
+  DWORD stringPct;      /* arguments written as string literals */
+  DWORD escapePct;      /* string literals carrying escapes */
+  DWORD beginPct;       /* commands written as ?begin blocks */
+  DWORD commentPct;     /* comment lines */
+  DWORD handlers;       /* command names cycle through h0..h<n-1> */
+  DWORD seed;
+  const char *language; /* `language` command to start with, or NULL */
+} GENOPTIONS;
+
+void defaultGenOptions(GENOPTIONS *options);
+
+/* consumes the generator option at argv[*i] and its value; returns 0
+   when argv[*i] is not one */
+int parseGenOption(GENOPTIONS *options, int argc, const char *argv[],
+                   int *i);
+void genUsage(void);
+
+/* a `\0`-terminated program, to be released with free */
+char *generateProgram(const GENOPTIONS *options, size_t *size);
+
+#endif /* PL2W_BENCH_H */
@@ -0,0 +1,146 @@
+#include "bench.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  char *data;
+  size_t size;
+  size_t capacity;
+} TEXT;
+
+static void put(TEXT *text, const char *fmt, ...);
+static DWORD nextRandom(DWORD *state);
+static int chance(DWORD *state, DWORD pct);
+
+void defaultGenOptions(GENOPTIONS *options) {
+  options->lines = 200000;
+  options->args = 3;
+  options->stringPct = 30;
+  options->escapePct = 10;
+  options->beginPct = 2;
+  options->commentPct = 10;
+  options->handlers = 16;
+  options->seed = 1;
+  options->language = NULL;
+}
+
+int parseGenOption(GENOPTIONS *options, int argc, const char *argv[],
+                   int *i) {
+  static const struct {
+    const char *flag;
+    size_t offset;
+  } flags[] = {
+    { "-n", offsetof(GENOPTIONS, lines) },
+    { "-a", offsetof(GENOPTIONS, args) },
+    { "-s", offsetof(GENOPTIONS, stringPct) },
+    { "-e", offsetof(GENOPTIONS, escapePct) },
+    { "-b", offsetof(GENOPTIONS, beginPct) },
+    { "-c", offsetof(GENOPTIONS, commentPct) },
+    { "-k", offsetof(GENOPTIONS, handlers) },
+    { "-r", offsetof(GENOPTIONS, seed) },
+  };
+  if (*i + 1 >= argc) {
+    return 0;
+  }
+  for (size_t j = 0; j < sizeof(flags) / sizeof(flags[0]); j++) {
+    if (!strcmp(argv[*i], flags[j].flag)) {
+      *(DWORD*)((char*)options + flags[j].offset) =
+        (DWORD)strtoul(argv[++*i], NULL, 10);
+      if (options->handlers == 0) {
+        options->handlers = 1;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void genUsage(void) {
+  fprintf(stderr,
+    "  -n  lines, default 200000\n"
+    "  -a  arguments per command, default 3\n"
+    "  -s  percentage of arguments that are string literals, default 30\n"
+    "  -e  percentage of string literals with escapes, default 10\n"
+    "  -b  percentage of commands written as ?begin blocks, default 2\n"
+    "  -c  percentage of lines that are comments, default 10\n"
+    "  -k  distinct command names, default 16\n"
+    "  -r  random seed, default 1\n");
+}
+
+char *generateProgram(const GENOPTIONS *options, size_t *size) {
+  TEXT text = { NULL, 0, 1024 * 1024 };
+  text.data = (char*)malloc(text.capacity);
+  DWORD state = options->seed != 0 ? options->seed : 1;
+  if (options->language != NULL) {
+    put(&text, "language %s\n", options->language);
+  }
+
+  int comment = 0;
+  for (DWORD i = 0; i < options->lines && text.data != NULL; i++) {
+    if (chance(&state, options->commentPct)) {
+      put(&text, "# comment on line %u, nothing to see here\n", i);
+      comment = 1;
+      continue;
+    }
+
+    /* a comment takes its line end with it, so the parser would see a
+       `?begin` right after one in the middle of a line */
+    int begin = chance(&state, options->beginPct) && !comment;
+    comment = 0;
+    const char *sep = begin ? "\n" : " ";
+    put(&text, begin ? "?begin\nh%u" : "h%u", i % options->handlers);
+    for (DWORD j = 0; j < options->args; j++) {
+      if (!chance(&state, options->stringPct)) {
+        put(&text, "%sarg%u", sep, j);
+      } else if (chance(&state, options->escapePct)) {
+        put(&text, "%s\"line %u\\targ %u\\n\\\"quoted\\\"\"", sep, i, j);
+      } else {
+        put(&text, "%s\"line %u arg %u\"", sep, i, j);
+      }
+    }
+    put(&text, begin ? "\n?end\n" : "\n");
+  }
+
+  if (text.data == NULL) {
+    return NULL;
+  }
+  *size = text.size;
+  return text.data;
+}
+
+static void put(TEXT *text, const char *fmt, ...) {
+  for (;;) {
+    if (text->data == NULL) {
+      return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(text->data + text->size, text->capacity - text->size,
+                      fmt, ap);
+    va_end(ap);
+    if (n >= 0 && (size_t)n < text->capacity - text->size) {
+      text->size += (size_t)n;
+      return;
+    }
+    char *data = (char*)realloc(text->data, text->capacity * 2);
+    if (data == NULL) {
+      free(text->data);
+    }
+    text->data = data;
+    text->capacity *= 2;
+  }
+}
+
+static DWORD nextRandom(DWORD *state) {
+  /* xorshift32, so programs are the same on every platform */
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static int chance(DWORD *state, DWORD pct) {
+  return nextRandom(state) % 100 < pct;
+}
@@ -0,0 +1,34 @@
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* writes a synthetic program to standard output, for timing pl2w.exe
+   itself or keeping a program around; commands are named h0..h<n-1>
+   like the handlers of the benchmark stub language */
+
+int main(int argc, const char *argv[]) {
+  GENOPTIONS options;
+  defaultGenOptions(&options);
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+      options.language = argv[++i];
+    } else if (!parseGenOption(&options, argc, argv, &i)) {
+      fprintf(stderr,
+        "usage: plgen [-l \"language version\"] [generator options]\n"
+        "  -l  start the program with `language <language version>`\n");
+      genUsage();
+      return -1;
+    }
+  }
+
+  size_t size;
+  char *text = generateProgram(&options, &size);
+  if (text == NULL) {
+    fprintf(stderr, "cannot allocate memory for the generated program\n");
+    return -1;
+  }
+  fwrite(text, 1, size, stdout);
+  free(text);
+  return 0;
+}
@@ -0,0 +1,213 @@
+#include "../pl2w.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Starts many runs of one program with bSharedProgram at the same time,
+   parsed and flattened, in rounds where another thread keeps evicting
+   the language, and checks that every run ended without an error and
+   ran each of its commands exactly once. `make stress` builds it with
+   pl2w.c under -fsanitize=thread; run from the directory holding
+   libstress.dll, as `language` loads ./lib*.dll */
+
+typedef void (*STRESSTOTALSPROC)(LONG *hits, LONG *mismatches, LONG *runs);
+
+typedef struct {
+  LPPROGRAM program;
+  HANDLE start;
+  LPERROR error;
+} STRESSRUN;
+
+static volatile LONG g_stopEvicting;
+
+static DWORD WINAPI runShared(LPVOID param) {
+  STRESSRUN *run = (STRESSRUN*)param;
+  RUNOPTIONS options;
+  options.cbSize = sizeof(RUNOPTIONS);
+  options.lpszProfileFile = NULL;
+  options.bSharedProgram = TRUE;
+  options.bLazyEasyLoad = FALSE;
+  options.bThreadedCode = FALSE;
+  WaitForSingleObject(run->start, INFINITE);
+  RunProgramEx(run->program, &options, run->error);
+  return 0;
+}
+
+static DWORD WINAPI evictLanguage(LPVOID param) {
+  (void)param;
+  while (!InterlockedCompareExchange(&g_stopEvicting, 0, 0)) {
+    EvictLanguages("stress");
+    Sleep(0);
+  }
+  return 0;
+}
+
+/* `hit' and `add' lines taking turns, then the `check' of their sum */
+static char *generate(DWORD lines, DWORD *hits) {
+  size_t size = 64 + (size_t)lines * 16;
+  char *text = (char*)malloc(size);
+  if (text == NULL) {
+    return NULL;
+  }
+  size_t length = (size_t)sprintf(text, "language stress 0.1\n");
+  long long sum = 0;
+  *hits = 0;
+  for (DWORD i = 0; i < lines; i++) {
+    if (i % 2 == 0) {
+      length += (size_t)sprintf(text + length, "hit %u x\n", (unsigned)i);
+      ++*hits;
+    } else {
+      length += (size_t)sprintf(text + length, "add %u\n",
+                                (unsigned)(i % 97));
+      sum += i % 97;
+    }
+  }
+  sprintf(text + length, "check %lld\n", sum);
+  return text;
+}
+
+static void check(LPERROR error, const char *what) {
+  if (IsError(error)) {
+    fprintf(stderr, "%s: error %d: line %llu: %s\n",
+            what,
+            error->nLine,
+            (unsigned long long)error->srcInfo.nLine,
+            ErrorReason(error));
+    exit(-1);
+  }
+}
+
+int main(int argc, const char *argv[]) {
+  DWORD threads = 256;
+  DWORD rounds = 4;
+  DWORD lines = 1000;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      threads = (DWORD)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+      rounds = (DWORD)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      lines = (DWORD)strtoul(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr,
+        "usage: stress [-t threads] [-r rounds] [-n lines]\n"
+        "  -t  runs started at once per round, default 256\n"
+        "  -r  rounds, taking turns between the parsed and the flattened\n"
+        "      program, the second half evicting the language meanwhile;\n"
+        "      default 4\n"
+        "  -n  lines of the program, default 1000\n");
+      return -1;
+    }
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+
+  /* the same module the runs load, kept loaded across evictions */
+  HMODULE module = LoadLibraryA("./libstress.dll");
+  STRESSTOTALSPROC totals = module != NULL
+    ? (STRESSTOTALSPROC)GetProcAddress(module, "StressTotals") : NULL;
+  if (totals == NULL) {
+    fprintf(stderr, "cannot load StressTotals from ./libstress.dll\n");
+    return -1;
+  }
+
+  DWORD hits;
+  char *text = generate(lines, &hits);
+  LPERROR error = ErrorBuffer(512);
+  STRESSRUN *runs = (STRESSRUN*)calloc(threads, sizeof(STRESSRUN));
+  HANDLE *handles = (HANDLE*)calloc(threads, sizeof(HANDLE));
+  if (text == NULL || error == NULL || runs == NULL || handles == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
+    return -1;
+  }
+  LPPROGRAM parsed = ParseProgramCopy(text, 512, error);
+  LPPROGRAM flat = ParseProgramCopy(text, 512, error);
+  if (parsed == NULL || flat == NULL) {
+    fprintf(stderr, "cannot allocate memory for parsing\n");
+    return -1;
+  }
+  check(error, "parse");
+  FlattenProgram(flat, error);
+  check(error, "flatten");
+
+  for (DWORD round = 0; round < rounds; round++) {
+    int flattened = round % 2 == 1;
+    int evicting = round >= (rounds + 1) / 2;
+    LONG hitsBefore, mismatchesBefore, runsBefore;
+    totals(&hitsBefore, &mismatchesBefore, &runsBefore);
+
+    /* no run starts before all of them are ready */
+    HANDLE start = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (start == NULL) {
+      fprintf(stderr, "cannot create event\n");
+      return -1;
+    }
+    for (DWORD i = 0; i < threads; i++) {
+      runs[i].program = flattened ? flat : parsed;
+      runs[i].start = start;
+      runs[i].error = ErrorBuffer(512);
+      handles[i] = runs[i].error != NULL
+        ? CreateThread(NULL, 0, runShared, &runs[i], 0, NULL) : NULL;
+      if (handles[i] == NULL) {
+        fprintf(stderr, "cannot create thread\n");
+        return -1;
+      }
+    }
+    HANDLE evictor = NULL;
+    if (evicting) {
+      InterlockedExchange(&g_stopEvicting, 0);
+      evictor = CreateThread(NULL, 0, evictLanguage, NULL, 0, NULL);
+      if (evictor == NULL) {
+        fprintf(stderr, "cannot create thread\n");
+        return -1;
+      }
+    }
+    SetEvent(start);
+    for (DWORD i = 0; i < threads; i++) {
+      WaitForSingleObject(handles[i], INFINITE);
+      CloseHandle(handles[i]);
+    }
+    CloseHandle(start);
+    if (evictor != NULL) {
+      InterlockedExchange(&g_stopEvicting, 1);
+      WaitForSingleObject(evictor, INFINITE);
+      CloseHandle(evictor);
+    }
+    for (DWORD i = 0; i < threads; i++) {
+      check(runs[i].error, "run");
+      DropError(runs[i].error);
+    }
+
+    LONG hitsAfter, mismatchesAfter, runsAfter;
+    totals(&hitsAfter, &mismatchesAfter, &runsAfter);
+    if (hitsAfter - hitsBefore != (LONG)(hits * threads)
+        || mismatchesAfter != mismatchesBefore
+        || runsAfter - runsBefore != (LONG)threads) {
+      fprintf(stderr,
+              "round %u: %ld runs of %u, %ld hits of %lu, %ld mismatches\n",
+              (unsigned)round,
+              (long)(runsAfter - runsBefore), (unsigned)threads,
+              (long)(hitsAfter - hitsBefore),
+              (unsigned long)hits * threads,
+              (long)(mismatchesAfter - mismatchesBefore));
+      return -1;
+    }
+    fprintf(stderr, "round %u: %u %s runs%s ok\n",
+            (unsigned)round, (unsigned)threads,
+            flattened ? "flat" : "parsed",
+            evicting ? " while evicting" : "");
+  }
+
+  DropProgram(parsed);
+  free(parsed);
+  DropProgram(flat);
+  free(flat);
+  DropError(error);
+  free(handles);
+  free(runs);
+  free(text);
+  EvictLanguages(NULL);
+  FreeLibrary(module);
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include "../pl2w.h"
+#include <stdlib.h>
+
+/* Built as libstress.dll for bench/stress.c, which loads it as well to
+   read the totals. `hit' counts the commands it ran over all runs, `add
+   <n>' adds n to a sum of the run's own, made by the init proc, and
+   `check <n>' counts a mismatch when that sum is not n. The atexit proc
+   counts the finished runs. Only atomics are shared, so any number of
+   runs may use it at once. */
+
+typedef struct {
+  LONGLONG sum;
+} STRESSRUN;
+
+static volatile LONG g_hits;
+static volatile LONG g_mismatches;
+static volatile LONG g_runs;
+
+static void stressHit(LPCSTR aStrings[]) {
+  (void)aStrings;
+  InterlockedIncrement(&g_hits);
+}
+
+static LPCOMMAND stressAdd(LPPROGRAM program, LPVOID context,
+                           LPCOMMAND command, LPERROR error) {
+  (void)program;
+  (void)error;
+  STRESSRUN *run = (STRESSRUN*)context;
+  if (run == NULL || command->aszArgs[0] == NULL) {
+    InterlockedIncrement(&g_mismatches);
+  } else {
+    run->sum += atoi(command->aszArgs[0]);
+  }
+  return command->lpNext;
+}
+
+static LPCOMMAND stressCheck(LPPROGRAM program, LPVOID context,
+                             LPCOMMAND command, LPERROR error) {
+  (void)program;
+  (void)error;
+  STRESSRUN *run = (STRESSRUN*)context;
+  if (run == NULL || command->aszArgs[0] == NULL
+      || run->sum != strtoll(command->aszArgs[0], NULL, 10)) {
+    InterlockedIncrement(&g_mismatches);
+  }
+  return command->lpNext;
+}
+
+static LPVOID stressInit(LPERROR error) {
+  (void)error;
+  return calloc(1, sizeof(STRESSRUN));
+}
+
+static void stressAtexit(LPVOID context) {
+  free(context);
+  InterlockedIncrement(&g_runs);
+}
+
+static SINVHANDLER g_sinvoke[] = {
+  { "hit", stressHit, FALSE, FALSE },
+  { NULL, NULL, FALSE, FALSE }
+};
+
+static WCALLHANDLER g_wcall[] = {
+  { "add", NULL, stressAdd, FALSE, FALSE },
+  { "check", NULL, stressCheck, FALSE, FALSE },
+  { NULL, NULL, NULL, FALSE, FALSE }
+};
+
+static struct stLanguage g_language = {
+  "stress",
+  "stub language for the pl2w stress test",
+  NULL,
+  stressInit,
+  stressAtexit,
+  g_sinvoke,
+  g_wcall,
+  NULL
+};
+
+LPLANGUAGE LoadLanguageExtension(SEMVER version, LPERROR error) {
+  (void)version;
+  (void)error;
+  return &g_language;
+}
+
+/* what every run so far did, read by bench/stress.c */
+void StressTotals(LONG *hits, LONG *mismatches, LONG *runs) {
+  *hits = InterlockedCompareExchange(&g_hits, 0, 0);
+  *mismatches = InterlockedCompareExchange(&g_mismatches, 0, 0);
+  *runs = InterlockedCompareExchange(&g_runs, 0, 0);
+}
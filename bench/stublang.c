@@ -0,0 +1,180 @@
+#include "bench.h"
+#include "../pl2w.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Built twice: as libbenchstub.dll exporting LoadLanguageExtension, and
+   with -DSTUB_EASYLOAD as libbenchez.dll exporting
+   EasyLoadLanguageExtension and one EL<name> function per handler. Both
+   register h0..h<n-1>, n taken from PL2W_BENCH_HANDLERS; setting
+   PL2W_BENCH_BATCH=1 gives the former batch procs through
+   LoadLanguageFeatures as well, and PL2W_BENCH_FUSE=1 fused handlers
+   for h0..h3, h4..h7 and so on. Several
+   runs may load it at the same time, see dispatch_shared. The former
+   also has `wait <ms>', suspending the run, see schedule_wait. */
+
+static DWORD handlerCount(void) {
+  const char *value = getenv(STUB_ENV_HANDLERS);
+  DWORD count = value != NULL ? (DWORD)strtoul(value, NULL, 10) : 16;
+  if (count == 0) {
+    count = 1;
+  } else if (count > STUB_MAX_HANDLERS) {
+    count = STUB_MAX_HANDLERS;
+  }
+  return count;
+}
+
+static void stubHandler(LPCSTR aStrings[]) {
+  size_t n = 0;
+  for (LPCSTR *iter = aStrings; *iter != NULL; iter++) {
+    n += (unsigned char)(*iter)[0];
+  }
+  volatile size_t sink = n;
+  (void)sink;
+}
+
+static char g_names[STUB_MAX_HANDLERS][8];
+static LPCSTR g_nameList[STUB_MAX_HANDLERS + 1];
+
+/* concurrent runs find the handlers already set up and leave them be */
+static SRWLOCK g_lock = SRWLOCK_INIT;
+static DWORD g_count;
+
+static void initNames(DWORD count) {
+  for (DWORD i = 0; i < count; i++) {
+    sprintf(g_names[i], "h%u", (unsigned)i);
+    g_nameList[i] = g_names[i];
+  }
+  g_nameList[count] = NULL;
+}
+
+#ifdef STUB_EASYLOAD
+
+#define DEF1(n) void ELh##n(LPCSTR aStrings[]) { stubHandler(aStrings); }
+#define DEF10(d) \
+  DEF1(d##0) DEF1(d##1) DEF1(d##2) DEF1(d##3) DEF1(d##4) \
+  DEF1(d##5) DEF1(d##6) DEF1(d##7) DEF1(d##8) DEF1(d##9)
+
+DEF1(0) DEF1(1) DEF1(2) DEF1(3) DEF1(4)
+DEF1(5) DEF1(6) DEF1(7) DEF1(8) DEF1(9)
+DEF10(1) DEF10(2) DEF10(3) DEF10(4) DEF10(5)
+DEF10(6) DEF10(7) DEF10(8) DEF10(9)
+
+LPCSTR *EasyLoadLanguageExtension(void) {
+  DWORD count = handlerCount();
+  AcquireSRWLockExclusive(&g_lock);
+  if (count != g_count) {
+    initNames(count);
+    g_count = count;
+  }
+  ReleaseSRWLockExclusive(&g_lock);
+  return g_nameList;
+}
+
+#else
+
+static void stubBatch(LPCSTR *aaszArgs[], DWORD nCount) {
+  for (DWORD i = 0; i < nCount; i++) {
+    stubHandler(aaszArgs[i]);
+  }
+}
+
+/* what a fused handler is for: the work of the window in one go */
+static void stubFused(LPCSTR *aaszArgs[], DWORD nCount) {
+  size_t n = 0;
+  for (DWORD i = 0; i < nCount; i++) {
+    for (LPCSTR *iter = aaszArgs[i]; *iter != NULL; iter++) {
+      n += (unsigned char)(*iter)[0];
+    }
+  }
+  volatile size_t sink = n;
+  (void)sink;
+}
+
+static void stubWait(LPCSTR aStrings[]) {
+  SuspendRun(NULL, aStrings[0] != NULL ? (DWORD)atoi(aStrings[0]) : 0);
+}
+
+static SINVHANDLER g_handlers[STUB_MAX_HANDLERS + 2];
+static BATCHHANDLER g_batchHandlers[STUB_MAX_HANDLERS + 1];
+
+#define STUB_FUSE_WINDOW 4
+
+static LPCSTR g_fuseNames[STUB_MAX_HANDLERS / STUB_FUSE_WINDOW]
+                        [STUB_FUSE_WINDOW + 1];
+static FUSEDHANDLER g_fused[STUB_MAX_HANDLERS / STUB_FUSE_WINDOW + 1];
+
+static struct stLanguage g_language = {
+  "benchstub",
+  "stub language for pl2w benchmarks",
+  NULL,
+  NULL,
+  NULL,
+  g_handlers,
+  NULL,
+  NULL
+};
+
+static struct stLangFeatures g_features = {
+  sizeof(struct stLangFeatures),
+  g_batchHandlers,
+  NULL
+};
+
+static LPSINVBATCHPROC g_batch;
+static int g_fuse;
+
+static void initFused(DWORD count) {
+  DWORD windows = count / STUB_FUSE_WINDOW;
+  memset(g_fused, 0, sizeof(g_fused));
+  for (DWORD w = 0; w < windows; w++) {
+    for (DWORD i = 0; i < STUB_FUSE_WINDOW; i++) {
+      g_fuseNames[w][i] = g_nameList[w * STUB_FUSE_WINDOW + i];
+    }
+    g_fuseNames[w][STUB_FUSE_WINDOW] = NULL;
+    g_fused[w].alpszCmdNames = g_fuseNames[w];
+    g_fused[w].lpfnFusedProc = stubFused;
+  }
+}
+
+LPLANGUAGE LoadLanguageExtension(SEMVER version, LPERROR error) {
+  (void)version;
+  (void)error;
+  DWORD count = handlerCount();
+  const char *batchValue = getenv(STUB_ENV_BATCH);
+  LPSINVBATCHPROC batch =
+    batchValue != NULL && batchValue[0] == '1' ? stubBatch : NULL;
+  const char *fuseValue = getenv(STUB_ENV_FUSE);
+  int fuse = fuseValue != NULL && fuseValue[0] == '1';
+  AcquireSRWLockExclusive(&g_lock);
+  if (count != g_count || batch != g_batch || fuse != g_fuse) {
+    initNames(count);
+    memset(g_handlers, 0, sizeof(g_handlers));
+    memset(g_batchHandlers, 0, sizeof(g_batchHandlers));
+    for (DWORD i = 0; i < count; i++) {
+      g_handlers[i].lpszCmdName = g_nameList[i];
+      g_handlers[i].lpfnHandlerProc = stubHandler;
+      if (batch != NULL) {
+        g_batchHandlers[i].lpszCmdName = g_nameList[i];
+        g_batchHandlers[i].lpfnBatchProc = batch;
+      }
+    }
+    g_handlers[count].lpszCmdName = "wait";
+    g_handlers[count].lpfnHandlerProc = stubWait;
+    initFused(count);
+    g_features.aFusedHandlers = fuse ? g_fused : NULL;
+    g_count = count;
+    g_batch = batch;
+    g_fuse = fuse;
+  }
+  ReleaseSRWLockExclusive(&g_lock);
+  return &g_language;
+}
+
+LPLANGFEATURES LoadLanguageFeatures(LPLANGUAGE language) {
+  (void)language;
+  return &g_features;
+}
+
+#endif
@@ -3,8 +3,433 @@
 #include <stdlib.h>
 #include <string.h>
 
+static void usage(void) {
+  fprintf(stderr,
+    "usage: pl2w [-s] [-w window-bytes] [-j threads] [-c out.pl2c]\n"
+    "            [-p profile] [-t|-T trace.json] [-l] [-d] [-L path] <file>\n"
+    "       pl2w -b [-m list] [-j threads] [-t|-T trace.json] [-l]\n"
+    "            [-L path] [<file>...]\n"
+    "       pl2w -i [-p profile] [-t|-T trace.json] [-l] [-L path]\n"
+    "  -s  parse and run the file while reading it, in bounded memory\n"
+    "  -w  stream window size, default %u bytes\n"
+    "  -j  parser threads for large files, default one per processor\n"
+    "  -c  compile the file to out.pl2c instead of running it\n"
+    "  -p  write an execution profile to profile, `-' for standard error;\n"
+    "      PL2W_PROFILE does the same\n"
+    "  -t  write a Chrome trace of loading, parsing and running to trace.json\n"
+    "  -T  like -t, with a span for every executed command\n"
+    "  -l  look up the handlers of an EasyLoad language as they are used\n"
+    "  -d  run the program on direct-threaded code once its language is\n"
+    "      loaded\n"
+    "  -L  `;' separated directories holding lib<id>-<version>.dll and\n"
+    "      lib<id>.dll languages, default PL2W_LANG_PATH or `.'\n"
+    "  -b  run every <file> and those listed in list, one path per line,\n"
+    "      on `-j' worker threads; a status line per file goes to standard\n"
+    "      output in the order given, whatever order they ran in\n"
+    "  -m  the list for -b, `-' reads it from standard input\n"
+    "  -i  read commands from standard input and run each one as soon as\n"
+    "      it is complete, keeping the language loaded in between\n"
+    "  a <file> of `-' reads standard input, a .pl2c <file> is run as is\n",
+    (unsigned)STREAM_DEFAULT_WINDOW);
+}
+
+static void printError(const char *what, LPERROR error) {
+  fprintf(stderr,
+          "%s error %d: line %llu: %s\n",
+          what,
+          error->nLine,
+          (unsigned long long)error->srcInfo.nLine,
+          ErrorReason(error));
+}
+
+static int runStream(const char *fileName,
+                     SIZE_T window,
+                     const RUNOPTIONS *options,
+                     LPERROR error) {
+  HANDLE file;
+  if (!strcmp(fileName, "-")) {
+    file = GetStdHandle(STD_INPUT_HANDLE);
+    fileName = "<stdin>";
+  } else {
+    file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  }
+  if (file == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "cannot open input file %s\n", fileName);
+    return -1;
+  }
+
+  int ret = 0;
+  LPSTREAM stream = OpenStream(file, fileName, window, 512, error);
+  if (stream != NULL) {
+    RunStreamEx(stream, options, error);
+    CloseStream(stream);
+  }
+  if (IsError(error)) {
+    printError("stream", error);
+    ret = -1;
+  }
+
+  if (file != GetStdHandle(STD_INPUT_HANDLE)) {
+    CloseHandle(file);
+  }
+  return ret;
+}
+
+static int isCompiled(const char *fileName) {
+  size_t length = strlen(fileName);
+  return length > 5 && !strcmp(fileName + length - 5, ".pl2c");
+}
+
+static int runProgram(LPPROGRAM program,
+                      const RUNOPTIONS *options,
+                      LPERROR error) {
+  int ret = 0;
+  RunProgramEx(program, options, error);
+  if (IsError(error)) {
+    printError("runtime", error);
+    ret = -1;
+  }
+  DropProgram(program);
+  free(program);
+  return ret;
+}
+
+static int runCompiled(const char *fileName,
+                       const RUNOPTIONS *options,
+                       LPERROR error) {
+  LPPROGRAM program = LoadCompiledProgram(fileName, error);
+  if (program == NULL) {
+    printError("loading", error);
+    return -1;
+  }
+  return runProgram(program, options, error);
+}
+
+static int runFile(const char *fileName,
+                   DWORD threads,
+                   const char *outName,
+                   const RUNOPTIONS *options,
+                   LPERROR error) {
+  LPSOURCE source = OpenSource(fileName, error);
+  if (source == NULL) {
+    printError("loading", error);
+    return -1;
+  }
+
+  LPPROGRAM program = ParseProgramParallel(source->lpszSource,
+                                             source->cbSource,
+                                             512, threads, error);
+  if (program == NULL || IsError(error)) {
+    if (program == NULL) {
+      fprintf(stderr, "cannot allocate memory for parsing\n");
+    } else {
+      printError("parsing", error);
+      DropProgram(program);
+      free(program);
+    }
+    CloseSource(source);
+    return -1;
+  }
+
+  int ret = 0;
+  if (outName != NULL) {
+    if (!SaveCompiledProgram(program, outName, error)) {
+      printError("compiling", error);
+      ret = -1;
+    }
+    DropProgram(program);
+    free(program);
+  } else {
+    ret = runProgram(program, options, error);
+  }
+  CloseSource(source);
+  return ret;
+}
+
+static int runInteractive(const RUNOPTIONS *options, LPERROR error) {
+  LPSESSION session = OpenSession("<stdin>", options, 512, error);
+  if (session == NULL) {
+    printError("session", error);
+    return -1;
+  }
+
+  char line[4096];
+  int running = 1;
+  while (running) {
+    fputs(SessionNeedsInput(session) ? "... " : "pl2> ", stderr);
+    fflush(stderr);
+    if (fgets(line, sizeof(line), stdin) == NULL) {
+      running = FeedSession(session, NULL, 0, error);
+    } else {
+      running = FeedSession(session, line, strlen(line), error);
+    }
+    fflush(stdout);
+    if (IsError(error)) {
+      printError("session", error);
+      error->nLine = 0;
+    }
+  }
+  fputc('\n', stderr);
+  CloseSession(session);
+  return 0;
+}
+
+/* Batch mode. Files are split into one contiguous range per worker; a
+   worker that runs out takes the back half of another's range. Errors
+   are kept per file and reported once all have run */
+
+typedef struct {
+  const char *fileName;
+  const char *what;     /* stage that failed, or NULL */
+  LPERROR error;        /* its error, or NULL when out of memory */
+} JOB;
+
+typedef struct {
+  SRWLOCK lock;
+  DWORD next;           /* jobs next..end-1 are not taken yet */
+  DWORD end;
+} QUEUE;
+
+typedef struct {
+  JOB *jobs;
+  QUEUE *queues;
+  DWORD workers;
+  const RUNOPTIONS *options;
+} BATCH;
+
+typedef struct {
+  BATCH *batch;
+  DWORD self;
+} WORKER;
+
+static int takeJob(BATCH *batch, DWORD self, DWORD *job) {
+  QUEUE *own = &batch->queues[self];
+  AcquireSRWLockExclusive(&own->lock);
+  int taken = own->next < own->end;
+  if (taken) {
+    *job = own->next++;
+  }
+  ReleaseSRWLockExclusive(&own->lock);
+  if (taken) {
+    return 1;
+  }
+
+  for (DWORD i = 1; i < batch->workers; i++) {
+    DWORD first = 0, end = 0;
+    QUEUE *victim = &batch->queues[(self + i) % batch->workers];
+    AcquireSRWLockExclusive(&victim->lock);
+    if (victim->next < victim->end) {
+      end = victim->end;
+      first = end - (end - victim->next + 1) / 2;
+      victim->end = first;
+    }
+    ReleaseSRWLockExclusive(&victim->lock);
+    if (first < end) {
+      AcquireSRWLockExclusive(&own->lock);
+      own->next = first + 1;
+      own->end = end;
+      ReleaseSRWLockExclusive(&own->lock);
+      *job = first;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void runJob(JOB *job, const RUNOPTIONS *options, LPERROR error) {
+  LPSOURCE source = NULL;
+  LPPROGRAM program;
+  if (isCompiled(job->fileName)) {
+    program = LoadCompiledProgram(job->fileName, error);
+    if (program == NULL) {
+      job->what = "loading";
+      return;
+    }
+  } else {
+    source = OpenSource(job->fileName, error);
+    if (source == NULL) {
+      job->what = "loading";
+      return;
+    }
+    program = ParseProgramParallel(source->lpszSource, source->cbSource,
+                                   512, 1, error);
+    if (program == NULL || IsError(error)) {
+      job->what = "parsing";
+      if (program != NULL) {
+        DropProgram(program);
+        free(program);
+      }
+      CloseSource(source);
+      return;
+    }
+  }
+
+  RunProgramEx(program, options, error);
+  if (IsError(error)) {
+    job->what = "runtime";
+  }
+  DropProgram(program);
+  free(program);
+  if (source != NULL) {
+    CloseSource(source);
+  }
+}
+
+static DWORD WINAPI batchWorker(LPVOID param) {
+  WORKER *worker = (WORKER*)param;
+  BATCH *batch = worker->batch;
+  LPERROR error = NULL;
+  DWORD index;
+  while (takeJob(batch, worker->self, &index)) {
+    JOB *job = &batch->jobs[index];
+    if (error == NULL && (error = ErrorBuffer(512)) == NULL) {
+      job->what = "memory";
+      continue;
+    }
+    runJob(job, batch->options, error);
+    if (job->what != NULL) {
+      job->error = error;
+      error = NULL;
+    }
+  }
+  if (error != NULL) {
+    DropError(error);
+  }
+  return 0;
+}
+
+/* one path per line, blank lines skipped; NULL when unreadable */
+static const char **readList(const char *listName, const char **files,
+                             DWORD *count) {
+  FILE *list = strcmp(listName, "-") ? fopen(listName, "r") : stdin;
+  if (list == NULL) {
+    fprintf(stderr, "cannot open list file %s\n", listName);
+    free(files);
+    return NULL;
+  }
+  DWORD capacity = *count;
+  char line[MAX_PATH + 2];
+  while (files != NULL && fgets(line, sizeof(line), list) != NULL) {
+    size_t length = strcspn(line, "\r\n");
+    line[length] = '\0';
+    if (length == 0) {
+      continue;
+    }
+    if (*count == capacity) {
+      capacity = capacity * 2 + 16;
+      const char **grown =
+        (const char**)realloc((void*)files, capacity * sizeof(char*));
+      if (grown == NULL) {
+        free((void*)files);
+      }
+      files = grown;
+    }
+    char *copy = (char*)malloc(length + 1);
+    if (files == NULL || copy == NULL) {
+      free(copy);
+      break;
+    }
+    files[(*count)++] = (const char*)memcpy(copy, line, length + 1);
+  }
+  if (list != stdin) {
+    fclose(list);
+  }
+  if (files == NULL) {
+    fprintf(stderr, "cannot allocate memory for list file\n");
+  }
+  return files;
+}
+
+static int runBatch(const char **files, DWORD count, DWORD threads,
+                    const RUNOPTIONS *options) {
+  enum { MAX_WORKERS = 64 };
+  if (threads == 0) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    threads = info.dwNumberOfProcessors;
+  }
+  if (threads > MAX_WORKERS) {
+    threads = MAX_WORKERS;
+  }
+  if (threads > count) {
+    threads = count != 0 ? count : 1;
+  }
+
+  BATCH batch;
+  batch.jobs = (JOB*)calloc(count != 0 ? count : 1, sizeof(JOB));
+  batch.queues = (QUEUE*)calloc(threads, sizeof(QUEUE));
+  batch.workers = threads;
+  batch.options = options;
+  if (batch.jobs == NULL || batch.queues == NULL) {
+    fprintf(stderr, "cannot allocate memory for batch\n");
+    free(batch.jobs);
+    free(batch.queues);
+    return -1;
+  }
+  for (DWORD i = 0; i < count; i++) {
+    batch.jobs[i].fileName = files[i];
+  }
+  for (DWORD i = 0; i < threads; i++) {
+    InitializeSRWLock(&batch.queues[i].lock);
+    batch.queues[i].next = (DWORD)((ULONGLONG)count * i / threads);
+    batch.queues[i].end = (DWORD)((ULONGLONG)count * (i + 1) / threads);
+  }
+
+  LARGE_INTEGER frequency, start, stop;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&start);
+  WORKER workers[MAX_WORKERS];
+  HANDLE handles[MAX_WORKERS];
+  for (DWORD i = 0; i < threads; i++) {
+    workers[i].batch = &batch;
+    workers[i].self = i;
+    handles[i] = i != 0
+      ? CreateThread(NULL, 0, batchWorker, &workers[i], 0, NULL)
+      : NULL;
+  }
+  /* the main thread is worker 0, and takes over any that did not start */
+  batchWorker(&workers[0]);
+  for (DWORD i = 1; i < threads; i++) {
+    if (handles[i] != NULL) {
+      WaitForSingleObject(handles[i], INFINITE);
+      CloseHandle(handles[i]);
+    }
+  }
+  QueryPerformanceCounter(&stop);
+
+  DWORD failed = 0;
+  for (DWORD i = 0; i < count; i++) {
+    JOB *job = &batch.jobs[i];
+    if (job->what == NULL) {
+      printf("%s: ok\n", job->fileName);
+    } else if (job->error == NULL) {
+      printf("%s: cannot allocate memory\n", job->fileName);
+      failed++;
+    } else {
+      printf("%s: %s error %d: line %llu: %s\n",
+             job->fileName,
+             job->what,
+             job->error->nLine,
+             (unsigned long long)job->error->srcInfo.nLine,
+             ErrorReason(job->error));
+      DropError(job->error);
+      failed++;
+    }
+  }
+  double seconds =
+    (double)(stop.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+  fprintf(stderr, "%u files, %u failed, %u threads, %.3f s, %.0f files/s\n",
+          (unsigned)count, (unsigned)failed, (unsigned)threads, seconds,
+          seconds > 0 ? count / seconds : 0.0);
+
+  free(batch.jobs);
+  free(batch.queues);
+  return failed != 0 ? -1 : 0;
+}
+
 int main(int argc, const char *argv[]) {
-  fprintf(stderr, 
+  fprintf(stderr,
     "PL2 programming language platform for Windows\n"
     "  Author:  ICEY<icey@icey.tech>\n"
     "  Edition: %s\n"
@@ -16,62 +441,110 @@ int main(int argc, const char *argv[]) {
     PL2W_VER_PATCH,
     PL2W_VER_POSTFIX);
 
-  if (argc != 2) {
-    fprintf(stderr, "expected 1 argument, got %d\n", argc - 1);
+  int stream = 0;
+  int batch = 0;
+  int interactive = 0;
+  SIZE_T window = 0;
+  DWORD threads = 0;
+  const char *outName = NULL;
+  const char *fileName = NULL;
+  const char *listName = NULL;
+  const char *langPath = NULL;
+  const char **files = (const char**)malloc(argc * sizeof(char*));
+  DWORD fileCount = 0;
+  DWORD argCount;
+  if (files == NULL) {
+    fprintf(stderr, "cannot allocate memory\n");
     return -1;
   }
-
-  FILE *fp = fopen(argv[1], "r");
-  if (fp == NULL) {
-    fprintf(stderr, "cannot open input file %s\n", argv[1]);
-    return -1;
-  }
-
-  long fileSize = 0;
-  if (fseek(fp, 0, SEEK_END) < 0) {
-    fprintf(stderr, "cannot determine file size\n");
-    return -1;
+  const char *traceName = NULL;
+  int traceCommands = 0;
+  RUNOPTIONS options;
+  options.cbSize = sizeof(RUNOPTIONS);
+  options.lpszProfileFile = NULL;
+  options.bSharedProgram = FALSE;
+  options.bLazyEasyLoad = FALSE;
+  options.bThreadedCode = FALSE;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s")) {
+      stream = 1;
+    } else if (!strcmp(argv[i], "-b")) {
+      batch = 1;
+    } else if (!strcmp(argv[i], "-i")) {
+      interactive = 1;
+    } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+      listName = argv[++i];
+      batch = 1;
+    } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+      window = (SIZE_T)strtoull(argv[++i], NULL, 10);
+      stream = 1;
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      threads = (DWORD)strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      outName = argv[++i];
+    } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+      options.lpszProfileFile = argv[++i];
+    } else if (!strcmp(argv[i], "-l")) {
+      options.bLazyEasyLoad = TRUE;
+    } else if (!strcmp(argv[i], "-d")) {
+      options.bThreadedCode = TRUE;
+    } else if (!strcmp(argv[i], "-L") && i + 1 < argc) {
+      langPath = argv[++i];
+    } else if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "-T"))
+               && i + 1 < argc) {
+      traceCommands = argv[i][1] == 'T';
+      traceName = argv[++i];
+    } else if (argv[i][0] != '-' || !argv[i][1]) {
+      files[fileCount++] = argv[i];
+    } else {
+      usage();
+      return -1;
+    }
   }
-  fileSize = ftell(fp);
-  if (fileSize < 0) {
-    fprintf(stderr, "cannot determine file size\n");
+  argCount = fileCount;
+  if (interactive) {
+    if (batch || fileCount != 0) {
+      usage();
+      return -1;
+    }
+  } else if (batch) {
+    if (listName != NULL
+        && (files = readList(listName, files, &fileCount)) == NULL) {
+      return -1;
+    }
+  } else if (fileCount == 1) {
+    fileName = files[0];
+  } else {
+    usage();
     return -1;
   }
 
-  char *buffer = (char*)malloc((size_t)fileSize + 1);
-  memset(buffer, 0, (size_t)fileSize + 1);
-  rewind(fp);
-  if ((long)fread(buffer, 1, (size_t)fileSize, fp) < fileSize) {
-    fprintf(stderr, "cannot read file\n");
+  if (langPath != NULL && !SetLanguagePath(langPath, NULL)) {
+    fprintf(stderr, "cannot allocate memory\n");
     return -1;
   }
-
-  pl2w_Error *error = pl2w_errorBuffer(512);
-  pl2w_Program lpProgram = pl2w_parse(buffer, 512, error);
-  if (pl2w_isError(error)) {
-    fprintf(stderr,
-            "parsing error %d: line %d: %s\n",
-            error->errorCode,
-            error->sourceInfo.line,
-            error->reason);
-    return -1;
+  LONGLONG errorSpace[(ERROR_BUFFER_SIZE(512) + 7) / 8];
+  LPERROR error = InitError(errorSpace, sizeof(errorSpace), TRUE);
+  if (traceName != NULL && !StartTrace(traceName, traceCommands)) {
+    fprintf(stderr, "cannot start trace\n");
   }
 
-  int ret = 0;
-  pl2w_run(&lpProgram, error);
-  if (pl2w_isError(error)) {
-    fprintf(stderr, 
-            "runtime error %d: line %d: %s\n",
-            error->errorCode,
-            error->sourceInfo.line,
-            error->reason);
-    ret = -1;
+  int ret;
+  if (interactive) {
+    ret = runInteractive(&options, error);
+  } else if (batch) {
+    ret = runBatch(files, fileCount, threads, &options);
+  } else if (isCompiled(fileName) && outName == NULL) {
+    ret = runCompiled(fileName, &options, error);
+  } else if (stream && outName == NULL) {
+    ret = runStream(fileName, window, &options, error);
+  } else {
+    ret = runFile(fileName, threads, outName, &options, error);
   }
-
-  pl2w_dropProgram(&lpProgram);
-  pl2w_dropError(error);
-  free(buffer);
-  fclose(fp);
-
+  StopTrace();
+  for (DWORD i = argCount; i < fileCount; i++) {
+    free((void*)files[i]);
+  }
+  free((void*)files);
   return ret;
 }
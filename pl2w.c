@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +31,7 @@ static SLICE Slice(PCHAR pcStart, PCHAR pcEnd);
 static SLICE NullSlice(void);
 static LPSTR SliceIntoCStr(SLICE slice);
 static BOOL IsNullSlice(SLICE slice);
+static BOOL SliceEquals(SLICE slice, LPCSTR lpszStr);
 
 SLICE Slice(PCHAR pcStart, PCHAR pcEnd)
 {
@@ -66,8 +68,35 @@ static BOOL IsNullSlice(SLICE slice)
   return slice.pcStart == slice.pcEnd;
 }
 
+static BOOL SliceEquals(SLICE slice, LPCSTR lpszStr)
+{
+  SIZE_T cbSlice = (SIZE_T)(slice.pcEnd - slice.pcStart);
+  return strlen(lpszStr) == cbSlice
+         && (cbSlice == 0 || !memcmp(slice.pcStart, lpszStr, cbSlice));
+}
+
 /*** ----------------- Implementation of PL2ERR ---------------- ***/
 
+/* one conversion of an ErrPrintf format */
+typedef struct
+{
+  WORD nStars;
+  /* -1 for none, -2 for one taken from the arguments */
+  int nPrecision;
+  CHAR chConv;
+  /* the integer length: 0 for int, 'l' for long, 'L' for ll and I64,
+     or 'z', 'j' or 't' */
+  CHAR chLength;
+  SIZE_T cbPrefix;  /* of the spec before the length */
+  SIZE_T cbSpec;
+} ERRSPEC;
+
+static LPCSTR ScanErrSpec(LPCSTR pc, ERRSPEC *lpSpec);
+static LONGLONG CaptureSignedArg(CHAR chLength, va_list *lpAp);
+static ULONGLONG CaptureUnsignedArg(CHAR chLength, va_list *lpAp);
+static BOOL CaptureErrArgs(LPERROR lpError, LPCSTR lpszFmt, va_list *lpAp);
+static void FormatLazyError(LPERROR lpError);
+
 LPERROR ErrorBuffer(WORD nBufferSize)
 {
   LPERROR ret = (LPERROR)malloc(sizeof(struct stError) + nBufferSize);
@@ -80,6 +109,20 @@ LPERROR ErrorBuffer(WORD nBufferSize)
   return ret;
 }
 
+LPERROR InitError(LPVOID lpBuffer, SIZE_T cbBuffer, BOOL bLazy)
+{
+  if (cbBuffer < sizeof(struct stError) + 1)
+    {
+      return NULL;
+    }
+  LPERROR ret = (LPERROR)lpBuffer;
+  SIZE_T cbReason = cbBuffer - sizeof(struct stError);
+  memset(ret, 0, sizeof(struct stError) + 1);
+  ret->nErrorBufferSize = cbReason > 0xFFFF ? 0xFFFF : (WORD)cbReason;
+  ret->bLazy = bLazy;
+  return ret;
+}
+
 void ErrPrintf(LPERROR lpError,
                WORD nLine,
                SRCINFO srcInfo,
@@ -90,458 +133,758 @@ void ErrPrintf(LPERROR lpError,
   lpError->nLine = nLine;
   lpError->lpExtraData = lpExtraData;
   lpError->srcInfo = srcInfo;
+  lpError->lpszFmt = NULL;
   if (lpError->nErrorBufferSize == 0)
     {
       return;
     }
 
   va_list ap;
+  if (lpError->bLazy)
+    {
+      va_start(ap, szFmt);
+      BOOL bCaptured = CaptureErrArgs(lpError, szFmt, &ap);
+      va_end(ap);
+      if (bCaptured)
+        {
+          lpError->lpszFmt = szFmt;
+          return;
+        }
+    }
   va_start(ap, szFmt);
   vsnprintf(lpError->szReason, lpError->nErrorBufferSize, szFmt, ap);
   va_end(ap);
 }
 
-void DropError(LPERROR lpError)
+LPCSTR ErrorReason(LPERROR lpError)
 {
-  if (lpError->lpExtraData)
+  if (lpError->lpszFmt != NULL)
     {
-      free(lpError->lpExtraData);
+      FormatLazyError(lpError);
+      lpError->lpszFmt = NULL;
     }
-  free(lpError);
-}
-
-BOOL IsError(LPERROR lpError)
-{
-  return lpError->nLine != 0;
-}
-
-/*** ------------------- Some toolkit functions -------------------- ***/
-
-SRCINFO SourceInfo(LPCSTR lpszFileName, WORD nLine)
-{
-  SRCINFO ret;
-  ret.lpszFileName = lpszFileName;
-  ret.nLine = nLine;
-  return ret;
+  return lpError->nErrorBufferSize != 0 ? lpError->szReason : "";
 }
 
-LPCOMMAND CreateCommand(LPCOMMAND lpPrev,
-                        LPCOMMAND lpNext,
-                        LPVOID lpExtraData,
-                        SRCINFO srcInfo,
-                        LPSTR lpszCmd,
-                        LPSTR aszArgs[])
+static LPCSTR ScanErrSpec(LPCSTR pc, ERRSPEC *lpSpec)
 {
-  DWORD nArgCount = 0;
-  for (; aszArgs[nArgCount] != NULL; ++nArgCount);
-
-  LPCOMMAND ret = (LPCOMMAND)malloc
-    (
-      sizeof(struct stCommand) + (nArgCount + 1) * sizeof(LPSTR)
-    );
-  if (ret == NULL)
+  LPCSTR pcStart = pc++;
+  lpSpec->nStars = 0;
+  lpSpec->nPrecision = -1;
+  lpSpec->chLength = 0;
+  pc += strspn(pc, "-+ #0");
+  if (*pc == '*')
     {
-      return NULL;
+      lpSpec->nStars++;
+      pc++;
     }
-  ret->lpPrev = lpPrev;
-  if (lpPrev != NULL)
+  pc += strspn(pc, "0123456789");
+  if (*pc == '.')
     {
-      lpPrev->lpNext = ret;
+      pc++;
+      if (*pc == '*')
+        {
+          lpSpec->nStars++;
+          lpSpec->nPrecision = -2;
+          pc++;
+        }
+      else
+        {
+          lpSpec->nPrecision = atoi(pc);
+          pc += strspn(pc, "0123456789");
+        }
     }
-  ret->lpNext = lpNext;
-  if (lpNext != NULL)
+  lpSpec->cbPrefix = (SIZE_T)(pc - pcStart);
+  if (pc[0] == 'l' && pc[1] == 'l')
     {
-      lpNext->lpPrev = ret;
+      lpSpec->chLength = 'L';
+      pc += 2;
     }
-  ret->srcInfo = srcInfo;
-  ret->lpszCmd = lpszCmd;
-  ret->lpExtraData = lpExtraData;
-  for (WORD i = 0; i < nArgCount; i++)
+  else if (pc[0] == 'I' && pc[1] == '6' && pc[2] == '4')
     {
-      ret->aszArgs[i] = aszArgs[i];
+      lpSpec->chLength = 'L';
+      pc += 3;
     }
-  ret->aszArgs[nArgCount] = NULL;
-  return ret;
+  else if (*pc == 'l' || *pc == 'z' || *pc == 'j' || *pc == 't')
+    {
+      lpSpec->chLength = *pc++;
+    }
+
+  /* h, L and the like are left to vsnprintf */
+  lpSpec->chConv = *pc;
+  if (*pc == '\0'
+      || (strchr("diuxXo", *pc) == NULL
+          && (lpSpec->chLength != 0 || strchr("cspfFeEgGaA", *pc) == NULL)))
+    {
+      return NULL;
+    }
+  lpSpec->cbSpec = (SIZE_T)(pc + 1 - pcStart);
+  return pc + 1;
 }
 
-WORD CountCommandArgs(LPCOMMAND lpCmd)
+/* each argument is read as the type its length names, as vsnprintf
+   would; a long is 32 bits on Windows */
+static LONGLONG CaptureSignedArg(CHAR chLength, va_list *lpAp)
 {
-  WORD nAcc = 0;
-  LPSTR *iter = lpCmd->aszArgs;
-  while (*iter != NULL)
+  switch (chLength)
     {
-      iter++;
-      nAcc++;
+      case 'l':
+        return va_arg(*lpAp, long);
+      case 'L':
+        return va_arg(*lpAp, LONGLONG);
+      case 'z':
+        return (LONGLONG)(ptrdiff_t)va_arg(*lpAp, SIZE_T);
+      case 'j':
+        return (LONGLONG)va_arg(*lpAp, intmax_t);
+      case 't':
+        return (LONGLONG)va_arg(*lpAp, ptrdiff_t);
+      default:
+        return va_arg(*lpAp, int);
     }
-  return nAcc;
 }
 
-/*** ---------------- Implementation of pl2w_Program --------------- ***/
-
-void InitProgram(LPPROGRAM lpProgram)
+static ULONGLONG CaptureUnsignedArg(CHAR chLength, va_list *lpAp)
 {
-  lpProgram->lpCommands = NULL;
+  switch (chLength)
+    {
+      case 'l':
+        return va_arg(*lpAp, unsigned long);
+      case 'L':
+        return va_arg(*lpAp, ULONGLONG);
+      case 'z':
+        return va_arg(*lpAp, SIZE_T);
+      case 'j':
+        return (ULONGLONG)va_arg(*lpAp, uintmax_t);
+      case 't':
+        return (ULONGLONG)(SIZE_T)va_arg(*lpAp, ptrdiff_t);
+      default:
+        return va_arg(*lpAp, unsigned);
+    }
 }
 
-void DropProgram(LPPROGRAM lpProgram)
+static BOOL CaptureErrArgs(LPERROR lpError, LPCSTR lpszFmt, va_list *lpAp)
 {
-  LPCOMMAND iter = lpProgram->lpCommands;
-  while (iter != NULL)
+  WORD nArgs = 0;
+  SIZE_T cbArgs = 0;
+  for (LPCSTR pc = strchr(lpszFmt, '%'); pc != NULL; pc = strchr(pc, '%'))
     {
-      LPCOMMAND lpNext = iter->lpNext;
-      free(iter);
-      iter = lpNext;
+      if (pc[1] == '%')
+        {
+          pc += 2;
+          continue;
+        }
+      ERRSPEC spec;
+      pc = ScanErrSpec(pc, &spec);
+      if (pc == NULL || nArgs + spec.nStars + 1 > ERROR_MAX_ARGS)
+        {
+          return FALSE;
+        }
+      for (WORD i = 0; i < spec.nStars; i++)
+        {
+          lpError->aArgs[nArgs++].i = va_arg(*lpAp, int);
+        }
+      if (spec.nPrecision == -2)
+        {
+          spec.nPrecision = (int)lpError->aArgs[nArgs - 1].i;
+        }
+
+      ERRARG *lpArg = &lpError->aArgs[nArgs++];
+      switch (spec.chConv)
+        {
+          case 'd': case 'i': case 'c':
+            lpArg->i = CaptureSignedArg(spec.chLength, lpAp);
+            break;
+          case 'u': case 'x': case 'X': case 'o':
+            lpArg->i = (LONGLONG)CaptureUnsignedArg(spec.chLength, lpAp);
+            break;
+          case 's':
+            {
+              /* the string need not outlive the error, so what is printed
+                 of it is copied; one too long for the rest of szArgs is
+                 formatted now */
+              LPCSTR lpszArg = va_arg(*lpAp, LPCSTR);
+              lpArg->p = NULL;
+              if (lpszArg == NULL)
+                {
+                  break;
+                }
+              SIZE_T cbRoom = ERROR_ARG_CHARS - cbArgs;
+              SIZE_T cbArg = strnlen(lpszArg, cbRoom);
+              if (spec.nPrecision >= 0 && cbArg > (SIZE_T)spec.nPrecision)
+                {
+                  cbArg = (SIZE_T)spec.nPrecision;
+                }
+              if (cbArg == cbRoom)
+                {
+                  return FALSE;
+                }
+              PCHAR pcCopy = lpError->szArgs + cbArgs;
+              memcpy(pcCopy, lpszArg, cbArg);
+              pcCopy[cbArg] = '\0';
+              lpArg->p = pcCopy;
+              cbArgs += cbArg + 1;
+              break;
+            }
+          case 'p':
+            lpArg->p = va_arg(*lpAp, LPCVOID);
+            break;
+          default:
+            lpArg->d = va_arg(*lpAp, double);
+            break;
+        }
     }
+  return TRUE;
 }
 
-void DebugPrintProgram(LPCPROGRAM lpProgram)
+static void FormatLazyError(LPERROR lpError)
 {
-  fprintf(stderr, "program commands\n");
-  LPCOMMAND lpCmd = lpProgram->lpCommands;
-  while (lpCmd != NULL)
+  PCHAR pcOut = lpError->szReason;
+  SIZE_T cbOut = lpError->nErrorBufferSize;
+  ERRARG *lpArg = lpError->aArgs;
+  LPCSTR pc = lpError->lpszFmt;
+  while (*pc != '\0' && cbOut > 1)
     {
-      fprintf(stderr, "\t%s [", lpCmd->lpszCmd);
-      for (WORD i = 0; lpCmd->aszArgs[i] != NULL; i++)
+      if (pc[0] != '%' || pc[1] == '%')
         {
-          LPSTR lpszArg = lpCmd->aszArgs[i];
-          fprintf(stderr, "`%s`, ", lpszArg);
+          *pcOut++ = *pc;
+          cbOut--;
+          pc += pc[0] == '%' ? 2 : 1;
+          continue;
         }
-      fprintf(stderr, "\b\b]\n");
-      lpCmd = lpCmd->lpNext;
+
+      /* one conversion at a time, integers widened to long long */
+      ERRSPEC spec;
+      LPCSTR pcNext = ScanErrSpec(pc, &spec);
+      CHAR szSpec[32];
+      SIZE_T cbCopy = spec.cbPrefix;
+      if (cbCopy + 4 > sizeof(szSpec))
+        {
+          break;
+        }
+      memcpy(szSpec, pc, cbCopy);
+      BOOL bInt = strchr("diuxXo", spec.chConv) != NULL;
+      snprintf(szSpec + cbCopy, sizeof(szSpec) - cbCopy, "%s%c",
+               bInt ? "ll" : "", spec.chConv);
+
+      int nStar1 = spec.nStars > 0 ? (int)lpArg[0].i : 0;
+      int nStar2 = spec.nStars > 1 ? (int)lpArg[1].i : 0;
+      lpArg += spec.nStars;
+      int n;
+      switch (spec.chConv)
+        {
+          case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+            n = spec.nStars == 2
+              ? snprintf(pcOut, cbOut, szSpec, nStar1, nStar2, lpArg->i)
+              : spec.nStars == 1
+              ? snprintf(pcOut, cbOut, szSpec, nStar1, lpArg->i)
+              : snprintf(pcOut, cbOut, szSpec, lpArg->i);
+            break;
+          case 'c':
+            n = spec.nStars == 2
+              ? snprintf(pcOut, cbOut, szSpec, nStar1, nStar2, (int)lpArg->i)
+              : spec.nStars == 1
+              ? snprintf(pcOut, cbOut, szSpec, nStar1, (int)lpArg->i)
+              : snprintf(pcOut, cbOut, szSpec, (int)lpArg->i);
+            break;
+          case 's': case 'p':
+            n = spec.nStars == 2
+              ? snprintf(pcOut, cbOut, szSpec, nStar1, nStar2, lpArg->p)
+              : spec.nStars == 1
+              ? snprintf(pcOut, cbOut, szSpec, nStar1, lpArg->p)
+              : snprintf(pcOut, cbOut, szSpec, lpArg->p);
+            break;
+          default:
+            n = spec.nStars == 2
+              ? snprintf(pcOut, cbOut, szSpec, nStar1, nStar2, lpArg->d)
+              : spec.nStars == 1
+              ? snprintf(pcOut, cbOut, szSpec, nStar1, lpArg->d)
+              : snprintf(pcOut, cbOut, szSpec, lpArg->d);
+            break;
+        }
+      lpArg++;
+      if (n < 0)
+        {
+          break;
+        }
+      if ((SIZE_T)n >= cbOut)
+        {
+          pcOut += cbOut - 1;
+          cbOut = 1;
+          break;
+        }
+      pcOut += n;
+      cbOut -= (SIZE_T)n;
+      pc = pcNext;
     }
-  fprintf(stderr, "end program commands\n");
+  *pcOut = '\0';
 }
 
-/*** ----------------- Implementation of pl2w_parse ---------------- ***/
+void DropError(LPERROR lpError)
+{
+  if (lpError->lpExtraData)
+    {
+      free(lpError->lpExtraData);
+    }
+  free(lpError);
+}
 
-typedef enum
+BOOL IsError(LPERROR lpError)
 {
-  PARSE_SINGLE_LINE = 1,
-  PARSE_MULTI_LINE  = 2
-} PARSEMODE;
+  return lpError->nLine != 0;
+}
 
-typedef enum
+/*** ---------------------------- Tracing --------------------------- ***/
+
+#define TRACE_ENV          "PL2W_TRACE"
+#define TRACE_ENV_COMMANDS "PL2W_TRACE_COMMANDS"
+#define TRACE_CHUNK_EVENTS 4096
+#define TRACE_DETAIL_LEN   40
+
+typedef struct stTraceEvent
 {
-  QUES_INVALID = 0,
-  QUES_BEGIN   = 1,
-  QUES_END     = 2
-} QUESCMD;
+  /* a string literal, or NULL for a span named by szDetail */
+  LPCSTR lpszName;
+  LPCSTR lpszCategory;
+  LONGLONG nStart;
+  LONGLONG nEnd;
+  CHAR szDetail[TRACE_DETAIL_LEN];
+} TRACEEVENT;
 
-typedef struct stParseContext
+typedef struct stTraceChunk
 {
-  struct stProgram lpProgram;
-  LPCOMMAND lpListTail;
+  struct stTraceChunk *lpNext;
+  DWORD nEvents;
+  TRACEEVENT aEvents[TRACE_CHUNK_EVENTS];
+} TRACECHUNK;
 
-  LPSTR lpszSrc;
-  DWORD dwSrcIdx;
-  PARSEMODE mode;
+/* owned by one thread while recording, only read by StopTrace */
+typedef struct stTraceBuffer
+{
+  struct stTraceBuffer *lpNext;
+  DWORD dwThreadId;
+  TRACECHUNK *lpFirst;
+  TRACECHUNK *lpLast;
+} TRACEBUFFER;
 
-  SRCINFO srcInfo;
+typedef struct stTrace
+{
+  LPSTR lpszFileName;
+  BOOL bCommands;
+  DWORD dwTlsIndex;
+  LONGLONG nOrigin;
+  LONGLONG nFrequency;
+  /* pushed to without locks as threads record their first span */
+  TRACEBUFFER *volatile lpBuffers;
+} *LPTRACE;
 
-  WORD nParseBufferSize;
-  WORD nParseBufferSize;
-  SLICE aParseBuffer[0];
-} *LPPARSECONTEXT;
+static LPTRACE volatile s_lpTrace;
+static volatile LONG s_nTraceEnvChecked;
 
-static LPPARSECONTEXT CreateParseContext(LPSTR lpszSrc,
-                                         WORD parseBufferSize);
-static void ParseLine(LPPARSECONTEXT lpCtx, LPERROR lpError);
-static void ParseQuesMark(LPPARSECONTEXT lpCtx, LPERROR lpError);
-static void ParsePart(LPPARSECONTEXT lpCtx, LPERROR lpError);
-static SLICE ParseId(LPPARSECONTEXT lpCtx, LPERROR lpError);
-static SLICE ParseStr(LPPARSECONTEXT lpCtx, LPERROR lpError);
-static void CheckBufferSize(LPPARSECONTEXT lpCtx, LPERROR lpError);
-static void FinishLine(LPPARSECONTEXT lpCtx, LPERROR lpError);
-static LPCOMMAND CreateCommandFS2(SRCINFO srcInfo,
-                                  SLICE *aParts);
-static LPCOMMAND CreateCommandFS5(LPCOMMAND lpPrev,
-                                  LPCOMMAND lpNext,
-                                  LPVOID lpExtraData,
-                                  SRCINFO srcInfo,
-                                  SLICE *aParts);
-static void SkipWhitespace(LPPARSECONTEXT lpCtx);
-static void SkipComment(LPPARSECONTEXT lpCtx);
-static CHAR CurChar(LPPARSECONTEXT lpCtx);
-static PCHAR CurCharPos(LPPARSECONTEXT lpCtx);
-static void NextChar(LPPARSECONTEXT lpCtx);
-static BOOL IsIdChar(CHAR ch);
-static BOOL IsLineEnd(CHAR ch);
-static LPSTR ShrinkConv(PCHAR pcStart, PCHAR pcEnd);
+static LPTRACE TraceSession(void);
+static LONGLONG TraceBegin(void);
+static void TraceEnd(LONGLONG nStart,
+                     LPCSTR lpszCategory,
+                     LPCSTR lpszName,
+                     LPCSTR lpszDetail);
+static TRACEBUFFER *TraceThreadBuffer(LPTRACE lpTrace);
+static void WriteTraceString(FILE *fp, LPCSTR lpszStr);
 
-LPPROGRAM ParseProgram(LPSTR lpszSource,
-                       WORD nParseBufferSize,
-                       LPERROR lpError)
+BOOL StartTrace(LPCSTR lpszFileName, BOOL bCommands)
 {
-  LPPARSECONTEXT lpCtx = CreateParseContext
-    (
-      lpszSource,
-      nParseBufferSize
-    );
-  if (lpCtx == NULL)
+  LPTRACE lpTrace = (LPTRACE)malloc(sizeof(struct stTrace));
+  if (lpTrace == NULL)
     {
-      return NULL;
+      return FALSE;
     }
-  while (CurChar(lpCtx) != '\0')
+  lpTrace->lpszFileName = (LPSTR)malloc(strlen(lpszFileName) + 1);
+  lpTrace->dwTlsIndex = TlsAlloc();
+  if (lpTrace->lpszFileName == NULL
+      || lpTrace->dwTlsIndex == TLS_OUT_OF_INDEXES)
     {
-      ParseLine(lpCtx, lpError);
-      if (IsError(lpError))
+      if (lpTrace->dwTlsIndex != TLS_OUT_OF_INDEXES)
         {
-          break;
+          TlsFree(lpTrace->dwTlsIndex);
         }
+      free(lpTrace->lpszFileName);
+      free(lpTrace);
+      return FALSE;
     }
+  strcpy(lpTrace->lpszFileName, lpszFileName);
+  lpTrace->bCommands = bCommands;
+  lpTrace->lpBuffers = NULL;
 
-  LPPROGRAM ret = (LPPROGRAM)malloc(sizeof(struct stProgram));
-  memcpy(ret, &lpCtx->lpProgram, sizeof(struct stProgram));
-  free(lpCtx);
-  return ret;
-}
+  LARGE_INTEGER liNow;
+  QueryPerformanceFrequency(&liNow);
+  lpTrace->nFrequency = liNow.QuadPart;
+  QueryPerformanceCounter(&liNow);
+  lpTrace->nOrigin = liNow.QuadPart;
 
-static LPPARSECONTEXT CreateParseContext(LPSTR lpszSrc,
-                                         WORD nParseBufferSize) {
-  LPPARSECONTEXT ret = (LPPARSECONTEXT)malloc
-    (
-      sizeof(struct stParseContext) + nParseBufferSize * sizeof(SLICE)
-    );
-  if (ret == NULL) 
+  /* the environment is not consulted once a trace was started */
+  InterlockedExchange(&s_nTraceEnvChecked, 1);
+  if (InterlockedCompareExchangePointer((PVOID volatile*)&s_lpTrace,
+                                        lpTrace, NULL) != NULL)
     {
-      return NULL;
+      TlsFree(lpTrace->dwTlsIndex);
+      free(lpTrace->lpszFileName);
+      free(lpTrace);
+      return FALSE;
     }
 
-  InitProgram(&ret->lpProgram);
-  ret->lpListTail = NULL;
-  ret->lpszSrc = lpszSrc;
-  ret->dwSrcIdx = 0;
-  ret->srcInfo = SourceInfo("<unknown-file>", 1);
-  ret->mode = PARSE_SINGLE_LINE;
-
-  ret->nParseBufferSize = nParseBufferSize;
-  ret->nParseBufferSize = 0;
-  memset(ret->aParseBuffer, 0, nParseBufferSize * sizeof(SLICE));
-  return ret;
+  static volatile LONG s_nAtExit;
+  if (InterlockedExchange(&s_nAtExit, 1) == 0)
+    {
+      atexit(StopTrace);
+    }
+  return TRUE;
 }
 
-static void ParseLine(LPPARSECONTEXT lpCtx, LPERROR lpError) {
-  if (CurChar(lpCtx) == '?')
+void StopTrace(void)
+{
+  LPTRACE lpTrace = (LPTRACE)InterlockedExchangePointer
+    (
+      (PVOID volatile*)&s_lpTrace,
+      NULL
+    );
+  if (lpTrace == NULL)
     {
-      ParseQuesMark(lpCtx, lpError);
-      if (IsError(lpError))
-        {
-          return;
-        }
+      return;
     }
 
-  while (TRUE)
+  FILE *fp = fopen(lpTrace->lpszFileName, "w");
+  if (fp == NULL)
     {
-      SkipWhitespace(lpCtx);
-      if (CurChar(lpCtx) == '\0' || CurChar(lpCtx) == '\n')
+      fprintf(stderr, "[int/e] cannot open trace output `%s`\n",
+              lpTrace->lpszFileName);
+    }
+  else
+    {
+      fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    }
+
+  BOOL bFirst = TRUE;
+  DWORD dwProcessId = GetCurrentProcessId();
+  double fScale = 1e6 / (double)lpTrace->nFrequency;
+  TRACEBUFFER *lpBuffer = lpTrace->lpBuffers;
+  while (lpBuffer != NULL)
+    {
+      TRACECHUNK *lpChunk = lpBuffer->lpFirst;
+      while (lpChunk != NULL)
         {
-          if (lpCtx->mode == PARSE_SINGLE_LINE)
-            {
-              FinishLine(lpCtx, lpError);
-            }
-          if (lpCtx->mode == PARSE_MULTI_LINE && CurChar(lpCtx) == '\0')
-            {
-              ErrPrintf(lpError, PL2ERR_UNCLOSED_BEGIN, lpCtx->srcInfo,
-                        NULL, "unclosed `?begin` block");
-            }
-          if (CurChar(lpCtx) == '\n')
+          for (DWORD i = 0; fp != NULL && i < lpChunk->nEvents; i++)
             {
-              NextChar(lpCtx);
+              const TRACEEVENT *lpEvent = &lpChunk->aEvents[i];
+              fprintf(fp, "%s\n{\"name\":", bFirst ? "" : ",");
+              WriteTraceString(fp, lpEvent->lpszName != NULL
+                                   ? lpEvent->lpszName
+                                   : lpEvent->szDetail);
+              fprintf(fp,
+                      ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                      "\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu",
+                      lpEvent->lpszCategory,
+                      (double)(lpEvent->nStart - lpTrace->nOrigin) * fScale,
+                      (double)(lpEvent->nEnd - lpEvent->nStart) * fScale,
+                      (unsigned long)dwProcessId,
+                      (unsigned long)lpBuffer->dwThreadId);
+              if (lpEvent->lpszName != NULL && lpEvent->szDetail[0] != '\0')
+                {
+                  fprintf(fp, ",\"args\":{\"detail\":");
+                  WriteTraceString(fp, lpEvent->szDetail);
+                  fprintf(fp, "}");
+                }
+              fprintf(fp, "}");
+              bFirst = FALSE;
             }
-          return;
-        }
-      else if (CurChar(lpCtx) == '#')
-        {
-          SkipComment(lpCtx);
+          TRACECHUNK *lpNextChunk = lpChunk->lpNext;
+          free(lpChunk);
+          lpChunk = lpNextChunk;
         }
-      else
+      TRACEBUFFER *lpNextBuffer = lpBuffer->lpNext;
+      free(lpBuffer);
+      lpBuffer = lpNextBuffer;
+    }
+
+  if (fp != NULL)
+    {
+      fprintf(fp, "\n]}\n");
+      fclose(fp);
+    }
+  TlsFree(lpTrace->dwTlsIndex);
+  free(lpTrace->lpszFileName);
+  free(lpTrace);
+}
+
+static LPTRACE TraceSession(void)
+{
+  LPTRACE lpTrace = s_lpTrace;
+  if (lpTrace == NULL
+      && s_nTraceEnvChecked == 0
+      && InterlockedExchange(&s_nTraceEnvChecked, 1) == 0)
+    {
+      LPCSTR lpszFileName = getenv(TRACE_ENV);
+      LPCSTR lpszCommands = getenv(TRACE_ENV_COMMANDS);
+      if (lpszFileName != NULL && lpszFileName[0] != '\0')
         {
-          ParsePart(lpCtx, lpError);
-          if (IsError(lpError))
-            {
-              return;
-            }
+          StartTrace(lpszFileName,
+                     lpszCommands != NULL && lpszCommands[0] == '1');
         }
-  }
+      lpTrace = s_lpTrace;
+    }
+  return lpTrace;
 }
 
-static void ParseQuesMark(LPPARSECONTEXT lpCtx, LPERROR lpError)
+/* 0 when not tracing, which makes the matching TraceEnd do nothing */
+static LONGLONG TraceBegin(void)
 {
-  assert(CurChar(lpCtx) == '?');
-  NextChar(lpCtx);
+  if (TraceSession() == NULL)
+    {
+      return 0;
+    }
+  LARGE_INTEGER liNow;
+  QueryPerformanceCounter(&liNow);
+  return liNow.QuadPart;
+}
 
-  PCHAR pcStart = CurCharPos(lpCtx);
-  while (isalnum((int)CurChar(lpCtx)))
+static void TraceEnd(LONGLONG nStart,
+                     LPCSTR lpszCategory,
+                     LPCSTR lpszName,
+                     LPCSTR lpszDetail)
+{
+  if (nStart == 0)
     {
-      NextChar(lpCtx);
+      return;
     }
-  PCHAR pcEnd = CurCharPos(lpCtx);
-  SLICE s = Slice(pcStart, pcEnd);
-  LPSTR szQuesCommand = SliceIntoCStr(s);
-  
-  if (!strcmp(szQuesCommand, "begin")) 
+  LARGE_INTEGER liNow;
+  QueryPerformanceCounter(&liNow);
+  LPTRACE lpTrace = s_lpTrace;
+  TRACEBUFFER *lpBuffer = lpTrace != NULL
+    ? TraceThreadBuffer(lpTrace)
+    : NULL;
+  if (lpBuffer == NULL)
     {
-      lpCtx->mode = PARSE_MULTI_LINE;
+      return;
     }
-  else if (!strcmp(szQuesCommand, "end"))
+
+  TRACECHUNK *lpChunk = lpBuffer->lpLast;
+  if (lpChunk == NULL || lpChunk->nEvents == TRACE_CHUNK_EVENTS)
     {
-      lpCtx->mode = PARSE_SINGLE_LINE;
-      FinishLine(lpCtx, lpError);
+      TRACECHUNK *lpNew = (TRACECHUNK*)malloc(sizeof(TRACECHUNK));
+      if (lpNew == NULL)
+        {
+          return;
+        }
+      lpNew->lpNext = NULL;
+      lpNew->nEvents = 0;
+      if (lpChunk != NULL)
+        {
+          lpChunk->lpNext = lpNew;
+        }
+      else
+        {
+          lpBuffer->lpFirst = lpNew;
+        }
+      lpBuffer->lpLast = lpChunk = lpNew;
     }
-  else
+
+  TRACEEVENT *lpEvent = &lpChunk->aEvents[lpChunk->nEvents++];
+  lpEvent->lpszName = lpszName;
+  lpEvent->lpszCategory = lpszCategory;
+  lpEvent->nStart = nStart;
+  lpEvent->nEnd = liNow.QuadPart;
+  lpEvent->szDetail[0] = '\0';
+  if (lpszDetail != NULL)
     {
-      ErrPrintf(lpError, PL2ERR_UNKNOWN_QUES, lpCtx->srcInfo,
-                NULL, "unknown question mark operator: `%s`",
-                szQuesCommand);
+      strncat(lpEvent->szDetail, lpszDetail, TRACE_DETAIL_LEN - 1);
     }
 }
 
-static void ParsePart(LPPARSECONTEXT lpCtx, LPERROR lpError)
+static TRACEBUFFER *TraceThreadBuffer(LPTRACE lpTrace)
 {
-  SLICE part;
-  if (CurChar(lpCtx) == '"' || CurChar(lpCtx) == '\'')
-    {
-      part = ParseStr(lpCtx, lpError);
-    }
-  else
+  TRACEBUFFER *lpBuffer = (TRACEBUFFER*)TlsGetValue(lpTrace->dwTlsIndex);
+  if (lpBuffer != NULL)
     {
-      part = ParseId(lpCtx, lpError);
+      return lpBuffer;
     }
-  if (IsError(lpError))
+
+  lpBuffer = (TRACEBUFFER*)malloc(sizeof(TRACEBUFFER));
+  if (lpBuffer == NULL)
     {
-      return;
+      return NULL;
     }
+  lpBuffer->dwThreadId = GetCurrentThreadId();
+  lpBuffer->lpFirst = NULL;
+  lpBuffer->lpLast = NULL;
+  TlsSetValue(lpTrace->dwTlsIndex, lpBuffer);
 
-  CheckBufferSize(lpCtx, lpError);
-  if (IsError(lpError))
+  TRACEBUFFER *lpHead;
+  do
     {
-      return;
+      lpHead = lpTrace->lpBuffers;
+      lpBuffer->lpNext = lpHead;
     }
-
-  lpCtx->aParseBuffer[lpCtx->nParseBufferSize++] = part;
+  while (InterlockedCompareExchangePointer
+           (
+             (PVOID volatile*)&lpTrace->lpBuffers,
+             lpBuffer,
+             lpHead
+           ) != lpHead);
+  return lpBuffer;
 }
 
-static SLICE ParseId(LPPARSECONTEXT lpCtx, LPERROR lpError)
+static void WriteTraceString(FILE *fp, LPCSTR lpszStr)
 {
-  (void)lpError;
-  PCHAR pcStart = CurCharPos(lpCtx);
-  while (IsIdChar(CurChar(lpCtx)))
+  fputc('"', fp);
+  for (LPCSTR pc = lpszStr; *pc != '\0'; pc++)
     {
-      NextChar(lpCtx);
+      if (*pc == '"' || *pc == '\\')
+        {
+          fprintf(fp, "\\%c", *pc);
+        }
+      else if (TransmuteU8(*pc) < 0x20)
+        {
+          fprintf(fp, "\\u%04x", (unsigned)TransmuteU8(*pc));
+        }
+      else
+        {
+          fputc(*pc, fp);
+        }
     }
-  PCHAR pcEnd = CurCharPos(lpCtx);
-  return Slice(pcStart, pcEnd);
+  fputc('"', fp);
 }
 
-static SLICE ParseStr(LPPARSECONTEXT lpCtx, LPERROR lpError)
+/*** ----------------------------- Arena ----------------------------- ***/
+
+#define ARENA_ALIGN        16
+#define ARENA_MIN_BLOCK    (64 * 1024)
+
+struct stArenaBlock
 {
-  assert(CurChar(lpCtx) == '"' || CurChar(lpCtx) == '\'');
-  NextChar(lpCtx);
+  struct stArenaBlock *lpPrev;
+  SIZE_T cbSize;
+  SIZE_T cbUsed;
+};
 
-  PCHAR pcStart = CurCharPos(lpCtx);
-  while (CurChar(lpCtx) != '"'
-         && CurChar(lpCtx) != '\''
-         && !IsLineEnd(CurChar(lpCtx)))
+#define ARENA_HEADER_SIZE \
+  ((sizeof(struct stArenaBlock) + ARENA_ALIGN - 1) & ~(SIZE_T)(ARENA_ALIGN - 1))
+
+static LPVOID ArenaAlloc(struct stArenaBlock **lplpArena, SIZE_T cbSize);
+static void ArenaFree(struct stArenaBlock *lpArena);
+static void ArenaAdopt(struct stArenaBlock **lplpArena,
+                       struct stArenaBlock *lpOther);
+
+static LPVOID ArenaAlloc(struct stArenaBlock **lplpArena, SIZE_T cbSize)
+{
+  cbSize = (cbSize + ARENA_ALIGN - 1) & ~(SIZE_T)(ARENA_ALIGN - 1);
+
+  struct stArenaBlock *lpBlock = *lplpArena;
+  if (lpBlock == NULL || lpBlock->cbSize - lpBlock->cbUsed < cbSize)
     {
-      if (CurChar(lpCtx) == '\\')
+      /* blocks double in size, so a program of any length only costs
+         a logarithmic number of blocks to allocate and release */
+      SIZE_T cbBlock = lpBlock != NULL ? lpBlock->cbSize * 2
+                                       : ARENA_MIN_BLOCK;
+      while (cbBlock - ARENA_HEADER_SIZE < cbSize)
         {
-          NextChar(lpCtx);
-          NextChar(lpCtx);
+          cbBlock *= 2;
         }
-      else
+      struct stArenaBlock *lpNewBlock =
+        (struct stArenaBlock*)malloc(cbBlock);
+      if (lpNewBlock == NULL)
         {
-          NextChar(lpCtx);
+          return NULL;
         }
+      lpNewBlock->lpPrev = lpBlock;
+      lpNewBlock->cbSize = cbBlock;
+      lpNewBlock->cbUsed = ARENA_HEADER_SIZE;
+      *lplpArena = lpBlock = lpNewBlock;
     }
 
-  PCHAR pcEnd = CurCharPos(lpCtx);
-  pcEnd = ShrinkConv(pcStart, pcEnd);
-
-  if (CurChar(lpCtx) == '"' || CurChar(lpCtx) == '\'')
-    {
-      NextChar(lpCtx);
-    }
-  else
-    {
-      ErrPrintf(lpError, PL2ERR_UNCLOSED_BEGIN, lpCtx->srcInfo,
-                NULL, "unclosed string literal");
-      return NullSlice();
-    }
-  return Slice(pcStart, pcEnd);
+  LPVOID ret = (PCHAR)lpBlock + lpBlock->cbUsed;
+  lpBlock->cbUsed += cbSize;
+  return ret;
 }
 
-static void CheckBufferSize(LPPARSECONTEXT lpCtx, LPERROR lpError)
+static void ArenaFree(struct stArenaBlock *lpArena)
 {
-  if (lpCtx->nParseBufferSize <= lpCtx->nParseBufferSize + 1)
+  while (lpArena != NULL)
     {
-      ErrPrintf(lpError, PL2ERR_UNCLOSED_BEGIN, lpCtx->srcInfo,
-                NULL, "command parts exceed internal parsing buffer");
+      struct stArenaBlock *lpPrev = lpArena->lpPrev;
+      free(lpArena);
+      lpArena = lpPrev;
     }
 }
 
-static void FinishLine(LPPARSECONTEXT lpCtx, LPERROR lpError)
+/* moves the blocks of lpOther behind those of *lplpArena */
+static void ArenaAdopt(struct stArenaBlock **lplpArena,
+                       struct stArenaBlock *lpOther)
 {
-  (void)lpError;
-
-  SRCINFO srcInfo = lpCtx->srcInfo;
-  NextChar(lpCtx);
-  if (lpCtx->nParseBufferSize == 0)
+  if (lpOther == NULL)
     {
       return;
     }
-  if (lpCtx->lpListTail == NULL)
-    {
-      assert(lpCtx->lpProgram.lpCommands == NULL);
-      lpCtx->lpProgram.lpCommands = lpCtx->lpListTail = CreateCommandFS2
-        (
-          lpCtx->srcInfo,
-          lpCtx->aParseBuffer
-        );
-    }
-  else
-    {
-      lpCtx->lpListTail = CreateCommandFS5
-        (
-          lpCtx->lpListTail,
-          NULL,
-          NULL,
-          lpCtx->srcInfo,
-          lpCtx->aParseBuffer
-        );
-    }
-  if (lpCtx->lpListTail == NULL)
+  struct stArenaBlock *lpOldest = lpOther;
+  while (lpOldest->lpPrev != NULL)
     {
-      ErrPrintf(lpError, PL2ERR_MALLOC, srcInfo, 0,
-                "failed allocating COMMAND");
+      lpOldest = lpOldest->lpPrev;
     }
-  memset(lpCtx->aParseBuffer, 0, sizeof(SLICE) * lpCtx->nParseBufferSize);
-  lpCtx->nParseBufferSize = 0;
+  lpOldest->lpPrev = *lplpArena;
+  *lplpArena = lpOther;
 }
 
-static LPCOMMAND CreateCommandFS2(SRCINFO srcInfo,
-                                  SLICE *aParts)
+/*** ------------------- Some toolkit functions -------------------- ***/
+
+static void CountHeapCommand(void);
+
+SRCINFO SourceInfo(LPCSTR lpszFileName, DWORDLONG nLine)
 {
-  return CreateCommandFS5(NULL, NULL, NULL, srcInfo, aParts);
+  SRCINFO ret;
+  ret.lpszFileName = lpszFileName;
+  ret.nLine = nLine;
+  return ret;
 }
 
-static LPCOMMAND CreateCommandFS5(LPCOMMAND lpPrev,
-                                  LPCOMMAND lpNext,
-                                  LPVOID lpExtraData,
-                                  SRCINFO srcInfo,
-                                  SLICE *aParts)
+LPCOMMAND CreateCommand(LPCOMMAND lpPrev,
+                        LPCOMMAND lpNext,
+                        LPVOID lpExtraData,
+                        SRCINFO srcInfo,
+                        LPSTR lpszCmd,
+                        LPSTR aszArgs[])
 {
-  WORD nPartCount = 0;
-  for (; !IsNullSlice(aParts[nPartCount]); ++nPartCount);
+  LPCOMMAND ret = CreateProgramCommand(NULL, lpPrev, lpNext, lpExtraData,
+                                       srcInfo, lpszCmd, aszArgs);
+  if (ret != NULL)
+    {
+      CountHeapCommand();
+    }
+  return ret;
+}
 
-  LPCOMMAND ret = (LPCOMMAND)malloc
-    (
-      sizeof(struct stCommand) + nPartCount * sizeof(LPSTR)
-    );
+LPCOMMAND CreateProgramCommand(LPPROGRAM lpProgram,
+                               LPCOMMAND lpPrev,
+                               LPCOMMAND lpNext,
+                               LPVOID lpExtraData,
+                               SRCINFO srcInfo,
+                               LPSTR lpszCmd,
+                               LPSTR aszArgs[])
+{
+  DWORD nArgCount = 0;
+  for (; aszArgs[nArgCount] != NULL; ++nArgCount);
+
+  SIZE_T cbCommand =
+    sizeof(struct stCommand) + (nArgCount + 1) * sizeof(LPSTR);
+  LPCOMMAND ret;
+  if (lpProgram != NULL)
+    {
+      ret = (LPCOMMAND)ArenaAlloc(&lpProgram->lpArena, cbCommand);
+    }
+  else
+    {
+      ret = (LPCOMMAND)malloc(cbCommand);
+    }
   if (ret == NULL)
     {
       return NULL;
     }
-
+  ret->bHeapAlloc = lpProgram == NULL;
   ret->lpPrev = lpPrev;
   if (lpPrev != NULL)
     {
@@ -552,798 +895,8943 @@ static LPCOMMAND CreateCommandFS5(LPCOMMAND lpPrev,
     {
       lpNext->lpPrev = ret;
     }
-  ret->lpExtraData = lpExtraData;
   ret->srcInfo = srcInfo;
-  ret->lpszCmd = SliceIntoCStr(aParts[0]);
-  for (WORD i = 1; i < nPartCount; i++)
+  ret->lpszCmd = lpszCmd;
+  ret->lpExtraData = lpExtraData;
+  ret->dwlBinding = 0;
+  ret->dwAtom = lpProgram != NULL ? GetCommandAtom(lpProgram, lpszCmd)
+                                  : ATOM_NONE;
+  for (WORD i = 0; i < nArgCount; i++)
     {
-      ret->aszArgs[i - 1] = SliceIntoCStr(aParts[i]);
+      ret->aszArgs[i] = aszArgs[i];
     }
-  ret->aszArgs[nPartCount - 1] = NULL;
+  ret->aszArgs[nArgCount] = NULL;
   return ret;
 }
 
-static void SkipWhitespace(LPPARSECONTEXT lpCtx)
+WORD CountCommandArgs(LPCOMMAND lpCmd)
 {
-  while (1)
+  WORD nAcc = 0;
+  LPSTR *iter = lpCmd->aszArgs;
+  while (*iter != NULL)
     {
-      switch (CurChar(lpCtx))
-        {
-          case ' ': case '\t': case '\f': case '\v': case '\r':
-            NextChar(lpCtx);
-            break;
-          default:
-            return;
-        }
+      iter++;
+      nAcc++;
     }
+  return nAcc;
 }
 
-static void SkipComment(LPPARSECONTEXT lpCtx)
+/*** ------------------------- Command atoms ------------------------ ***/
+
+/* every distinct command name of a program gets a dense atom, in the
+   order it is first seen; the table keeps its own copy of each name,
+   so atoms outlive the commands and sources they came from */
+
+#define ATOM_MIN_SLOTS 64
+
+typedef struct stAtomTable
 {
-  assert(CurChar(lpCtx) == '#');
-  NextChar(lpCtx);
+  DWORD nAtoms;
+  DWORD nNameCap;
+  LPCSTR *alpszNames;
+  DWORD *adwHashes;
+  /* atom in each slot, ATOM_NONE for a free one */
+  DWORD *anSlots;
+  DWORD nSlotMask;
+  /* scripts tend to repeat a command, so the last atom is tried first */
+  DWORD dwLastAtom;
+  struct stArenaBlock *lpArena;
+} *LPATOMTABLE;
 
-  while (!IsLineEnd(CurChar(lpCtx)))
+static LPATOMTABLE CreateAtomTable(void);
+static void DropAtomTable(LPATOMTABLE lpAtoms);
+static DWORD InternAtom(LPATOMTABLE lpAtoms, LPCSTR lpszName);
+static DWORD FindAtom(LPATOMTABLE lpAtoms, LPCSTR lpszName);
+static BOOL GrowAtomSlots(LPATOMTABLE lpAtoms);
+static DWORD HashCmdName(LPCSTR lpszCmdName);
+
+DWORD GetCommandAtom(LPPROGRAM lpProgram, LPCSTR lpszCmdName)
+{
+  if (lpProgram->lpAtoms == NULL)
     {
-      NextChar(lpCtx);
+      lpProgram->lpAtoms = CreateAtomTable();
+      if (lpProgram->lpAtoms == NULL)
+        {
+          return ATOM_NONE;
+        }
     }
+  return InternAtom(lpProgram->lpAtoms, lpszCmdName);
+}
 
-  if (CurChar(lpCtx) == '\n')
+DWORD CommandAtom(LPPROGRAM lpProgram, LPCOMMAND lpCmd)
+{
+  if (lpCmd->dwAtom == ATOM_NONE)
     {
-      NextChar(lpCtx);
+      lpCmd->dwAtom = GetCommandAtom(lpProgram, lpCmd->lpszCmd);
     }
+  return lpCmd->dwAtom;
 }
 
-static CHAR CurChar(LPPARSECONTEXT lpCtx)
+LPCSTR AtomName(LPPROGRAM lpProgram, DWORD dwAtom)
 {
-  return lpCtx->lpszSrc[lpCtx->dwSrcIdx];
+  if (lpProgram->lpAtoms == NULL
+      || dwAtom == ATOM_NONE
+      || dwAtom >= lpProgram->lpAtoms->nAtoms)
+    {
+      return NULL;
+    }
+  return lpProgram->lpAtoms->alpszNames[dwAtom];
 }
 
-static PCHAR CurCharPos(LPPARSECONTEXT lpCtx)
+static LPATOMTABLE CreateAtomTable(void)
 {
-  return lpCtx->lpszSrc + lpCtx->dwSrcIdx;
+  LPATOMTABLE ret = (LPATOMTABLE)malloc(sizeof(struct stAtomTable));
+  if (ret == NULL)
+    {
+      return NULL;
+    }
+  ret->nAtoms = 1;
+  ret->nNameCap = ATOM_MIN_SLOTS / 2;
+  ret->alpszNames = (LPCSTR*)malloc(ret->nNameCap * sizeof(LPCSTR));
+  ret->adwHashes = (DWORD*)malloc(ret->nNameCap * sizeof(DWORD));
+  ret->anSlots = (DWORD*)calloc(ATOM_MIN_SLOTS, sizeof(DWORD));
+  ret->nSlotMask = ATOM_MIN_SLOTS - 1;
+  ret->dwLastAtom = ATOM_NONE;
+  ret->lpArena = NULL;
+  if (ret->alpszNames == NULL || ret->adwHashes == NULL
+      || ret->anSlots == NULL)
+    {
+      DropAtomTable(ret);
+      return NULL;
+    }
+  ret->alpszNames[ATOM_NONE] = NULL;
+  ret->adwHashes[ATOM_NONE] = 0;
+
+  /* the built-ins always get the same atoms */
+  if (InternAtom(ret, "language") != ATOM_LANGUAGE
+      || InternAtom(ret, "abort") != ATOM_ABORT)
+    {
+      DropAtomTable(ret);
+      return NULL;
+    }
+  return ret;
 }
 
-static void NextChar(LPPARSECONTEXT lpCtx)
+static void DropAtomTable(LPATOMTABLE lpAtoms)
 {
-  if (lpCtx->lpszSrc[lpCtx->dwSrcIdx] == '\0')
+  if (lpAtoms == NULL)
     {
       return;
     }
-  else
-    {
-      if (lpCtx->lpszSrc[lpCtx->dwSrcIdx] == '\n')
-        {
-          lpCtx->srcInfo.nLine += 1;
-        }
-      lpCtx->dwSrcIdx += 1;
-    }
+  free((LPVOID)lpAtoms->alpszNames);
+  free(lpAtoms->adwHashes);
+  free(lpAtoms->anSlots);
+  ArenaFree(lpAtoms->lpArena);
+  free(lpAtoms);
 }
 
-static BOOL IsIdChar(CHAR ch)
+static DWORD InternAtom(LPATOMTABLE lpAtoms, LPCSTR lpszName)
 {
-  BYTE uch = TransmuteU8(ch);
-  if (uch >= 128)
+  if (lpAtoms->dwLastAtom != ATOM_NONE
+      && !strcmp(lpAtoms->alpszNames[lpAtoms->dwLastAtom], lpszName))
     {
-      return 1;
+      return lpAtoms->dwLastAtom;
     }
-  else if (isalnum(ch))
+
+  DWORD dwHash = HashCmdName(lpszName);
+  DWORD i = dwHash & lpAtoms->nSlotMask;
+  for (; lpAtoms->anSlots[i] != ATOM_NONE; i = (i + 1) & lpAtoms->nSlotMask)
     {
-      return 1;
+      DWORD dwAtom = lpAtoms->anSlots[i];
+      if (lpAtoms->adwHashes[dwAtom] == dwHash
+          && !strcmp(lpAtoms->alpszNames[dwAtom], lpszName))
+        {
+          lpAtoms->dwLastAtom = dwAtom;
+          return dwAtom;
+        }
     }
-  else 
+
+  if (lpAtoms->nAtoms == lpAtoms->nNameCap)
     {
-      switch (ch)
+      DWORD nNameCap = lpAtoms->nNameCap * 2;
+      LPCSTR *alpszNames = (LPCSTR*)realloc
+        (
+          (LPVOID)lpAtoms->alpszNames,
+          nNameCap * sizeof(LPCSTR)
+        );
+      if (alpszNames == NULL)
         {
-          case '!': case '$': case '%': case '^': case '&': case '*':
-          case '(': case ')': case '-': case '+': case '_': case '=':
-          case '[': case ']': case '{': case '}': case '|': case '\\':
-          case ':': case ';': case '\'': case ',': case '<': case '>':
-          case '/': case '?': case '~': case '@': case '.':
-            return 1;
-          default:
-            return 0;
+          return ATOM_NONE;
         }
+      lpAtoms->alpszNames = alpszNames;
+      DWORD *adwHashes = (DWORD*)realloc
+        (
+          lpAtoms->adwHashes,
+          nNameCap * sizeof(DWORD)
+        );
+      if (adwHashes == NULL)
+        {
+          return ATOM_NONE;
+        }
+      lpAtoms->adwHashes = adwHashes;
+      lpAtoms->nNameCap = nNameCap;
     }
-}
 
-static BOOL IsLineEnd(CHAR ch)
-{
-  return ch == '\0' || ch == '\n';
+  SIZE_T cbName = strlen(lpszName) + 1;
+  PCHAR lpszCopy = (PCHAR)ArenaAlloc(&lpAtoms->lpArena, cbName);
+  if (lpszCopy == NULL)
+    {
+      return ATOM_NONE;
+    }
+  memcpy(lpszCopy, lpszName, cbName);
+
+  DWORD dwAtom = lpAtoms->nAtoms++;
+  lpAtoms->alpszNames[dwAtom] = lpszCopy;
+  lpAtoms->adwHashes[dwAtom] = dwHash;
+  lpAtoms->anSlots[i] = dwAtom;
+  lpAtoms->dwLastAtom = dwAtom;
+
+  /* keep the load factor at or below one half */
+  if (lpAtoms->nAtoms * 2 > lpAtoms->nSlotMask + 1
+      && !GrowAtomSlots(lpAtoms))
+    {
+      lpAtoms->anSlots[i] = ATOM_NONE;
+      lpAtoms->nAtoms--;
+      lpAtoms->dwLastAtom = ATOM_NONE;
+      return ATOM_NONE;
+    }
+  return dwAtom;
 }
 
-static LPSTR ShrinkConv(PCHAR pcStart, PCHAR pcEnd)
+/* like InternAtom without adding the name or touching the memo, so
+   it may run on a table other threads read at the same time */
+static DWORD FindAtom(LPATOMTABLE lpAtoms, LPCSTR lpszName)
 {
-  PCHAR iter1 = pcStart, iter2 = pcStart;
-  while (iter1 != pcEnd)
+  if (lpAtoms == NULL)
+    {
+      return ATOM_NONE;
+    }
+  DWORD dwHash = HashCmdName(lpszName);
+  for (DWORD i = dwHash & lpAtoms->nSlotMask;
+       lpAtoms->anSlots[i] != ATOM_NONE;
+       i = (i + 1) & lpAtoms->nSlotMask)
     {
-      if (iter1[0] == '\\')
+      DWORD dwAtom = lpAtoms->anSlots[i];
+      if (lpAtoms->adwHashes[dwAtom] == dwHash
+          && !strcmp(lpAtoms->alpszNames[dwAtom], lpszName))
         {
-          switch (iter1[1])
-            {
-              case 'n': *iter2++ = '\n'; iter1 += 2; break;
-              case 'r': *iter2++ = '\r'; iter1 += 2; break;
-              case 'f': *iter2++ = '\f'; iter1 += 2; break;
-              case 'v': *iter2++ = '\v'; iter1 += 2; break;
-              case 't': *iter2++ = '\t'; iter1 += 2; break;
-              case 'a': *iter2++ = '\a'; iter1 += 2; break;
-              case '"': *iter2++ = '\"'; iter1 += 2; break;
-              case '0': *iter2++ = '\0'; iter1 += 2; break;
-              default: *iter2++ = *iter1++;
-            }
+          return dwAtom;
         }
-      else
+    }
+  return ATOM_NONE;
+}
+
+static BOOL GrowAtomSlots(LPATOMTABLE lpAtoms)
+{
+  DWORD nSlots = (lpAtoms->nSlotMask + 1) * 2;
+  DWORD *anSlots = (DWORD*)calloc(nSlots, sizeof(DWORD));
+  if (anSlots == NULL)
+    {
+      return FALSE;
+    }
+  for (DWORD dwAtom = ATOM_NONE + 1; dwAtom < lpAtoms->nAtoms; dwAtom++)
+    {
+      DWORD i = lpAtoms->adwHashes[dwAtom] & (nSlots - 1);
+      while (anSlots[i] != ATOM_NONE)
         {
-          *iter2++ = *iter1++;
+          i = (i + 1) & (nSlots - 1);
         }
+      anSlots[i] = dwAtom;
     }
-  return iter2;
+  free(lpAtoms->anSlots);
+  lpAtoms->anSlots = anSlots;
+  lpAtoms->nSlotMask = nSlots - 1;
+  return TRUE;
 }
 
-/*** -------------------- Semantic-ver parsing  -------------------- ***/
+static DWORD HashCmdName(LPCSTR lpszCmdName)
+{
+  /* FNV-1a */
+  DWORD dwHash = 2166136261u;
+  for (; *lpszCmdName != '\0'; ++lpszCmdName)
+    {
+      dwHash ^= TransmuteU8(*lpszCmdName);
+      dwHash *= 16777619u;
+    }
+  return dwHash;
+}
 
-static LPCSTR ParseUint16(LPCSTR lpszSrc,
-                          WORD *lpnOutput,
-                          LPERROR lpError);
+/*** ------------------------- Flat program ------------------------ ***/
 
-static void ParseSemVerPostfix(LPCSTR lpszSrc,
-                               LPSTR lpszOutput,
-                               LPERROR lpError);
+#define FLAT_NONE ((DWORD)-1)
+#define FLAT_INLINE_ARGS 16
 
-SEMVER ZeroVersion(void)
+typedef struct stFlatCommand
 {
-  SEMVER ret;
-  ret.nMajor = 0;
-  ret.nMinor = 0;
-  ret.nPatch = 0;
-  memset(ret.szPostfix, 0, SEMVER_POSTFIX_LEN);
-  ret.bExact = FALSE;
-  return ret;
-}
+  DWORD nNext;
+  DWORD nPrev;
+  DWORD dwCmdOffset;
+  DWORD nFirstArg;
+  WORD nArgCount;
+  WORD wReserved;
+} FLATCOMMAND;
 
-BOOL IsZeroVersion(SEMVER ver)
+struct stFlatProgram
 {
-  return ver.nMajor == 0
-         && ver.nMinor == 0
-         && ver.nPatch == 0
-         && ver.szPostfix[0] == 0
-         && ver.bExact == 0;
-}
+  DWORD nCommands;
+  DWORD nArgs;
+  DWORD cbStrings;
+  const FLATCOMMAND *aCommands;
+  const DWORD *adwAtoms;
+  const DWORD *adwArgOffsets;
+  const DWORDLONG *anLines;
+  LPCSTR lpStrings;
+  LPCSTR lpszFileName;
 
-BOOL IsAlpha(SEMVER ver)
-{
-  return ver.szPostfix[0] != '\0';
-}
+  /* run-time side tables, never part of the packed image */
+  DWORDLONG *adwlBindings;
+  LPCOMMAND *alpViews;
+  LPVOID lpViewBlock;
+  SIZE_T cbViewBlock;
 
-BOOL IsStable(SEMVER ver)
-{
-  return !IsAlpha(ver) && ver.nMajor != 0;
-}
+  LPVOID lpStorage;
+  /* set when the image is a mapped .pl2c file */
+  HANDLE hImageMapping;
+  LPVOID lpImageView;
+};
 
-SEMVER ParseSemVer(LPCSTR lpszSrc, LPERROR lpError)
+typedef struct stFlatProgram *LPFLATPROGRAM;
+
+static void DropFlatProgram(LPFLATPROGRAM lpFlat);
+static void DropCommands(LPPROGRAM lpProgram);
+static LPCSTR FlatCmdName(LPFLATPROGRAM lpFlat, DWORD nIdx);
+static LPCSTR *FlatCmdArgs(LPFLATPROGRAM lpFlat,
+                           DWORD nIdx,
+                           LPCSTR *aszInline);
+static void FreeFlatCmdArgs(LPCSTR *aszArgs, LPCSTR *aszInline);
+static SRCINFO FlatSrcInfo(LPFLATPROGRAM lpFlat, DWORD nIdx);
+static BOOL MaterializeViews(LPPROGRAM lpProgram, LPERROR lpError);
+static DWORD FindViewIndex(LPFLATPROGRAM lpFlat, LPCOMMAND lpCmd);
+
+typedef struct stLineIndex *LPLINEINDEX;
+
+static BOOL BuildLineIndex(LPPROGRAM lpProgram, LPCSTR lpszSource);
+static void DropLineIndex(LPLINEINDEX lpIndex);
+
+BOOL FlattenProgram(LPPROGRAM lpProgram, LPERROR lpError)
 {
-  SEMVER ret = ZeroVersion();
-  if (lpszSrc[0] == '^')
+  if (lpProgram->lpFlat != NULL)
     {
-      ret.bExact = 1;
-      lpszSrc++;
+      return TRUE;
     }
+  SettleProgramLines(lpProgram);
 
-  lpszSrc = ParseUint16(lpszSrc, &ret.nMajor, lpError);
-  if (IsError(lpError))
+  DWORD nCommands = 0;
+  DWORD nArgs = 0;
+  SIZE_T cbStrings = 0;
+  for (LPCOMMAND iter = lpProgram->lpCommands;
+       iter != NULL;
+       iter = iter->lpNext)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0), NULL,
-                "missing major version");
-      goto done;
+      if (CommandAtom(lpProgram, iter) == ATOM_NONE)
+        {
+          ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                    "flatten: cannot allocate memory for command atoms");
+          return FALSE;
+        }
+      ++nCommands;
+      cbStrings += strlen(iter->lpszCmd) + 1;
+      for (WORD i = 0; iter->aszArgs[i] != NULL; i++)
+        {
+          ++nArgs;
+          cbStrings += strlen(iter->aszArgs[i]) + 1;
+        }
     }
-  else if (lpszSrc[0] == '\0')
+  if (cbStrings >= (SIZE_T)FLAT_NONE || nCommands >= FLAT_NONE)
     {
-      goto done;
+      ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(NULL, 0), NULL,
+                "flatten: program too large for 32-bit offsets");
+      return FALSE;
     }
-  else if (lpszSrc[0] == '-')
+
+  SIZE_T cbCommands = nCommands * sizeof(FLATCOMMAND);
+  SIZE_T cbBindings = nCommands * sizeof(DWORDLONG);
+  SIZE_T cbAtoms = nCommands * sizeof(DWORD);
+  SIZE_T cbArgOffsets = nArgs * sizeof(DWORD);
+  SIZE_T cbLines = nCommands * sizeof(DWORDLONG);
+  PCHAR lpStorage = (PCHAR)malloc
+    (
+      sizeof(struct stFlatProgram)
+      + cbBindings + cbCommands + cbAtoms + cbArgOffsets + cbLines
+      + cbStrings
+    );
+  if (lpStorage == NULL)
     {
-      goto parse_postfix;
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                "flatten: cannot allocate memory for flat program");
+      return FALSE;
     }
-  else if (lpszSrc[0] != '.')
+
+  LPFLATPROGRAM lpFlat = (LPFLATPROGRAM)lpStorage;
+  DWORDLONG *adwlBindings =
+    (DWORDLONG*)(lpStorage + sizeof(struct stFlatProgram));
+  DWORDLONG *anLines = (DWORDLONG*)((PCHAR)adwlBindings + cbBindings);
+  FLATCOMMAND *aCommands = (FLATCOMMAND*)((PCHAR)anLines + cbLines);
+  DWORD *adwAtoms = (DWORD*)((PCHAR)aCommands + cbCommands);
+  DWORD *adwArgOffsets = (DWORD*)((PCHAR)adwAtoms + cbAtoms);
+  PCHAR lpStrings = (PCHAR)adwArgOffsets + cbArgOffsets;
+
+  DWORD nIdx = 0;
+  DWORD nArgIdx = 0;
+  DWORD dwStrOffset = 0;
+  lpFlat->lpszFileName = NULL;
+  for (LPCOMMAND iter = lpProgram->lpCommands;
+       iter != NULL;
+       iter = iter->lpNext, nIdx++)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0), NULL,
-                "expected `.`, got `%c`", lpszSrc[0]);
-      goto done;
+      FLATCOMMAND *lpFlatCmd = &aCommands[nIdx];
+      lpFlatCmd->nPrev = nIdx == 0 ? FLAT_NONE : nIdx - 1;
+      lpFlatCmd->nNext = iter->lpNext == NULL ? FLAT_NONE : nIdx + 1;
+      lpFlatCmd->nFirstArg = nArgIdx;
+      lpFlatCmd->nArgCount = 0;
+      lpFlatCmd->wReserved = 0;
+
+      SIZE_T cbName = strlen(iter->lpszCmd) + 1;
+      memcpy(lpStrings + dwStrOffset, iter->lpszCmd, cbName);
+      lpFlatCmd->dwCmdOffset = dwStrOffset;
+      dwStrOffset += (DWORD)cbName;
+      adwAtoms[nIdx] = iter->dwAtom;
+
+      for (WORD i = 0; iter->aszArgs[i] != NULL; i++)
+        {
+          SIZE_T cbArg = strlen(iter->aszArgs[i]) + 1;
+          memcpy(lpStrings + dwStrOffset, iter->aszArgs[i], cbArg);
+          adwArgOffsets[nArgIdx++] = dwStrOffset;
+          dwStrOffset += (DWORD)cbArg;
+          lpFlatCmd->nArgCount++;
+        }
+
+      anLines[nIdx] = iter->srcInfo.nLine;
+      adwlBindings[nIdx] = 0;
+      if (lpFlat->lpszFileName == NULL)
+        {
+          lpFlat->lpszFileName = iter->srcInfo.lpszFileName;
+        }
     }
-  lpszSrc++;
-  lpszSrc = ParseUint16(lpszSrc, &ret.nMinor, lpError);
-  if (IsError(lpError))
+
+  lpFlat->nCommands = nCommands;
+  lpFlat->nArgs = nArgs;
+  lpFlat->cbStrings = (DWORD)cbStrings;
+  lpFlat->aCommands = aCommands;
+  lpFlat->adwAtoms = adwAtoms;
+  lpFlat->adwArgOffsets = adwArgOffsets;
+  lpFlat->anLines = anLines;
+  lpFlat->lpStrings = lpStrings;
+  lpFlat->adwlBindings = adwlBindings;
+  lpFlat->alpViews = NULL;
+  lpFlat->lpViewBlock = NULL;
+  lpFlat->cbViewBlock = 0;
+  lpFlat->lpStorage = lpStorage;
+  lpFlat->hImageMapping = NULL;
+  lpFlat->lpImageView = NULL;
+
+  /* the flat image owns copies of every string, so the linked commands
+     and their arena are no longer needed */
+  DropCommands(lpProgram);
+  lpProgram->lpFlat = lpFlat;
+  return TRUE;
+}
+
+static void DropFlatProgram(LPFLATPROGRAM lpFlat)
+{
+  free(lpFlat->lpViewBlock);
+  if (lpFlat->lpImageView != NULL)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0),
-                NULL, "missing minor version");
-      goto done;
+      UnmapViewOfFile(lpFlat->lpImageView);
+      CloseHandle(lpFlat->hImageMapping);
     }
-  else if (lpszSrc[0] == '\0')
+  free(lpFlat->lpStorage);
+}
+
+static LPCSTR FlatCmdName(LPFLATPROGRAM lpFlat, DWORD nIdx)
+{
+  return lpFlat->lpStrings + lpFlat->aCommands[nIdx].dwCmdOffset;
+}
+
+static LPCSTR *FlatCmdArgs(LPFLATPROGRAM lpFlat,
+                           DWORD nIdx,
+                           LPCSTR *aszInline)
+{
+  const FLATCOMMAND *lpFlatCmd = &lpFlat->aCommands[nIdx];
+  LPCSTR *ret = aszInline;
+  if (lpFlatCmd->nArgCount >= FLAT_INLINE_ARGS)
     {
-      goto done;
+      ret = (LPCSTR*)malloc((lpFlatCmd->nArgCount + 1) * sizeof(LPCSTR));
+      if (ret == NULL)
+        {
+          return NULL;
+        }
     }
-  else if (lpszSrc[0] == '-')
+  const DWORD *adwOffsets = lpFlat->adwArgOffsets + lpFlatCmd->nFirstArg;
+  for (WORD i = 0; i < lpFlatCmd->nArgCount; i++)
     {
-      goto parse_postfix;
+      ret[i] = lpFlat->lpStrings + adwOffsets[i];
     }
-  else if (lpszSrc[0] != '.')
+  ret[lpFlatCmd->nArgCount] = NULL;
+  return ret;
+}
+
+static void FreeFlatCmdArgs(LPCSTR *aszArgs, LPCSTR *aszInline)
+{
+  if (aszArgs != aszInline)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0), NULL,
-                "expected `.`, got `%c`", lpszSrc[0]);
-      goto done;
+      free((LPVOID)aszArgs);
     }
+}
 
-  lpszSrc++;
-  lpszSrc = ParseUint16(lpszSrc, &ret.nPatch, lpError);
-  if (IsError(lpError))
+static SRCINFO FlatSrcInfo(LPFLATPROGRAM lpFlat, DWORD nIdx)
+{
+  return SourceInfo(lpFlat->lpszFileName, lpFlat->anLines[nIdx]);
+}
+
+static BOOL MaterializeViews(LPPROGRAM lpProgram, LPERROR lpError)
+{
+  LPFLATPROGRAM lpFlat = lpProgram->lpFlat;
+  if (lpFlat->alpViews != NULL)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0), NULL,
-                "missing patch version");
-      goto done;
+      return TRUE;
     }
-  else if (lpszSrc[0] == '\0')
+
+  /* all views share one block laid out in index order, which keeps
+     FindViewIndex a binary search over ascending addresses */
+  SIZE_T cbViews = lpFlat->nCommands * sizeof(LPCOMMAND);
+  for (DWORD i = 0; i < lpFlat->nCommands; i++)
     {
-      goto done;
+      cbViews += sizeof(struct stCommand)
+                 + (lpFlat->aCommands[i].nArgCount + 1) * sizeof(LPSTR);
     }
-  else if (lpszSrc[0] != '-')
+  PCHAR lpBlock = (PCHAR)malloc(cbViews);
+  if (lpBlock == NULL)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0), NULL,
-                "unterminated semver, "
-                "expected `-` or `\\0`, got `%c`",
-                lpszSrc[0]);
-      goto done;
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                "run: cannot allocate memory for command views");
+      return FALSE;
     }
 
-parse_postfix:
-  ParseSemVerPostfix(lpszSrc, ret.szPostfix, lpError);
+  LPCOMMAND *alpViews = (LPCOMMAND*)lpBlock;
+  PCHAR lpCursor = lpBlock + lpFlat->nCommands * sizeof(LPCOMMAND);
+  for (DWORD i = 0; i < lpFlat->nCommands; i++)
+    {
+      const FLATCOMMAND *lpFlatCmd = &lpFlat->aCommands[i];
+      LPCOMMAND lpView = (LPCOMMAND)lpCursor;
+      lpCursor += sizeof(struct stCommand)
+                  + (lpFlatCmd->nArgCount + 1) * sizeof(LPSTR);
 
-done:
-  return ret;
+      lpView->lpExtraData = NULL;
+      lpView->bHeapAlloc = FALSE;
+      lpView->dwlBinding = lpFlat->adwlBindings[i];
+      lpView->dwAtom = lpFlat->adwAtoms[i];
+      lpView->srcInfo = FlatSrcInfo(lpFlat, i);
+      lpView->lpszCmd = (LPSTR)FlatCmdName(lpFlat, i);
+      const DWORD *adwOffsets = lpFlat->adwArgOffsets + lpFlatCmd->nFirstArg;
+      for (WORD j = 0; j < lpFlatCmd->nArgCount; j++)
+        {
+          lpView->aszArgs[j] = (LPSTR)(lpFlat->lpStrings + adwOffsets[j]);
+        }
+      lpView->aszArgs[lpFlatCmd->nArgCount] = NULL;
+      alpViews[i] = lpView;
+    }
+  for (DWORD i = 0; i < lpFlat->nCommands; i++)
+    {
+      const FLATCOMMAND *lpFlatCmd = &lpFlat->aCommands[i];
+      alpViews[i]->lpPrev =
+        lpFlatCmd->nPrev == FLAT_NONE ? NULL : alpViews[lpFlatCmd->nPrev];
+      alpViews[i]->lpNext =
+        lpFlatCmd->nNext == FLAT_NONE ? NULL : alpViews[lpFlatCmd->nNext];
+    }
+
+  lpFlat->lpViewBlock = lpBlock;
+  lpFlat->cbViewBlock = cbViews;
+  lpFlat->alpViews = alpViews;
+  lpProgram->lpCommands = lpFlat->nCommands != 0 ? alpViews[0] : NULL;
+  return TRUE;
 }
 
-BOOL IsCompatible(SEMVER expected, SEMVER actual)
+static DWORD FindViewIndex(LPFLATPROGRAM lpFlat, LPCOMMAND lpCmd)
 {
-  if (strncmp(expected.szPostfix,
-              actual.szPostfix,
-              SEMVER_POSTFIX_LEN) != 0)
+  if (lpFlat->alpViews == NULL
+      || (PCHAR)lpCmd < (PCHAR)lpFlat->lpViewBlock
+      || (PCHAR)lpCmd >= (PCHAR)lpFlat->lpViewBlock + lpFlat->cbViewBlock)
     {
-      return FALSE;
-    }
-  if (expected.bExact)
-    {
-      return expected.nMajor == actual.nMajor
-             && expected.nMinor == actual.nMinor
-             && expected.nPatch == actual.nPatch;
+      return FLAT_NONE;
     }
-  else if (expected.nMajor == actual.nMajor)
+
+  DWORD nLow = 0;
+  DWORD nHigh = lpFlat->nCommands;
+  while (nLow < nHigh)
     {
-      return (expected.nMinor == actual.nMinor
-              && expected.nPatch < actual.nPatch)
-             || (expected.nMinor < actual.nMinor);
+      DWORD nMid = nLow + (nHigh - nLow) / 2;
+      if ((PCHAR)lpFlat->alpViews[nMid] < (PCHAR)lpCmd)
+        {
+          nLow = nMid + 1;
+        }
+      else
+        {
+          nHigh = nMid;
+        }
     }
-  else
+  if (nLow < lpFlat->nCommands && lpFlat->alpViews[nLow] == lpCmd)
     {
-      return FALSE;
+      return nLow;
     }
+  return FLAT_NONE;
 }
 
-CMPRESULT CompareSemVer(SEMVER ver1, SEMVER ver2)
+/*** ----------------------- Compiled programs ----------------------- ***/
+
+/* A .pl2c file is a flat image: a header, the line table, the command
+   table, the command atoms, the argument offsets, the atom names and a
+   string pool holding every distinct string once. All offsets are
+   relative to the pool, so a loaded program points straight into the
+   mapped file. */
+
+#define PL2C_FORMAT      2
+#define PL2C_WRITE_CHUNK (64 * 1024 * 1024)
+
+typedef struct stCompiledHeader
+{
+  CHAR achMagic[4];
+  WORD wFormat;
+  WORD nVerMajor;
+  WORD nVerMinor;
+  WORD nVerPatch;
+  CHAR szVerPostfix[SEMVER_POSTFIX_LEN + 1];
+  DWORD nCommands;
+  DWORD nArgs;
+  DWORD cbStrings;
+  DWORD dwFileName;
+  /* atoms other than ATOM_NONE, named in order */
+  DWORD nAtoms;
+} PL2CHEADER;
+
+typedef struct stStringPool
+{
+  PCHAR lpStrings;
+  DWORD cbStrings;
+  /* pool offset + 1 of each string, 0 for a free slot */
+  DWORD *adwSlots;
+  SIZE_T nSlotMask;
+} STRINGPOOL;
+
+static DWORD PoolString(STRINGPOOL *lpPool, LPCSTR lpszStr);
+static BOOL WriteImage(HANDLE hFile, LPCVOID lpData, SIZE_T cbData);
+static LPCSTR CheckCompiledHeader(const PL2CHEADER *lpHeader,
+                                  SIZE_T cbImage);
+static LPCSTR LoadAtomNames(LPPROGRAM lpProgram,
+                            const PL2CHEADER *lpHeader);
+
+BOOL SaveCompiledProgram(LPPROGRAM lpProgram,
+                         LPCSTR lpszFileName,
+                         LPERROR lpError)
 {
-  if (!strncmp(ver1.szPostfix, ver2.szPostfix, SEMVER_POSTFIX_LEN))
+  if (!FlattenProgram(lpProgram, lpError))
     {
-      return CMP_NONE;
+      return FALSE;
     }
 
-  if (ver1.nMajor < ver2.nMajor)
+  LPFLATPROGRAM lpFlat = lpProgram->lpFlat;
+  LPATOMTABLE lpAtoms = lpProgram->lpAtoms;
+  DWORD nAtoms = lpAtoms != NULL ? lpAtoms->nAtoms - 1 : 0;
+  SIZE_T cbName = lpFlat->lpszFileName != NULL
+                  ? strlen(lpFlat->lpszFileName) + 1 : 0;
+  SIZE_T cbPool = lpFlat->cbStrings + cbName;
+  for (DWORD i = 1; i <= nAtoms; i++)
     {
-      return CMP_LESS;
+      cbPool += strlen(lpAtoms->alpszNames[i]) + 1;
     }
-  else if (ver1.nMajor > ver2.nMajor)
+  if (cbPool >= (SIZE_T)FLAT_NONE)
     {
-      return CMP_GREATER;
+      ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(NULL, 0), NULL,
+                "compile: program too large for 32-bit offsets");
+      return FALSE;
     }
-  else if (ver1.nMinor < ver2.nMinor)
+
+  SIZE_T nSlots = 16;
+  while (nSlots < 2 * ((SIZE_T)lpFlat->nCommands + lpFlat->nArgs
+                        + nAtoms + 1))
     {
-      return CMP_LESS;
+      nSlots *= 2;
     }
-  else if (ver1.nMinor > ver2.nMinor)
+  SIZE_T cbCommands = lpFlat->nCommands * sizeof(FLATCOMMAND);
+  SIZE_T cbArgOffsets = lpFlat->nArgs * sizeof(DWORD);
+  SIZE_T cbAtomNames = nAtoms * sizeof(DWORD);
+  PCHAR lpTables = (PCHAR)malloc
+    (
+      cbCommands + cbArgOffsets + cbAtomNames + cbPool + 1
+    );
+  STRINGPOOL pool;
+  pool.adwSlots = (DWORD*)calloc(nSlots, sizeof(DWORD));
+  if (lpTables == NULL || pool.adwSlots == NULL)
     {
-      return CMP_GREATER;
+      free(lpTables);
+      free(pool.adwSlots);
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                "compile: cannot allocate memory for the image");
+      return FALSE;
     }
-  else if (ver1.nPatch < ver2.nPatch)
+  pool.lpStrings = lpTables + cbCommands + cbArgOffsets + cbAtomNames;
+  pool.cbStrings = 0;
+  pool.nSlotMask = nSlots - 1;
+
+  PL2CHEADER header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.achMagic, "PL2C", 4);
+  header.wFormat = PL2C_FORMAT;
+  header.nVerMajor = PL2W_VER_MAJOR;
+  header.nVerMinor = PL2W_VER_MINOR;
+  header.nVerPatch = PL2W_VER_PATCH;
+  strncpy(header.szVerPostfix, PL2W_VER_POSTFIX, SEMVER_POSTFIX_LEN);
+  header.nCommands = lpFlat->nCommands;
+  header.nArgs = lpFlat->nArgs;
+  header.nAtoms = nAtoms;
+  header.dwFileName = lpFlat->lpszFileName != NULL
+                      ? PoolString(&pool, lpFlat->lpszFileName) : FLAT_NONE;
+
+  FLATCOMMAND *aCommands = (FLATCOMMAND*)lpTables;
+  DWORD *adwArgOffsets = (DWORD*)(lpTables + cbCommands);
+  DWORD *adwAtomNames = (DWORD*)(lpTables + cbCommands + cbArgOffsets);
+  for (DWORD i = 0; i < lpFlat->nCommands; i++)
     {
-      return CMP_LESS;
+      aCommands[i] = lpFlat->aCommands[i];
+      aCommands[i].dwCmdOffset = PoolString(&pool, FlatCmdName(lpFlat, i));
     }
-  else if (ver1.nPatch > ver2.nPatch)
+  for (DWORD i = 0; i < lpFlat->nArgs; i++)
     {
-      return CMP_GREATER;
+      adwArgOffsets[i] = PoolString
+        (
+          &pool,
+          lpFlat->lpStrings + lpFlat->adwArgOffsets[i]
+        );
     }
-  else
+  for (DWORD i = 0; i < nAtoms; i++)
     {
-      return CMP_EQ;
+      adwAtomNames[i] = PoolString(&pool, lpAtoms->alpszNames[i + 1]);
     }
-}
+  header.cbStrings = pool.cbStrings;
+  free(pool.adwSlots);
 
-void FormatSemVer(SEMVER ver, LPSTR lpszBuffer)
-{
-  if (ver.szPostfix[0]) 
+  HANDLE hFile = CreateFileA(lpszFileName, GENERIC_WRITE, 0, NULL,
+                             CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  BOOL bWritten = hFile != INVALID_HANDLE_VALUE
+    && WriteImage(hFile, &header, sizeof(header))
+    && WriteImage(hFile, lpFlat->anLines,
+                  lpFlat->nCommands * sizeof(DWORDLONG))
+    && WriteImage(hFile, aCommands, cbCommands)
+    && WriteImage(hFile, lpFlat->adwAtoms,
+                  lpFlat->nCommands * sizeof(DWORD))
+    && WriteImage(hFile, adwArgOffsets, cbArgOffsets)
+    && WriteImage(hFile, adwAtomNames, cbAtomNames)
+    && WriteImage(hFile, pool.lpStrings, pool.cbStrings);
+  if (hFile != INVALID_HANDLE_VALUE)
     {
-      sprintf(lpszBuffer, "%s%u.%u.%u-%s",
-              ver.bExact ? "^" : "",
-              ver.nMajor,
-              ver.nMinor,
-              ver.nPatch,
-              ver.szPostfix);
+      CloseHandle(hFile);
+      if (!bWritten)
+        {
+          DeleteFileA(lpszFileName);
+        }
     }
-  else
+  free(lpTables);
+
+  if (!bWritten)
     {
-      sprintf(lpszBuffer, "%s%u.%u.%u",
-              ver.bExact ? "^" : "",
-              ver.nMajor,
-              ver.nMinor,
-              ver.nPatch);
+      ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(NULL, 0), NULL,
+                "compile: cannot write %s", lpszFileName);
     }
+  return bWritten;
 }
 
-static LPCSTR ParseUint16(LPCSTR lpszSrc,
-                          WORD *lpnOutput,
-                          LPERROR lpError)
+LPPROGRAM LoadCompiledProgram(LPCSTR lpszFileName, LPERROR lpError)
 {
-  if (!isdigit((int)lpszSrc[0]))
+  LONGLONG nTraceStart = TraceBegin();
+  HANDLE hFile = CreateFileA(lpszFileName, GENERIC_READ, FILE_SHARE_READ,
+                             NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                             NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0),
-                NULL, "expected numeric version");
+      ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(lpszFileName, 0), NULL,
+                "cannot open compiled program %s", lpszFileName);
+      return NULL;
+    }
+
+  /* copy-on-write: the pages stay shared with every other process
+     running the same image unless a handler writes to a string */
+  LARGE_INTEGER liSize;
+  HANDLE hMapping = NULL;
+  LPVOID lpView = NULL;
+  if (GetFileSizeEx(hFile, &liSize)
+      && (ULONGLONG)liSize.QuadPart >= sizeof(PL2CHEADER)
+      && (ULONGLONG)liSize.QuadPart <= (SIZE_T)-1)
+    {
+      hMapping = CreateFileMappingA(hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+      if (hMapping != NULL)
+        {
+          lpView = MapViewOfFile(hMapping, FILE_MAP_COPY, 0, 0, 0);
+        }
+    }
+  CloseHandle(hFile);
+
+  LPCSTR lpszProblem = lpView == NULL
+    ? "cannot map the file"
+    : CheckCompiledHeader((const PL2CHEADER*)lpView,
+                          (SIZE_T)liSize.QuadPart);
+  LPFLATPROGRAM lpFlat = NULL;
+  LPPROGRAM ret = NULL;
+  if (lpszProblem == NULL)
+    {
+      const PL2CHEADER *lpHeader = (const PL2CHEADER*)lpView;
+      lpFlat = (LPFLATPROGRAM)malloc
+        (
+          sizeof(struct stFlatProgram)
+          + lpHeader->nCommands * sizeof(DWORDLONG)
+        );
+      ret = (LPPROGRAM)malloc(sizeof(struct stProgram));
+      if (ret != NULL)
+        {
+          InitProgram(ret);
+        }
+      lpszProblem = lpFlat == NULL || ret == NULL
+        ? "cannot allocate memory for the program"
+        : LoadAtomNames(ret, lpHeader);
+    }
+  if (lpszProblem != NULL)
+    {
+      free(lpFlat);
+      if (ret != NULL)
+        {
+          DropProgram(ret);
+          free(ret);
+        }
+      if (lpView != NULL)
+        {
+          UnmapViewOfFile(lpView);
+        }
+      if (hMapping != NULL)
+        {
+          CloseHandle(hMapping);
+        }
+      ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(lpszFileName, 0), NULL,
+                "%s: %s", lpszFileName, lpszProblem);
       return NULL;
     }
-  *lpnOutput = 0;
-  while (isdigit((int)lpszSrc[0]))
+
+  const PL2CHEADER *lpHeader = (const PL2CHEADER*)lpView;
+  PCHAR lpBase = (PCHAR)lpView + sizeof(PL2CHEADER);
+  lpFlat->nCommands = lpHeader->nCommands;
+  lpFlat->nArgs = lpHeader->nArgs;
+  lpFlat->cbStrings = lpHeader->cbStrings;
+  lpFlat->anLines = (const DWORDLONG*)lpBase;
+  lpBase += lpHeader->nCommands * sizeof(DWORDLONG);
+  lpFlat->aCommands = (const FLATCOMMAND*)lpBase;
+  lpBase += lpHeader->nCommands * sizeof(FLATCOMMAND);
+  lpFlat->adwAtoms = (const DWORD*)lpBase;
+  lpBase += lpHeader->nCommands * sizeof(DWORD);
+  lpFlat->adwArgOffsets = (const DWORD*)lpBase;
+  lpBase += (lpHeader->nArgs + lpHeader->nAtoms) * sizeof(DWORD);
+  lpFlat->lpStrings = lpBase;
+  lpFlat->lpszFileName = lpHeader->dwFileName == FLAT_NONE
+                         ? NULL : lpBase + lpHeader->dwFileName;
+
+  lpFlat->adwlBindings = (DWORDLONG*)(lpFlat + 1);
+  memset(lpFlat->adwlBindings, 0, lpHeader->nCommands * sizeof(DWORDLONG));
+  lpFlat->alpViews = NULL;
+  lpFlat->lpViewBlock = NULL;
+  lpFlat->cbViewBlock = 0;
+  lpFlat->lpStorage = lpFlat;
+  lpFlat->hImageMapping = hMapping;
+  lpFlat->lpImageView = lpView;
+
+  ret->lpFlat = lpFlat;
+  TraceEnd(nTraceStart, "source", "LoadCompiledProgram", lpszFileName);
+  return ret;
+}
+
+static DWORD PoolString(STRINGPOOL *lpPool, LPCSTR lpszStr)
+{
+  DWORD dwHash = 2166136261u;
+  for (LPCSTR pc = lpszStr; *pc != '\0'; ++pc)
+    {
+      dwHash = (dwHash ^ TransmuteU8(*pc)) * 16777619u;
+    }
+
+  for (SIZE_T i = dwHash & lpPool->nSlotMask;;
+       i = (i + 1) & lpPool->nSlotMask)
+    {
+      DWORD dwSlot = lpPool->adwSlots[i];
+      if (dwSlot == 0)
+        {
+          DWORD dwOffset = lpPool->cbStrings;
+          SIZE_T cbStr = strlen(lpszStr) + 1;
+          memcpy(lpPool->lpStrings + dwOffset, lpszStr, cbStr);
+          lpPool->cbStrings += (DWORD)cbStr;
+          lpPool->adwSlots[i] = dwOffset + 1;
+          return dwOffset;
+        }
+      if (!strcmp(lpPool->lpStrings + dwSlot - 1, lpszStr))
+        {
+          return dwSlot - 1;
+        }
+    }
+}
+
+static BOOL WriteImage(HANDLE hFile, LPCVOID lpData, SIZE_T cbData)
+{
+  const CHAR *pcData = (const CHAR*)lpData;
+  while (cbData != 0)
+    {
+      DWORD cbChunk = cbData < PL2C_WRITE_CHUNK ? (DWORD)cbData
+                                                : PL2C_WRITE_CHUNK;
+      DWORD cbWritten = 0;
+      if (!WriteFile(hFile, pcData, cbChunk, &cbWritten, NULL)
+          || cbWritten == 0)
+        {
+          return FALSE;
+        }
+      pcData += cbWritten;
+      cbData -= cbWritten;
+    }
+  return TRUE;
+}
+
+static LPCSTR CheckCompiledHeader(const PL2CHEADER *lpHeader,
+                                  SIZE_T cbImage)
+{
+  if (memcmp(lpHeader->achMagic, "PL2C", 4) != 0)
+    {
+      return "not a compiled PL2 program";
+    }
+  /* the image is only as good as the parser and the layout that made
+     it, so anything built by another version has to be recompiled */
+  if (lpHeader->wFormat != PL2C_FORMAT
+      || lpHeader->nVerMajor != PL2W_VER_MAJOR
+      || lpHeader->nVerMinor != PL2W_VER_MINOR
+      || lpHeader->nVerPatch != PL2W_VER_PATCH
+      || strncmp(lpHeader->szVerPostfix, PL2W_VER_POSTFIX,
+                 SEMVER_POSTFIX_LEN) != 0)
+    {
+      return "compiled by another PL2W version, recompile it";
+    }
+
+  ULONGLONG cbExpected = sizeof(PL2CHEADER)
+    + (ULONGLONG)lpHeader->nCommands
+      * (sizeof(DWORDLONG) + sizeof(FLATCOMMAND) + sizeof(DWORD))
+    + ((ULONGLONG)lpHeader->nArgs + lpHeader->nAtoms) * sizeof(DWORD)
+    + lpHeader->cbStrings;
+  if (cbExpected != cbImage
+      || (lpHeader->nCommands != 0 && lpHeader->nAtoms < ATOM_ABORT))
+    {
+      return "truncated or corrupted image";
+    }
+  LPCSTR lpStrings = (LPCSTR)lpHeader + (cbImage - lpHeader->cbStrings);
+  if ((lpHeader->cbStrings != 0
+       && lpStrings[lpHeader->cbStrings - 1] != '\0')
+      || (lpHeader->dwFileName != FLAT_NONE
+          && lpHeader->dwFileName >= lpHeader->cbStrings))
+    {
+      return "truncated or corrupted image";
+    }
+  const DWORD *adwAtomNames = (const DWORD*)lpStrings - lpHeader->nAtoms;
+  for (DWORD i = 0; i < lpHeader->nAtoms; i++)
+    {
+      if (adwAtomNames[i] >= lpHeader->cbStrings)
+        {
+          return "truncated or corrupted image";
+        }
+    }
+
+  /* the runtime follows these fields without further checks, so every
+     command has to stay inside the tables it indexes */
+  const FLATCOMMAND *aCommands = (const FLATCOMMAND*)
+    ((LPCSTR)(lpHeader + 1) + lpHeader->nCommands * sizeof(DWORDLONG));
+  const DWORD *adwAtoms = (const DWORD*)(aCommands + lpHeader->nCommands);
+  const DWORD *adwArgOffsets = adwAtoms + lpHeader->nCommands;
+  for (DWORD i = 0; i < lpHeader->nCommands; i++)
+    {
+      const FLATCOMMAND *lpFlatCmd = &aCommands[i];
+      if ((ULONGLONG)lpFlatCmd->nFirstArg + lpFlatCmd->nArgCount
+            > lpHeader->nArgs
+          || (lpFlatCmd->nNext != FLAT_NONE
+              && lpFlatCmd->nNext >= lpHeader->nCommands)
+          || (lpFlatCmd->nPrev != FLAT_NONE
+              && lpFlatCmd->nPrev >= lpHeader->nCommands)
+          || lpFlatCmd->dwCmdOffset >= lpHeader->cbStrings
+          || adwAtoms[i] > lpHeader->nAtoms)
+        {
+          return "truncated or corrupted image";
+        }
+    }
+  for (DWORD i = 0; i < lpHeader->nArgs; i++)
+    {
+      if (adwArgOffsets[i] >= lpHeader->cbStrings)
+        {
+          return "truncated or corrupted image";
+        }
+    }
+  return NULL;
+}
+
+static LPCSTR LoadAtomNames(LPPROGRAM lpProgram,
+                            const PL2CHEADER *lpHeader)
+{
+  /* interned in order into a fresh table, each name has to come back
+     with the atom the commands were saved with */
+  SIZE_T cbTables = sizeof(PL2CHEADER)
+    + (SIZE_T)lpHeader->nCommands
+      * (sizeof(DWORDLONG) + sizeof(FLATCOMMAND) + sizeof(DWORD))
+    + ((SIZE_T)lpHeader->nArgs + lpHeader->nAtoms) * sizeof(DWORD);
+  LPCSTR lpStrings = (LPCSTR)lpHeader + cbTables;
+  const DWORD *adwAtomNames = (const DWORD*)lpStrings - lpHeader->nAtoms;
+  for (DWORD i = 0; i < lpHeader->nAtoms; i++)
+    {
+      DWORD dwAtom = GetCommandAtom(lpProgram, lpStrings + adwAtomNames[i]);
+      if (dwAtom == ATOM_NONE)
+        {
+          return "cannot allocate memory for the program";
+        }
+      if (dwAtom != i + 1)
+        {
+          return "truncated or corrupted image";
+        }
+    }
+  return NULL;
+}
+
+/*** ---------------- Implementation of pl2w_Program --------------- ***/
+
+void InitProgram(LPPROGRAM lpProgram)
+{
+  lpProgram->lpCommands = NULL;
+  lpProgram->lpArena = NULL;
+  lpProgram->lpFlat = NULL;
+  lpProgram->lpAtoms = NULL;
+  lpProgram->lpLines = NULL;
+  lpProgram->nHeapCommands = 0;
+}
+
+void DropProgram(LPPROGRAM lpProgram)
+{
+  DropCommands(lpProgram);
+  DropAtomTable(lpProgram->lpAtoms);
+  lpProgram->lpAtoms = NULL;
+}
+
+static void DropCommands(LPPROGRAM lpProgram)
+{
+  /* parsed commands live in the arena; only commands spliced in with
+     CreateCommand have to be released one by one, and a program built
+     by hand has nothing but those */
+  BOOL bHeapCommands = lpProgram->nHeapCommands != 0
+                       || lpProgram->lpArena == NULL;
+  for (LPCOMMAND iter = bHeapCommands ? lpProgram->lpCommands : NULL;
+       iter != NULL;)
+    {
+      LPCOMMAND lpNext = iter->lpNext;
+      if (iter->bHeapAlloc)
+        {
+          free(iter);
+        }
+      iter = lpNext;
+    }
+  ArenaFree(lpProgram->lpArena);
+  if (lpProgram->lpFlat != NULL)
+    {
+      DropFlatProgram(lpProgram->lpFlat);
+    }
+  DropLineIndex(lpProgram->lpLines);
+  lpProgram->lpCommands = NULL;
+  lpProgram->lpArena = NULL;
+  lpProgram->lpFlat = NULL;
+  lpProgram->lpLines = NULL;
+  lpProgram->nHeapCommands = 0;
+}
+
+void DebugPrintProgram(LPCPROGRAM lpProgram)
+{
+  fprintf(stderr, "program commands\n");
+  if (lpProgram->lpFlat != NULL && lpProgram->lpCommands == NULL)
+    {
+      LPFLATPROGRAM lpFlat = lpProgram->lpFlat;
+      for (DWORD i = 0; i < lpFlat->nCommands; i++)
+        {
+          const FLATCOMMAND *lpFlatCmd = &lpFlat->aCommands[i];
+          fprintf(stderr, "\t%s [", FlatCmdName(lpFlat, i));
+          for (WORD j = 0; j < lpFlatCmd->nArgCount; j++)
+            {
+              fprintf(stderr, "`%s`, ",
+                      lpFlat->lpStrings
+                      + lpFlat->adwArgOffsets[lpFlatCmd->nFirstArg + j]);
+            }
+          fprintf(stderr, "\b\b]\n");
+        }
+      fprintf(stderr, "end program commands\n");
+      return;
+    }
+  LPCOMMAND lpCmd = lpProgram->lpCommands;
+  while (lpCmd != NULL)
+    {
+      fprintf(stderr, "\t%s [", lpCmd->lpszCmd);
+      for (WORD i = 0; lpCmd->aszArgs[i] != NULL; i++)
+        {
+          LPSTR lpszArg = lpCmd->aszArgs[i];
+          fprintf(stderr, "`%s`, ", lpszArg);
+        }
+      fprintf(stderr, "\b\b]\n");
+      lpCmd = lpCmd->lpNext;
+    }
+  fprintf(stderr, "end program commands\n");
+}
+
+/*** ------------------------- Lexer scanning ------------------------ ***/
+
+/* The parser skips whole runs of identifier characters, whitespace,
+   comment bodies and plain string bodies with one ScanClass call, and
+   counts newlines only when a line number is actually needed. On x86
+   both are vectorized (SSE2, or AVX2 when the CPU has it); building
+   with PL2W_SCALAR_LEXER keeps the byte-by-byte reference path. */
+
+#if !defined(PL2W_SCALAR_LEXER) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define PL2W_SIMD_LEXER
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define NO_ASAN
+#endif
+
+typedef enum
+{
+  LEX_ID      = 0, /* stops at the first non-identifier character */
+  LEX_SPACE   = 1, /* stops at the first non-blank character */
+  LEX_COMMENT = 2, /* stops at `\n` or `\0` */
+  LEX_STRING  = 3, /* stops at a quote, `\\`, `\n` or `\0` */
+  LEX_PLAIN   = 4  /* stops at a quote, `#`, `\n` or `\0` */
+} LEXCLASS;
+
+typedef PCHAR (*LPSCANPROC)(PCHAR pc, LEXCLASS cls);
+typedef SIZE_T (*LPCOUNTPROC)(PCHAR pcStart, PCHAR pcEnd);
+
+static BOOL IsIdChar(CHAR ch);
+static BOOL IsLineEnd(CHAR ch);
+static BOOL IsSpaceChar(CHAR ch);
+static PCHAR ScanClass(PCHAR pc, LEXCLASS cls);
+static SIZE_T CountNewlines(PCHAR pcStart, PCHAR pcEnd);
+static PCHAR ScanScalar(PCHAR pc, LEXCLASS cls);
+static SIZE_T CountNewlinesScalar(PCHAR pcStart, PCHAR pcEnd);
+static void SelectLexer(void);
+
+static LPSCANPROC s_lpfnScan;
+static LPCOUNTPROC s_lpfnCountNewlines;
+
+static PCHAR ScanClass(PCHAR pc, LEXCLASS cls)
+{
+  return s_lpfnScan(pc, cls);
+}
+
+static SIZE_T CountNewlines(PCHAR pcStart, PCHAR pcEnd)
+{
+  return s_lpfnCountNewlines(pcStart, pcEnd);
+}
+
+static PCHAR ScanScalar(PCHAR pc, LEXCLASS cls)
+{
+  switch (cls)
+    {
+      case LEX_ID:
+        while (IsIdChar(*pc))
+          {
+            ++pc;
+          }
+        break;
+      case LEX_SPACE:
+        while (IsSpaceChar(*pc))
+          {
+            ++pc;
+          }
+        break;
+      case LEX_COMMENT:
+        while (!IsLineEnd(*pc))
+          {
+            ++pc;
+          }
+        break;
+      case LEX_STRING:
+        while (*pc != '"' && *pc != '\'' && *pc != '\\' && !IsLineEnd(*pc))
+          {
+            ++pc;
+          }
+        break;
+      case LEX_PLAIN:
+        while (*pc != '"' && *pc != '\'' && *pc != '#' && !IsLineEnd(*pc))
+          {
+            ++pc;
+          }
+        break;
+    }
+  return pc;
+}
+
+static SIZE_T CountNewlinesScalar(PCHAR pcStart, PCHAR pcEnd)
+{
+  SIZE_T nCount = 0;
+  for (; pcStart != pcEnd; ++pcStart)
+    {
+      nCount += *pcStart == '\n';
+    }
+  return nCount;
+}
+
+#ifdef PL2W_SIMD_LEXER
+
+/* Vector loads are aligned, so a block holding the terminating `\0`
+   never reaches into the next page; every class stops at `\0`. */
+
+__attribute__((target("sse2")))
+static inline DWORD StopMaskSse2(__m128i v, LEXCLASS cls)
+{
+  __m128i vStop;
+  switch (cls)
+    {
+      case LEX_ID:
+        vStop = _mm_or_si128
+          (
+            _mm_or_si128
+              (
+                _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x20)),
+                               _mm_set1_epi8(0x20)),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F))
+              ),
+            _mm_or_si128
+              (
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('#'))),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('`'))
+              )
+          );
+        break;
+      case LEX_SPACE:
+        {
+          /* blank is ' ' or 9..13 except `\n` */
+          __m128i vRel = _mm_sub_epi8(v, _mm_set1_epi8(9));
+          __m128i vCtl = _mm_cmpeq_epi8(_mm_min_epu8(vRel, _mm_set1_epi8(4)),
+                                        vRel);
+          __m128i vBlank = _mm_or_si128
+            (
+              _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), vCtl),
+              _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))
+            );
+          return ~(DWORD)_mm_movemask_epi8(vBlank) & 0xFFFF;
+        }
+      case LEX_COMMENT:
+        vStop = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                             _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        break;
+      case LEX_STRING:
+      case LEX_PLAIN:
+      default:
+        vStop = _mm_or_si128
+          (
+            _mm_or_si128
+              (
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\''))),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(cls == LEX_PLAIN ? '#'
+                                                                 : '\\'))
+              ),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_setzero_si128()))
+          );
+        break;
+    }
+  return (DWORD)_mm_movemask_epi8(vStop);
+}
+
+__attribute__((target("sse2"))) NO_ASAN
+static PCHAR ScanSse2(PCHAR pc, LEXCLASS cls)
+{
+  DWORD dwOffset = (DWORD)((ULONG_PTR)pc & 15);
+  const __m128i *lpBlock = (const __m128i*)(pc - dwOffset);
+  DWORD dwMask = StopMaskSse2(_mm_load_si128(lpBlock), cls) >> dwOffset;
+  if (dwMask != 0)
+    {
+      return pc + __builtin_ctz(dwMask);
+    }
+  for (;;)
+    {
+      ++lpBlock;
+      dwMask = StopMaskSse2(_mm_load_si128(lpBlock), cls);
+      if (dwMask != 0)
+        {
+          return (PCHAR)lpBlock + __builtin_ctz(dwMask);
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+static SIZE_T CountNewlinesSse2(PCHAR pcStart, PCHAR pcEnd)
+{
+  SIZE_T nCount = 0;
+  const __m128i vNewline = _mm_set1_epi8('\n');
+  for (; pcEnd - pcStart >= 16; pcStart += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i*)pcStart);
+      nCount += __builtin_popcount
+        (
+          (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vNewline))
+        );
+    }
+  return nCount + CountNewlinesScalar(pcStart, pcEnd);
+}
+
+__attribute__((target("avx2")))
+static inline DWORD StopMaskAvx2(__m256i v, LEXCLASS cls)
+{
+  __m256i vStop;
+  switch (cls)
+    {
+      case LEX_ID:
+        vStop = _mm256_or_si256
+          (
+            _mm256_or_si256
+              (
+                _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x20)),
+                                  _mm256_set1_epi8(0x20)),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F))
+              ),
+            _mm256_or_si256
+              (
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#'))),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('`'))
+              )
+          );
+        break;
+      case LEX_SPACE:
+        {
+          __m256i vRel = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+          __m256i vCtl = _mm256_cmpeq_epi8
+            (
+              _mm256_min_epu8(vRel, _mm256_set1_epi8(4)),
+              vRel
+            );
+          __m256i vBlank = _mm256_or_si256
+            (
+              _mm256_andnot_si256(_mm256_cmpeq_epi8(v,
+                                                    _mm256_set1_epi8('\n')),
+                                  vCtl),
+              _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))
+            );
+          return ~(DWORD)_mm256_movemask_epi8(vBlank);
+        }
+      case LEX_COMMENT:
+        vStop = _mm256_or_si256
+          (
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256())
+          );
+        break;
+      case LEX_STRING:
+      case LEX_PLAIN:
+      default:
+        vStop = _mm256_or_si256
+          (
+            _mm256_or_si256
+              (
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(cls == LEX_PLAIN
+                                                      ? '#' : '\\'))
+              ),
+            _mm256_or_si256
+              (
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                _mm256_cmpeq_epi8(v, _mm256_setzero_si256())
+              )
+          );
+        break;
+    }
+  return (DWORD)_mm256_movemask_epi8(vStop);
+}
+
+__attribute__((target("avx2"))) NO_ASAN
+static PCHAR ScanAvx2(PCHAR pc, LEXCLASS cls)
+{
+  DWORD dwOffset = (DWORD)((ULONG_PTR)pc & 31);
+  const __m256i *lpBlock = (const __m256i*)(pc - dwOffset);
+  DWORD dwMask = StopMaskAvx2(_mm256_load_si256(lpBlock), cls) >> dwOffset;
+  if (dwMask != 0)
+    {
+      return pc + __builtin_ctz(dwMask);
+    }
+  for (;;)
+    {
+      ++lpBlock;
+      dwMask = StopMaskAvx2(_mm256_load_si256(lpBlock), cls);
+      if (dwMask != 0)
+        {
+          return (PCHAR)lpBlock + __builtin_ctz(dwMask);
+        }
+    }
+}
+
+__attribute__((target("avx2,popcnt")))
+static SIZE_T CountNewlinesAvx2(PCHAR pcStart, PCHAR pcEnd)
+{
+  SIZE_T nCount = 0;
+  const __m256i vNewline = _mm256_set1_epi8('\n');
+  for (; pcEnd - pcStart >= 32; pcStart += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i*)pcStart);
+      nCount += __builtin_popcount
+        (
+          (DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vNewline))
+        );
+    }
+  return nCount + CountNewlinesScalar(pcStart, pcEnd);
+}
+
+#endif /* PL2W_SIMD_LEXER */
+
+static void SelectLexer(void)
+{
+  if (s_lpfnScan != NULL)
+    {
+      return;
+    }
+
+  LPSCANPROC lpfnScan = ScanScalar;
+  LPCOUNTPROC lpfnCountNewlines = CountNewlinesScalar;
+#ifdef PL2W_SIMD_LEXER
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+      lpfnScan = ScanAvx2;
+      lpfnCountNewlines = CountNewlinesAvx2;
+    }
+  else if (__builtin_cpu_supports("sse2"))
+    {
+      lpfnScan = ScanSse2;
+      lpfnCountNewlines = CountNewlinesSse2;
+    }
+#endif
+  s_lpfnCountNewlines = lpfnCountNewlines;
+  s_lpfnScan = lpfnScan;
+}
+
+static BOOL IsIdChar(CHAR ch)
+{
+  BYTE uch = TransmuteU8(ch);
+  if (uch >= 128)
+    {
+      return 1;
+    }
+  else if (isalnum(ch))
+    {
+      return 1;
+    }
+  else 
+    {
+      switch (ch)
+        {
+          case '!': case '$': case '%': case '^': case '&': case '*':
+          case '(': case ')': case '-': case '+': case '_': case '=':
+          case '[': case ']': case '{': case '}': case '|': case '\\':
+          case ':': case ';': case '\'': case ',': case '<': case '>':
+          case '/': case '?': case '~': case '@': case '.':
+            return 1;
+          default:
+            return 0;
+        }
+    }
+}
+
+static BOOL IsLineEnd(CHAR ch)
+{
+  return ch == '\0' || ch == '\n';
+}
+
+static BOOL IsSpaceChar(CHAR ch)
+{
+  switch (ch)
+    {
+      case ' ': case '\t': case '\f': case '\v': case '\r':
+        return 1;
+      default:
+        return 0;
+    }
+}
+
+/*** ----------------- Implementation of pl2w_parse ---------------- ***/
+
+typedef enum
+{
+  PARSE_SINGLE_LINE = 1,
+  PARSE_MULTI_LINE  = 2
+} PARSEMODE;
+
+typedef enum
+{
+  QUES_INVALID = 0,
+  QUES_BEGIN   = 1,
+  QUES_END     = 2
+} QUESCMD;
+
+typedef struct stParseContext
+{
+  struct stProgram lpProgram;
+  LPCOMMAND lpListTail;
+
+  LPSTR lpszSrc;
+  SIZE_T nSrcIdx;
+  /* parsing stops at the first line starting at or after nSrcEnd */
+  SIZE_T nSrcEnd;
+  PARSEMODE mode;
+
+  /* srcInfo.nLine is only brought up to date with nSrcIdx by
+     CurSrcInfo, newlines up to nLineIdx have been counted */
+  SRCINFO srcInfo;
+  SIZE_T nLineIdx;
+
+  /* set while the `\0` ending lpszSrc only ends a stream window; the
+     parser then rolls back to the last complete command and sets
+     bNeedInput instead of finishing the command at it */
+  BOOL bPartial;
+  BOOL bNeedInput;
+  SIZE_T nSaveIdx;
+  SIZE_T nSaveLineIdx;
+  DWORDLONG nSaveLine;
+
+  /* commands get their own copies of their strings instead of pointing
+     into lpszSrc, which is then never written to */
+  BOOL bCopyStrings;
+
+  WORD nParseBufferCap;
+  WORD nParseBufferSize;
+  SLICE aParseBuffer[0];
+} *LPPARSECONTEXT;
+
+static LPPROGRAM ParseWhole(LPSTR lpszSource,
+                            WORD nParseBufferSize,
+                            BOOL bCopyStrings,
+                            LPERROR lpError);
+static LPPARSECONTEXT CreateParseContext(LPSTR lpszSrc,
+                                         WORD parseBufferSize);
+static void ParseSource(LPPARSECONTEXT lpCtx, LPERROR lpError);
+static void SaveParsePoint(LPPARSECONTEXT lpCtx);
+static void RestoreParsePoint(LPPARSECONTEXT lpCtx);
+static BOOL NeedInput(LPPARSECONTEXT lpCtx);
+static void ParseLine(LPPARSECONTEXT lpCtx, LPERROR lpError);
+static void ParseQuesMark(LPPARSECONTEXT lpCtx, LPERROR lpError);
+static void ParsePart(LPPARSECONTEXT lpCtx, LPERROR lpError);
+static SLICE ParseId(LPPARSECONTEXT lpCtx, LPERROR lpError);
+static SLICE ParseStr(LPPARSECONTEXT lpCtx, LPERROR lpError);
+static void CheckBufferSize(LPPARSECONTEXT lpCtx, LPERROR lpError);
+static void FinishLine(LPPARSECONTEXT lpCtx, LPERROR lpError);
+static LPCOMMAND CreateCommandFS3(LPPARSECONTEXT lpCtx,
+                                  SRCINFO srcInfo,
+                                  SLICE *aParts);
+static LPCOMMAND CreateCommandFS6(LPPARSECONTEXT lpCtx,
+                                  LPCOMMAND lpPrev,
+                                  LPCOMMAND lpNext,
+                                  LPVOID lpExtraData,
+                                  SRCINFO srcInfo,
+                                  SLICE *aParts);
+static LPSTR PartIntoCStr(SLICE part, PCHAR pcCopy);
+static void SkipWhitespace(LPPARSECONTEXT lpCtx);
+static void SkipComment(LPPARSECONTEXT lpCtx);
+static CHAR CurChar(LPPARSECONTEXT lpCtx);
+static PCHAR CurCharPos(LPPARSECONTEXT lpCtx);
+static void NextChar(LPPARSECONTEXT lpCtx);
+static void SkipTo(LPPARSECONTEXT lpCtx, PCHAR pcPos);
+static void SyncLine(LPPARSECONTEXT lpCtx);
+static SRCINFO CurSrcInfo(LPPARSECONTEXT lpCtx);
+static LPSTR ShrinkConv(PCHAR pcStart, PCHAR pcEnd);
+
+LPPROGRAM ParseProgram(LPSTR lpszSource,
+                       WORD nParseBufferSize,
+                       LPERROR lpError)
+{
+  return ParseWhole(lpszSource, nParseBufferSize, FALSE, lpError);
+}
+
+LPPROGRAM ParseProgramCopy(LPCSTR lpszSource,
+                           WORD nParseBufferSize,
+                           LPERROR lpError)
+{
+  /* with copied strings the source is only read */
+  LPPROGRAM ret = ParseWhole((LPSTR)lpszSource, nParseBufferSize, TRUE,
+                             lpError);
+
+  /* the index for ReparseProgram, which builds it itself should there
+     be no memory for it now */
+  if (ret != NULL && !IsError(lpError))
+    {
+      BuildLineIndex(ret, lpszSource);
+    }
+  return ret;
+}
+
+static LPPROGRAM ParseWhole(LPSTR lpszSource,
+                            WORD nParseBufferSize,
+                            BOOL bCopyStrings,
+                            LPERROR lpError)
+{
+  LPPARSECONTEXT lpCtx = CreateParseContext
+    (
+      lpszSource,
+      nParseBufferSize
+    );
+  if (lpCtx == NULL)
+    {
+      return NULL;
+    }
+  lpCtx->bCopyStrings = bCopyStrings;
+  LONGLONG nTraceStart = TraceBegin();
+  ParseSource(lpCtx, lpError);
+  TraceEnd(nTraceStart, "parse", "ParseProgram", NULL);
+
+  LPPROGRAM ret = (LPPROGRAM)malloc(sizeof(struct stProgram));
+  memcpy(ret, &lpCtx->lpProgram, sizeof(struct stProgram));
+  free(lpCtx);
+  return ret;
+}
+
+static LPPARSECONTEXT CreateParseContext(LPSTR lpszSrc,
+                                         WORD nParseBufferSize) {
+  SelectLexer();
+
+  LPPARSECONTEXT ret = (LPPARSECONTEXT)malloc
+    (
+      sizeof(struct stParseContext) + nParseBufferSize * sizeof(SLICE)
+    );
+  if (ret == NULL) 
+    {
+      return NULL;
+    }
+
+  InitProgram(&ret->lpProgram);
+  ret->lpListTail = NULL;
+  ret->lpszSrc = lpszSrc;
+  ret->nSrcIdx = 0;
+  ret->nSrcEnd = (SIZE_T)-1;
+  ret->srcInfo = SourceInfo("<unknown-file>", 1);
+  ret->nLineIdx = 0;
+  ret->mode = PARSE_SINGLE_LINE;
+  ret->bPartial = FALSE;
+  ret->bNeedInput = FALSE;
+  ret->bCopyStrings = FALSE;
+  SaveParsePoint(ret);
+
+  ret->nParseBufferCap = nParseBufferSize;
+  ret->nParseBufferSize = 0;
+  memset(ret->aParseBuffer, 0, nParseBufferSize * sizeof(SLICE));
+  return ret;
+}
+
+static void ParseSource(LPPARSECONTEXT lpCtx, LPERROR lpError)
+{
+  while (CurChar(lpCtx) != '\0' && lpCtx->nSrcIdx < lpCtx->nSrcEnd)
+    {
+      if (lpCtx->bPartial && lpCtx->mode == PARSE_SINGLE_LINE)
+        {
+          SaveParsePoint(lpCtx);
+        }
+      ParseLine(lpCtx, lpError);
+      if (IsError(lpError))
+        {
+          return;
+        }
+      if (lpCtx->bNeedInput)
+        {
+          RestoreParsePoint(lpCtx);
+          return;
+        }
+    }
+  if (lpCtx->bPartial && lpCtx->mode == PARSE_MULTI_LINE)
+    {
+      lpCtx->bNeedInput = TRUE;
+      RestoreParsePoint(lpCtx);
+    }
+}
+
+static void SaveParsePoint(LPPARSECONTEXT lpCtx)
+{
+  lpCtx->nSaveIdx = lpCtx->nSrcIdx;
+  lpCtx->nSaveLineIdx = lpCtx->nLineIdx;
+  lpCtx->nSaveLine = lpCtx->srcInfo.nLine;
+}
+
+static void RestoreParsePoint(LPPARSECONTEXT lpCtx)
+{
+  lpCtx->nSrcIdx = lpCtx->nSaveIdx;
+  lpCtx->nLineIdx = lpCtx->nSaveLineIdx;
+  lpCtx->srcInfo.nLine = lpCtx->nSaveLine;
+  lpCtx->mode = PARSE_SINGLE_LINE;
+  memset(lpCtx->aParseBuffer, 0, sizeof(SLICE) * lpCtx->nParseBufferSize);
+  lpCtx->nParseBufferSize = 0;
+}
+
+static BOOL NeedInput(LPPARSECONTEXT lpCtx)
+{
+  if (lpCtx->bPartial && CurChar(lpCtx) == '\0')
+    {
+      lpCtx->bNeedInput = TRUE;
+      return TRUE;
+    }
+  return FALSE;
+}
+
+static void ParseLine(LPPARSECONTEXT lpCtx, LPERROR lpError) {
+  if (CurChar(lpCtx) == '?')
+    {
+      ParseQuesMark(lpCtx, lpError);
+      if (IsError(lpError) || lpCtx->bNeedInput)
+        {
+          return;
+        }
+    }
+
+  while (TRUE)
+    {
+      SkipWhitespace(lpCtx);
+      if (CurChar(lpCtx) == '\0' || CurChar(lpCtx) == '\n')
+        {
+          if (NeedInput(lpCtx))
+            {
+              return;
+            }
+          if (lpCtx->mode == PARSE_SINGLE_LINE)
+            {
+              FinishLine(lpCtx, lpError);
+            }
+          if (lpCtx->mode == PARSE_MULTI_LINE && CurChar(lpCtx) == '\0')
+            {
+              ErrPrintf(lpError, PL2ERR_UNCLOSED_BEGIN, CurSrcInfo(lpCtx),
+                        NULL, "unclosed `?begin` block");
+            }
+          if (CurChar(lpCtx) == '\n')
+            {
+              NextChar(lpCtx);
+            }
+          return;
+        }
+      else if (CurChar(lpCtx) == '#')
+        {
+          SkipComment(lpCtx);
+        }
+      else
+        {
+          ParsePart(lpCtx, lpError);
+          if (IsError(lpError) || lpCtx->bNeedInput)
+            {
+              return;
+            }
+        }
+  }
+}
+
+static void ParseQuesMark(LPPARSECONTEXT lpCtx, LPERROR lpError)
+{
+  assert(CurChar(lpCtx) == '?');
+  NextChar(lpCtx);
+
+  PCHAR pcStart = CurCharPos(lpCtx);
+  while (isalnum((int)CurChar(lpCtx)))
+    {
+      NextChar(lpCtx);
+    }
+  PCHAR pcEnd = CurCharPos(lpCtx);
+  if (NeedInput(lpCtx))
+    {
+      return;
+    }
+
+  /* compared in place: terminating the word would clobber the line
+     end right after it */
+  SLICE s = {pcStart, pcEnd};
+  if (SliceEquals(s, "begin"))
+    {
+      lpCtx->mode = PARSE_MULTI_LINE;
+    }
+  else if (SliceEquals(s, "end"))
+    {
+      /* the command is finished at the end of this line */
+      lpCtx->mode = PARSE_SINGLE_LINE;
+    }
+  else
+    {
+      ErrPrintf(lpError, PL2ERR_UNKNOWN_QUES, CurSrcInfo(lpCtx),
+                NULL, "unknown question mark operator: `%.*s`",
+                (int)(pcEnd - pcStart), pcStart);
+    }
+}
+
+static void ParsePart(LPPARSECONTEXT lpCtx, LPERROR lpError)
+{
+  SLICE part;
+  if (CurChar(lpCtx) == '"' || CurChar(lpCtx) == '\'')
+    {
+      part = ParseStr(lpCtx, lpError);
+    }
+  else
+    {
+      part = ParseId(lpCtx, lpError);
+    }
+  if (IsError(lpError) || lpCtx->bNeedInput)
+    {
+      return;
+    }
+
+  CheckBufferSize(lpCtx, lpError);
+  if (IsError(lpError))
+    {
+      return;
+    }
+
+  lpCtx->aParseBuffer[lpCtx->nParseBufferSize++] = part;
+}
+
+static SLICE ParseId(LPPARSECONTEXT lpCtx, LPERROR lpError)
+{
+  (void)lpError;
+  PCHAR pcStart = CurCharPos(lpCtx);
+  PCHAR pcEnd = ScanClass(pcStart, LEX_ID);
+  SkipTo(lpCtx, pcEnd);
+  return Slice(pcStart, pcEnd);
+}
+
+static SLICE ParseStr(LPPARSECONTEXT lpCtx, LPERROR lpError)
+{
+  assert(CurChar(lpCtx) == '"' || CurChar(lpCtx) == '\'');
+  PCHAR pcQuote = CurCharPos(lpCtx);
+  NextChar(lpCtx);
+
+  PCHAR pcStart = CurCharPos(lpCtx);
+  for (;;)
+    {
+      SkipTo(lpCtx, ScanClass(CurCharPos(lpCtx), LEX_STRING));
+      if (CurChar(lpCtx) != '\\')
+        {
+          break;
+        }
+      NextChar(lpCtx);
+      NextChar(lpCtx);
+    }
+
+  PCHAR pcEnd = CurCharPos(lpCtx);
+  if (CurChar(lpCtx) == '"' || CurChar(lpCtx) == '\'')
+    {
+      NextChar(lpCtx);
+    }
+  else
+    {
+      if (NeedInput(lpCtx))
+        {
+          return NullSlice();
+        }
+      ErrPrintf(lpError, PL2ERR_UNCLOSED_BEGIN, CurSrcInfo(lpCtx),
+                NULL, "unclosed string literal");
+      return NullSlice();
+    }
+
+  /* the slice keeps the opening quote to tell it from an identifier;
+     escapes are only converted once the whole command is parsed */
+  if (pcStart == pcEnd)
+    {
+      return NullSlice();
+    }
+  return Slice(pcQuote, pcEnd);
+}
+
+static void CheckBufferSize(LPPARSECONTEXT lpCtx, LPERROR lpError)
+{
+  /* one slot is kept for the terminating null slice */
+  if (lpCtx->nParseBufferCap <= lpCtx->nParseBufferSize + 1)
+    {
+      ErrPrintf(lpError, PL2ERR_UNCLOSED_BEGIN, CurSrcInfo(lpCtx),
+                NULL, "command parts exceed internal parsing buffer");
+    }
+}
+
+static void FinishLine(LPPARSECONTEXT lpCtx, LPERROR lpError)
+{
+  (void)lpError;
+
+  SRCINFO srcInfo = CurSrcInfo(lpCtx);
+  NextChar(lpCtx);
+  if (lpCtx->nParseBufferSize == 0)
+    {
+      return;
+    }
+  if (IsNullSlice(lpCtx->aParseBuffer[0]))
+    {
+      ErrPrintf(lpError, PL2ERR_EMPTY_CMD, srcInfo, NULL,
+                "empty command");
+      return;
+    }
+  if (lpCtx->lpListTail == NULL)
+    {
+      assert(lpCtx->lpProgram.lpCommands == NULL);
+      lpCtx->lpProgram.lpCommands = lpCtx->lpListTail = CreateCommandFS3
+        (
+          lpCtx,
+          CurSrcInfo(lpCtx),
+          lpCtx->aParseBuffer
+        );
+    }
+  else
+    {
+      lpCtx->lpListTail = CreateCommandFS6
+        (
+          lpCtx,
+          lpCtx->lpListTail,
+          NULL,
+          NULL,
+          CurSrcInfo(lpCtx),
+          lpCtx->aParseBuffer
+        );
+    }
+  if (lpCtx->lpListTail == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, srcInfo, 0,
+                "failed allocating COMMAND");
+    }
+  memset(lpCtx->aParseBuffer, 0, sizeof(SLICE) * lpCtx->nParseBufferSize);
+  lpCtx->nParseBufferSize = 0;
+}
+
+static LPCOMMAND CreateCommandFS3(LPPARSECONTEXT lpCtx,
+                                  SRCINFO srcInfo,
+                                  SLICE *aParts)
+{
+  return CreateCommandFS6(lpCtx, NULL, NULL, NULL, srcInfo, aParts);
+}
+
+static LPCOMMAND CreateCommandFS6(LPPARSECONTEXT lpCtx,
+                                  LPCOMMAND lpPrev,
+                                  LPCOMMAND lpNext,
+                                  LPVOID lpExtraData,
+                                  SRCINFO srcInfo,
+                                  SLICE *aParts)
+{
+  WORD nPartCount = 0;
+  SIZE_T cbStrings = 0;
+  for (; !IsNullSlice(aParts[nPartCount]); ++nPartCount)
+    {
+      if (lpCtx->bCopyStrings)
+        {
+          cbStrings += (SIZE_T)(aParts[nPartCount].pcEnd
+                                - aParts[nPartCount].pcStart) + 1;
+        }
+    }
+
+  SIZE_T cbCommand = sizeof(struct stCommand) + nPartCount * sizeof(LPSTR);
+  LPCOMMAND ret = (LPCOMMAND)ArenaAlloc
+    (
+      &lpCtx->lpProgram.lpArena,
+      cbCommand + cbStrings
+    );
+  if (ret == NULL)
+    {
+      return NULL;
+    }
+
+  ret->bHeapAlloc = FALSE;
+  ret->lpPrev = lpPrev;
+  if (lpPrev != NULL)
+    {
+      lpPrev->lpNext = ret;
+    }
+  ret->lpNext = lpNext;
+  if (lpNext != NULL)
+    {
+      lpNext->lpPrev = ret;
+    }
+  ret->lpExtraData = lpExtraData;
+  ret->dwlBinding = 0;
+  ret->srcInfo = srcInfo;
+
+  /* backwards, so terminating a part never overwrites the opening
+     quote of a string part right behind it before that is looked at */
+  PCHAR pcCopy = lpCtx->bCopyStrings ? (PCHAR)ret + cbCommand : NULL;
+  for (WORD i = nPartCount; i-- > 0;)
+    {
+      LPSTR lpszPart = PartIntoCStr(aParts[i], pcCopy);
+      if (pcCopy != NULL)
+        {
+          pcCopy += aParts[i].pcEnd - aParts[i].pcStart + 1;
+        }
+      if (i == 0)
+        {
+          ret->lpszCmd = lpszPart;
+        }
+      else
+        {
+          ret->aszArgs[i - 1] = lpszPart;
+        }
+    }
+  ret->aszArgs[nPartCount - 1] = NULL;
+  /* ATOM_NONE when out of memory, it is then interned on first use */
+  ret->dwAtom = GetCommandAtom(&lpCtx->lpProgram, ret->lpszCmd);
+  return ret;
+}
+
+static LPSTR PartIntoCStr(SLICE part, PCHAR pcCopy)
+{
+  BOOL bString = *part.pcStart == '"' || *part.pcStart == '\'';
+  if (bString)
+    {
+      part.pcStart++;
+    }
+  if (pcCopy != NULL)
+    {
+      SIZE_T cbPart = (SIZE_T)(part.pcEnd - part.pcStart);
+      memcpy(pcCopy, part.pcStart, cbPart);
+      part = Slice(pcCopy, pcCopy + cbPart);
+    }
+  if (bString)
+    {
+      part.pcEnd = ShrinkConv(part.pcStart, part.pcEnd);
+    }
+  return SliceIntoCStr(part);
+}
+
+static void SkipWhitespace(LPPARSECONTEXT lpCtx)
+{
+  SkipTo(lpCtx, ScanClass(CurCharPos(lpCtx), LEX_SPACE));
+}
+
+static void SkipComment(LPPARSECONTEXT lpCtx)
+{
+  assert(CurChar(lpCtx) == '#');
+  NextChar(lpCtx);
+  SkipTo(lpCtx, ScanClass(CurCharPos(lpCtx), LEX_COMMENT));
+
+  if (CurChar(lpCtx) == '\n')
+    {
+      NextChar(lpCtx);
+    }
+}
+
+static CHAR CurChar(LPPARSECONTEXT lpCtx)
+{
+  return lpCtx->lpszSrc[lpCtx->nSrcIdx];
+}
+
+static PCHAR CurCharPos(LPPARSECONTEXT lpCtx)
+{
+  return lpCtx->lpszSrc + lpCtx->nSrcIdx;
+}
+
+static void NextChar(LPPARSECONTEXT lpCtx)
+{
+  if (lpCtx->lpszSrc[lpCtx->nSrcIdx] != '\0')
+    {
+      lpCtx->nSrcIdx += 1;
+    }
+}
+
+static void SkipTo(LPPARSECONTEXT lpCtx, PCHAR pcPos)
+{
+  lpCtx->nSrcIdx = (SIZE_T)(pcPos - lpCtx->lpszSrc);
+}
+
+static void SyncLine(LPPARSECONTEXT lpCtx)
+{
+  lpCtx->srcInfo.nLine += CountNewlines
+    (
+      lpCtx->lpszSrc + lpCtx->nLineIdx,
+      lpCtx->lpszSrc + lpCtx->nSrcIdx
+    );
+  lpCtx->nLineIdx = lpCtx->nSrcIdx;
+}
+
+static SRCINFO CurSrcInfo(LPPARSECONTEXT lpCtx)
+{
+  SyncLine(lpCtx);
+  return lpCtx->srcInfo;
+}
+
+static LPSTR ShrinkConv(PCHAR pcStart, PCHAR pcEnd)
+{
+  PCHAR iter1 = pcStart, iter2 = pcStart;
+  while (iter1 != pcEnd)
+    {
+      /* a `\\` right before pcEnd pairs with the closing quote */
+      if (iter1[0] == '\\' && iter1 + 1 != pcEnd)
+        {
+          switch (iter1[1])
+            {
+              case 'n': *iter2++ = '\n'; iter1 += 2; break;
+              case 'r': *iter2++ = '\r'; iter1 += 2; break;
+              case 'f': *iter2++ = '\f'; iter1 += 2; break;
+              case 'v': *iter2++ = '\v'; iter1 += 2; break;
+              case 't': *iter2++ = '\t'; iter1 += 2; break;
+              case 'a': *iter2++ = '\a'; iter1 += 2; break;
+              case '"': *iter2++ = '\"'; iter1 += 2; break;
+              case '0': *iter2++ = '\0'; iter1 += 2; break;
+              default: *iter2++ = *iter1++;
+            }
+        }
+      else
+        {
+          *iter2++ = *iter1++;
+        }
+    }
+  return iter2;
+}
+
+/*** ------------------------- Parallel parse ------------------------ ***/
+
+/* The source is cut only where ParseLine would start a line in single
+   line mode, so every chunk parses exactly as it does in ParseProgram.
+   Finding those places is a pre-scan that follows ParseLine without
+   building anything (SkimLine). It runs on all regions at once, each
+   guessing that its first line starts in single line mode; the guesses
+   are then checked in order against where the previous region really
+   ended, and only a region guessed wrong (inside a `?begin` block or a
+   string continued over a newline) is scanned again. */
+
+#define PARSE_MIN_CHUNK  (512 * 1024)
+#define PARSE_MAX_CHUNKS 64
+
+typedef struct stParseChunk
+{
+  PCHAR pcSrc;
+  SIZE_T nStart;
+  SIZE_T nEnd;
+
+  /* pre-scan of [nStart, nEnd) from the guessed first line up to the
+     first line at or after nEnd; pcScanEnd is NULL on a parse error */
+  PCHAR pcGuess;
+  PCHAR pcScanEnd;
+  PARSEMODE scanMode;
+  SIZE_T nNewlines;
+
+  LPPARSECONTEXT lpCtx;
+  LPERROR lpError;
+  HANDLE hThread;
+
+  /* chunk atom to program atom, NULL to drop the chunk atoms */
+  DWORD *anAtomMap;
+} PARSECHUNK;
+
+static DWORD FindChunkCuts(PARSECHUNK *aChunks,
+                           DWORD nChunks,
+                           PCHAR *apcCuts,
+                           DWORDLONG *anLines);
+static PCHAR SkimLine(PCHAR pc, PARSEMODE *lpMode);
+static void RunChunks(PARSECHUNK *aChunks,
+                      DWORD nChunks,
+                      LPTHREAD_START_ROUTINE lpfnChunkProc);
+static DWORD WINAPI ScanChunkProc(LPVOID lpParam);
+static DWORD WINAPI ParseChunkProc(LPVOID lpParam);
+static DWORD WINAPI RemapChunkProc(LPVOID lpParam);
+static DWORD *MapChunkAtoms(LPPROGRAM lpProgram, LPPROGRAM lpChunk);
+static void SpliceChunk(LPPROGRAM lpProgram,
+                        LPCOMMAND *lplpTail,
+                        LPPARSECONTEXT lpCtx);
+
+LPPROGRAM ParseProgramParallel(LPSTR lpszSource,
+                               SIZE_T cbSource,
+                               WORD nParseBufferSize,
+                               DWORD nThreads,
+                               LPERROR lpError)
+{
+  if (nThreads == 0)
+    {
+      SYSTEM_INFO sysInfo;
+      GetSystemInfo(&sysInfo);
+      nThreads = sysInfo.dwNumberOfProcessors;
+    }
+  DWORD nChunks = nThreads < PARSE_MAX_CHUNKS ? nThreads : PARSE_MAX_CHUNKS;
+  if (cbSource / PARSE_MIN_CHUNK < nChunks)
+    {
+      nChunks = (DWORD)(cbSource / PARSE_MIN_CHUNK);
+    }
+  if (nChunks <= 1)
+    {
+      return ParseProgram(lpszSource, nParseBufferSize, lpError);
+    }
+
+  LONGLONG nTraceStart = TraceBegin();
+  PARSECHUNK aChunks[PARSE_MAX_CHUNKS];
+  PCHAR apcCuts[PARSE_MAX_CHUNKS + 1];
+  DWORDLONG anLines[PARSE_MAX_CHUNKS];
+  for (DWORD i = 0; i < nChunks; i++)
+    {
+      aChunks[i].pcSrc = lpszSource;
+      aChunks[i].nStart = cbSource / nChunks * i;
+      aChunks[i].nEnd = i + 1 < nChunks ? cbSource / nChunks * (i + 1)
+                                        : cbSource;
+    }
+  SelectLexer();
+  RunChunks(aChunks, nChunks, ScanChunkProc);
+  nChunks = FindChunkCuts(aChunks, nChunks, apcCuts, anLines);
+
+  BOOL bFailed = FALSE;
+  for (DWORD i = 0; i < nChunks; i++)
+    {
+      aChunks[i].lpCtx = CreateParseContext(apcCuts[i], nParseBufferSize);
+      aChunks[i].lpError = ErrorBuffer(lpError->nErrorBufferSize);
+      aChunks[i].anAtomMap = NULL;
+      if (aChunks[i].lpCtx == NULL || aChunks[i].lpError == NULL)
+        {
+          bFailed = TRUE;
+          continue;
+        }
+      aChunks[i].lpCtx->srcInfo.nLine = anLines[i];
+      if (i + 1 < nChunks)
+        {
+          aChunks[i].lpCtx->nSrcEnd = (SIZE_T)(apcCuts[i + 1] - apcCuts[i]);
+        }
+    }
+
+  LPPROGRAM ret = NULL;
+  if (!bFailed)
+    {
+      ret = (LPPROGRAM)malloc(sizeof(struct stProgram));
+    }
+  if (ret != NULL)
+    {
+      InitProgram(ret);
+      RunChunks(aChunks, nChunks, ParseChunkProc);
+
+      /* each chunk interned its names on its own; the first chunk
+         hands its atoms to the program, the others are merged into
+         them name by name and then renumber their commands */
+      ret->lpAtoms = aChunks[0].lpCtx->lpProgram.lpAtoms;
+      aChunks[0].lpCtx->lpProgram.lpAtoms = NULL;
+      for (DWORD i = 1; i < nChunks; i++)
+        {
+          aChunks[i].anAtomMap = MapChunkAtoms
+            (
+              ret,
+              &aChunks[i].lpCtx->lpProgram
+            );
+        }
+      if (nChunks > 1)
+        {
+          RunChunks(aChunks + 1, nChunks - 1, RemapChunkProc);
+        }
+    }
+
+  /* the serial parser stops at the first error, so everything parsed
+     after the first failing chunk is thrown away */
+  LPCOMMAND lpTail = NULL;
+  for (DWORD i = 0; i < nChunks; i++)
+    {
+      LPPARSECONTEXT lpCtx = aChunks[i].lpCtx;
+      LPERROR lpChunkError = aChunks[i].lpError;
+      if (lpCtx != NULL)
+        {
+          if (ret != NULL && !bFailed)
+            {
+              SpliceChunk(ret, &lpTail, lpCtx);
+            }
+          DropProgram(&lpCtx->lpProgram);
+          free(lpCtx);
+        }
+      free(aChunks[i].anAtomMap);
+      if (lpChunkError != NULL)
+        {
+          if (ret != NULL && !bFailed && IsError(lpChunkError))
+            {
+              ErrPrintf(lpError, lpChunkError->nLine, lpChunkError->srcInfo,
+                        NULL, "%s", ErrorReason(lpChunkError));
+              bFailed = TRUE;
+            }
+          DropError(lpChunkError);
+        }
+    }
+  if (ret == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                "parse: cannot allocate memory for parallel parsing");
+    }
+  TraceEnd(nTraceStart, "parse", "ParseProgramParallel", NULL);
+  return ret;
+}
+
+static DWORD FindChunkCuts(PARSECHUNK *aChunks,
+                           DWORD nChunks,
+                           PCHAR *apcCuts,
+                           DWORDLONG *anLines)
+{
+  PCHAR pcSrc = aChunks[0].pcSrc;
+  PCHAR pc = aChunks[0].pcScanEnd;
+  PARSEMODE mode = aChunks[0].scanMode;
+  DWORD nCuts = 1;
+  apcCuts[0] = pcSrc;
+  anLines[0] = 1;
+
+  for (DWORD i = 1; i < nChunks; i++)
+    {
+      /* pc and mode are where ParseLine really starts its next line; a
+         NULL pc is a parse error, and nothing after it is parsed */
+      PCHAR pcStart = pcSrc + aChunks[i].nStart;
+      while (pc != NULL && *pc != '\0'
+             && (mode != PARSE_SINGLE_LINE || pc < pcStart
+                 || pc == apcCuts[nCuts - 1]))
+        {
+          pc = SkimLine(pc, &mode);
+        }
+      if (pc == NULL || *pc == '\0')
+        {
+          break;
+        }
+
+      DWORD nRegion = i;
+      DWORDLONG nLine = anLines[0];
+      while (nRegion + 1 < nChunks
+             && pcSrc + aChunks[nRegion + 1].nStart <= pc)
+        {
+          ++nRegion;
+        }
+      for (DWORD j = 0; j < nRegion; j++)
+        {
+          nLine += aChunks[j].nNewlines;
+        }
+      apcCuts[nCuts] = pc;
+      anLines[nCuts] = nLine + CountNewlines(pcSrc + aChunks[nRegion].nStart,
+                                             pc);
+      ++nCuts;
+
+      if (pc == aChunks[i].pcGuess)
+        {
+          pc = aChunks[i].pcScanEnd;
+          mode = aChunks[i].scanMode;
+        }
+    }
+  apcCuts[nCuts] = pcSrc + aChunks[nChunks - 1].nEnd;
+  return nCuts;
+}
+
+static PCHAR SkimLine(PCHAR pc, PARSEMODE *lpMode)
+{
+  if (*pc == '?')
+    {
+      PCHAR pcStart = ++pc;
+      while (isalnum((int)*pc))
+        {
+          ++pc;
+        }
+      SLICE s = {pcStart, pc};
+      if (SliceEquals(s, "begin"))
+        {
+          *lpMode = PARSE_MULTI_LINE;
+        }
+      else if (SliceEquals(s, "end"))
+        {
+          *lpMode = PARSE_SINGLE_LINE;
+        }
+      else
+        {
+          return NULL;
+        }
+    }
+
+  for (;;)
+    {
+      PCHAR pcStop = ScanClass(pc, LEX_PLAIN);
+      switch (*pcStop)
+        {
+          case '\0':
+            return pcStop;
+          case '\n':
+            ++pcStop;
+            if (*lpMode == PARSE_SINGLE_LINE && *pcStop == '\n')
+              {
+                ++pcStop;
+              }
+            return pcStop;
+          case '#':
+            pc = ScanClass(pcStop + 1, LEX_COMMENT);
+            if (*pc == '\n')
+              {
+                ++pc;
+              }
+            break;
+          default:
+            /* `'` inside an identifier is part of it */
+            if (*pcStop == '\'' && pcStop != pc && IsIdChar(pcStop[-1]))
+              {
+                pc = ScanClass(pcStop, LEX_ID);
+                break;
+              }
+            pc = pcStop + 1;
+            for (;;)
+              {
+                pc = ScanClass(pc, LEX_STRING);
+                if (*pc != '\\')
+                  {
+                    break;
+                  }
+                ++pc;
+                if (*pc != '\0')
+                  {
+                    ++pc;
+                  }
+              }
+            if (*pc != '"' && *pc != '\'')
+              {
+                return NULL;
+              }
+            ++pc;
+            break;
+        }
+    }
+}
+
+static void RunChunks(PARSECHUNK *aChunks,
+                      DWORD nChunks,
+                      LPTHREAD_START_ROUTINE lpfnChunkProc)
+{
+  /* a chunk whose thread cannot be started is done right here */
+  for (DWORD i = 1; i < nChunks; i++)
+    {
+      aChunks[i].hThread = CreateThread(NULL, 0, lpfnChunkProc,
+                                        &aChunks[i], 0, NULL);
+      if (aChunks[i].hThread == NULL)
+        {
+          lpfnChunkProc(&aChunks[i]);
+        }
+    }
+  lpfnChunkProc(&aChunks[0]);
+  for (DWORD i = 1; i < nChunks; i++)
+    {
+      if (aChunks[i].hThread != NULL)
+        {
+          WaitForSingleObject(aChunks[i].hThread, INFINITE);
+          CloseHandle(aChunks[i].hThread);
+        }
+    }
+}
+
+static DWORD WINAPI ScanChunkProc(LPVOID lpParam)
+{
+  PARSECHUNK *lpChunk = (PARSECHUNK*)lpParam;
+  LONGLONG nTraceStart = TraceBegin();
+  PCHAR pcEnd = lpChunk->pcSrc + lpChunk->nEnd;
+  PCHAR pc = lpChunk->pcSrc + lpChunk->nStart;
+  PARSEMODE mode = PARSE_SINGLE_LINE;
+
+  /* the first line is guessed to follow a complete single line one */
+  if (lpChunk->nStart != 0)
+    {
+      pc = ScanClass(pc - 1, LEX_COMMENT);
+      if (*pc == '\n')
+        {
+          ++pc;
+          if (*pc == '\n')
+            {
+              ++pc;
+            }
+        }
+    }
+  lpChunk->pcGuess = pc;
+  lpChunk->nNewlines = CountNewlines(lpChunk->pcSrc + lpChunk->nStart, pcEnd);
+
+  while (pc != NULL && *pc != '\0' && pc < pcEnd)
+    {
+      pc = SkimLine(pc, &mode);
+    }
+  lpChunk->pcScanEnd = pc;
+  lpChunk->scanMode = mode;
+  TraceEnd(nTraceStart, "parse", "ScanChunk", NULL);
+  return 0;
+}
+
+static DWORD WINAPI ParseChunkProc(LPVOID lpParam)
+{
+  PARSECHUNK *lpChunk = (PARSECHUNK*)lpParam;
+  LONGLONG nTraceStart = TraceBegin();
+  ParseSource(lpChunk->lpCtx, lpChunk->lpError);
+  TraceEnd(nTraceStart, "parse", "ParseChunk", NULL);
+  return 0;
+}
+
+static DWORD WINAPI RemapChunkProc(LPVOID lpParam)
+{
+  PARSECHUNK *lpChunk = (PARSECHUNK*)lpParam;
+  for (LPCOMMAND iter = lpChunk->lpCtx->lpProgram.lpCommands;
+       iter != NULL;
+       iter = iter->lpNext)
+    {
+      iter->dwAtom = lpChunk->anAtomMap != NULL
+                     ? lpChunk->anAtomMap[iter->dwAtom] : ATOM_NONE;
+    }
+  return 0;
+}
+
+static DWORD *MapChunkAtoms(LPPROGRAM lpProgram, LPPROGRAM lpChunk)
+{
+  LPATOMTABLE lpAtoms = lpChunk->lpAtoms;
+  if (lpAtoms == NULL)
+    {
+      return NULL;
+    }
+  DWORD *ret = (DWORD*)malloc(lpAtoms->nAtoms * sizeof(DWORD));
+  if (ret == NULL)
+    {
+      return NULL;
+    }
+  /* a name that cannot be merged is left to be interned on first use */
+  ret[ATOM_NONE] = ATOM_NONE;
+  for (DWORD i = ATOM_NONE + 1; i < lpAtoms->nAtoms; i++)
+    {
+      ret[i] = GetCommandAtom(lpProgram, lpAtoms->alpszNames[i]);
+    }
+  return ret;
+}
+
+static void SpliceChunk(LPPROGRAM lpProgram,
+                        LPCOMMAND *lplpTail,
+                        LPPARSECONTEXT lpCtx)
+{
+  LPPROGRAM lpChunk = &lpCtx->lpProgram;
+  if (lpChunk->lpCommands != NULL)
+    {
+      if (*lplpTail == NULL)
+        {
+          lpProgram->lpCommands = lpChunk->lpCommands;
+        }
+      else
+        {
+          (*lplpTail)->lpNext = lpChunk->lpCommands;
+          lpChunk->lpCommands->lpPrev = *lplpTail;
+        }
+      *lplpTail = lpCtx->lpListTail;
+    }
+
+  ArenaAdopt(&lpProgram->lpArena, lpChunk->lpArena);
+  lpChunk->lpCommands = NULL;
+  lpChunk->lpArena = NULL;
+}
+
+/*** ------------------------ Incremental parse ----------------------- ***/
+
+/* A parsed command carries the number of the line right after its last
+   one, which is where ParseLine takes up the next command in single
+   line mode. An edit is therefore parsed again from the end of the
+   command before it up to the end of the first command past it; should
+   the edited lines leave a `?begin` block open there, the region grows
+   by one command at a time until it closes.
+
+   The commands are found through a line index cutting them into chunks
+   of about LINE_CHUNK_COMMANDS. The anchor of a chunk is where its first
+   command is parsed from, kept as the bytes and lines from it to the
+   next anchor and summed up in two Fenwick trees, so both finding the
+   chunk of an edit and moving every chunk behind it take O(log n). The
+   srcInfo.nLine of the commands of a chunk is relative to its anchor:
+   it was right when the anchor was on line nBase. SettleProgramLines
+   brings it up to date, and runs and FlattenProgram call it first. */
+
+#define LINE_CHUNK_COMMANDS 64
+
+typedef struct
+{
+  /* NULL only for the one anchor of an empty program */
+  LPCOMMAND lpFirst;
+  DWORD nCommands;
+  SIZE_T cbSpan;
+  DWORDLONG nLineSpan;
+  DWORDLONG nBase;
+} LINEANCHOR;
+
+struct stLineIndex
+{
+  DWORD nAnchors;
+  DWORD nCapacity;
+  /* set while the lines of some commands lag behind their anchors */
+  volatile LONG bStale;
+  LINEANCHOR *aAnchors;
+  LONGLONG *acbTree;
+  LONGLONG *anLineTree;
+};
+
+/* a walk over the commands in order, keeping track of their chunk */
+typedef struct
+{
+  LPLINEINDEX lpIndex;
+  DWORD nAnchor;
+  DWORDLONG nLine;    /* of the anchor */
+  LONGLONG nShift;    /* what the lines of its commands lag behind */
+  LPCOMMAND lpCmd;
+  DWORD nIdx;         /* of lpCmd in the chunk */
+} LINECURSOR;
+
+/* where ReparseProgram took out commands and put in new ones */
+typedef struct
+{
+  /* at the first command taken out, or the last one when none was */
+  LINECURSOR first;
+  DWORD nKept;        /* commands of its chunk before it */
+  /* at the last command taken out, unless they went to the end */
+  LINECURSOR last;
+  BOOL bToEnd;
+  /* where lpAfter is now parsed from, the end of the command before it */
+  SIZE_T nAfterStart;
+  DWORDLONG nAfterLine;
+  LONGLONG cbDelta;
+  LONGLONG nLineDelta;
+  /* the new commands, which end at lpAfter */
+  LPCOMMAND lpHead;
+  LPCOMMAND lpAfter;
+} LINEEDIT;
+
+static SRWLOCK s_lineLock = SRWLOCK_INIT;
+
+static LPCSTR SkipLines(LPCSTR pc, DWORDLONG nLines);
+static BOOL ReserveAnchors(LPLINEINDEX lpIndex, DWORD nCapacity);
+static void TreeAdd(LONGLONG *aTree, DWORD nCount, DWORD nIdx,
+                    LONGLONG nDelta);
+static LONGLONG TreeSum(const LONGLONG *aTree, DWORD nIdx);
+static void BuildTrees(LPLINEINDEX lpIndex);
+static DWORD FindAnchor(LPLINEINDEX lpIndex, SIZE_T nPos, SIZE_T *lpnStart);
+static DWORDLONG AnchorLine(LPLINEINDEX lpIndex, DWORD nAnchor);
+static void SetAnchorSpan(LPLINEINDEX lpIndex,
+                          DWORD nAnchor,
+                          SIZE_T cbSpan,
+                          DWORDLONG nLineSpan);
+static BOOL SplitAnchor(LPLINEINDEX lpIndex, DWORD nAnchor,
+                        LPCSTR lpszSource);
+static void CompactAnchors(LPLINEINDEX lpIndex);
+static void StartCursor(LINECURSOR *lpCursor,
+                        LPLINEINDEX lpIndex,
+                        DWORD nAnchor,
+                        DWORDLONG nLine);
+static DWORDLONG CursorLine(LINECURSOR *lpCursor, LPCOMMAND lpCmd);
+static void ReanchorEdit(LPLINEINDEX lpIndex, const LINEEDIT *lpEdit);
+
+BOOL ReparseProgram(LPPROGRAM lpProgram,
+                    LPCSTR lpszSource,
+                    SIZE_T nEditStart,
+                    SIZE_T cbRemoved,
+                    LPCSTR lpszText,
+                    SIZE_T cbText,
+                    WORD nParseBufferSize,
+                    LPERROR lpError)
+{
+  if (lpProgram->lpFlat != NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(NULL, 0), NULL,
+                "reparse: cannot reparse a flattened program");
+      return FALSE;
+    }
+
+  SelectLexer();
+  LONGLONG nTraceStart = TraceBegin();
+  if (lpProgram->lpLines == NULL
+      && !BuildLineIndex(lpProgram, lpszSource))
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                "reparse: cannot allocate memory for line index");
+      return FALSE;
+    }
+  LPLINEINDEX lpIndex = lpProgram->lpLines;
+
+  /* lines are only counted from the anchor of the edit, one that earlier
+     edits have grown being split up first */
+  LPCSTR pcEditStart = lpszSource + nEditStart;
+  LPCSTR pcEditEnd = pcEditStart + cbRemoved;
+  SIZE_T nAnchorStart;
+  DWORD nAnchor = FindAnchor(lpIndex, nEditStart, &nAnchorStart);
+  if (lpIndex->aAnchors[nAnchor].nCommands > 2 * LINE_CHUNK_COMMANDS
+      && SplitAnchor(lpIndex, nAnchor, lpszSource))
+    {
+      nAnchor = FindAnchor(lpIndex, nEditStart, &nAnchorStart);
+    }
+  DWORDLONG nAnchorLine = AnchorLine(lpIndex, nAnchor);
+  DWORDLONG nEditLine = nAnchorLine
+    + CountNewlines((PCHAR)lpszSource + nAnchorStart, (PCHAR)pcEditStart);
+  DWORDLONG nEditEndLine = nEditLine + CountNewlines((PCHAR)pcEditStart,
+                                                     (PCHAR)pcEditEnd);
+  LONGLONG nLineDelta =
+    (LONGLONG)CountNewlines((PCHAR)lpszText, (PCHAR)lpszText + cbText)
+    - (LONGLONG)(nEditEndLine - nEditLine);
+
+  /* the command before the edit ends on a line before it, which the
+     command before an anchor ends on */
+  while (nAnchor != 0 && nAnchorLine >= nEditLine)
+    {
+      nAnchorLine = AnchorLine(lpIndex, --nAnchor);
+    }
+  LINEEDIT edit;
+  LINECURSOR cursor;
+  StartCursor(&cursor, lpIndex, nAnchor, nAnchorLine);
+  LPCOMMAND lpFirst = lpIndex->aAnchors[nAnchor].lpFirst;
+  LPCOMMAND lpBefore = lpFirst != NULL ? lpFirst->lpPrev : NULL;
+  DWORDLONG nBeforeLine = nAnchorLine;
+  while (lpFirst != NULL && CursorLine(&cursor, lpFirst) < nEditLine)
+    {
+      lpBefore = lpFirst;
+      nBeforeLine = CursorLine(&cursor, lpFirst);
+      lpFirst = lpFirst->lpNext;
+    }
+  edit.first = cursor;
+  edit.nKept = lpFirst != NULL
+    ? cursor.nIdx
+    : lpIndex->aAnchors[cursor.nAnchor].nCommands;
+
+  LPCOMMAND lpLast = lpFirst;
+  DWORDLONG nLastLine = 0;
+  while (lpLast != NULL
+         && (nLastLine = CursorLine(&cursor, lpLast)) <= nEditEndLine)
+    {
+      lpLast = lpLast->lpNext;
+    }
+  SRCINFO srcInfo = SourceInfo("<unknown-file>", nBeforeLine);
+  if (lpFirst != NULL || lpBefore != NULL)
+    {
+      srcInfo.lpszFileName = (lpFirst != NULL ? lpFirst : lpBefore)
+        ->srcInfo.lpszFileName;
+    }
+
+  /* the start of the line lpBefore ended at */
+  LPCSTR pcStart = pcEditStart;
+  DWORDLONG nLines = nEditLine - srcInfo.nLine + 1;
+  while (pcStart != lpszSource)
+    {
+      if (pcStart[-1] == '\n' && --nLines == 0)
+        {
+          break;
+        }
+      --pcStart;
+    }
+
+  LPPARSECONTEXT lpCtx = NULL;
+  PCHAR pcRegion = NULL;
+  LPCSTR pcEnd = pcEditEnd;
+  DWORDLONG nEndLine = nEditEndLine;
+  BOOL bToEnd;
+  SIZE_T cbAfter = 0;
+  for (;;)
+    {
+      /* the last command ends at the end of the source, which need not
+         be the end of a line */
+      bToEnd = lpLast == NULL || lpLast->lpNext == NULL;
+      if (bToEnd)
+        {
+          pcEnd += strlen(pcEnd);
+        }
+      else
+        {
+          pcEnd = SkipLines(pcEnd, nLastLine - nEndLine);
+          nEndLine = nLastLine;
+        }
+
+      SIZE_T cbHead = (SIZE_T)(pcEditStart - pcStart);
+      SIZE_T cbTail = (SIZE_T)(pcEnd - pcEditEnd);
+      pcRegion = (PCHAR)malloc(cbHead + cbText + cbTail + 1);
+      lpCtx = pcRegion != NULL
+        ? CreateParseContext(pcRegion, nParseBufferSize)
+        : NULL;
+      if (lpCtx == NULL)
+        {
+          ErrPrintf(lpError, PL2ERR_MALLOC, srcInfo, NULL,
+                    "reparse: cannot allocate memory for parsing");
+          free(pcRegion);
+          return FALSE;
+        }
+      memcpy(pcRegion, pcStart, cbHead);
+      memcpy(pcRegion + cbHead, lpszText, cbText);
+      memcpy(pcRegion + cbHead + cbText, pcEditEnd, cbTail);
+      pcRegion[cbHead + cbText + cbTail] = '\0';
+
+      lpCtx->srcInfo = srcInfo;
+      lpCtx->bPartial = !bToEnd;
+      lpCtx->bCopyStrings = TRUE;
+      lpCtx->lpProgram.lpAtoms = lpProgram->lpAtoms;
+      SaveParsePoint(lpCtx);
+      ParseSource(lpCtx, lpError);
+      lpProgram->lpAtoms = lpCtx->lpProgram.lpAtoms;
+      if (lpCtx->lpListTail != NULL)
+        {
+          cbAfter = (SIZE_T)(SkipLines(pcRegion,
+                                       lpCtx->lpListTail->srcInfo.nLine
+                                       - srcInfo.nLine)
+                             - pcRegion);
+        }
+      free(pcRegion);
+      if (IsError(lpError) || !lpCtx->bNeedInput)
+        {
+          break;
+        }
+
+      /* a `?begin` block is still open at the end of the region */
+      ArenaFree(lpCtx->lpProgram.lpArena);
+      free(lpCtx);
+      lpCtx = NULL;
+      lpLast = lpLast->lpNext;
+      nLastLine = CursorLine(&cursor, lpLast);
+    }
+
+  if (IsError(lpError))
+    {
+      ArenaFree(lpCtx->lpProgram.lpArena);
+      free(lpCtx);
+      return FALSE;
+    }
+
+  /* lpFirst up to lpLast make way for the new commands */
+  LPCOMMAND lpAfter = lpLast != NULL ? lpLast->lpNext : NULL;
+  LPCOMMAND iter = lpProgram->nHeapCommands != 0 ? lpFirst : lpAfter;
+  while (iter != lpAfter)
+    {
+      LPCOMMAND lpNext = iter->lpNext;
+      if (iter->bHeapAlloc)
+        {
+          free(iter);
+          InterlockedDecrement(&lpProgram->nHeapCommands);
+        }
+      iter = lpNext;
+    }
+  LPCOMMAND lpHead = lpCtx->lpProgram.lpCommands;
+  LPCOMMAND lpTail = lpCtx->lpListTail;
+  edit.lpHead = lpHead;
+  edit.lpAfter = lpAfter;
+  if (lpHead == NULL)
+    {
+      lpHead = lpAfter;
+      lpTail = lpBefore;
+    }
+  else
+    {
+      lpHead->lpPrev = lpBefore;
+      lpTail->lpNext = lpAfter;
+    }
+  if (lpBefore != NULL)
+    {
+      lpBefore->lpNext = lpHead;
+    }
+  else
+    {
+      lpProgram->lpCommands = lpHead;
+    }
+  if (lpAfter != NULL)
+    {
+      lpAfter->lpPrev = lpTail;
+    }
+  ArenaAdopt(&lpProgram->lpArena, lpCtx->lpProgram.lpArena);
+  free(lpCtx);
+
+  edit.last = cursor;
+  edit.bToEnd = bToEnd;
+  edit.nAfterStart = (SIZE_T)(pcStart - lpszSource) + cbAfter;
+  edit.nAfterLine = lpTail != lpBefore && lpTail != NULL
+    ? lpTail->srcInfo.nLine
+    : srcInfo.nLine;
+  edit.cbDelta = (LONGLONG)cbText - (LONGLONG)cbRemoved;
+  edit.nLineDelta = nLineDelta;
+  ReanchorEdit(lpIndex, &edit);
+  TraceEnd(nTraceStart, "parse", "ReparseProgram", NULL);
+  return TRUE;
+}
+
+static LPCSTR SkipLines(LPCSTR pc, DWORDLONG nLines)
+{
+  while (nLines != 0 && *pc != '\0')
+    {
+      if (*pc++ == '\n')
+        {
+          --nLines;
+        }
+    }
+  return pc;
+}
+
+static BOOL BuildLineIndex(LPPROGRAM lpProgram, LPCSTR lpszSource)
+{
+  DWORD nCommands = 0;
+  for (LPCOMMAND iter = lpProgram->lpCommands;
+       iter != NULL;
+       iter = iter->lpNext)
+    {
+      ++nCommands;
+    }
+  DWORD nAnchors = nCommands / LINE_CHUNK_COMMANDS;
+  if (nAnchors == 0)
+    {
+      nAnchors = 1;
+    }
+
+  LPLINEINDEX lpIndex = (LPLINEINDEX)malloc(sizeof(struct stLineIndex));
+  if (lpIndex == NULL)
+    {
+      return FALSE;
+    }
+  lpIndex->nAnchors = 0;
+  lpIndex->nCapacity = 0;
+  lpIndex->bStale = FALSE;
+  lpIndex->aAnchors = NULL;
+  lpIndex->acbTree = NULL;
+  lpIndex->anLineTree = NULL;
+  if (!ReserveAnchors(lpIndex, nAnchors))
+    {
+      DropLineIndex(lpIndex);
+      return FALSE;
+    }
+
+  /* the last chunk takes the commands left over, and the source up to
+     its end */
+  LPCSTR pc = lpszSource;
+  DWORDLONG nLine = 1;
+  LPCOMMAND iter = lpProgram->lpCommands;
+  for (DWORD i = 0; i < nAnchors; i++)
+    {
+      LINEANCHOR *lpAnchor = &lpIndex->aAnchors[i];
+      lpAnchor->lpFirst = iter;
+      lpAnchor->nCommands = i + 1 < nAnchors
+        ? LINE_CHUNK_COMMANDS
+        : nCommands - i * LINE_CHUNK_COMMANDS;
+      lpAnchor->nBase = nLine;
+      LPCOMMAND lpLastCmd = NULL;
+      for (DWORD j = 0; j < lpAnchor->nCommands; j++)
+        {
+          lpLastCmd = iter;
+          iter = iter->lpNext;
+        }
+
+      LPCSTR pcNext;
+      DWORDLONG nNextLine;
+      if (i + 1 < nAnchors)
+        {
+          nNextLine = lpLastCmd->srcInfo.nLine;
+          pcNext = SkipLines(pc, nNextLine - nLine);
+        }
+      else
+        {
+          pcNext = pc + strlen(pc);
+          nNextLine = nLine + CountNewlines((PCHAR)pc, (PCHAR)pcNext);
+        }
+      lpAnchor->cbSpan = (SIZE_T)(pcNext - pc);
+      lpAnchor->nLineSpan = nNextLine - nLine;
+      pc = pcNext;
+      nLine = nNextLine;
+    }
+  lpIndex->nAnchors = nAnchors;
+  BuildTrees(lpIndex);
+
+  DropLineIndex(lpProgram->lpLines);
+  lpProgram->lpLines = lpIndex;
+  return TRUE;
+}
+
+void SettleProgramLines(LPPROGRAM lpProgram)
+{
+  LPLINEINDEX lpIndex = lpProgram->lpLines;
+  if (lpIndex == NULL
+      || !InterlockedCompareExchange(&lpIndex->bStale, FALSE, FALSE))
+    {
+      return;
+    }
+
+  /* runs of a shared program may start at the same time */
+  AcquireSRWLockExclusive(&s_lineLock);
+  if (InterlockedCompareExchange(&lpIndex->bStale, FALSE, FALSE))
+    {
+      DWORDLONG nLine = 1;
+      for (DWORD i = 0; i < lpIndex->nAnchors; i++)
+        {
+          LINEANCHOR *lpAnchor = &lpIndex->aAnchors[i];
+          DWORDLONG nShift = nLine - lpAnchor->nBase;
+          if (nShift != 0)
+            {
+              LPCOMMAND iter = lpAnchor->lpFirst;
+              for (DWORD j = 0; j < lpAnchor->nCommands; j++)
+                {
+                  iter->srcInfo.nLine += nShift;
+                  iter = iter->lpNext;
+                }
+              lpAnchor->nBase = nLine;
+            }
+          nLine += lpAnchor->nLineSpan;
+        }
+      InterlockedExchange(&lpIndex->bStale, FALSE);
+    }
+  ReleaseSRWLockExclusive(&s_lineLock);
+}
+
+static void DropLineIndex(LPLINEINDEX lpIndex)
+{
+  if (lpIndex == NULL)
+    {
+      return;
+    }
+  free(lpIndex->aAnchors);
+  free(lpIndex->acbTree);
+  free(lpIndex->anLineTree);
+  free(lpIndex);
+}
+
+static BOOL ReserveAnchors(LPLINEINDEX lpIndex, DWORD nCapacity)
+{
+  if (nCapacity <= lpIndex->nCapacity)
+    {
+      return TRUE;
+    }
+  if (nCapacity < lpIndex->nCapacity * 2)
+    {
+      nCapacity = lpIndex->nCapacity * 2;
+    }
+
+  LINEANCHOR *aAnchors = (LINEANCHOR*)realloc
+    (
+      lpIndex->aAnchors,
+      nCapacity * sizeof(LINEANCHOR)
+    );
+  if (aAnchors == NULL)
+    {
+      return FALSE;
+    }
+  lpIndex->aAnchors = aAnchors;
+  LONGLONG *acbTree = (LONGLONG*)realloc
+    (
+      lpIndex->acbTree,
+      nCapacity * sizeof(LONGLONG)
+    );
+  if (acbTree == NULL)
+    {
+      return FALSE;
+    }
+  lpIndex->acbTree = acbTree;
+  LONGLONG *anLineTree = (LONGLONG*)realloc
+    (
+      lpIndex->anLineTree,
+      nCapacity * sizeof(LONGLONG)
+    );
+  if (anLineTree == NULL)
+    {
+      return FALSE;
+    }
+  lpIndex->anLineTree = anLineTree;
+  lpIndex->nCapacity = nCapacity;
+  return TRUE;
+}
+
+static void TreeAdd(LONGLONG *aTree, DWORD nCount, DWORD nIdx,
+                    LONGLONG nDelta)
+{
+  for (DWORD i = nIdx + 1; i <= nCount; i += i & (0 - i))
+    {
+      aTree[i - 1] += nDelta;
+    }
+}
+
+/* of the first nIdx spans, which is where anchor nIdx starts */
+static LONGLONG TreeSum(const LONGLONG *aTree, DWORD nIdx)
+{
+  LONGLONG nSum = 0;
+  for (DWORD i = nIdx; i != 0; i &= i - 1)
+    {
+      nSum += aTree[i - 1];
+    }
+  return nSum;
+}
+
+static void BuildTrees(LPLINEINDEX lpIndex)
+{
+  DWORD nCount = lpIndex->nAnchors;
+  for (DWORD i = 0; i < nCount; i++)
+    {
+      lpIndex->acbTree[i] = (LONGLONG)lpIndex->aAnchors[i].cbSpan;
+      lpIndex->anLineTree[i] = (LONGLONG)lpIndex->aAnchors[i].nLineSpan;
+    }
+  for (DWORD i = 1; i <= nCount; i++)
+    {
+      DWORD nParent = i + (i & (0 - i));
+      if (nParent <= nCount)
+        {
+          lpIndex->acbTree[nParent - 1] += lpIndex->acbTree[i - 1];
+          lpIndex->anLineTree[nParent - 1] += lpIndex->anLineTree[i - 1];
+        }
+    }
+}
+
+/* the last anchor starting at or before nPos */
+static DWORD FindAnchor(LPLINEINDEX lpIndex, SIZE_T nPos, SIZE_T *lpnStart)
+{
+  DWORD nCount = lpIndex->nAnchors;
+  DWORD nStep = 1;
+  while (nStep * 2 <= nCount)
+    {
+      nStep *= 2;
+    }
+  DWORD nIdx = 0;
+  LONGLONG nSum = 0;
+  for (; nStep != 0; nStep /= 2)
+    {
+      if (nIdx + nStep <= nCount
+          && nSum + lpIndex->acbTree[nIdx + nStep - 1] <= (LONGLONG)nPos)
+        {
+          nIdx += nStep;
+          nSum += lpIndex->acbTree[nIdx - 1];
+        }
+    }
+  if (nIdx == nCount)
+    {
+      nSum -= (LONGLONG)lpIndex->aAnchors[--nIdx].cbSpan;
+    }
+  *lpnStart = (SIZE_T)nSum;
+  return nIdx;
+}
+
+static DWORDLONG AnchorLine(LPLINEINDEX lpIndex, DWORD nAnchor)
+{
+  return 1 + (DWORDLONG)TreeSum(lpIndex->anLineTree, nAnchor);
+}
+
+static void SetAnchorSpan(LPLINEINDEX lpIndex,
+                          DWORD nAnchor,
+                          SIZE_T cbSpan,
+                          DWORDLONG nLineSpan)
+{
+  LINEANCHOR *lpAnchor = &lpIndex->aAnchors[nAnchor];
+  TreeAdd(lpIndex->acbTree, lpIndex->nAnchors, nAnchor,
+          (LONGLONG)cbSpan - (LONGLONG)lpAnchor->cbSpan);
+  TreeAdd(lpIndex->anLineTree, lpIndex->nAnchors, nAnchor,
+          (LONGLONG)nLineSpan - (LONGLONG)lpAnchor->nLineSpan);
+  lpAnchor->cbSpan = cbSpan;
+  lpAnchor->nLineSpan = nLineSpan;
+}
+
+/* cuts a chunk edits have grown into ones of LINE_CHUNK_COMMANDS, the
+   last taking what is left over; lpszSource is the source the index is
+   up to date with */
+static BOOL SplitAnchor(LPLINEINDEX lpIndex, DWORD nAnchor,
+                        LPCSTR lpszSource)
+{
+  LINEANCHOR anchor = lpIndex->aAnchors[nAnchor];
+  DWORD nPieces = anchor.nCommands / LINE_CHUNK_COMMANDS;
+  if (!ReserveAnchors(lpIndex, lpIndex->nAnchors + nPieces - 1))
+    {
+      return FALSE;
+    }
+  SIZE_T nStart = (SIZE_T)TreeSum(lpIndex->acbTree, nAnchor);
+  DWORDLONG nLine = AnchorLine(lpIndex, nAnchor);
+  LONGLONG nShift = (LONGLONG)(nLine - anchor.nBase);
+  memmove(&lpIndex->aAnchors[nAnchor + nPieces],
+          &lpIndex->aAnchors[nAnchor + 1],
+          (lpIndex->nAnchors - nAnchor - 1) * sizeof(LINEANCHOR));
+  lpIndex->nAnchors += nPieces - 1;
+
+  LPCSTR pc = lpszSource + nStart;
+  LPCSTR pcEnd = pc + anchor.cbSpan;
+  DWORDLONG nEndLine = nLine + anchor.nLineSpan;
+  LPCOMMAND iter = anchor.lpFirst;
+  for (DWORD i = 0; i < nPieces; i++)
+    {
+      LINEANCHOR *lpAnchor = &lpIndex->aAnchors[nAnchor + i];
+      lpAnchor->lpFirst = iter;
+      lpAnchor->nCommands = i + 1 < nPieces
+        ? LINE_CHUNK_COMMANDS
+        : anchor.nCommands - i * LINE_CHUNK_COMMANDS;
+      lpAnchor->nBase = nLine - (DWORDLONG)nShift;
+      LPCOMMAND lpLastCmd = NULL;
+      for (DWORD j = 0; j < lpAnchor->nCommands; j++)
+        {
+          lpLastCmd = iter;
+          iter = iter->lpNext;
+        }
+
+      LPCSTR pcNext = pcEnd;
+      DWORDLONG nNextLine = nEndLine;
+      if (i + 1 < nPieces)
+        {
+          nNextLine = lpLastCmd->srcInfo.nLine + (DWORDLONG)nShift;
+          pcNext = SkipLines(pc, nNextLine - nLine);
+        }
+      lpAnchor->cbSpan = (SIZE_T)(pcNext - pc);
+      lpAnchor->nLineSpan = nNextLine - nLine;
+      pc = pcNext;
+      nLine = nNextLine;
+    }
+  BuildTrees(lpIndex);
+  return TRUE;
+}
+
+/* drops the anchors an edit left without commands, what they spanned
+   going to the anchor before them */
+static void CompactAnchors(LPLINEINDEX lpIndex)
+{
+  DWORD nKept = 0;
+  SIZE_T cbLead = 0;
+  DWORDLONG nLeadLines = 0;
+  for (DWORD i = 0; i < lpIndex->nAnchors; i++)
+    {
+      LINEANCHOR *lpAnchor = &lpIndex->aAnchors[i];
+      if (lpAnchor->nCommands != 0)
+        {
+          lpIndex->aAnchors[nKept++] = *lpAnchor;
+        }
+      else if (nKept != 0)
+        {
+          lpIndex->aAnchors[nKept - 1].cbSpan += lpAnchor->cbSpan;
+          lpIndex->aAnchors[nKept - 1].nLineSpan += lpAnchor->nLineSpan;
+        }
+      else
+        {
+          cbLead += lpAnchor->cbSpan;
+          nLeadLines += lpAnchor->nLineSpan;
+        }
+    }
+
+  /* the first chunk starts at the top, whatever line that moves its
+     anchor to, and an empty program keeps one anchor */
+  LINEANCHOR *lpHead = &lpIndex->aAnchors[0];
+  if (nKept == 0)
+    {
+      lpHead->lpFirst = NULL;
+      lpHead->nCommands = 0;
+      lpHead->cbSpan = 0;
+      lpHead->nLineSpan = 0;
+      lpHead->nBase = 1;
+      nKept = 1;
+    }
+  else
+    {
+      lpHead->nBase -= nLeadLines;
+    }
+  lpHead->cbSpan += cbLead;
+  lpHead->nLineSpan += nLeadLines;
+  lpIndex->nAnchors = nKept;
+  BuildTrees(lpIndex);
+}
+
+static void StartCursor(LINECURSOR *lpCursor,
+                        LPLINEINDEX lpIndex,
+                        DWORD nAnchor,
+                        DWORDLONG nLine)
+{
+  lpCursor->lpIndex = lpIndex;
+  lpCursor->nAnchor = nAnchor;
+  lpCursor->nLine = nLine;
+  lpCursor->nShift =
+    (LONGLONG)(nLine - lpIndex->aAnchors[nAnchor].nBase);
+  lpCursor->lpCmd = NULL;
+  lpCursor->nIdx = 0;
+}
+
+/* the line of lpCmd, which is the command after the one asked for last,
+   or the same one again */
+static DWORDLONG CursorLine(LINECURSOR *lpCursor, LPCOMMAND lpCmd)
+{
+  if (lpCmd != lpCursor->lpCmd)
+    {
+      LPLINEINDEX lpIndex = lpCursor->lpIndex;
+      DWORD nNext = lpCursor->nAnchor + 1;
+      if (nNext < lpIndex->nAnchors
+          && lpIndex->aAnchors[nNext].lpFirst == lpCmd)
+        {
+          lpCursor->nLine += lpIndex->aAnchors[lpCursor->nAnchor].nLineSpan;
+          lpCursor->nAnchor = nNext;
+          lpCursor->nShift =
+            (LONGLONG)(lpCursor->nLine - lpIndex->aAnchors[nNext].nBase);
+          lpCursor->nIdx = 0;
+        }
+      else if (lpCursor->lpCmd != NULL)
+        {
+          lpCursor->nIdx++;
+        }
+      lpCursor->lpCmd = lpCmd;
+    }
+  return lpCmd->srcInfo.nLine + (DWORDLONG)lpCursor->nShift;
+}
+
+static void ReanchorEdit(LPLINEINDEX lpIndex, const LINEEDIT *lpEdit)
+{
+  DWORD nFirst = lpEdit->first.nAnchor;
+  DWORD nLast = lpEdit->bToEnd ? lpIndex->nAnchors - 1 : lpEdit->last.nAnchor;
+  LINEANCHOR *aAnchors = lpIndex->aAnchors;
+  DWORD nRest = lpEdit->bToEnd
+    ? 0
+    : aAnchors[nLast].nCommands - lpEdit->last.nIdx - 1;
+
+  /* the new commands join the chunk of the first one they replace */
+  DWORD nNew = 0;
+  for (LPCOMMAND iter = lpEdit->lpHead;
+       iter != NULL && iter != lpEdit->lpAfter;
+       iter = iter->lpNext)
+    {
+      iter->srcInfo.nLine -= (DWORDLONG)lpEdit->first.nShift;
+      nNew++;
+    }
+
+  LINEANCHOR *lpFirst = &aAnchors[nFirst];
+  if (lpEdit->nKept == 0)
+    {
+      lpFirst->lpFirst = nNew != 0 ? lpEdit->lpHead
+                         : nRest != 0 && nLast == nFirst ? lpEdit->lpAfter
+                         : NULL;
+    }
+  if (nLast == nFirst && nRest != 0)
+    {
+      /* the rest of the chunk keeps its anchor and moves by itself */
+      LPCOMMAND iter = lpEdit->lpAfter;
+      for (DWORD i = 0; i < nRest; i++)
+        {
+          iter->srcInfo.nLine += (DWORDLONG)lpEdit->nLineDelta;
+          iter = iter->lpNext;
+        }
+      SetAnchorSpan(lpIndex, nFirst,
+                    lpFirst->cbSpan + (SIZE_T)lpEdit->cbDelta,
+                    lpFirst->nLineSpan + (DWORDLONG)lpEdit->nLineDelta);
+      lpFirst->nCommands = lpEdit->nKept + nNew + nRest;
+      if (lpEdit->nLineDelta != 0)
+        {
+          InterlockedExchange(&lpIndex->bStale, TRUE);
+        }
+      return;
+    }
+
+  /* otherwise the chunk of lpAfter, if any, now starts where the new
+     commands end, and chunks in between lose all of their commands */
+  DWORD nAfter = nRest != 0 ? nLast : nLast + 1;
+  SIZE_T nFirstStart = (SIZE_T)TreeSum(lpIndex->acbTree, nFirst);
+  if (nAfter < lpIndex->nAnchors)
+    {
+      LINEANCHOR *lpAfter = &aAnchors[nAfter];
+      SIZE_T nOldStart = (SIZE_T)TreeSum(lpIndex->acbTree, nAfter);
+      DWORDLONG nOldLine = AnchorLine(lpIndex, nAfter);
+      DWORDLONG nShift = nOldLine - lpAfter->nBase;
+      SetAnchorSpan(lpIndex, nAfter,
+                    nOldStart + lpAfter->cbSpan + (SIZE_T)lpEdit->cbDelta
+                    - lpEdit->nAfterStart,
+                    nOldLine + lpAfter->nLineSpan
+                    + (DWORDLONG)lpEdit->nLineDelta - lpEdit->nAfterLine);
+      lpAfter->lpFirst = lpEdit->lpAfter;
+      lpAfter->nCommands = nRest != 0 ? nRest : lpAfter->nCommands;
+      lpAfter->nBase = lpEdit->nAfterLine - nShift
+                       - (DWORDLONG)lpEdit->nLineDelta;
+      SetAnchorSpan(lpIndex, nFirst,
+                    lpEdit->nAfterStart - nFirstStart,
+                    lpEdit->nAfterLine - lpEdit->first.nLine);
+    }
+  else
+    {
+      SIZE_T nLastStart = (SIZE_T)TreeSum(lpIndex->acbTree, nLast);
+      SetAnchorSpan(lpIndex, nFirst,
+                    nLastStart + aAnchors[nLast].cbSpan
+                    + (SIZE_T)lpEdit->cbDelta - nFirstStart,
+                    AnchorLine(lpIndex, nLast) + aAnchors[nLast].nLineSpan
+                    + (DWORDLONG)lpEdit->nLineDelta - lpEdit->first.nLine);
+    }
+  lpFirst->nCommands = lpEdit->nKept + nNew;
+
+  BOOL bDropped = lpFirst->nCommands == 0;
+  for (DWORD i = nFirst + 1; i < nAfter && i < lpIndex->nAnchors; i++)
+    {
+      SetAnchorSpan(lpIndex, i, 0, 0);
+      aAnchors[i].nCommands = 0;
+      bDropped = TRUE;
+    }
+  if (bDropped)
+    {
+      CompactAnchors(lpIndex);
+    }
+  InterlockedExchange(&lpIndex->bStale, TRUE);
+}
+
+/*** ------------------------- Source files ------------------------- ***/
+
+#define SOURCE_READ_CHUNK (64 * 1024)
+
+typedef struct
+{
+  PVOID VirtualAddress;
+  SIZE_T NumberOfBytes;
+} PREFETCHRANGE;
+
+typedef BOOL (WINAPI *LPPREFETCHPROC)(HANDLE hProcess,
+                                      ULONG_PTR nEntries,
+                                      PREFETCHRANGE *aRanges,
+                                      ULONG dwFlags);
+
+static BOOL MapSource(LPSOURCE lpSource, HANDLE hFile, SIZE_T cbFile);
+static BOOL ReadSource(LPSOURCE lpSource, HANDLE hFile, LPERROR lpError);
+
+LPSOURCE OpenSource(LPCSTR lpszFileName, LPERROR lpError)
+{
+  LONGLONG nTraceStart = TraceBegin();
+  LPSOURCE ret = (LPSOURCE)malloc(sizeof(struct stSource));
+  if (ret == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(lpszFileName, 0), NULL,
+                "source: cannot allocate memory for source");
+      return NULL;
+    }
+  ret->lpszSource = NULL;
+  ret->cbSource = 0;
+  ret->hMapping = NULL;
+  ret->lpView = NULL;
+
+  BOOL bStdin = !strcmp(lpszFileName, "-");
+  HANDLE hFile = bStdin
+    ? GetStdHandle(STD_INPUT_HANDLE)
+    : CreateFileA(lpszFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                  OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile == INVALID_HANDLE_VALUE || hFile == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(lpszFileName, 0), NULL,
+                "source: cannot open `%s`: %ld",
+                lpszFileName, GetLastError());
+      free(ret);
+      return NULL;
+    }
+
+  /* a mapping ends in zeroed page slack, which terminates the source
+     for free; files filling their last page exactly are read instead */
+  LARGE_INTEGER liSize;
+  SYSTEM_INFO sysInfo;
+  GetSystemInfo(&sysInfo);
+  BOOL bMapped = FALSE;
+  if (GetFileType(hFile) == FILE_TYPE_DISK
+      && GetFileSizeEx(hFile, &liSize)
+      && liSize.QuadPart > 0
+      && (ULONGLONG)liSize.QuadPart < (SIZE_T)-1
+      && liSize.QuadPart % sysInfo.dwPageSize != 0)
+    {
+      bMapped = MapSource(ret, hFile, (SIZE_T)liSize.QuadPart);
+    }
+  if (!bMapped && !ReadSource(ret, hFile, lpError))
+    {
+      if (!bStdin)
+        {
+          CloseHandle(hFile);
+        }
+      free(ret);
+      return NULL;
+    }
+
+  /* the mapping keeps the file open by itself */
+  if (!bStdin)
+    {
+      CloseHandle(hFile);
+    }
+  TraceEnd(nTraceStart, "source", "OpenSource", lpszFileName);
+  return ret;
+}
+
+void CloseSource(LPSOURCE lpSource)
+{
+  if (lpSource->lpView != NULL)
+    {
+      UnmapViewOfFile(lpSource->lpView);
+      CloseHandle(lpSource->hMapping);
+    }
+  else
+    {
+      free(lpSource->lpszSource);
+    }
+  free(lpSource);
+}
+
+static BOOL MapSource(LPSOURCE lpSource, HANDLE hFile, SIZE_T cbFile)
+{
+  HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_WRITECOPY,
+                                       0, 0, NULL);
+  if (hMapping == NULL)
+    {
+      return FALSE;
+    }
+  LPVOID lpView = MapViewOfFile(hMapping, FILE_MAP_COPY, 0, 0, 0);
+  if (lpView == NULL)
+    {
+      CloseHandle(hMapping);
+      return FALSE;
+    }
+
+  /* the parser walks the file front to back exactly once */
+  LPPREFETCHPROC lpfnPrefetch = (LPPREFETCHPROC)GetProcAddress
+    (
+      GetModuleHandleA("kernel32.dll"),
+      "PrefetchVirtualMemory"
+    );
+  if (lpfnPrefetch != NULL)
+    {
+      PREFETCHRANGE range;
+      range.VirtualAddress = lpView;
+      range.NumberOfBytes = cbFile;
+      lpfnPrefetch(GetCurrentProcess(), 1, &range, 0);
+    }
+
+  lpSource->lpszSource = (LPSTR)lpView;
+  lpSource->cbSource = cbFile;
+  lpSource->hMapping = hMapping;
+  lpSource->lpView = lpView;
+  return TRUE;
+}
+
+static BOOL ReadSource(LPSOURCE lpSource, HANDLE hFile, LPERROR lpError)
+{
+  SIZE_T cbBuffer = SOURCE_READ_CHUNK;
+  SIZE_T cbFill = 0;
+  PCHAR pcBuffer = (PCHAR)malloc(cbBuffer + 1);
+  for (;;)
+    {
+      if (pcBuffer != NULL && cbFill == cbBuffer)
+        {
+          PCHAR pcGrown = (PCHAR)realloc(pcBuffer, cbBuffer * 2 + 1);
+          if (pcGrown == NULL)
+            {
+              free(pcBuffer);
+            }
+          pcBuffer = pcGrown;
+          cbBuffer *= 2;
+        }
+      if (pcBuffer == NULL)
+        {
+          ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                    "source: cannot allocate memory for source");
+          return FALSE;
+        }
+
+      SIZE_T cbFree = cbBuffer - cbFill;
+      DWORD cbRead = 0;
+      if (!ReadFile(hFile,
+                    pcBuffer + cbFill,
+                    cbFree > MAXDWORD ? MAXDWORD : (DWORD)cbFree,
+                    &cbRead,
+                    NULL))
+        {
+          DWORD dwLastError = GetLastError();
+          if (dwLastError != ERROR_BROKEN_PIPE)
+            {
+              ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(NULL, 0), NULL,
+                        "source: cannot read input: %ld", dwLastError);
+              free(pcBuffer);
+              return FALSE;
+            }
+          cbRead = 0;
+        }
+      if (cbRead == 0)
+        {
+          break;
+        }
+      cbFill += cbRead;
+    }
+
+  pcBuffer[cbFill] = '\0';
+  lpSource->lpszSource = pcBuffer;
+  lpSource->cbSource = cbFill;
+  return TRUE;
+}
+
+/*** --------------------------- Streaming -------------------------- ***/
+
+struct stStream
+{
+  HANDLE hFile;
+  LPPARSECONTEXT lpParse;
+
+  /* cbFill bytes of input, always followed by a `\0` */
+  PCHAR pcWindow;
+  SIZE_T cbWindow;
+  SIZE_T cbFill;
+  BOOL bEof;
+
+  /* parse error found behind commands that were still returned */
+  LPERROR lpPending;
+};
+
+static BOOL FillWindow(LPSTREAM lpStream, LPERROR lpError);
+
+LPSTREAM OpenStream(HANDLE hFile,
+                    LPCSTR lpszFileName,
+                    SIZE_T cbWindow,
+                    WORD nParseBufferSize,
+                    LPERROR lpError)
+{
+  if (cbWindow == 0)
+    {
+      cbWindow = STREAM_DEFAULT_WINDOW;
+    }
+
+  LPSTREAM ret = (LPSTREAM)malloc(sizeof(struct stStream));
+  PCHAR pcWindow = (PCHAR)malloc(cbWindow + 1);
+  LPPARSECONTEXT lpParse = pcWindow != NULL
+    ? CreateParseContext(pcWindow, nParseBufferSize)
+    : NULL;
+  if (ret == NULL || lpParse == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(lpszFileName, 0), NULL,
+                "stream: cannot allocate memory for stream window");
+      free(lpParse);
+      free(pcWindow);
+      free(ret);
+      return NULL;
+    }
+
+  pcWindow[0] = '\0';
+  if (lpszFileName != NULL)
+    {
+      lpParse->srcInfo.lpszFileName = lpszFileName;
+    }
+  lpParse->bCopyStrings = TRUE;
+
+  ret->hFile = hFile;
+  ret->lpParse = lpParse;
+  ret->pcWindow = pcWindow;
+  ret->cbWindow = cbWindow;
+  ret->cbFill = 0;
+  ret->bEof = FALSE;
+  ret->lpPending = NULL;
+  return ret;
+}
+
+LPCOMMAND ReadStreamCommands(LPSTREAM lpStream, LPERROR lpError)
+{
+  LPPARSECONTEXT lpParse = lpStream->lpParse;
+  if (lpStream->lpPending != NULL)
+    {
+      LPERROR lpPending = lpStream->lpPending;
+      ErrPrintf(lpError, lpPending->nLine, lpPending->srcInfo,
+                lpPending->lpExtraData, "%s", ErrorReason(lpPending));
+      /* lpError owns the extra data now */
+      lpPending->lpExtraData = NULL;
+      DropError(lpPending);
+      lpStream->lpPending = NULL;
+      return NULL;
+    }
+
+  /* handlers may have linked commands of their own after the last
+     parsed one */
+  LPCOMMAND lpTail = lpParse->lpListTail;
+  while (lpTail != NULL && lpTail->lpNext != NULL)
+    {
+      lpTail = lpTail->lpNext;
+    }
+  lpParse->lpListTail = lpTail;
+
+  for (;;)
+    {
+      lpParse->bPartial = !lpStream->bEof;
+      lpParse->bNeedInput = FALSE;
+      LONGLONG nTraceStart = TraceBegin();
+      ParseSource(lpParse, lpError);
+      TraceEnd(nTraceStart, "parse", "ParseWindow", NULL);
+
+      LPCOMMAND lpFirst = lpTail != NULL
+        ? lpTail->lpNext
+        : lpParse->lpProgram.lpCommands;
+      if (IsError(lpError))
+        {
+          /* the commands before the bad one still run, however the
+             input was split into windows; the error is held back
+             until the next call */
+          if (lpFirst != NULL)
+            {
+              lpStream->lpPending = ErrorBuffer(lpError->nErrorBufferSize);
+            }
+          if (lpStream->lpPending == NULL)
+            {
+              return NULL;
+            }
+          ErrPrintf(lpStream->lpPending, lpError->nLine, lpError->srcInfo,
+                    lpError->lpExtraData, "%s", ErrorReason(lpError));
+          lpError->nLine = 0;
+          lpError->lpExtraData = NULL;
+        }
+      if (lpFirst != NULL)
+        {
+          return lpFirst;
+        }
+      if (lpStream->bEof)
+        {
+          return NULL;
+        }
+      nTraceStart = TraceBegin();
+      BOOL bFilled = FillWindow(lpStream, lpError);
+      TraceEnd(nTraceStart, "source", "FillWindow", NULL);
+      if (!bFilled)
+        {
+          return NULL;
+        }
+    }
+}
+
+void ReleaseStreamCommands(LPSTREAM lpStream)
+{
+  /* atoms stay, the dispatch table of a running stream indexes them */
+  DropCommands(&lpStream->lpParse->lpProgram);
+  lpStream->lpParse->lpListTail = NULL;
+}
+
+LPPROGRAM GetStreamProgram(LPSTREAM lpStream)
+{
+  return &lpStream->lpParse->lpProgram;
+}
+
+void CloseStream(LPSTREAM lpStream)
+{
+  if (lpStream->lpPending != NULL)
+    {
+      DropError(lpStream->lpPending);
+    }
+  DropProgram(&lpStream->lpParse->lpProgram);
+  free(lpStream->lpParse);
+  free(lpStream->pcWindow);
+  free(lpStream);
+}
+
+static BOOL FillWindow(LPSTREAM lpStream, LPERROR lpError)
+{
+  LPPARSECONTEXT lpParse = lpStream->lpParse;
+
+  /* keep only the unparsed rest, with its line number counted up to
+     its start */
+  SyncLine(lpParse);
+  SIZE_T cbKeep = lpStream->cbFill - lpParse->nSrcIdx;
+  memmove(lpStream->pcWindow,
+          lpStream->pcWindow + lpParse->nSrcIdx,
+          cbKeep);
+  lpStream->cbFill = cbKeep;
+  lpParse->nSrcIdx = 0;
+  lpParse->nLineIdx = 0;
+
+  if (cbKeep == lpStream->cbWindow)
+    {
+      /* a single command longer than the window */
+      PCHAR pcWindow = (PCHAR)realloc(lpStream->pcWindow,
+                                      lpStream->cbWindow * 2 + 1);
+      if (pcWindow == NULL)
+        {
+          ErrPrintf(lpError, PL2ERR_MALLOC, CurSrcInfo(lpParse), NULL,
+                    "stream: cannot grow stream window");
+          return FALSE;
+        }
+      lpStream->pcWindow = lpParse->lpszSrc = pcWindow;
+      lpStream->cbWindow *= 2;
+    }
+
+  SIZE_T cbFree = lpStream->cbWindow - lpStream->cbFill;
+  DWORD cbRead = 0;
+  if (!ReadFile(lpStream->hFile,
+                lpStream->pcWindow + lpStream->cbFill,
+                cbFree > MAXDWORD ? MAXDWORD : (DWORD)cbFree,
+                &cbRead,
+                NULL))
+    {
+      DWORD dwLastError = GetLastError();
+      if (dwLastError != ERROR_BROKEN_PIPE)
+        {
+          ErrPrintf(lpError, PL2ERR_GENERAL, CurSrcInfo(lpParse), NULL,
+                    "stream: cannot read input: %ld", dwLastError);
+          return FALSE;
+        }
+      cbRead = 0;
+    }
+  if (cbRead == 0)
+    {
+      lpStream->bEof = TRUE;
+    }
+
+  /* a `\0` in the input ends it, as it does for ParseProgram */
+  PCHAR pcNul = (PCHAR)memchr(lpStream->pcWindow + lpStream->cbFill,
+                              '\0',
+                              cbRead);
+  if (pcNul != NULL)
+    {
+      cbRead = (DWORD)(pcNul - (lpStream->pcWindow + lpStream->cbFill));
+      lpStream->bEof = TRUE;
+    }
+  lpStream->cbFill += cbRead;
+  lpStream->pcWindow[lpStream->cbFill] = '\0';
+  return TRUE;
+}
+
+/*** -------------------- Semantic-ver parsing  -------------------- ***/
+
+static LPCSTR ParseUint16(LPCSTR lpszSrc,
+                          WORD *lpnOutput,
+                          LPERROR lpError);
+
+static void ParseSemVerPostfix(LPCSTR lpszSrc,
+                               LPSTR lpszOutput,
+                               LPERROR lpError);
+
+SEMVER ZeroVersion(void)
+{
+  SEMVER ret;
+  ret.nMajor = 0;
+  ret.nMinor = 0;
+  ret.nPatch = 0;
+  memset(ret.szPostfix, 0, SEMVER_POSTFIX_LEN);
+  ret.bExact = FALSE;
+  return ret;
+}
+
+BOOL IsZeroVersion(SEMVER ver)
+{
+  return ver.nMajor == 0
+         && ver.nMinor == 0
+         && ver.nPatch == 0
+         && ver.szPostfix[0] == 0
+         && ver.bExact == 0;
+}
+
+BOOL IsAlpha(SEMVER ver)
+{
+  return ver.szPostfix[0] != '\0';
+}
+
+BOOL IsStable(SEMVER ver)
+{
+  return !IsAlpha(ver) && ver.nMajor != 0;
+}
+
+SEMVER ParseSemVer(LPCSTR lpszSrc, LPERROR lpError)
+{
+  SEMVER ret = ZeroVersion();
+  if (lpszSrc[0] == '^')
+    {
+      ret.bExact = 1;
+      lpszSrc++;
+    }
+
+  lpszSrc = ParseUint16(lpszSrc, &ret.nMajor, lpError);
+  if (IsError(lpError))
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0), NULL,
+                "missing major version");
+      goto done;
+    }
+  else if (lpszSrc[0] == '\0')
+    {
+      goto done;
+    }
+  else if (lpszSrc[0] == '-')
+    {
+      goto parse_postfix;
+    }
+  else if (lpszSrc[0] != '.')
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0), NULL,
+                "expected `.`, got `%c`", lpszSrc[0]);
+      goto done;
+    }
+  lpszSrc++;
+  lpszSrc = ParseUint16(lpszSrc, &ret.nMinor, lpError);
+  if (IsError(lpError))
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0),
+                NULL, "missing minor version");
+      goto done;
+    }
+  else if (lpszSrc[0] == '\0')
+    {
+      goto done;
+    }
+  else if (lpszSrc[0] == '-')
+    {
+      goto parse_postfix;
+    }
+  else if (lpszSrc[0] != '.')
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0), NULL,
+                "expected `.`, got `%c`", lpszSrc[0]);
+      goto done;
+    }
+
+  lpszSrc++;
+  lpszSrc = ParseUint16(lpszSrc, &ret.nPatch, lpError);
+  if (IsError(lpError))
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0), NULL,
+                "missing patch version");
+      goto done;
+    }
+  else if (lpszSrc[0] == '\0')
+    {
+      goto done;
+    }
+  else if (lpszSrc[0] != '-')
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0), NULL,
+                "unterminated semver, "
+                "expected `-` or `\\0`, got `%c`",
+                lpszSrc[0]);
+      goto done;
+    }
+
+parse_postfix:
+  ParseSemVerPostfix(lpszSrc, ret.szPostfix, lpError);
+
+done:
+  return ret;
+}
+
+BOOL IsCompatible(SEMVER expected, SEMVER actual)
+{
+  return strncmp(expected.szPostfix,
+                 actual.szPostfix,
+                 SEMVER_POSTFIX_LEN) == 0
+         && IsCompatibleKey(PackSemVer(expected),
+                            PackSemVer(actual),
+                            expected.bExact);
+}
+
+CMPRESULT CompareSemVer(SEMVER ver1, SEMVER ver2)
+{
+  /* versions with different postfixes do not order */
+  if (strncmp(ver1.szPostfix, ver2.szPostfix, SEMVER_POSTFIX_LEN) != 0)
+    {
+      return CMP_NONE;
+    }
+  return CompareSemVerKeys(PackSemVer(ver1), PackSemVer(ver2));
+}
+
+SEMVERKEY PackSemVer(SEMVER ver)
+{
+  return (SEMVERKEY)ver.nMajor << 32
+         | (SEMVERKEY)ver.nMinor << 16
+         | (SEMVERKEY)ver.nPatch;
+}
+
+CMPRESULT CompareSemVerKeys(SEMVERKEY lhs, SEMVERKEY rhs)
+{
+  return (CMPRESULT)((lhs > rhs) - (lhs < rhs));
+}
+
+BOOL IsCompatibleKey(SEMVERKEY expected, SEMVERKEY actual, BOOL bExact)
+{
+  /* the same version, or a later one of the same major one */
+  return (actual == expected)
+         | (!bExact
+            & ((actual >> 32) == (expected >> 32))
+            & (actual >= expected));
+}
+
+void FormatSemVer(SEMVER ver, LPSTR lpszBuffer)
+{
+  if (ver.szPostfix[0]) 
+    {
+      sprintf(lpszBuffer, "%s%u.%u.%u-%s",
+              ver.bExact ? "^" : "",
+              ver.nMajor,
+              ver.nMinor,
+              ver.nPatch,
+              ver.szPostfix);
+    }
+  else
+    {
+      sprintf(lpszBuffer, "%s%u.%u.%u",
+              ver.bExact ? "^" : "",
+              ver.nMajor,
+              ver.nMinor,
+              ver.nPatch);
+    }
+}
+
+static LPCSTR ParseUint16(LPCSTR lpszSrc,
+                          WORD *lpnOutput,
+                          LPERROR lpError)
+{
+  if (!isdigit((int)lpszSrc[0]))
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0),
+                NULL, "expected numeric version");
+      return NULL;
+    }
+  *lpnOutput = 0;
+  while (isdigit((int)lpszSrc[0]))
+    {
+      *lpnOutput *= 10;
+      *lpnOutput += lpszSrc[0] - '0';
+      ++lpszSrc;
+    }
+  return lpszSrc;
+}
+
+static void ParseSemVerPostfix(LPCSTR lpszSrc,
+                               LPSTR lpszOutput,
+                               LPERROR lpError)
+{
+  assert(lpszSrc[0] == '-');
+  ++lpszSrc;
+  if (lpszSrc[0] == '\0')
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0), NULL,
+                "empty semver postfix");
+      return;
+    }
+  for (size_t i = 0; i < SEMVER_POSTFIX_LEN - 1; i++)
+    {
+      if (!(*lpszOutput++ = *lpszSrc++))
+        {
+          return;
+        }
+    }
+  if (lpszSrc[0] != '\0')
+    {
+      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
+                SourceInfo(NULL, 0), NULL,
+                "semver postfix too long");
+      return;
+    }
+}
+
+/*** ------------------------ Dispatch table ----------------------- ***/
+
+#define DISPATCH_NONE ((DWORD)-1)
+
+/* longest run of one command handed to an lpfnBatchProc, or window to
+   an lpfnFusedProc, at once */
+#define SINV_BATCH_MAX 4096
+
+/* a field of the features a language was built with, NULL when it has
+   none or was built before the field existed */
+#define LANG_FEATURE(lpFeatures, field) \
+  ((lpFeatures) != NULL \
+   && (lpFeatures)->cbSize >= offsetof(struct stLangFeatures, field) \
+                              + sizeof((lpFeatures)->field) \
+   ? (lpFeatures)->field : NULL)
+
+typedef enum
+{
+  BIND_LANGUAGE = 0, /* built-in `language` */
+  BIND_ABORT    = 1, /* built-in `abort` */
+  BIND_FALLBACK = 2, /* routed to lpfnFallbackProc, or unknown */
+  BIND_SINVOKE  = 3, /* SINVHANDLER */
+  BIND_WCALL    = 4, /* WCALLHANDLER */
+  BIND_FUSED    = 5, /* FUSEDHANDLER, bound to the first of a window */
+  BIND_ROUTED   = 6  /* WCALLHANDLERs whose routers pick one per run */
+} BINDKIND;
+
+typedef struct stBinding
+{
+  BINDKIND kind;
+  SINVHANDLER *lpSinvoke;
+  WCALLHANDLER *lpWCall;
+  /* lpSinvoke->lpfnHandlerProc, or the symbol a lazy EasyLoad handler
+     resolved to; bUnresolved until it has been looked up */
+  LPSINVPROC lpfnProc;
+  BOOL bUnresolved;
+  /* the batch proc the language's features give lpSinvoke, or NULL */
+  LPSINVBATCHPROC lpfnBatchProc;
+  /* the sinvoke handler of each command of a lpFused window, or no
+     members when one of its names is not a sinvoke handler */
+  FUSEDHANDLER *lpFused;
+  const DWORD *anMembers;
+  DWORD nMembers;
+  BOOL bDeprecatedMember;
+  /* the WCALL handler a BIND_ROUTED chain starts at, lpWCall */
+  DWORD nRouteHead;
+} BINDING;
+
+/* the handlers of a language by name, made once per loaded language so
+   a dispatch table only has to look up the names its program uses */
+typedef struct stHandlerName
+{
+  LPCSTR lpszName;
+  DWORD dwHash;
+  DWORD nSinvoke;
+  /* WCALL handlers with the name, chained in table order */
+  DWORD nWCallHead;
+} HANDLERNAME;
+
+typedef struct stHandlerIndex
+{
+  DWORD nSinvokeCount;
+  DWORD nWCallCount;
+  DWORD *anWCallNext;
+  /* the batch proc of each sinvoke handler, or NULL */
+  LPSINVBATCHPROC *alpfnBatch;
+  /* sinvoke handlers of the commands of fused handler i are
+     anFusedMembers[anFusedStart[i]] up to anFusedStart[i + 1]; those
+     that can match are chained in table order by their first one */
+  FUSEDHANDLER *aFusedHandlers;
+  DWORD nFusedCount;
+  DWORD *anFusedStart;
+  DWORD *anFusedMembers;
+  DWORD *anFusedHead;
+  DWORD *anFusedNext;
+  HANDLERNAME *aNames;
+  DWORD nNameMask;
+} *LPHANDLERINDEX;
+
+typedef struct stDispatchSlot
+{
+  DWORD nSinvoke;
+  DWORD nWCallHead;
+  /* binding index, DISPATCH_NONE until the atom is first resolved */
+  DWORD nBinding;
+} DISPATCHSLOT;
+
+typedef struct stDispatchTable
+{
+  DWORD dwSerial;
+  DWORD nSinvokeCount;
+  LPLANGUAGE lpLanguage;
+  LPHANDLERINDEX lpIndex;
+  /* resolved symbols of a lazily loaded EasyLoad language, shared by
+     all its runs, or NULL */
+  PVOID volatile *alpLazyProcs;
+  /* one slot per program atom known when the table was made, later
+     atoms are looked up by name */
+  DWORD nSlotCount;
+  BINDING *aBindings;
+  DISPATCHSLOT aSlots[0];
+} *LPDISPATCHTABLE;
+
+/* aBindings layout: the three fixed kinds first, then one entry per
+   sinvoke handler, then one entry per WCALL handler, then one entry
+   per fused handler, then one routed entry per WCALL handler */
+#define BINDIDX_SINVOKE(lpTable, i) (BIND_SINVOKE + (i))
+#define BINDIDX_WCALL(lpTable, i) \
+  (BIND_SINVOKE + (lpTable)->nSinvokeCount + (i))
+#define BINDIDX_FUSED(lpTable, i) \
+  (BINDIDX_WCALL(lpTable, (lpTable)->lpIndex->nWCallCount) + (i))
+#define BINDIDX_ROUTED(lpTable, i) \
+  (BINDIDX_FUSED(lpTable, (lpTable)->lpIndex->nFusedCount) + (i))
+
+#define MAKE_BINDING(dwSerial, nIndex) \
+  (((DWORDLONG)(dwSerial) << 32) | (DWORDLONG)(nIndex))
+#define BINDING_SERIAL(dwlBinding) ((DWORD)((dwlBinding) >> 32))
+#define BINDING_INDEX(dwlBinding) ((DWORD)(dwlBinding))
+
+static volatile LONG s_nDispatchSerial;
+
+static LPHANDLERINDEX CreateHandlerIndex(LPLANGUAGE lpLanguage,
+                                         LPLANGFEATURES lpFeatures);
+static void DropHandlerIndex(LPHANDLERINDEX lpIndex);
+static HANDLERNAME *FindHandlerName(LPHANDLERINDEX lpIndex,
+                                    LPCSTR lpszName,
+                                    DWORD dwHash);
+static LPDISPATCHTABLE CreateDispatchTable(LPPROGRAM lpProgram,
+                                           LPLANGUAGE lpLanguage,
+                                           LPHANDLERINDEX lpIndex,
+                                           PVOID volatile *alpLazyProcs,
+                                           LPERROR lpError);
+static DWORD ResolveAtom(LPDISPATCHTABLE lpTable,
+                         DWORD dwAtom,
+                         LPCSTR lpszCmdName);
+static DWORD FillBinding(LPDISPATCHTABLE lpTable, DWORD nBinding);
+static BINDING *RouteBinding(LPDISPATCHTABLE lpTable,
+                             BINDING *lpBinding,
+                             LPCSTR lpszCmdName);
+
+static LPHANDLERINDEX CreateHandlerIndex(LPLANGUAGE lpLanguage,
+                                         LPLANGFEATURES lpFeatures)
+{
+  DWORD nSinvokeCount = 0;
+  DWORD nWCallCount = 0;
+  DWORD nFusedCount = 0;
+  DWORD nFusedNames = 0;
+  for (SINVHANDLER *iter = lpLanguage->aSinvokeHandlers;
+       iter != NULL && !IS_EMPTY_SINVOKE_CMD(iter);
+       ++iter)
+    {
+      ++nSinvokeCount;
+    }
+  for (WCALLHANDLER *iter = lpLanguage->aWCallHandlers;
+       iter != NULL && !IS_EMPTY_CMD(iter);
+       ++iter)
+    {
+      ++nWCallCount;
+    }
+  FUSEDHANDLER *aFusedHandlers = LANG_FEATURE(lpFeatures, aFusedHandlers);
+  for (FUSEDHANDLER *iter = aFusedHandlers;
+       iter != NULL && !IS_EMPTY_FUSED(iter);
+       ++iter)
+    {
+      ++nFusedCount;
+      for (LPCSTR *lpszName = iter->alpszCmdNames; *lpszName; ++lpszName)
+        {
+          ++nFusedNames;
+        }
+    }
+
+  /* at most half the name slots are used */
+  DWORD nNameSlots = ATOM_MIN_SLOTS;
+  while (nNameSlots < (nSinvokeCount + nWCallCount) * 2)
+    {
+      nNameSlots *= 2;
+    }
+  LPHANDLERINDEX ret = (LPHANDLERINDEX)malloc(sizeof(struct stHandlerIndex));
+  if (ret == NULL)
+    {
+      return NULL;
+    }
+  ret->nSinvokeCount = nSinvokeCount;
+  ret->nWCallCount = nWCallCount;
+  ret->aFusedHandlers = aFusedHandlers;
+  ret->nFusedCount = nFusedCount;
+  ret->nNameMask = nNameSlots - 1;
+  ret->aNames = (HANDLERNAME*)calloc(nNameSlots, sizeof(HANDLERNAME));
+  ret->anWCallNext = (DWORD*)malloc((nWCallCount + 1) * sizeof(DWORD));
+  ret->alpfnBatch = (LPSINVBATCHPROC*)calloc(nSinvokeCount + 1,
+                                             sizeof(LPSINVBATCHPROC));
+  ret->anFusedStart = (DWORD*)malloc((nFusedCount + 1) * sizeof(DWORD));
+  ret->anFusedMembers = (DWORD*)malloc((nFusedNames + 1) * sizeof(DWORD));
+  ret->anFusedHead = (DWORD*)malloc((nSinvokeCount + 1) * sizeof(DWORD));
+  ret->anFusedNext = (DWORD*)malloc((nFusedCount + 1) * sizeof(DWORD));
+  if (ret->aNames == NULL || ret->anWCallNext == NULL
+      || ret->alpfnBatch == NULL || ret->anFusedStart == NULL || ret->anFusedMembers == NULL
+      || ret->anFusedHead == NULL || ret->anFusedNext == NULL)
+    {
+      DropHandlerIndex(ret);
+      return NULL;
+    }
+
+  for (DWORD i = 0; i < nSinvokeCount + nWCallCount; i++)
+    {
+      BOOL bSinvoke = i < nSinvokeCount;
+      LPCSTR lpszName = bSinvoke
+        ? lpLanguage->aSinvokeHandlers[i].lpszCmdName
+        : lpLanguage->aWCallHandlers[i - nSinvokeCount].lpszCmdName;
+      BOOL bRemoved = bSinvoke
+        ? lpLanguage->aSinvokeHandlers[i].bRemoved
+        : lpLanguage->aWCallHandlers[i - nSinvokeCount].bRemoved;
+      if (!bSinvoke)
+        {
+          ret->anWCallNext[i - nSinvokeCount] = DISPATCH_NONE;
+        }
+      if (bRemoved || lpszName == NULL)
+        {
+          continue;
+        }
+
+      DWORD dwHash = HashCmdName(lpszName);
+      HANDLERNAME *lpName = FindHandlerName(ret, lpszName, dwHash);
+      if (lpName == NULL)
+        {
+          DWORD j = dwHash & ret->nNameMask;
+          while (ret->aNames[j].lpszName != NULL)
+            {
+              j = (j + 1) & ret->nNameMask;
+            }
+          lpName = &ret->aNames[j];
+          lpName->lpszName = lpszName;
+          lpName->dwHash = dwHash;
+          lpName->nSinvoke = DISPATCH_NONE;
+          lpName->nWCallHead = DISPATCH_NONE;
+        }
+
+      if (bSinvoke)
+        {
+          if (lpName->nSinvoke == DISPATCH_NONE)
+            {
+              lpName->nSinvoke = i;
+            }
+          continue;
+        }
+      /* handlers sharing a name keep their table order, so routers are
+         still consulted in the same sequence as a linear walk would */
+      DWORD *lpnLink = &lpName->nWCallHead;
+      while (*lpnLink != DISPATCH_NONE)
+        {
+          lpnLink = &ret->anWCallNext[*lpnLink];
+        }
+      *lpnLink = i - nSinvokeCount;
+    }
+
+  /* the first batch proc given for a name wins, like its handler */
+  for (BATCHHANDLER *iter = LANG_FEATURE(lpFeatures, aBatchHandlers);
+       iter != NULL && !IS_EMPTY_BATCH(iter);
+       ++iter)
+    {
+      HANDLERNAME *lpName = FindHandlerName(ret,
+                                            iter->lpszCmdName,
+                                            HashCmdName(iter->lpszCmdName));
+      if (lpName != NULL && lpName->nSinvoke != DISPATCH_NONE
+          && ret->alpfnBatch[lpName->nSinvoke] == NULL)
+        {
+          ret->alpfnBatch[lpName->nSinvoke] = iter->lpfnBatchProc;
+        }
+    }
+
+  /* a sequence with a command that is no sinvoke handler, with fewer
+     than two or with more than SINV_BATCH_MAX never matches */
+  for (DWORD i = 0; i < nSinvokeCount; i++)
+    {
+      ret->anFusedHead[i] = DISPATCH_NONE;
+    }
+  DWORD nMember = 0;
+  for (DWORD i = 0; i < nFusedCount; i++)
+    {
+      DWORD nStart = nMember;
+      ret->anFusedStart[i] = nStart;
+      ret->anFusedNext[i] = DISPATCH_NONE;
+      for (LPCSTR *lpszName = aFusedHandlers[i].alpszCmdNames;
+           *lpszName != NULL;
+           ++lpszName)
+        {
+          HANDLERNAME *lpName = FindHandlerName(ret,
+                                                *lpszName,
+                                                HashCmdName(*lpszName));
+          if (lpName == NULL || lpName->nSinvoke == DISPATCH_NONE)
+            {
+              nMember = nStart;
+              break;
+            }
+          ret->anFusedMembers[nMember++] = lpName->nSinvoke;
+        }
+      if (nMember - nStart < 2 || nMember - nStart > SINV_BATCH_MAX)
+        {
+          nMember = nStart;
+          continue;
+        }
+      DWORD *lpnLink = &ret->anFusedHead[ret->anFusedMembers[nStart]];
+      while (*lpnLink != DISPATCH_NONE)
+        {
+          lpnLink = &ret->anFusedNext[*lpnLink];
+        }
+      *lpnLink = i;
+    }
+  ret->anFusedStart[nFusedCount] = nMember;
+  return ret;
+}
+
+static void DropHandlerIndex(LPHANDLERINDEX lpIndex)
+{
+  if (lpIndex == NULL)
+    {
+      return;
+    }
+  free(lpIndex->aNames);
+  free(lpIndex->anWCallNext);
+  free(lpIndex->alpfnBatch);
+  free(lpIndex->anFusedStart);
+  free(lpIndex->anFusedMembers);
+  free(lpIndex->anFusedHead);
+  free(lpIndex->anFusedNext);
+  free(lpIndex);
+}
+
+static HANDLERNAME *FindHandlerName(LPHANDLERINDEX lpIndex,
+                                    LPCSTR lpszName,
+                                    DWORD dwHash)
+{
+  for (DWORD i = dwHash & lpIndex->nNameMask;
+       lpIndex->aNames[i].lpszName != NULL;
+       i = (i + 1) & lpIndex->nNameMask)
+    {
+      HANDLERNAME *lpName = &lpIndex->aNames[i];
+      if (lpName->dwHash == dwHash && !strcmp(lpName->lpszName, lpszName))
+        {
+          return lpName;
+        }
+    }
+  return NULL;
+}
+
+static LPDISPATCHTABLE CreateDispatchTable(LPPROGRAM lpProgram,
+                                           LPLANGUAGE lpLanguage,
+                                           LPHANDLERINDEX lpIndex,
+                                           PVOID volatile *alpLazyProcs,
+                                           LPERROR lpError)
+{
+  /* only reads the program, and bindings are filled in as commands
+     resolve to them, so the table costs what the program uses */
+  LPATOMTABLE lpAtoms = lpProgram->lpAtoms;
+  DWORD nSlotCount = lpAtoms != NULL ? lpAtoms->nAtoms : ATOM_NONE + 1;
+  DWORD nBindingCount = BIND_SINVOKE
+                        + lpIndex->nSinvokeCount
+                        + lpIndex->nWCallCount * 2
+                        + lpIndex->nFusedCount;
+  /* the bindings behind the slots hold pointers */
+  SIZE_T cbSlots = (nSlotCount * sizeof(DISPATCHSLOT) + sizeof(LPVOID) - 1)
+                   & ~(SIZE_T)(sizeof(LPVOID) - 1);
+  LPDISPATCHTABLE ret = (LPDISPATCHTABLE)calloc
+    (
+      1,
+      sizeof(struct stDispatchTable) + cbSlots
+      + nBindingCount * sizeof(BINDING)
+    );
+  if (ret == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                "language: cannot allocate memory for dispatch table");
+      return NULL;
+    }
+  ret->aBindings = (BINDING*)((PCHAR)ret->aSlots + cbSlots);
+  ret->nSinvokeCount = lpIndex->nSinvokeCount;
+  ret->lpLanguage = lpLanguage;
+  ret->lpIndex = lpIndex;
+  ret->alpLazyProcs = alpLazyProcs;
+  ret->nSlotCount = nSlotCount;
+  for (DWORD i = 0; i < nSlotCount; i++)
+    {
+      DISPATCHSLOT *lpSlot = &ret->aSlots[i];
+      HANDLERNAME *lpName = i != ATOM_NONE
+        ? FindHandlerName(lpIndex,
+                          lpAtoms->alpszNames[i],
+                          lpAtoms->adwHashes[i])
+        : NULL;
+      lpSlot->nSinvoke = lpName != NULL ? lpName->nSinvoke : DISPATCH_NONE;
+      lpSlot->nWCallHead = lpName != NULL ? lpName->nWCallHead
+                                          : DISPATCH_NONE;
+      lpSlot->nBinding = DISPATCH_NONE;
+    }
+
+  /* serial 0 is reserved for unbound commands */
+  do
+    {
+      ret->dwSerial = (DWORD)InterlockedIncrement(&s_nDispatchSerial);
+    }
+  while (ret->dwSerial == 0);
+
+  ret->aBindings[BIND_LANGUAGE].kind = BIND_LANGUAGE;
+  ret->aBindings[BIND_ABORT].kind = BIND_ABORT;
+  ret->aBindings[BIND_FALLBACK].kind = BIND_FALLBACK;
+  for (DWORD i = 0; i < lpIndex->nWCallCount; i++)
+    {
+      BINDING *lpBinding = &ret->aBindings[BINDIDX_ROUTED(ret, i)];
+      lpBinding->kind = BIND_ROUTED;
+      lpBinding->lpWCall = &lpLanguage->aWCallHandlers[i];
+      lpBinding->nRouteHead = i;
+    }
+  for (DWORD i = 0; i < lpIndex->nFusedCount; i++)
+    {
+      BINDING *lpBinding = &ret->aBindings[BINDIDX_FUSED(ret, i)];
+      lpBinding->kind = BIND_FUSED;
+      lpBinding->lpFused = &lpIndex->aFusedHandlers[i];
+      lpBinding->anMembers = lpIndex->anFusedMembers
+                             + lpIndex->anFusedStart[i];
+      lpBinding->nMembers = lpIndex->anFusedStart[i + 1]
+                            - lpIndex->anFusedStart[i];
+      lpBinding->bDeprecatedMember = FALSE;
+      for (DWORD j = 0; j < lpBinding->nMembers; j++)
+        {
+          lpBinding->bDeprecatedMember |=
+            lpLanguage->aSinvokeHandlers[lpBinding->anMembers[j]].bDeprecated;
+        }
+      /* a window that no longer matches runs its first command alone */
+      if (lpBinding->nMembers != 0)
+        {
+          FillBinding(ret, BINDIDX_SINVOKE(ret, lpBinding->anMembers[0]));
+        }
+    }
+  return ret;
+}
+
+static DWORD ResolveAtom(LPDISPATCHTABLE lpTable,
+                         DWORD dwAtom,
+                         LPCSTR lpszCmdName)
+{
+  if (dwAtom == ATOM_LANGUAGE)
+    {
+      return BIND_LANGUAGE;
+    }
+  else if (dwAtom == ATOM_ABORT)
+    {
+      return BIND_ABORT;
+    }
+
+  DISPATCHSLOT *lpSlot = NULL;
+  DWORD nSinvoke = DISPATCH_NONE;
+  DWORD nWCallHead = DISPATCH_NONE;
+  if (dwAtom != ATOM_NONE && dwAtom < lpTable->nSlotCount)
+    {
+      lpSlot = &lpTable->aSlots[dwAtom];
+      if (lpSlot->nBinding != DISPATCH_NONE)
+        {
+          return lpSlot->nBinding;
+        }
+      nSinvoke = lpSlot->nSinvoke;
+      nWCallHead = lpSlot->nWCallHead;
+    }
+  else
+    {
+      /* a name the program did not have when the table was made */
+      HANDLERNAME *lpName = FindHandlerName(lpTable->lpIndex,
+                                            lpszCmdName,
+                                            HashCmdName(lpszCmdName));
+      if (lpName != NULL)
+        {
+          nSinvoke = lpName->nSinvoke;
+          nWCallHead = lpName->nWCallHead;
+        }
+    }
+
+  DWORD nBinding = BIND_FALLBACK;
+  if (nSinvoke != DISPATCH_NONE)
+    {
+      nBinding = FillBinding(lpTable, BINDIDX_SINVOKE(lpTable, nSinvoke));
+    }
+  else if (nWCallHead != DISPATCH_NONE)
+    {
+      /* routers may keep state, so a name that reaches one is routed
+         each time it runs, as the linear walk did */
+      nBinding = lpTable->lpLanguage->aWCallHandlers[nWCallHead]
+                   .lpfnRouterProc != NULL
+        ? BINDIDX_ROUTED(lpTable, nWCallHead)
+        : FillBinding(lpTable, BINDIDX_WCALL(lpTable, nWCallHead));
+    }
+  if (lpSlot != NULL)
+    {
+      lpSlot->nBinding = nBinding;
+    }
+  return nBinding;
+}
+
+static DWORD FillBinding(LPDISPATCHTABLE lpTable, DWORD nBinding)
+{
+  BINDING *lpBinding = &lpTable->aBindings[nBinding];
+  if (lpBinding->lpSinvoke != NULL || lpBinding->lpWCall != NULL)
+    {
+      return nBinding;
+    }
+  if (nBinding >= BINDIDX_WCALL(lpTable, 0))
+    {
+      lpBinding->kind = BIND_WCALL;
+      lpBinding->lpWCall = &lpTable->lpLanguage->aWCallHandlers
+        [nBinding - BINDIDX_WCALL(lpTable, 0)];
+      return nBinding;
+    }
+
+  DWORD nSinvoke = nBinding - BINDIDX_SINVOKE(lpTable, 0);
+  lpBinding->kind = BIND_SINVOKE;
+  lpBinding->lpSinvoke = &lpTable->lpLanguage->aSinvokeHandlers[nSinvoke];
+  lpBinding->lpfnProc = lpBinding->lpSinvoke->lpfnHandlerProc;
+  lpBinding->lpfnBatchProc = lpTable->lpIndex->alpfnBatch[nSinvoke];
+  if (lpBinding->lpfnProc == NULL && lpTable->alpLazyProcs != NULL)
+    {
+      /* another run may have resolved it already */
+      lpBinding->lpfnProc = (LPSINVPROC)InterlockedCompareExchangePointer
+        (
+          &lpTable->alpLazyProcs[nSinvoke],
+          NULL,
+          NULL
+        );
+      lpBinding->bUnresolved = lpBinding->lpfnProc == NULL;
+    }
+  return nBinding;
+}
+
+static BINDING *RouteBinding(LPDISPATCHTABLE lpTable,
+                             BINDING *lpBinding,
+                             LPCSTR lpszCmdName)
+{
+  for (DWORD i = lpBinding->nRouteHead;
+       i != DISPATCH_NONE;
+       i = lpTable->lpIndex->anWCallNext[i])
+    {
+      WCALLHANDLER *lpHandler = &lpTable->lpLanguage->aWCallHandlers[i];
+      if (lpHandler->lpfnRouterProc == NULL
+          || lpHandler->lpfnRouterProc(lpszCmdName))
+        {
+          return &lpTable->aBindings[FillBinding(lpTable,
+                                                 BINDIDX_WCALL(lpTable, i))];
+        }
+    }
+  return &lpTable->aBindings[BIND_FALLBACK];
+}
+
+/*** ---------------------------- Profiler -------------------------- ***/
+
+#define PROFILE_ENV       "PL2W_PROFILE"
+#define PROFILE_TOP_LINES 50
+
+typedef struct stProfileEntry
+{
+  DWORDLONG nCalls;     /* handler invocations, one per batch */
+  DWORDLONG nCommands;  /* commands executed by them */
+  LONGLONG nTicks;
+} PROFILEENTRY;
+
+typedef struct stProfileLine
+{
+  DWORDLONG nLine;
+  PROFILEENTRY entry;
+} PROFILELINE;
+
+typedef struct stProfile
+{
+  LPSTR lpszFileName;
+  LONGLONG nFrequency;
+  /* indexed by binding index; BIND_FALLBACK is split by atom into
+     aFallback instead */
+  PROFILEENTRY *aHandlers;
+  DWORD nHandlerCap;
+  PROFILEENTRY *aFallback;
+  DWORD nFallbackCap;
+  /* open addressing on the line number, a line is used once it has
+     commands */
+  PROFILELINE *aLines;
+  DWORD nLineCount;
+  DWORD nLineMask;
+  BOOL bIncomplete;
+} *LPPROFILE;
+
+typedef struct stProfileRow
+{
+  LPCSTR lpszName;
+  LPCSTR lpszKind;
+  DWORDLONG nLine;
+  const PROFILEENTRY *lpEntry;
+  /* shown instead of lpszName when set, the names of the window of a
+     fused row joined by `+` */
+  CHAR szWindow[33];
+} PROFILEROW;
+
+static LPPROFILE CreateProfile(LPCSTR lpszFileName);
+static void DropProfile(LPPROFILE lpProfile);
+static void RecordProfile(LPPROFILE lpProfile,
+                          LPDISPATCHTABLE lpTable,
+                          DWORDLONG dwlBinding,
+                          DWORD dwAtom,
+                          DWORDLONG nLine,
+                          DWORD nCommands,
+                          LONGLONG nTicks);
+static void WriteProfile(LPPROFILE lpProfile,
+                         LPPROGRAM lpProgram,
+                         LPDISPATCHTABLE lpTable,
+                         DWORD nFusedWindows);
+static PROFILEENTRY *ProfileSlot(PROFILEENTRY **lpaEntries,
+                                 DWORD *lpnCap,
+                                 DWORD nIdx);
+static PROFILEENTRY *ProfileLine(LPPROFILE lpProfile, DWORDLONG nLine);
+static void WriteProfileRows(FILE *fp,
+                             LPPROFILE lpProfile,
+                             PROFILEROW *aRows,
+                             DWORD nRows,
+                             DWORD nShown);
+static int CompareProfileRows(const void *lhs, const void *rhs);
+
+static LPPROFILE CreateProfile(LPCSTR lpszFileName)
+{
+  LPPROFILE ret = (LPPROFILE)malloc(sizeof(struct stProfile));
+  if (ret == NULL)
+    {
+      return NULL;
+    }
+  memset(ret, 0, sizeof(struct stProfile));
+  ret->lpszFileName = (LPSTR)malloc(strlen(lpszFileName) + 1);
+  if (ret->lpszFileName == NULL)
+    {
+      free(ret);
+      return NULL;
+    }
+  strcpy(ret->lpszFileName, lpszFileName);
+
+  LARGE_INTEGER liFrequency;
+  QueryPerformanceFrequency(&liFrequency);
+  ret->nFrequency = liFrequency.QuadPart;
+  return ret;
+}
+
+static void DropProfile(LPPROFILE lpProfile)
+{
+  free(lpProfile->lpszFileName);
+  free(lpProfile->aHandlers);
+  free(lpProfile->aFallback);
+  free(lpProfile->aLines);
+  free(lpProfile);
+}
+
+static void RecordProfile(LPPROFILE lpProfile,
+                          LPDISPATCHTABLE lpTable,
+                          DWORDLONG dwlBinding,
+                          DWORD dwAtom,
+                          DWORDLONG nLine,
+                          DWORD nCommands,
+                          LONGLONG nTicks)
+{
+  /* commands run before the language loads carry no binding yet */
+  DWORD nBinding;
+  if (lpTable != NULL && BINDING_SERIAL(dwlBinding) == lpTable->dwSerial)
+    {
+      nBinding = BINDING_INDEX(dwlBinding);
+    }
+  else if (dwAtom == ATOM_LANGUAGE)
+    {
+      nBinding = BIND_LANGUAGE;
+    }
+  else if (dwAtom == ATOM_ABORT)
+    {
+      nBinding = BIND_ABORT;
+    }
+  else
+    {
+      nBinding = BIND_FALLBACK;
+    }
+
+  PROFILEENTRY *lpEntries[2];
+  lpEntries[0] = nBinding == BIND_FALLBACK
+    ? ProfileSlot(&lpProfile->aFallback, &lpProfile->nFallbackCap, dwAtom)
+    : ProfileSlot(&lpProfile->aHandlers, &lpProfile->nHandlerCap, nBinding);
+  lpEntries[1] = ProfileLine(lpProfile, nLine);
+  for (int i = 0; i < 2; i++)
+    {
+      if (lpEntries[i] == NULL)
+        {
+          lpProfile->bIncomplete = TRUE;
+          continue;
+        }
+      lpEntries[i]->nCalls++;
+      lpEntries[i]->nCommands += nCommands;
+      lpEntries[i]->nTicks += nTicks;
+    }
+}
+
+static void WriteProfile(LPPROFILE lpProfile,
+                         LPPROGRAM lpProgram,
+                         LPDISPATCHTABLE lpTable,
+                         DWORD nFusedWindows)
+{
+  FILE *fp = stderr;
+  if (strcmp(lpProfile->lpszFileName, "-") != 0)
+    {
+      fp = fopen(lpProfile->lpszFileName, "w");
+      if (fp == NULL)
+        {
+          fprintf(stderr, "[int/e] cannot open profile output `%s`\n",
+                  lpProfile->lpszFileName);
+          return;
+        }
+    }
+
+  DWORD nRowCap = lpProfile->nHandlerCap + lpProfile->nFallbackCap;
+  if (lpProfile->nLineCount > nRowCap)
+    {
+      nRowCap = lpProfile->nLineCount;
+    }
+  PROFILEROW *aRows = (PROFILEROW*)malloc
+    (
+      (nRowCap != 0 ? nRowCap : 1) * sizeof(PROFILEROW)
+    );
+  if (aRows == NULL)
+    {
+      fprintf(stderr, "[int/e] cannot allocate memory for profile\n");
+      if (fp != stderr)
+        {
+          fclose(fp);
+        }
+      return;
+    }
+
+  PROFILEENTRY total = {0, 0, 0};
+  DWORD nRows = 0;
+  for (DWORD i = 0; i < lpProfile->nHandlerCap; i++)
+    {
+      const PROFILEENTRY *lpEntry = &lpProfile->aHandlers[i];
+      if (lpEntry->nCalls == 0)
+        {
+          continue;
+        }
+      PROFILEROW *lpRow = &aRows[nRows++];
+      lpRow->lpEntry = lpEntry;
+      lpRow->nLine = 0;
+      lpRow->szWindow[0] = '\0';
+      if (i == BIND_LANGUAGE)
+        {
+          lpRow->lpszName = "language";
+          lpRow->lpszKind = "built-in";
+        }
+      else if (i == BIND_ABORT)
+        {
+          lpRow->lpszName = "abort";
+          lpRow->lpszKind = "built-in";
+        }
+      else if (lpTable->aBindings[i].kind == BIND_SINVOKE)
+        {
+          lpRow->lpszName = lpTable->aBindings[i].lpSinvoke->lpszCmdName;
+          lpRow->lpszKind = "sinvoke";
+        }
+      else if (lpTable->aBindings[i].kind == BIND_FUSED)
+        {
+          LPCSTR *alpszNames = lpTable->aBindings[i].lpFused->alpszCmdNames;
+          SIZE_T nLength = 0;
+          for (LPCSTR *iter = alpszNames;
+               *iter != NULL && nLength + 1 < sizeof(lpRow->szWindow);
+               iter++)
+            {
+              nLength += snprintf(lpRow->szWindow + nLength,
+                                  sizeof(lpRow->szWindow) - nLength,
+                                  iter == alpszNames ? "%s" : "+%s",
+                                  *iter);
+            }
+          lpRow->lpszName = alpszNames[0];
+          lpRow->lpszKind = "fused";
+        }
+      else
+        {
+          lpRow->lpszName = lpTable->aBindings[i].lpWCall->lpszCmdName;
+          lpRow->lpszKind = "wcall";
+        }
+      total.nCalls += lpEntry->nCalls;
+      total.nCommands += lpEntry->nCommands;
+      total.nTicks += lpEntry->nTicks;
+    }
+  for (DWORD i = 0; i < lpProfile->nFallbackCap; i++)
+    {
+      const PROFILEENTRY *lpEntry = &lpProfile->aFallback[i];
+      if (lpEntry->nCalls == 0)
+        {
+          continue;
+        }
+      PROFILEROW *lpRow = &aRows[nRows++];
+      lpRow->lpEntry = lpEntry;
+      lpRow->nLine = 0;
+      lpRow->szWindow[0] = '\0';
+      lpRow->lpszName = AtomName(lpProgram, i);
+      if (lpRow->lpszName == NULL)
+        {
+          lpRow->lpszName = "?";
+        }
+      lpRow->lpszKind = "fallback";
+      total.nCalls += lpEntry->nCalls;
+      total.nCommands += lpEntry->nCommands;
+      total.nTicks += lpEntry->nTicks;
+    }
+
+  fprintf(fp,
+          "[int/i] profile: %llu commands in %llu handler calls, %.3f ms\n",
+          (unsigned long long)total.nCommands,
+          (unsigned long long)total.nCalls,
+          (double)total.nTicks * 1e3 / (double)lpProfile->nFrequency);
+  if (nFusedWindows != 0)
+    {
+      fprintf(fp, "[int/i] profile: %lu command windows fused\n",
+              (unsigned long)nFusedWindows);
+    }
+  if (lpProfile->bIncomplete)
+    {
+      fprintf(fp, "[int/w] profile: out of memory, some commands "
+                  "are not counted\n");
+    }
+  fprintf(fp, "\n%-32s %-9s %12s %12s %12s %10s %6s\n",
+          "command", "kind", "calls", "commands", "total ms",
+          "ns/command", "%");
+  WriteProfileRows(fp, lpProfile, aRows, nRows, nRows);
+
+  nRows = 0;
+  for (DWORD i = 0; i <= lpProfile->nLineMask && lpProfile->aLines; i++)
+    {
+      const PROFILELINE *lpLine = &lpProfile->aLines[i];
+      if (lpLine->entry.nCommands == 0)
+        {
+          continue;
+        }
+      PROFILEROW *lpRow = &aRows[nRows++];
+      lpRow->lpEntry = &lpLine->entry;
+      lpRow->nLine = lpLine->nLine;
+      lpRow->lpszName = NULL;
+      lpRow->lpszKind = "";
+      lpRow->szWindow[0] = '\0';
+    }
+  fprintf(fp, "\n%-42s %12s %12s %12s %10s %6s\n",
+          "line", "calls", "commands", "total ms", "ns/command", "%");
+  WriteProfileRows(fp, lpProfile, aRows, nRows, PROFILE_TOP_LINES);
+  if (nRows > PROFILE_TOP_LINES)
+    {
+      fprintf(fp, "... %lu more lines\n",
+              (unsigned long)(nRows - PROFILE_TOP_LINES));
+    }
+
+  free(aRows);
+  if (fp != stderr)
+    {
+      fclose(fp);
+    }
+}
+
+static PROFILEENTRY *ProfileSlot(PROFILEENTRY **lpaEntries,
+                                 DWORD *lpnCap,
+                                 DWORD nIdx)
+{
+  if (nIdx >= *lpnCap)
+    {
+      DWORD nCap = *lpnCap != 0 ? *lpnCap : 16;
+      while (nCap <= nIdx)
+        {
+          nCap *= 2;
+        }
+      PROFILEENTRY *aEntries = (PROFILEENTRY*)realloc
+        (
+          *lpaEntries,
+          nCap * sizeof(PROFILEENTRY)
+        );
+      if (aEntries == NULL)
+        {
+          return NULL;
+        }
+      memset(aEntries + *lpnCap, 0,
+             (nCap - *lpnCap) * sizeof(PROFILEENTRY));
+      *lpaEntries = aEntries;
+      *lpnCap = nCap;
+    }
+  return &(*lpaEntries)[nIdx];
+}
+
+static PROFILEENTRY *ProfileLine(LPPROFILE lpProfile, DWORDLONG nLine)
+{
+  if (lpProfile->aLines == NULL
+      || (lpProfile->nLineCount + 1) * 2 > lpProfile->nLineMask + 1)
+    {
+      DWORD nCap = lpProfile->aLines != NULL
+        ? (lpProfile->nLineMask + 1) * 2
+        : 256;
+      PROFILELINE *aLines = (PROFILELINE*)malloc(nCap * sizeof(PROFILELINE));
+      if (aLines == NULL)
+        {
+          return NULL;
+        }
+      memset(aLines, 0, nCap * sizeof(PROFILELINE));
+      for (DWORD i = 0;
+           lpProfile->aLines != NULL && i <= lpProfile->nLineMask;
+           i++)
+        {
+          if (lpProfile->aLines[i].entry.nCommands == 0)
+            {
+              continue;
+            }
+          DWORD nSlot = (DWORD)(lpProfile->aLines[i].nLine
+                                * 0x9E3779B97F4A7C15ull >> 32)
+                        & (nCap - 1);
+          while (aLines[nSlot].entry.nCommands != 0)
+            {
+              nSlot = (nSlot + 1) & (nCap - 1);
+            }
+          aLines[nSlot] = lpProfile->aLines[i];
+        }
+      free(lpProfile->aLines);
+      lpProfile->aLines = aLines;
+      lpProfile->nLineMask = nCap - 1;
+    }
+
+  DWORD nSlot = (DWORD)(nLine * 0x9E3779B97F4A7C15ull >> 32)
+                & lpProfile->nLineMask;
+  while (lpProfile->aLines[nSlot].entry.nCommands != 0)
+    {
+      if (lpProfile->aLines[nSlot].nLine == nLine)
+        {
+          return &lpProfile->aLines[nSlot].entry;
+        }
+      nSlot = (nSlot + 1) & lpProfile->nLineMask;
+    }
+  /* claimed by the caller adding its commands */
+  lpProfile->aLines[nSlot].nLine = nLine;
+  lpProfile->nLineCount++;
+  return &lpProfile->aLines[nSlot].entry;
+}
+
+static void WriteProfileRows(FILE *fp,
+                             LPPROFILE lpProfile,
+                             PROFILEROW *aRows,
+                             DWORD nRows,
+                             DWORD nShown)
+{
+  LONGLONG nTotalTicks = 0;
+  for (DWORD i = 0; i < nRows; i++)
+    {
+      nTotalTicks += aRows[i].lpEntry->nTicks;
+    }
+  qsort(aRows, nRows, sizeof(PROFILEROW), CompareProfileRows);
+
+  for (DWORD i = 0; i < nRows && i < nShown; i++)
+    {
+      const PROFILEENTRY *lpEntry = aRows[i].lpEntry;
+      double fMillis = (double)lpEntry->nTicks * 1e3
+                       / (double)lpProfile->nFrequency;
+      if (aRows[i].lpszName != NULL)
+        {
+          fprintf(fp, "%-32s %-9s",
+                  aRows[i].szWindow[0] != '\0' ? aRows[i].szWindow
+                                                : aRows[i].lpszName,
+                  aRows[i].lpszKind);
+        }
+      else
+        {
+          fprintf(fp, "%-42llu", (unsigned long long)aRows[i].nLine);
+        }
+      fprintf(fp, " %12llu %12llu %12.3f %10.1f %6.2f\n",
+              (unsigned long long)lpEntry->nCalls,
+              (unsigned long long)lpEntry->nCommands,
+              fMillis,
+              fMillis * 1e6 / (double)lpEntry->nCommands,
+              nTotalTicks != 0
+                ? (double)lpEntry->nTicks * 100.0 / (double)nTotalTicks
+                : 0.0);
+    }
+}
+
+static int CompareProfileRows(const void *lhs, const void *rhs)
+{
+  const PROFILEROW *lpLhs = (const PROFILEROW*)lhs;
+  const PROFILEROW *lpRhs = (const PROFILEROW*)rhs;
+  if (lpLhs->lpEntry->nTicks != lpRhs->lpEntry->nTicks)
+    {
+      return lpLhs->lpEntry->nTicks > lpRhs->lpEntry->nTicks ? -1 : 1;
+    }
+  if (lpLhs->lpEntry->nCommands != lpRhs->lpEntry->nCommands)
+    {
+      return lpLhs->lpEntry->nCommands > lpRhs->lpEntry->nCommands ? -1 : 1;
+    }
+  return lpLhs->nLine < lpRhs->nLine ? -1 : lpLhs->nLine > lpRhs->nLine;
+}
+
+/*** ---------------------------- Modules ---------------------------- ***/
+
+/* a language library is loaded once for all the runs using it at the
+   same time, and freed with the last of them */
+
+typedef struct stLangModule
+{
+  struct stLangModule *lpNext;
+  /* NULL while LoadLibraryA runs outside the lock; runs wanting the
+     same library meanwhile wait on s_moduleLoaded */
+  HMODULE hModule;
+  DWORD nRefs;
+  CHAR szPath[1];
+} *LPLANGMODULE;
+
+static SRWLOCK s_moduleLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE s_moduleLoaded = CONDITION_VARIABLE_INIT;
+static LPLANGMODULE s_lpModules;
+
+static HMODULE AcquireModule(LPCSTR lpszPath);
+static BOOL ReleaseModule(HMODULE hModule);
+
+static HMODULE AcquireModule(LPCSTR lpszPath)
+{
+  AcquireSRWLockExclusive(&s_moduleLock);
+  for (LPLANGMODULE iter = s_lpModules; iter != NULL;)
+    {
+      if (strcmp(iter->szPath, lpszPath) != 0)
+        {
+          iter = iter->lpNext;
+        }
+      else if (iter->hModule == NULL)
+        {
+          /* a failed load leaves the list, so look again from the top */
+          SleepConditionVariableSRW(&s_moduleLoaded, &s_moduleLock,
+                                    INFINITE, 0);
+          iter = s_lpModules;
+        }
+      else
+        {
+          ++iter->nRefs;
+          HMODULE ret = iter->hModule;
+          ReleaseSRWLockExclusive(&s_moduleLock);
+          return ret;
+        }
+    }
+
+  LPLANGMODULE lpModule = (LPLANGMODULE)malloc
+    (
+      sizeof(struct stLangModule) + strlen(lpszPath)
+    );
+  if (lpModule == NULL)
+    {
+      ReleaseSRWLockExclusive(&s_moduleLock);
+      return NULL;
+    }
+  strcpy(lpModule->szPath, lpszPath);
+  lpModule->hModule = NULL;
+  lpModule->nRefs = 1;
+  lpModule->lpNext = s_lpModules;
+  s_lpModules = lpModule;
+  ReleaseSRWLockExclusive(&s_moduleLock);
+
+  LONGLONG nTraceStart = TraceBegin();
+  HMODULE ret = LoadLibraryA(lpszPath);
+  DWORD dwLoadError = GetLastError();
+  TraceEnd(nTraceStart, "language", "LoadLibraryA", lpszPath);
+
+  AcquireSRWLockExclusive(&s_moduleLock);
+  lpModule->hModule = ret;
+  if (ret == NULL)
+    {
+      for (LPLANGMODULE *lplpIter = &s_lpModules;
+           *lplpIter != NULL;
+           lplpIter = &(*lplpIter)->lpNext)
+        {
+          if (*lplpIter == lpModule)
+            {
+              *lplpIter = lpModule->lpNext;
+              break;
+            }
+        }
+    }
+  WakeAllConditionVariable(&s_moduleLoaded);
+  ReleaseSRWLockExclusive(&s_moduleLock);
+  if (ret == NULL)
+    {
+      free(lpModule);
+      /* the caller reports why LoadLibraryA failed */
+      SetLastError(dwLoadError);
+    }
+  return ret;
+}
+
+static BOOL ReleaseModule(HMODULE hModule)
+{
+  BOOL bLast = TRUE;
+  AcquireSRWLockExclusive(&s_moduleLock);
+  for (LPLANGMODULE *lplpIter = &s_lpModules;
+       *lplpIter != NULL;
+       lplpIter = &(*lplpIter)->lpNext)
+    {
+      LPLANGMODULE lpModule = *lplpIter;
+      if (lpModule->hModule == hModule)
+        {
+          bLast = --lpModule->nRefs == 0;
+          if (bLast)
+            {
+              *lplpIter = lpModule->lpNext;
+              free(lpModule);
+            }
+          break;
+        }
+    }
+  ReleaseSRWLockExclusive(&s_moduleLock);
+  if (!bLast)
+    {
+      return TRUE;
+    }
+
+  LONGLONG nTraceStart = TraceBegin();
+  BOOL bFreed = FreeLibrary(hModule);
+  TraceEnd(nTraceStart, "language", "FreeLibrary", NULL);
+  return bFreed;
+}
+
+/*** ----------------------- Language registry ---------------------- ***/
+
+/* the lib*.dll modules of the search path, sorted by language id and
+   then by key: the postfix class of the version, 0 for none, above
+   PackSemVer, so one binary search finds the newest compatible one.
+   lib<id>.dll has REGKEY_NONE and sorts behind the versioned ones */
+
+#define LANGPATH_ENV   "PL2W_LANG_PATH"
+#define LANGCACHE_ENV  "PL2W_LANG_CACHE"
+#define LANGCACHE_NAME "pl2w-langs.cache"
+#define LANGCACHE_HEAD "pl2w-langs 1\n"
+#define REGKEY_NONE    ((SEMVERKEY)-1)
+#define REG_MAX_CLASS  0xFFFE
+
+typedef struct
+{
+  LPCSTR lpszLangId;
+  LPCSTR lpszPath;
+  SEMVERKEY nKey;
+  SEMVER ver;
+  /* index of the directory in the search path, the first one wins */
+  DWORD nDir;
+} REGMODULE;
+
+typedef struct
+{
+  struct stArenaBlock *lpArena;
+  REGMODULE *aModules;
+  DWORD nModules;
+  DWORD nCapacity;
+  LPCSTR *alpszPostfixes;
+  WORD nPostfixes;
+} REGISTRY;
+
+/* a directory listing of the cache file, its lines tokenized in place */
+typedef struct stCachedDir
+{
+  struct stCachedDir *lpNext;
+  LPCSTR lpszDir;
+  LPCSTR lpszStamp;
+  /* version, id and file name of each module, in order */
+  LPCSTR *alpszFields;
+  DWORD nModules;
+  BOOL bUsed;
+} CACHEDDIR;
+
+typedef struct
+{
+  CHAR szDir[MAX_PATH];
+  CHAR szFullDir[MAX_PATH];
+  CHAR szStamp[24];
+  BOOL bExists;
+  /* the listing in the cache file, when it is still current */
+  CACHEDDIR *lpCached;
+} SEARCHDIR;
+
+static SRWLOCK s_registryLock = SRWLOCK_INIT;
+static LPSTR s_lpszSearchPath;
+static LPSTR s_lpszCacheFile;
+static REGISTRY *s_lpRegistry;
+
+static REGISTRY *ScanLanguages(void);
+static void DropRegistry(REGISTRY *lpRegistry);
+static BOOL AddModule(REGISTRY *lpRegistry,
+                      DWORD nDir,
+                      LPCSTR lpszDir,
+                      LPCSTR lpszFileName,
+                      LPCSTR lpszLangId,
+                      LPCSTR lpszVersion);
+static BOOL SplitModuleName(LPCSTR lpszFileName,
+                            LPSTR lpszLangId,
+                            LPSTR lpszVersion);
+static BOOL ListDirectory(REGISTRY *lpRegistry,
+                          DWORD nDir,
+                          LPCSTR lpszDir,
+                          FILE *fpCache);
+static CACHEDDIR *ReadLangCache(LPCSTR lpszCacheFile, LPSTR *lplpszText);
+static int CompareRegModules(const void *lpLhs, const void *lpRhs);
+static DWORD RegFindLangId(REGISTRY *lpRegistry,
+                           LPCSTR lpszLangId,
+                           BOOL bPast);
+static DWORD RegLowerBound(REGISTRY *lpRegistry,
+                           DWORD nLow,
+                           DWORD nHigh,
+                           SEMVERKEY nKey);
+
+BOOL SetLanguagePath(LPCSTR lpszSearchPath, LPCSTR lpszCacheFile)
+{
+  LPSTR lpszPath = NULL;
+  LPSTR lpszCache = NULL;
+  if (lpszSearchPath != NULL)
+    {
+      lpszPath = (LPSTR)malloc(strlen(lpszSearchPath) + 1);
+    }
+  if (lpszCacheFile != NULL)
+    {
+      lpszCache = (LPSTR)malloc(strlen(lpszCacheFile) + 1);
+    }
+  if ((lpszSearchPath != NULL && lpszPath == NULL)
+      || (lpszCacheFile != NULL && lpszCache == NULL))
+    {
+      free(lpszPath);
+      free(lpszCache);
+      return FALSE;
+    }
+  if (lpszPath != NULL)
+    {
+      strcpy(lpszPath, lpszSearchPath);
+    }
+  if (lpszCache != NULL)
+    {
+      strcpy(lpszCache, lpszCacheFile);
+    }
+
+  AcquireSRWLockExclusive(&s_registryLock);
+  free(s_lpszSearchPath);
+  free(s_lpszCacheFile);
+  s_lpszSearchPath = lpszPath;
+  s_lpszCacheFile = lpszCache;
+  REGISTRY *lpOld = s_lpRegistry;
+  s_lpRegistry = NULL;
+  ReleaseSRWLockExclusive(&s_registryLock);
+  DropRegistry(lpOld);
+  return TRUE;
+}
+
+BOOL ResolveLanguage(LPCSTR lpszLangId,
+                     SEMVER ver,
+                     LPSTR lpszPath,
+                     SEMVER *lpFound)
+{
+  AcquireSRWLockShared(&s_registryLock);
+  REGISTRY *lpRegistry = s_lpRegistry;
+  ReleaseSRWLockShared(&s_registryLock);
+  if (lpRegistry == NULL)
+    {
+      AcquireSRWLockExclusive(&s_registryLock);
+      if (s_lpRegistry == NULL)
+        {
+          s_lpRegistry = ScanLanguages();
+        }
+      ReleaseSRWLockExclusive(&s_registryLock);
+    }
+
+  AcquireSRWLockShared(&s_registryLock);
+  REGMODULE *lpMatch = NULL;
+  lpRegistry = s_lpRegistry;
+  if (lpRegistry != NULL)
+    {
+      /* the modules of lpszLangId are [nLow, nHigh) */
+      DWORD nLow = RegFindLangId(lpRegistry, lpszLangId, FALSE);
+      DWORD nHigh = RegFindLangId(lpRegistry, lpszLangId, TRUE);
+
+      WORD nClass = 0;
+      if (ver.szPostfix[0] != '\0')
+        {
+          nClass = REG_MAX_CLASS + 1;
+          for (WORD i = 0; i < lpRegistry->nPostfixes; i++)
+            {
+              if (!strcmp(lpRegistry->alpszPostfixes[i], ver.szPostfix))
+                {
+                  nClass = i + 1;
+                  break;
+                }
+            }
+        }
+
+      /* the newest compatible one is the last before the next major
+         version, or the exact one */
+      SEMVERKEY nKey = (SEMVERKEY)nClass << 48 | PackSemVer(ver);
+      if (nClass <= REG_MAX_CLASS && nLow < nHigh)
+        {
+          SEMVERKEY nBound = ver.bExact ? nKey + 1
+                                        : ((nKey >> 32) + 1) << 32;
+          DWORD nFound = RegLowerBound(lpRegistry, nLow, nHigh, nBound);
+          SEMVERKEY nLastKey = nFound > nLow
+            ? lpRegistry->aModules[nFound - 1].nKey
+            : REGKEY_NONE;
+          if (nLastKey != REGKEY_NONE
+              && IsCompatibleKey(nKey, nLastKey, ver.bExact))
+            {
+              /* the first directory providing that version */
+              nFound = RegLowerBound(lpRegistry, nLow, nHigh, nLastKey);
+              lpMatch = &lpRegistry->aModules[nFound];
+            }
+        }
+      if (lpMatch == NULL && nLow < nHigh
+          && lpRegistry->aModules[nHigh - 1].nKey == REGKEY_NONE)
+        {
+          lpMatch = &lpRegistry->aModules
+            [RegLowerBound(lpRegistry, nLow, nHigh, REGKEY_NONE)];
+        }
+    }
+  if (lpMatch != NULL)
+    {
+      strcpy(lpszPath, lpMatch->lpszPath);
+      if (lpFound != NULL)
+        {
+          *lpFound = lpMatch->ver;
+        }
+    }
+  ReleaseSRWLockShared(&s_registryLock);
+  return lpMatch != NULL;
+}
+
+static REGISTRY *ScanLanguages(void)
+{
+  LPCSTR lpszSearchPath = s_lpszSearchPath;
+  if (lpszSearchPath == NULL)
+    {
+      lpszSearchPath = getenv(LANGPATH_ENV);
+    }
+  if (lpszSearchPath == NULL || lpszSearchPath[0] == '\0')
+    {
+      lpszSearchPath = ".";
+    }
+  CHAR szCacheFile[MAX_PATH];
+  LPCSTR lpszCacheFile = s_lpszCacheFile;
+  if (lpszCacheFile == NULL)
+    {
+      lpszCacheFile = getenv(LANGCACHE_ENV);
+    }
+  if (lpszCacheFile == NULL)
+    {
+      DWORD cchTemp = GetTempPathA(MAX_PATH, szCacheFile);
+      if (cchTemp == 0 || cchTemp + sizeof(LANGCACHE_NAME) > MAX_PATH)
+        {
+          szCacheFile[0] = '\0';
+        }
+      else
+        {
+          strcat(szCacheFile, LANGCACHE_NAME);
+        }
+      lpszCacheFile = szCacheFile;
+    }
+
+  DWORD nDirs = 1;
+  for (LPCSTR pc = strchr(lpszSearchPath, ';');
+       pc != NULL;
+       pc = strchr(pc + 1, ';'))
+    {
+      nDirs++;
+    }
+  REGISTRY *ret = (REGISTRY*)calloc(1, sizeof(REGISTRY));
+  SEARCHDIR *aDirs = (SEARCHDIR*)calloc(nDirs, sizeof(SEARCHDIR));
+  if (ret == NULL || aDirs == NULL)
+    {
+      free(ret);
+      free(aDirs);
+      return NULL;
+    }
+  LONGLONG nTraceStart = TraceBegin();
+  LPSTR lpszCacheText = NULL;
+  CACHEDDIR *lpCached = lpszCacheFile[0] != '\0'
+    ? ReadLangCache(lpszCacheFile, &lpszCacheText)
+    : NULL;
+
+  /* a directory whose modification time is still the cached one is
+     not listed again */
+  BOOL bChanged = lpCached == NULL;
+  LPCSTR pc = lpszSearchPath;
+  for (DWORD nDir = 0; nDir < nDirs; nDir++)
+    {
+      SEARCHDIR *lpDir = &aDirs[nDir];
+      SIZE_T cchDir = strcspn(pc, ";");
+      LPCSTR pcDir = pc;
+      pc += cchDir + (pc[cchDir] == ';');
+      WIN32_FILE_ATTRIBUTE_DATA dirData;
+      if (cchDir == 0 || cchDir >= MAX_PATH)
+        {
+          continue;
+        }
+      memcpy(lpDir->szDir, pcDir, cchDir);
+      lpDir->szDir[cchDir] = '\0';
+      DWORD cchFull = GetFullPathNameA(lpDir->szDir, MAX_PATH,
+                                       lpDir->szFullDir, NULL);
+      if (cchFull == 0 || cchFull >= MAX_PATH
+          || !GetFileAttributesExA(lpDir->szDir, GetFileExInfoStandard,
+                                   &dirData))
+        {
+          continue;
+        }
+      lpDir->bExists = TRUE;
+      sprintf(lpDir->szStamp, "%08lx%08lx",
+              (unsigned long)dirData.ftLastWriteTime.dwHighDateTime,
+              (unsigned long)dirData.ftLastWriteTime.dwLowDateTime);
+      for (CACHEDDIR *iter = lpCached; iter != NULL; iter = iter->lpNext)
+        {
+          if (!iter->bUsed && !strcmp(iter->lpszDir, lpDir->szFullDir))
+            {
+              iter->bUsed = TRUE;
+              if (!strcmp(iter->lpszStamp, lpDir->szStamp))
+                {
+                  lpDir->lpCached = iter;
+                }
+              break;
+            }
+        }
+      bChanged = bChanged || lpDir->lpCached == NULL;
+    }
+
+  /* the new cache is written next to the old one and replaces it once
+     complete, so a concurrent reader never sees half of it; every writer
+     uses its own file, as other processes and threads share the cache */
+  CHAR szNewCache[MAX_PATH];
+  FILE *fpCache = NULL;
+  if (bChanged && lpszCacheFile[0] != '\0'
+      && strlen(lpszCacheFile) + sizeof(".ffffffff.ffffffff.new") <= MAX_PATH)
+    {
+      sprintf(szNewCache, "%s.%lx.%lx.new", lpszCacheFile,
+              (unsigned long)GetCurrentProcessId(),
+              (unsigned long)GetCurrentThreadId());
+      fpCache = fopen(szNewCache, "w");
+      if (fpCache != NULL)
+        {
+          fputs(LANGCACHE_HEAD, fpCache);
+        }
+    }
+
+  BOOL bOk = TRUE;
+  for (DWORD nDir = 0; bOk && nDir < nDirs; nDir++)
+    {
+      SEARCHDIR *lpDir = &aDirs[nDir];
+      if (!lpDir->bExists)
+        {
+          continue;
+        }
+      if (fpCache != NULL)
+        {
+          fprintf(fpCache, "D\t%s\t%s\n", lpDir->szStamp, lpDir->szFullDir);
+        }
+      if (lpDir->lpCached == NULL)
+        {
+          bOk = ListDirectory(ret, nDir, lpDir->szDir, fpCache);
+          continue;
+        }
+      for (DWORD i = 0; bOk && i < lpDir->lpCached->nModules; i++)
+        {
+          LPCSTR *alpszFields = &lpDir->lpCached->alpszFields[i * 3];
+          bOk = AddModule(ret, nDir, lpDir->szDir, alpszFields[2],
+                          alpszFields[1], alpszFields[0]);
+          if (fpCache != NULL)
+            {
+              fprintf(fpCache, "M\t%s\t%s\t%s\n", alpszFields[0],
+                      alpszFields[1], alpszFields[2]);
+            }
+        }
+    }
+
+  /* listings of directories other search paths use stay cached */
+  for (CACHEDDIR *iter = lpCached; iter != NULL; iter = iter->lpNext)
+    {
+      if (fpCache == NULL || iter->bUsed)
+        {
+          continue;
+        }
+      fprintf(fpCache, "D\t%s\t%s\n", iter->lpszStamp, iter->lpszDir);
+      for (DWORD i = 0; i < iter->nModules; i++)
+        {
+          LPCSTR *alpszFields = &iter->alpszFields[i * 3];
+          fprintf(fpCache, "M\t%s\t%s\t%s\n", alpszFields[0],
+                  alpszFields[1], alpszFields[2]);
+        }
+    }
+  while (lpCached != NULL)
+    {
+      CACHEDDIR *lpNext = lpCached->lpNext;
+      free(lpCached->alpszFields);
+      free(lpCached);
+      lpCached = lpNext;
+    }
+  free(lpszCacheText);
+  free(aDirs);
+
+  if (fpCache != NULL)
+    {
+      BOOL bWritten = !ferror(fpCache);
+      bWritten = fclose(fpCache) == 0 && bWritten;
+      if (!bOk || !bWritten
+          || !MoveFileExA(szNewCache, lpszCacheFile,
+                          MOVEFILE_REPLACE_EXISTING))
+        {
+          DeleteFileA(szNewCache);
+        }
+    }
+  if (!bOk)
+    {
+      DropRegistry(ret);
+      ret = NULL;
+    }
+  else
+    {
+      qsort(ret->aModules, ret->nModules, sizeof(REGMODULE),
+            CompareRegModules);
+    }
+  TraceEnd(nTraceStart, "language", "ScanLanguages", NULL);
+  return ret;
+}
+
+static void DropRegistry(REGISTRY *lpRegistry)
+{
+  if (lpRegistry == NULL)
+    {
+      return;
+    }
+  ArenaFree(lpRegistry->lpArena);
+  free(lpRegistry->aModules);
+  free(lpRegistry->alpszPostfixes);
+  free(lpRegistry);
+}
+
+static BOOL AddModule(REGISTRY *lpRegistry,
+                      DWORD nDir,
+                      LPCSTR lpszDir,
+                      LPCSTR lpszFileName,
+                      LPCSTR lpszLangId,
+                      LPCSTR lpszVersion)
+{
+  /* a name or version that does not parse is not a language module */
+  SEMVER ver = ZeroVersion();
+  SEMVERKEY nKey = REGKEY_NONE;
+  if (strcmp(lpszVersion, "-") != 0)
+    {
+      LONGLONG aErrorSpace[(ERROR_BUFFER_SIZE(1) + 7) / 8];
+      LPERROR lpError = InitError(aErrorSpace, sizeof(aErrorSpace), TRUE);
+      ver = ParseSemVer(lpszVersion, lpError);
+      if (IsError(lpError) || ver.bExact)
+        {
+          return TRUE;
+        }
+      WORD nClass = 0;
+      if (ver.szPostfix[0] != '\0')
+        {
+          while (nClass < lpRegistry->nPostfixes
+                 && strcmp(lpRegistry->alpszPostfixes[nClass],
+                           ver.szPostfix) != 0)
+            {
+              nClass++;
+            }
+          if (nClass == lpRegistry->nPostfixes)
+            {
+              if (nClass == REG_MAX_CLASS)
+                {
+                  return TRUE;
+                }
+              LPCSTR *alpszPostfixes = (LPCSTR*)realloc
+                (
+                  lpRegistry->alpszPostfixes,
+                  (nClass + 1) * sizeof(LPCSTR)
+                );
+              LPSTR lpszPostfix = (LPSTR)ArenaAlloc(&lpRegistry->lpArena,
+                                                    SEMVER_POSTFIX_LEN);
+              if (alpszPostfixes == NULL || lpszPostfix == NULL)
+                {
+                  if (alpszPostfixes != NULL)
+                    {
+                      lpRegistry->alpszPostfixes = alpszPostfixes;
+                    }
+                  return FALSE;
+                }
+              memcpy(lpszPostfix, ver.szPostfix, SEMVER_POSTFIX_LEN);
+              alpszPostfixes[nClass] = lpszPostfix;
+              lpRegistry->alpszPostfixes = alpszPostfixes;
+              lpRegistry->nPostfixes++;
+            }
+          nClass++;
+        }
+      nKey = (SEMVERKEY)nClass << 48 | PackSemVer(ver);
+    }
+
+  SIZE_T cchDir = strlen(lpszDir);
+  BOOL bSlash = lpszDir[cchDir - 1] == '/' || lpszDir[cchDir - 1] == '\\';
+  SIZE_T cchPath = cchDir + !bSlash + strlen(lpszFileName);
+  if (cchPath >= MAX_PATH)
+    {
+      return TRUE;
+    }
+  if (lpRegistry->nModules == lpRegistry->nCapacity)
+    {
+      DWORD nCapacity = lpRegistry->nCapacity != 0
+        ? lpRegistry->nCapacity * 2
+        : 64;
+      REGMODULE *aModules = (REGMODULE*)realloc
+        (
+          lpRegistry->aModules,
+          nCapacity * sizeof(REGMODULE)
+        );
+      if (aModules == NULL)
+        {
+          return FALSE;
+        }
+      lpRegistry->aModules = aModules;
+      lpRegistry->nCapacity = nCapacity;
+    }
+  LPSTR lpszPath = (LPSTR)ArenaAlloc(&lpRegistry->lpArena, cchPath + 1);
+  LPSTR lpszId = (LPSTR)ArenaAlloc(&lpRegistry->lpArena,
+                                   strlen(lpszLangId) + 1);
+  if (lpszPath == NULL || lpszId == NULL)
+    {
+      return FALSE;
+    }
+  sprintf(lpszPath, "%s%s%s", lpszDir, bSlash ? "" : "/", lpszFileName);
+  strcpy(lpszId, lpszLangId);
+
+  REGMODULE *lpModule = &lpRegistry->aModules[lpRegistry->nModules++];
+  lpModule->lpszLangId = lpszId;
+  lpModule->lpszPath = lpszPath;
+  lpModule->nKey = nKey;
+  lpModule->ver = ver;
+  lpModule->nDir = nDir;
+  return TRUE;
+}
+
+static BOOL SplitModuleName(LPCSTR lpszFileName,
+                            LPSTR lpszLangId,
+                            LPSTR lpszVersion)
+{
+  /* lib<id>-<semver>.dll splits at the first `-` a version follows,
+     anything else lib<id>.dll is unversioned */
+  SIZE_T cchName = strlen(lpszFileName);
+  if (cchName <= sizeof("lib.dll") - 1
+      || _strnicmp(lpszFileName, "lib", 3) != 0
+      || _stricmp(lpszFileName + cchName - 4, ".dll") != 0)
+    {
+      return FALSE;
+    }
+  SIZE_T cchStem = cchName - sizeof("lib.dll") + 1;
+  memcpy(lpszLangId, lpszFileName + 3, cchStem);
+  lpszLangId[cchStem] = '\0';
+  strcpy(lpszVersion, "-");
+
+  LONGLONG aErrorSpace[(ERROR_BUFFER_SIZE(1) + 7) / 8];
+  LPERROR lpError = InitError(aErrorSpace, sizeof(aErrorSpace), TRUE);
+  for (LPSTR pc = strchr(lpszLangId, '-'); pc != NULL; pc = strchr(pc + 1, '-'))
+    {
+      if (pc == lpszLangId || !isdigit((int)pc[1]))
+        {
+          continue;
+        }
+      lpError->nLine = 0;
+      ParseSemVer(pc + 1, lpError);
+      if (!IsError(lpError))
+        {
+          strcpy(lpszVersion, pc + 1);
+          *pc = '\0';
+          break;
+        }
+    }
+  return TRUE;
+}
+
+static BOOL ListDirectory(REGISTRY *lpRegistry,
+                          DWORD nDir,
+                          LPCSTR lpszDir,
+                          FILE *fpCache)
+{
+  CHAR szPattern[MAX_PATH];
+  if (strlen(lpszDir) + sizeof("/lib*.dll") > MAX_PATH)
+    {
+      return TRUE;
+    }
+  sprintf(szPattern, "%s/lib*.dll", lpszDir);
+
+  WIN32_FIND_DATAA findData;
+  HANDLE hFind = FindFirstFileA(szPattern, &findData);
+  if (hFind == INVALID_HANDLE_VALUE)
+    {
+      return TRUE;
+    }
+  BOOL bOk = TRUE;
+  do
+    {
+      CHAR szLangId[MAX_PATH];
+      CHAR szVersion[MAX_PATH];
+      if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+          || strpbrk(findData.cFileName, "\t\n") != NULL
+          || !SplitModuleName(findData.cFileName, szLangId, szVersion))
+        {
+          continue;
+        }
+      bOk = AddModule(lpRegistry, nDir, lpszDir, findData.cFileName,
+                      szLangId, szVersion);
+      if (fpCache != NULL)
+        {
+          fprintf(fpCache, "M\t%s\t%s\t%s\n", szVersion, szLangId,
+                  findData.cFileName);
+        }
+    }
+  while (bOk && FindNextFileA(hFind, &findData));
+  FindClose(hFind);
+  return bOk;
+}
+
+static CACHEDDIR *ReadLangCache(LPCSTR lpszCacheFile, LPSTR *lplpszText)
+{
+  *lplpszText = NULL;
+  FILE *fp = fopen(lpszCacheFile, "rb");
+  if (fp == NULL)
+    {
+      return NULL;
+    }
+  LPSTR lpszText = NULL;
+  SIZE_T cbText = 0;
+  for (;;)
+    {
+      LPSTR lpszMore = (LPSTR)realloc(lpszText, cbText + SOURCE_READ_CHUNK + 1);
+      if (lpszMore == NULL)
+        {
+          break;
+        }
+      lpszText = lpszMore;
+      SIZE_T cbRead = fread(lpszText + cbText, 1, SOURCE_READ_CHUNK, fp);
+      cbText += cbRead;
+      if (cbRead < SOURCE_READ_CHUNK)
+        {
+          break;
+        }
+    }
+  BOOL bRead = lpszText != NULL && !ferror(fp) && feof(fp);
+  fclose(fp);
+  if (!bRead
+      || cbText < sizeof(LANGCACHE_HEAD) - 1
+      || memcmp(lpszText, LANGCACHE_HEAD, sizeof(LANGCACHE_HEAD) - 1) != 0)
+    {
+      free(lpszText);
+      return NULL;
+    }
+  lpszText[cbText] = '\0';
+
+  /* a malformed cache is dropped as a whole and the directories are
+     listed again */
+  CACHEDDIR *ret = NULL;
+  CACHEDDIR **lplpLast = &ret;
+  CACHEDDIR *lpDir = NULL;
+  DWORD nCapacity = 0;
+  BOOL bOk = TRUE;
+  LPSTR pc = lpszText + sizeof(LANGCACHE_HEAD) - 1;
+  while (bOk && *pc != '\0')
+    {
+      LPSTR pcEnd = strchr(pc, '\n');
+      if (pcEnd == NULL)
+        {
+          bOk = FALSE;
+          break;
+        }
+      *pcEnd = '\0';
+      LPSTR alpszFields[4];
+      DWORD nFields = 0;
+      for (LPSTR pcField = pc; nFields < 4; nFields++)
+        {
+          alpszFields[nFields] = pcField;
+          pcField = strchr(pcField, '\t');
+          if (pcField == NULL)
+            {
+              nFields++;
+              break;
+            }
+          *pcField++ = '\0';
+        }
+
+      if (!strcmp(alpszFields[0], "D") && nFields == 3)
+        {
+          lpDir = (CACHEDDIR*)calloc(1, sizeof(CACHEDDIR));
+          if (lpDir == NULL)
+            {
+              bOk = FALSE;
+              break;
+            }
+          lpDir->lpszStamp = alpszFields[1];
+          lpDir->lpszDir = alpszFields[2];
+          *lplpLast = lpDir;
+          lplpLast = &lpDir->lpNext;
+          nCapacity = 0;
+        }
+      else if (!strcmp(alpszFields[0], "M") && nFields == 4 && lpDir != NULL)
+        {
+          if (lpDir->nModules == nCapacity)
+            {
+              nCapacity = nCapacity != 0 ? nCapacity * 2 : 16;
+              LPCSTR *alpszMore = (LPCSTR*)realloc
+                (
+                  lpDir->alpszFields,
+                  nCapacity * 3 * sizeof(LPCSTR)
+                );
+              if (alpszMore == NULL)
+                {
+                  bOk = FALSE;
+                  break;
+                }
+              lpDir->alpszFields = alpszMore;
+            }
+          memcpy(&lpDir->alpszFields[lpDir->nModules * 3], &alpszFields[1],
+                 3 * sizeof(LPCSTR));
+          lpDir->nModules++;
+        }
+      else
+        {
+          bOk = FALSE;
+        }
+      pc = pcEnd + 1;
+    }
+
+  if (!bOk)
+    {
+      while (ret != NULL)
+        {
+          CACHEDDIR *lpNext = ret->lpNext;
+          free(ret->alpszFields);
+          free(ret);
+          ret = lpNext;
+        }
+      free(lpszText);
+      return NULL;
+    }
+  *lplpszText = lpszText;
+  return ret;
+}
+
+static int CompareRegModules(const void *lpLhs, const void *lpRhs)
+{
+  const REGMODULE *lpA = (const REGMODULE*)lpLhs;
+  const REGMODULE *lpB = (const REGMODULE*)lpRhs;
+  int nCmp = strcmp(lpA->lpszLangId, lpB->lpszLangId);
+  if (nCmp != 0)
+    {
+      return nCmp;
+    }
+  if (lpA->nKey != lpB->nKey)
+    {
+      return lpA->nKey < lpB->nKey ? -1 : 1;
+    }
+  return (lpA->nDir > lpB->nDir) - (lpA->nDir < lpB->nDir);
+}
+
+/* the first module of lpszLangId, or the first past them if bPast */
+static DWORD RegFindLangId(REGISTRY *lpRegistry,
+                           LPCSTR lpszLangId,
+                           BOOL bPast)
+{
+  DWORD nLow = 0;
+  DWORD nHigh = lpRegistry->nModules;
+  while (nLow < nHigh)
+    {
+      DWORD nMid = nLow + (nHigh - nLow) / 2;
+      int nCmp = strcmp(lpRegistry->aModules[nMid].lpszLangId, lpszLangId);
+      if (nCmp < 0 || (bPast && nCmp == 0))
+        {
+          nLow = nMid + 1;
+        }
+      else
+        {
+          nHigh = nMid;
+        }
+    }
+  return nLow;
+}
+
+/* the first module of [nLow, nHigh) with a key not below nKey */
+static DWORD RegLowerBound(REGISTRY *lpRegistry,
+                           DWORD nLow,
+                           DWORD nHigh,
+                           SEMVERKEY nKey)
+{
+  while (nLow < nHigh)
+    {
+      DWORD nMid = nLow + (nHigh - nLow) / 2;
+      if (lpRegistry->aModules[nMid].nKey < nKey)
+        {
+          nLow = nMid + 1;
+        }
+      else
+        {
+          nHigh = nMid;
+        }
+    }
+  return nLow;
+}
+
+/*** ------------------------- Language cache ------------------------- ***/
+
+/* the LPLANGUAGE a library builds is kept for later runs asking for the
+   same language and version, which then only call lpfnInitProc and
+   lpfnAtexitProc; an entry lives until it is evicted and no run is
+   using it any more */
+
+typedef struct stLangEntry
+{
+  struct stLangEntry *lpNext;
+  HMODULE hModule;
+  LPLANGUAGE lpLanguage;
+  BOOL bOwnLanguage;
+  LPHANDLERINDEX lpIndex;
+  /* an EasyLoad language loaded lazily has NULL handler procs, and
+     its EL<name> symbols are published here as runs first dispatch
+     them; nResolved counts them */
+  PVOID volatile *alpLazyProcs;
+  volatile LONG nResolved;
+  SEMVER langVer;
+  DWORD nRefs;
+  BOOL bEvicted;
+  /* listed while its library is still being loaded, outside the lock;
+     runs asking for it meanwhile wait on s_languageLoaded */
+  BOOL bLoading;
+  CHAR szLangId[1];
+} *LPLANGENTRY;
+
+static SRWLOCK s_languageLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE s_languageLoaded = CONDITION_VARIABLE_INIT;
+static LPLANGENTRY s_lpLanguages;
+
+static LPLANGENTRY AcquireLanguage(LPCSTR lpszLangId,
+                                   SEMVER langVer,
+                                   BOOL bLazy,
+                                   SRCINFO srcInfo,
+                                   LPERROR lpError);
+static void ReleaseLanguage(LPLANGENTRY lpEntry);
+static LPLANGENTRY CreateLangEntry(LPCSTR lpszLangId,
+                                   SEMVER langVer,
+                                   SRCINFO srcInfo,
+                                   LPERROR lpError);
+static BOOL LoadLangEntry(LPLANGENTRY lpEntry,
+                          BOOL bLazy,
+                          SRCINFO srcInfo,
+                          LPERROR lpError);
+static void ClearLangEntry(LPLANGENTRY lpEntry);
+static void DropLangEntry(LPLANGENTRY lpEntry);
+static BOOL SameVersion(SEMVER lhs, SEMVER rhs);
+static LPLANGUAGE EasyLoad(HMODULE hModule,
+                           LPCSTR *aszCmdNames,
+                           BOOL bLazy,
+                           LPERROR lpError);
+static LPSINVPROC EasyLoadProc(HMODULE hModule,
+                               LPCSTR lpszCmdName,
+                               LPERROR lpError);
+static LPSINVPROC ResolveLazyProc(LPLANGENTRY lpEntry,
+                                  BINDING *lpBinding,
+                                  SRCINFO srcInfo,
+                                  LPERROR lpError);
+static BOOL ResolveAllLazy(LPLANGENTRY lpEntry,
+                           SRCINFO srcInfo,
+                           LPERROR lpError);
+
+DWORD EvictLanguages(LPCSTR lpszLangId)
+{
+  DWORD nEvicted = 0;
+  LPLANGENTRY lpUnused = NULL;
+  AcquireSRWLockExclusive(&s_languageLock);
+  LPLANGENTRY *lplpIter = &s_lpLanguages;
+  while (*lplpIter != NULL)
+    {
+      LPLANGENTRY lpEntry = *lplpIter;
+      if (lpszLangId != NULL && strcmp(lpEntry->szLangId, lpszLangId) != 0)
+        {
+          lplpIter = &lpEntry->lpNext;
+          continue;
+        }
+      *lplpIter = lpEntry->lpNext;
+      lpEntry->bEvicted = TRUE;
+      ++nEvicted;
+      /* an entry still in use goes with its last run */
+      if (lpEntry->nRefs == 0)
+        {
+          lpEntry->lpNext = lpUnused;
+          lpUnused = lpEntry;
+        }
+    }
+  ReleaseSRWLockExclusive(&s_languageLock);
+
+  while (lpUnused != NULL)
+    {
+      LPLANGENTRY lpNext = lpUnused->lpNext;
+      DropLangEntry(lpUnused);
+      lpUnused = lpNext;
+    }
+  return nEvicted;
+}
+
+static LPLANGENTRY AcquireLanguage(LPCSTR lpszLangId,
+                                   SEMVER langVer,
+                                   BOOL bLazy,
+                                   SRCINFO srcInfo,
+                                   LPERROR lpError)
+{
+  /* the first run asking for a language lists it before loading it
+     outside the lock, so other languages load meanwhile and later runs
+     wait for this one instead of loading it a second time */
+  LPLANGENTRY ret = NULL;
+  AcquireSRWLockExclusive(&s_languageLock);
+  for (LPLANGENTRY iter = s_lpLanguages; iter != NULL;)
+    {
+      if (strcmp(iter->szLangId, lpszLangId) != 0
+          || !SameVersion(iter->langVer, langVer))
+        {
+          iter = iter->lpNext;
+        }
+      else if (iter->bLoading)
+        {
+          /* a failed load leaves the list, so look again from the top */
+          SleepConditionVariableSRW(&s_languageLoaded, &s_languageLock,
+                                    INFINITE, 0);
+          iter = s_lpLanguages;
+        }
+      else
+        {
+          ++iter->nRefs;
+          ret = iter;
+          break;
+        }
+    }
+  BOOL bLoader = FALSE;
+  if (ret == NULL)
+    {
+      ret = CreateLangEntry(lpszLangId, langVer, srcInfo, lpError);
+      if (ret != NULL)
+        {
+          ret->lpNext = s_lpLanguages;
+          s_lpLanguages = ret;
+          bLoader = TRUE;
+        }
+    }
+  ReleaseSRWLockExclusive(&s_languageLock);
+
+  if (bLoader)
+    {
+      BOOL bLoaded = LoadLangEntry(ret, bLazy, srcInfo, lpError);
+      BOOL bUnused = FALSE;
+      AcquireSRWLockExclusive(&s_languageLock);
+      ret->bLoading = FALSE;
+      if (!bLoaded)
+        {
+          /* the runs waiting for it try for themselves and report
+             their own errors */
+          for (LPLANGENTRY *lplpIter = &s_lpLanguages;
+               !ret->bEvicted && *lplpIter != NULL;
+               lplpIter = &(*lplpIter)->lpNext)
+            {
+              if (*lplpIter == ret)
+                {
+                  *lplpIter = ret->lpNext;
+                  break;
+                }
+            }
+          bUnused = --ret->nRefs == 0;
+        }
+      WakeAllConditionVariable(&s_languageLoaded);
+      ReleaseSRWLockExclusive(&s_languageLock);
+      if (!bLoaded)
+        {
+          if (bUnused)
+            {
+              DropLangEntry(ret);
+            }
+          return NULL;
+        }
+    }
+
+  /* a run loading eagerly still fails on a missing symbol up front */
+  if (ret != NULL && !bLazy && !ResolveAllLazy(ret, srcInfo, lpError))
+    {
+      ReleaseLanguage(ret);
+      return NULL;
+    }
+  return ret;
+}
+
+static void ReleaseLanguage(LPLANGENTRY lpEntry)
+{
+  AcquireSRWLockExclusive(&s_languageLock);
+  BOOL bUnused = --lpEntry->nRefs == 0 && lpEntry->bEvicted;
+  ReleaseSRWLockExclusive(&s_languageLock);
+  if (bUnused)
+    {
+      DropLangEntry(lpEntry);
+    }
+}
+
+static LPLANGENTRY CreateLangEntry(LPCSTR lpszLangId,
+                                   SEMVER langVer,
+                                   SRCINFO srcInfo,
+                                   LPERROR lpError)
+{
+  if (strlen(lpszLangId) > MAX_PATH - sizeof("./lib.dll"))
+    {
+      ErrPrintf(lpError, PL2ERR_LOAD_LANG, srcInfo, NULL,
+                "language: language name `%s` too long", lpszLangId);
+      return NULL;
+    }
+
+  LPLANGENTRY ret = (LPLANGENTRY)malloc
+    (
+      sizeof(struct stLangEntry) + strlen(lpszLangId)
+    );
+  if (ret == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, srcInfo, NULL,
+                "language: cannot allocate memory for language cache");
+      return NULL;
+    }
+  strcpy(ret->szLangId, lpszLangId);
+  ret->langVer = langVer;
+  ret->nRefs = 1;
+  ret->bEvicted = FALSE;
+  ret->bLoading = TRUE;
+  ret->hModule = NULL;
+  ret->lpLanguage = NULL;
+  ret->bOwnLanguage = FALSE;
+  ret->lpIndex = NULL;
+  ret->alpLazyProcs = NULL;
+  ret->nResolved = 0;
+  return ret;
+}
+
+static BOOL LoadLangEntry(LPLANGENTRY lpEntry,
+                          BOOL bLazy,
+                          SRCINFO srcInfo,
+                          LPERROR lpError)
+{
+  LPCSTR lpszLangId = lpEntry->szLangId;
+  CHAR szPath[MAX_PATH];
+  if (!ResolveLanguage(lpszLangId, lpEntry->langVer, szPath, NULL))
+    {
+      strcpy(szPath, "./lib");
+      strcat(szPath, lpszLangId);
+      strcat(szPath, ".dll");
+    }
+
+  lpEntry->hModule = AcquireModule(szPath);
+  if (lpEntry->hModule == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_LOAD_LANG, srcInfo, NULL,
+                "language: cannot load language library `%s`: %ld",
+                lpszLangId, GetLastError());
+      return FALSE;
+    }
+
+  LPLOADPROC lpfnLoadProc = (LPLOADPROC)GetProcAddress
+    (
+      lpEntry->hModule,
+      "LoadLanguageExtension"
+    );
+  if (lpfnLoadProc == NULL)
+    {
+      LPEASYLOADPROC lpfnEasyLoadProc = (LPEASYLOADPROC)GetProcAddress
+        (
+          lpEntry->hModule,
+          "EasyLoadLanguageExtension"
+        );
+
+      if (lpfnEasyLoadProc == NULL)
+        {
+          ErrPrintf(lpError, PL2ERR_LOAD_LANG, srcInfo, NULL,
+                    "language: cannot locate `%s` or `%s` "
+                    "on library `%s`: %ld",
+                    "LoadLanguageExtension",
+                    "EasyLoadLanguageExtension",
+                    lpszLangId,
+                    GetLastError());
+          ClearLangEntry(lpEntry);
+          return FALSE;
+        }
+
+      LONGLONG nTraceStart = TraceBegin();
+      lpEntry->lpLanguage = EasyLoad(lpEntry->hModule,
+                                     lpfnEasyLoadProc(),
+                                     bLazy,
+                                     lpError);
+      TraceEnd(nTraceStart, "language", "EasyLoad", lpszLangId);
+      lpEntry->bOwnLanguage = TRUE;
+      bLazy = bLazy && lpEntry->lpLanguage != NULL;
+    }
+  else
+    {
+      LONGLONG nTraceStart = TraceBegin();
+      lpEntry->lpLanguage = lpfnLoadProc(lpEntry->langVer, lpError);
+      TraceEnd(nTraceStart, "language", "LoadLanguageExtension", lpszLangId);
+      bLazy = FALSE;
+    }
+  if (IsError(lpError))
+    {
+      /* a lazy error's format may be in the library unloaded below */
+      ErrorReason(lpError);
+      lpError->srcInfo = srcInfo;
+      ClearLangEntry(lpEntry);
+      return FALSE;
+    }
+
+  if (lpEntry->lpLanguage != NULL)
+    {
+      /* only a language that knows of the features exports them */
+      LPFEATURESPROC lpfnFeaturesProc = (LPFEATURESPROC)GetProcAddress
+        (
+          lpEntry->hModule,
+          "LoadLanguageFeatures"
+        );
+      LPLANGFEATURES lpFeatures = lpfnFeaturesProc != NULL
+        ? lpfnFeaturesProc(lpEntry->lpLanguage) : NULL;
+      lpEntry->lpIndex = CreateHandlerIndex(lpEntry->lpLanguage, lpFeatures);
+      if (lpEntry->lpIndex != NULL && bLazy)
+        {
+          lpEntry->alpLazyProcs = (PVOID volatile*)calloc
+            (
+              lpEntry->lpIndex->nSinvokeCount + 1,
+              sizeof(PVOID)
+            );
+        }
+      if (lpEntry->lpIndex == NULL
+          || (bLazy && lpEntry->alpLazyProcs == NULL))
+        {
+          ErrPrintf(lpError, PL2ERR_MALLOC, srcInfo, NULL,
+                    "language: cannot allocate memory for handler index");
+          ClearLangEntry(lpEntry);
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+static void ClearLangEntry(LPLANGENTRY lpEntry)
+{
+  DropHandlerIndex(lpEntry->lpIndex);
+  free((LPVOID)lpEntry->alpLazyProcs);
+  if (lpEntry->bOwnLanguage && lpEntry->lpLanguage != NULL)
+    {
+      free(lpEntry->lpLanguage->aSinvokeHandlers);
+      free(lpEntry->lpLanguage->aWCallHandlers);
+      free(lpEntry->lpLanguage);
+    }
+  if (lpEntry->hModule != NULL && !ReleaseModule(lpEntry->hModule))
+    {
+      fprintf(stderr, "[int/e] error invoking FreeLibrary: %ld\n",
+              GetLastError());
+    }
+  lpEntry->lpIndex = NULL;
+  lpEntry->alpLazyProcs = NULL;
+  lpEntry->lpLanguage = NULL;
+  lpEntry->bOwnLanguage = FALSE;
+  lpEntry->hModule = NULL;
+}
+
+static void DropLangEntry(LPLANGENTRY lpEntry)
+{
+  ClearLangEntry(lpEntry);
+  free(lpEntry);
+}
+
+static BOOL SameVersion(SEMVER lhs, SEMVER rhs)
+{
+  return lhs.nMajor == rhs.nMajor
+         && lhs.nMinor == rhs.nMinor
+         && lhs.nPatch == rhs.nPatch
+         && lhs.bExact == rhs.bExact
+         && !strcmp(lhs.szPostfix, rhs.szPostfix);
+}
+
+static LPSINVPROC ResolveLazyProc(LPLANGENTRY lpEntry,
+                                  BINDING *lpBinding,
+                                  SRCINFO srcInfo,
+                                  LPERROR lpError)
+{
+  /* runs racing on one symbol all find the same address, whichever of
+     them publishes it */
+  DWORD nSinvoke =
+    (DWORD)(lpBinding->lpSinvoke - lpEntry->lpLanguage->aSinvokeHandlers);
+  LPSINVPROC lpfnProc = EasyLoadProc(lpEntry->hModule,
+                                     lpBinding->lpSinvoke->lpszCmdName,
+                                     lpError);
+  if (lpfnProc == NULL)
+    {
+      lpError->srcInfo = srcInfo;
+      return NULL;
+    }
+  if (InterlockedCompareExchangePointer(&lpEntry->alpLazyProcs[nSinvoke],
+                                        (PVOID)lpfnProc,
+                                        NULL) == NULL)
+    {
+      InterlockedIncrement(&lpEntry->nResolved);
+    }
+  lpBinding->lpfnProc = lpfnProc;
+  lpBinding->bUnresolved = FALSE;
+  return lpfnProc;
+}
+
+static BOOL ResolveAllLazy(LPLANGENTRY lpEntry,
+                           SRCINFO srcInfo,
+                           LPERROR lpError)
+{
+  if (lpEntry->alpLazyProcs == NULL)
+    {
+      return TRUE;
+    }
+  DWORD nSinvokeCount = lpEntry->lpIndex->nSinvokeCount;
+  if ((DWORD)InterlockedCompareExchange(&lpEntry->nResolved, 0, 0)
+      == nSinvokeCount)
+    {
+      return TRUE;
+    }
+  for (DWORD i = 0; i < nSinvokeCount; i++)
+    {
+      if (InterlockedCompareExchangePointer(&lpEntry->alpLazyProcs[i],
+                                            NULL,
+                                            NULL) != NULL)
+        {
+          continue;
+        }
+      BINDING binding;
+      binding.lpSinvoke = &lpEntry->lpLanguage->aSinvokeHandlers[i];
+      if (ResolveLazyProc(lpEntry, &binding, srcInfo, lpError) == NULL)
+        {
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+static LPLANGUAGE EasyLoad(HMODULE hModule,
+                           LPCSTR *aszCmdNames,
+                           BOOL bLazy,
+                           LPERROR lpError)
+{
+  if (aszCmdNames == NULL || aszCmdNames[0] == NULL)
+    {
+      return NULL;
+    }
+
+  WORD wCount = 0;
+  for (LPCSTR* iter = aszCmdNames; *iter != NULL; iter++)
+    {
+      ++wCount;
+    }
+
+  LPLANGUAGE ret = (LPLANGUAGE)malloc(sizeof(struct stLanguage));
+  if (ret == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0),
+                NULL,
+                "language: ezload: "
+                "cannot allocate memory for pl2w_Language");
+      return NULL;
+    }
+
+  ret->lpszLangName = "unknown";
+  ret->lpszLangInfo = "anonymous language loaded by ezload";
+  ret->lpTermCmd = NULL;
+  ret->lpfnInitProc = NULL;
+  ret->lpfnAtexitProc = NULL;
+  ret->aWCallHandlers = NULL;
+  ret->lpfnFallbackProc = NULL;
+  ret->aSinvokeHandlers = (SINVHANDLER*)malloc
+    (
+      sizeof(SINVHANDLER) * (wCount + 1)
+    );
+  if (ret->aSinvokeHandlers == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0),
+                NULL,
+                "langauge: EasyLoad: "
+                "cannot allocate memory for "
+                "LPLANGUAGE->aSinvokeHandlers");
+      free(ret);
+      return NULL;
+    }
+
+  memset(ret->aSinvokeHandlers, 0, (wCount + 1) * sizeof(SINVHANDLER));
+  for (WORD i = 0; i < wCount; i++)
+    {
+      /* a lazy table holds the names alone until they are dispatched */
+      LPCSTR lpszCmdName = aszCmdNames[i];
+      LPSINVPROC lpfnProc = NULL;
+      if (!bLazy)
+        {
+          lpfnProc = EasyLoadProc(hModule, lpszCmdName, lpError);
+          if (lpfnProc == NULL)
+            {
+              free(ret->aSinvokeHandlers);
+              free(ret);
+              return NULL;
+            }
+        }
+
+      ret->aSinvokeHandlers[i].lpszCmdName = lpszCmdName;
+      ret->aSinvokeHandlers[i].lpfnHandlerProc = lpfnProc;
+      ret->aSinvokeHandlers[i].bDeprecated = FALSE;
+      ret->aSinvokeHandlers[i].bRemoved = FALSE;
+    }
+
+  return ret;
+}
+
+static LPSINVPROC EasyLoadProc(HMODULE hModule,
+                               LPCSTR lpszCmdName,
+                               LPERROR lpError)
+{
+  CHAR szNameBuffer[512];
+  if (strlen(lpszCmdName) > 504)
+    {
+      ErrPrintf(lpError, PL2ERR_LOAD_LANG, SourceInfo(NULL, 0),
+                NULL,
+                "language: EasyLoad: "
+                "name over 504 chars not supported");
+      return NULL;
+    }
+  strcpy(szNameBuffer, "EL");
+  strncat(szNameBuffer, lpszCmdName, 504);
+  void *ptr = GetProcAddress(hModule, szNameBuffer);
+  if (ptr == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_LOAD_LANG, SourceInfo(NULL, 0),
+                NULL,
+                "language: ezload: cannot load function `%s`: %ld",
+                szNameBuffer, GetLastError());
+      return NULL;
+    }
+  return (LPSINVPROC)ptr;
+}
+
+/*** ----------------------------- Run ----------------------------- ***/
+
+/* held while a shared program gets its views built */
+static SRWLOCK s_viewLock = SRWLOCK_INIT;
+
+/* a field of the options a caller was built with, 0 when there are
+   none or the caller was built before the field existed */
+#define RUN_OPTION(lpOptions, field) \
+  ((lpOptions) != NULL \
+   && (lpOptions)->cbSize >= offsetof(RUNOPTIONS, field) \
+                             + sizeof((lpOptions)->field) \
+   ? (lpOptions)->field : 0)
+
+typedef struct stRunContext
+{
+  LPPROGRAM lpProgram;
+  LPCOMMAND lpCurCmd;
+  LPVOID lpUserContext;
+
+  LPLANGENTRY lpLangEntry;
+  LPLANGUAGE lpLanguage;
+  LPDISPATCHTABLE lpDispatch;
+
+  /* position in lpProgram->lpFlat, or NULL when walking lpCurCmd */
+  LPFLATPROGRAM lpFlat;
+  DWORD nCurIdx;
+  /* lpFlat->alpViews as this run has seen them built */
+  LPCOMMAND *alpViews;
+
+  /* bindings of a shared program are resolved on every step instead
+     of being kept in its commands */
+  BOOL bShared;
+  BOOL bLazyEasyLoad;
+  /* RunProgramEx runs on threaded code, see RunThreaded */
+  BOOL bThreaded;
+
+  /* argument vectors of the run going to an lpfnBatchProc; flat
+     commands get theirs built in aszBatchArgs */
+  LPCSTR **aaszBatch;
+  LPCSTR *aszBatchArgs;
+  SIZE_T nBatchArgCap;
+
+  /* windows BindProgram bound to a fused handler */
+  DWORD nFusedWindows;
+
+  /* steps are timed only when profiling or tracing commands; a step
+     covers nStepCommands commands */
+  BOOL bTimedSteps;
+  BOOL bTraceCommands;
+  LPPROFILE lpProfile;
+  DWORD nStepCommands;
+
+  /* a wait asked for by SuspendRun, taken before the next step */
+  BOOL bSuspended;
+  HANDLE hSuspendObject;
+  DWORD dwSuspendMs;
+  DWORD dwSuspendResult;
+} *LPRUNCONTEXT;
+
+/* TLS slot holding the run whose handlers the thread is calling */
+static volatile LONG s_nRunTls = (LONG)TLS_OUT_OF_INDEXES;
+
+static LPRUNCONTEXT CreateRunContext(LPPROGRAM lpProgram,
+                                     const RUNOPTIONS *lpOptions);
+static void DestroyRunContext(LPRUNCONTEXT lpCtx);
+static BOOL StepRun(LPRUNCONTEXT lpCtx, LPERROR lpError);
+static BOOL RunStep(LPRUNCONTEXT lpCtx, LPERROR lpError);
+static BOOL RunThreaded(LPRUNCONTEXT lpCtx, LPERROR lpError);
+static BOOL TimedStep(LPRUNCONTEXT lpCtx, LPERROR lpError);
+static DWORD RunTlsIndex(void);
+static LPRUNCONTEXT CurrentRun(void);
+static LPRUNCONTEXT EnterRun(LPRUNCONTEXT lpCtx);
+static void LeaveRun(LPRUNCONTEXT lpOuter);
+static void WaitSuspended(LPRUNCONTEXT lpCtx);
+static BOOL HandleCommand(LPRUNCONTEXT lpContext,
+                          LPCOMMAND lpCmd,
+                          LPERROR lpError);
+static BOOL RunBinding(LPRUNCONTEXT lpCtx,
+                       LPCOMMAND lpCmd,
+                       BINDING *lpBinding,
+                       LPERROR lpError);
+static BOOL HandleFlatCommand(LPRUNCONTEXT lpCtx,
+                              DWORD nIdx,
+                              LPERROR lpError);
+static BOOL RunSinvokeBatch(LPRUNCONTEXT lpCtx,
+                            LPCOMMAND lpCmd,
+                            BINDING *lpBinding,
+                            LPERROR lpError);
+static BOOL RunFlatSinvokeBatch(LPRUNCONTEXT lpCtx,
+                                DWORD nIdx,
+                                BINDING *lpBinding,
+                                LPERROR lpError);
+static DWORD FlatBinding(LPRUNCONTEXT lpCtx, DWORD nIdx);
+static BOOL ReserveBatch(LPRUNCONTEXT lpCtx, SIZE_T nArgs);
+static BOOL RunFused(LPRUNCONTEXT lpCtx,
+                     LPCOMMAND lpCmd,
+                     BINDING *lpBinding,
+                     LPERROR lpError);
+static BOOL RunFlatFused(LPRUNCONTEXT lpCtx,
+                         DWORD nIdx,
+                         BINDING *lpBinding,
+                         LPERROR lpError);
+static void WarnFusedDeprecated(LPRUNCONTEXT lpCtx, BINDING *lpBinding);
+static BOOL IsFusedMember(LPDISPATCHTABLE lpTable,
+                          BINDING *lpBinding,
+                          DWORD nMember,
+                          DWORDLONG dwlBinding);
+static DWORD MaxFusedMembers(LPDISPATCHTABLE lpTable);
+static DWORD FirstFused(LPDISPATCHTABLE lpTable, DWORDLONG dwlBinding);
+static DWORD FuseFlatProgram(LPDISPATCHTABLE lpTable, LPFLATPROGRAM lpFlat);
+static DWORD FuseWindow(LPDISPATCHTABLE lpTable,
+                        LPCOMMAND lpHead,
+                        DWORD *lpnSkip);
+static BOOL FlatAdvance(LPRUNCONTEXT lpCtx, DWORD nIdx);
+static BOOL FlatFollow(LPRUNCONTEXT lpCtx,
+                       LPCOMMAND lpNext,
+                       DWORD nExpected);
+static BOOL RunViews(LPRUNCONTEXT lpCtx, LPERROR lpError);
+static DWORD VerifyCommandAtom(LPPROGRAM lpProgram, LPCOMMAND lpCmd);
+static void BindCommand(LPDISPATCHTABLE lpTable, LPCOMMAND lpCmd);
+static DWORD BindProgram(LPRUNCONTEXT lpCtx);
+static DWORD SharedCommandAtom(LPPROGRAM lpProgram, LPCOMMAND lpCmd);
+static DWORD SharedBinding(LPRUNCONTEXT lpCtx, LPCOMMAND lpCmd);
+static BOOL LoadLanguage(LPRUNCONTEXT lpContext,
+                         LPCSTR *aszArgs,
+                         SRCINFO srcInfo,
+                         LPERROR lpError);
+static BOOL LoadLanguageModule(LPRUNCONTEXT lpContext,
+                               LPCSTR *aszArgs,
+                               SRCINFO srcInfo,
+                               LPERROR lpError);
+static BOOL MayJumpBack(LPLANGUAGE lpLanguage);
+
+void RunProgram(LPPROGRAM lpProgram, LPERROR lpError)
+{
+  RunProgramEx(lpProgram, NULL, lpError);
+}
+
+void RunProgramEx(LPPROGRAM lpProgram,
+                  const RUNOPTIONS *lpOptions,
+                  LPERROR lpError)
+{
+  LPRUNCONTEXT lpContext = CreateRunContext(lpProgram, lpOptions);
+  if (lpContext == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0),
+                NULL, "run: cannot allocate memory for run context");
+      return;
+    }
+
+  LONGLONG nTraceStart = TraceBegin();
+  LPRUNCONTEXT lpOuter = EnterRun(lpContext);
+  /* threaded code may hand the rest of the run back to the steps */
+  if (!lpContext->bThreaded || !RunThreaded(lpContext, lpError))
+    {
+      while (StepRun(lpContext, lpError))
+        {
+          if (IsError(lpError))
+            {
+              break;
+            }
+          if (lpContext->bSuspended)
+            {
+              WaitSuspended(lpContext);
+            }
+        }
+    }
+  LeaveRun(lpOuter);
+  TraceEnd(nTraceStart, "run", "RunProgram", NULL);
+
+  DestroyRunContext(lpContext);
+}
+
+void RunStream(LPSTREAM lpStream, LPERROR lpError)
+{
+  RunStreamEx(lpStream, NULL, lpError);
+}
+
+void RunStreamEx(LPSTREAM lpStream,
+                 const RUNOPTIONS *lpOptions,
+                 LPERROR lpError)
+{
+  LPRUNCONTEXT lpContext = CreateRunContext(GetStreamProgram(lpStream),
+                                            lpOptions);
+  if (lpContext == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0),
+                NULL, "run: cannot allocate memory for run context");
+      return;
+    }
+
+  LONGLONG nTraceStart = TraceBegin();
+  LPRUNCONTEXT lpOuter = EnterRun(lpContext);
+  for (;;)
+    {
+      if (lpContext->lpCurCmd == NULL)
+        {
+          if (!MayJumpBack(lpContext->lpLanguage))
+            {
+              ReleaseStreamCommands(lpStream);
+            }
+          lpContext->lpCurCmd = ReadStreamCommands(lpStream, lpError);
+          if (lpContext->lpCurCmd == NULL)
+            {
+              break;
+            }
+        }
+      if (!StepRun(lpContext, lpError) || IsError(lpError))
+        {
+          break;
+        }
+      if (lpContext->bSuspended)
+        {
+          WaitSuspended(lpContext);
+        }
+    }
+  LeaveRun(lpOuter);
+  TraceEnd(nTraceStart, "run", "RunStream", NULL);
+
+  DestroyRunContext(lpContext);
+}
+
+static LPRUNCONTEXT CreateRunContext(LPPROGRAM lpProgram,
+                                     const RUNOPTIONS *lpOptions)
+{
+  LPRUNCONTEXT ret = (LPRUNCONTEXT)malloc(sizeof(struct stRunContext));
+  if (ret == NULL)
+    {
+      return NULL;
+    }
+  SettleProgramLines(lpProgram);
+
+  LPCSTR lpszProfileFile = RUN_OPTION(lpOptions, lpszProfileFile);
+  if (lpszProfileFile == NULL)
+    {
+      lpszProfileFile = getenv(PROFILE_ENV);
+    }
+  LPTRACE lpTrace = TraceSession();
+  ret->lpProfile = NULL;
+  ret->nStepCommands = 1;
+  ret->bTraceCommands = lpTrace != NULL && lpTrace->bCommands;
+  if (lpszProfileFile != NULL && lpszProfileFile[0] != '\0')
+    {
+      ret->lpProfile = CreateProfile(lpszProfileFile);
+      if (ret->lpProfile == NULL)
+        {
+          free(ret);
+          return NULL;
+        }
+    }
+  ret->bTimedSteps = ret->lpProfile != NULL || ret->bTraceCommands;
+
+  ret->bShared = RUN_OPTION(lpOptions, bSharedProgram);
+  ret->bThreaded = RUN_OPTION(lpOptions, bThreadedCode)
+                   && !ret->bShared && !ret->bTimedSteps;
+  ret->bSuspended = FALSE;
+  ret->hSuspendObject = NULL;
+  ret->dwSuspendMs = 0;
+  ret->dwSuspendResult = WAIT_OBJECT_0;
+  ret->bLazyEasyLoad = RUN_OPTION(lpOptions, bLazyEasyLoad);
+  ret->lpProgram = lpProgram;
+  ret->lpUserContext = NULL;
+  ret->lpLangEntry = NULL;
+  ret->lpLanguage = NULL;
+  ret->lpDispatch = NULL;
+  ret->lpFlat = NULL;
+  ret->nCurIdx = FLAT_NONE;
+  ret->alpViews = NULL;
+  ret->aaszBatch = NULL;
+  ret->aszBatchArgs = NULL;
+  ret->nBatchArgCap = 0;
+  ret->nFusedWindows = 0;
+
+  if (ret->bShared)
+    {
+      AcquireSRWLockShared(&s_viewLock);
+    }
+  ret->lpCurCmd = lpProgram->lpCommands;
+  LPFLATPROGRAM lpFlat = lpProgram->lpFlat;
+  if (lpFlat != NULL
+      && (lpFlat->alpViews == NULL
+          || lpProgram->lpCommands
+             == (lpFlat->nCommands != 0 ? lpFlat->alpViews[0] : NULL)))
+    {
+      ret->lpFlat = lpFlat;
+      ret->nCurIdx = lpFlat->nCommands != 0 ? 0 : FLAT_NONE;
+      ret->alpViews = lpFlat->alpViews;
+    }
+  if (ret->bShared)
+    {
+      ReleaseSRWLockShared(&s_viewLock);
+    }
+  return ret;
+}
+
+static void DestroyRunContext(LPRUNCONTEXT lpCtx)
+{
+  /* handler names may live in the module about to be freed */
+  if (lpCtx->lpProfile != NULL)
+    {
+      WriteProfile(lpCtx->lpProfile, lpCtx->lpProgram, lpCtx->lpDispatch,
+                   lpCtx->nFusedWindows);
+      DropProfile(lpCtx->lpProfile);
+    }
+  if (lpCtx->lpLangEntry != NULL)
+    {
+      if (lpCtx->lpLanguage != NULL
+          && lpCtx->lpLanguage->lpfnAtexitProc != NULL)
+        {
+          LONGLONG nTraceStart = TraceBegin();
+          lpCtx->lpLanguage->lpfnAtexitProc(lpCtx->lpUserContext);
+          TraceEnd(nTraceStart, "language", "AtexitProc", NULL);
+        }
+      lpCtx->lpLanguage = NULL;
+      ReleaseLanguage(lpCtx->lpLangEntry);
+    }
+  free(lpCtx->lpDispatch);
+  free((LPVOID)lpCtx->aaszBatch);
+  free((LPVOID)lpCtx->aszBatchArgs);
+  free(lpCtx);
+}
+
+static BOOL StepRun(LPRUNCONTEXT lpCtx, LPERROR lpError)
+{
+  return lpCtx->bTimedSteps
+    ? TimedStep(lpCtx, lpError)
+    : RunStep(lpCtx, lpError);
+}
+
+static BOOL RunStep(LPRUNCONTEXT lpCtx, LPERROR lpError)
+{
+  return lpCtx->lpFlat != NULL
+    ? HandleFlatCommand(lpCtx, lpCtx->nCurIdx, lpError)
+    : HandleCommand(lpCtx, lpCtx->lpCurCmd, lpError);
+}
+
+static BOOL TimedStep(LPRUNCONTEXT lpCtx, LPERROR lpError)
+{
+  LPFLATPROGRAM lpFlat = lpCtx->lpFlat;
+  DWORD nIdx = lpCtx->nCurIdx;
+  LPCOMMAND lpCmd = lpCtx->lpCurCmd;
+  if (lpFlat != NULL ? nIdx == FLAT_NONE : lpCmd == NULL)
+    {
+      return FALSE;
+    }
+
+  LARGE_INTEGER liStart;
+  LARGE_INTEGER liEnd;
+  lpCtx->nStepCommands = 1;
+  QueryPerformanceCounter(&liStart);
+  BOOL bRet = RunStep(lpCtx, lpError);
+  QueryPerformanceCounter(&liEnd);
+
+  /* read back afterwards, the step binds the command it runs */
+  if (lpCtx->lpProfile != NULL)
+    {
+      DWORDLONG dwlBinding = lpFlat != NULL ? lpFlat->adwlBindings[nIdx]
+                                            : lpCmd->dwlBinding;
+      if (lpCtx->bShared && lpCtx->lpDispatch != NULL)
+        {
+          dwlBinding = MAKE_BINDING
+            (
+              lpCtx->lpDispatch->dwSerial,
+              lpFlat != NULL
+                ? ResolveAtom(lpCtx->lpDispatch,
+                              lpFlat->adwAtoms[nIdx],
+                              FlatCmdName(lpFlat, nIdx))
+                : SharedBinding(lpCtx, lpCmd)
+            );
+        }
+      RecordProfile(lpCtx->lpProfile,
+                    lpCtx->lpDispatch,
+                    dwlBinding,
+                    lpFlat != NULL ? lpFlat->adwAtoms[nIdx] : lpCmd->dwAtom,
+                    lpFlat != NULL ? lpFlat->anLines[nIdx]
+                                   : lpCmd->srcInfo.nLine,
+                    lpCtx->nStepCommands,
+                    liEnd.QuadPart - liStart.QuadPart);
+    }
+  if (lpCtx->bTraceCommands)
+    {
+      TraceEnd(liStart.QuadPart,
+               "command",
+               NULL,
+               lpFlat != NULL ? FlatCmdName(lpFlat, nIdx) : lpCmd->lpszCmd);
+    }
+  return bRet;
+}
+
+BOOL SuspendRun(HANDLE hObject, DWORD dwMilliseconds)
+{
+  LPRUNCONTEXT lpCtx = CurrentRun();
+  if (lpCtx == NULL)
+    {
+      return FALSE;
+    }
+  lpCtx->bSuspended = TRUE;
+  lpCtx->hSuspendObject = hObject;
+  lpCtx->dwSuspendMs = dwMilliseconds;
+  return TRUE;
+}
+
+DWORD GetSuspendResult(void)
+{
+  LPRUNCONTEXT lpCtx = CurrentRun();
+  return lpCtx != NULL ? lpCtx->dwSuspendResult : WAIT_FAILED;
+}
+
+static DWORD RunTlsIndex(void)
+{
+  DWORD dwIndex = (DWORD)InterlockedCompareExchange(&s_nRunTls, 0, 0);
+  if (dwIndex != TLS_OUT_OF_INDEXES)
+    {
+      return dwIndex;
+    }
+  dwIndex = TlsAlloc();
+  if (dwIndex == TLS_OUT_OF_INDEXES)
+    {
+      return TLS_OUT_OF_INDEXES;
+    }
+  LONG nIndex = InterlockedCompareExchange(&s_nRunTls,
+                                           (LONG)dwIndex,
+                                           (LONG)TLS_OUT_OF_INDEXES);
+  if (nIndex != (LONG)TLS_OUT_OF_INDEXES)
+    {
+      TlsFree(dwIndex);
+      dwIndex = (DWORD)nIndex;
+    }
+  return dwIndex;
+}
+
+static LPRUNCONTEXT CurrentRun(void)
+{
+  DWORD dwIndex = (DWORD)InterlockedCompareExchange(&s_nRunTls, 0, 0);
+  return dwIndex != TLS_OUT_OF_INDEXES
+    ? (LPRUNCONTEXT)TlsGetValue(dwIndex)
+    : NULL;
+}
+
+/* a command from CreateCommand made by a handler goes into the program
+   of its run, which has to look for it when the program is dropped */
+static void CountHeapCommand(void)
+{
+  LPRUNCONTEXT lpCtx = CurrentRun();
+  if (lpCtx != NULL)
+    {
+      InterlockedIncrement(&lpCtx->lpProgram->nHeapCommands);
+    }
+}
+
+/* handlers may run programs of their own, so the outer run is kept */
+static LPRUNCONTEXT EnterRun(LPRUNCONTEXT lpCtx)
+{
+  DWORD dwIndex = RunTlsIndex();
+  if (dwIndex == TLS_OUT_OF_INDEXES)
+    {
+      return NULL;
+    }
+  LPRUNCONTEXT lpOuter = (LPRUNCONTEXT)TlsGetValue(dwIndex);
+  TlsSetValue(dwIndex, lpCtx);
+  return lpOuter;
+}
+
+static void LeaveRun(LPRUNCONTEXT lpOuter)
+{
+  DWORD dwIndex = (DWORD)InterlockedCompareExchange(&s_nRunTls, 0, 0);
+  if (dwIndex != TLS_OUT_OF_INDEXES)
+    {
+      TlsSetValue(dwIndex, lpOuter);
+    }
+}
+
+static void WaitSuspended(LPRUNCONTEXT lpCtx)
+{
+  LONGLONG nTraceStart = TraceBegin();
+  lpCtx->bSuspended = FALSE;
+  if (lpCtx->hSuspendObject == NULL)
+    {
+      Sleep(lpCtx->dwSuspendMs);
+      lpCtx->dwSuspendResult = WAIT_TIMEOUT;
+    }
+  else
+    {
+      lpCtx->dwSuspendResult = WaitForSingleObject(lpCtx->hSuspendObject,
+                                                   lpCtx->dwSuspendMs);
+    }
+  TraceEnd(nTraceStart, "run", "Suspend", NULL);
+}
+
+static BOOL HandleCommand(LPRUNCONTEXT lpCtx,
+                          LPCOMMAND lpCmd,
+                          LPERROR lpError)
+{
+  if (lpCmd == NULL)
+    {
+      return FALSE;
+    }
+
+  LPDISPATCHTABLE lpTable = lpCtx->lpDispatch;
+  if (lpTable != NULL
+      && BINDING_SERIAL(lpCmd->dwlBinding) == lpTable->dwSerial)
+    {
+      return RunBinding(lpCtx,
+                        lpCmd,
+                        &lpTable->aBindings[BINDING_INDEX(lpCmd->dwlBinding)],
+                        lpError);
+    }
+
+  DWORD dwAtom;
+  if (lpCtx->bShared)
+    {
+      dwAtom = SharedCommandAtom(lpCtx->lpProgram, lpCmd);
+    }
+  else if ((dwAtom = VerifyCommandAtom(lpCtx->lpProgram, lpCmd))
+           == ATOM_NONE)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, lpCmd->srcInfo, NULL,
+                "run: cannot allocate memory for command atom");
+      return FALSE;
+    }
+  if (lpTable == NULL)
+    {
+      if (dwAtom == ATOM_LANGUAGE)
+        {
+          if (!LoadLanguage(lpCtx,
+                            (LPCSTR*)lpCmd->aszArgs,
+                            lpCmd->srcInfo,
+                            lpError))
+            {
+              return FALSE;
+            }
+          lpCtx->lpCurCmd = lpCmd->lpNext;
+          return TRUE;
+        }
+      else if (dwAtom == ATOM_ABORT)
+        {
+          return FALSE;
+        }
+      ErrPrintf(lpError, PL2ERR_NO_LANG, lpCmd->srcInfo, NULL,
+                "no language loaded to execute user command");
+      return FALSE;
+    }
+
+  if (lpCtx->bShared)
+    {
+      return RunBinding(lpCtx,
+                        lpCmd,
+                        &lpTable->aBindings[ResolveAtom(lpTable,
+                                                        dwAtom,
+                                                        lpCmd->lpszCmd)],
+                        lpError);
+    }
+  BindCommand(lpTable, lpCmd);
+  return RunBinding(lpCtx,
+                    lpCmd,
+                    &lpTable->aBindings[BINDING_INDEX(lpCmd->dwlBinding)],
+                    lpError);
+}
+
+static BOOL RunBinding(LPRUNCONTEXT lpCtx,
+                       LPCOMMAND lpCmd,
+                       BINDING *lpBinding,
+                       LPERROR lpError)
+{
+  switch (lpBinding->kind)
+    {
+      case BIND_LANGUAGE:
+        if (!LoadLanguage(lpCtx,
+                          (LPCSTR*)lpCmd->aszArgs,
+                          lpCmd->srcInfo,
+                          lpError))
+          {
+            return FALSE;
+          }
+        lpCtx->lpCurCmd = lpCmd->lpNext;
+        return TRUE;
+      case BIND_ABORT:
+        return FALSE;
+      case BIND_SINVOKE:
+        {
+          SINVHANDLER *lpHandler = lpBinding->lpSinvoke;
+          if (lpBinding->lpfnBatchProc != NULL)
+            {
+              return RunSinvokeBatch(lpCtx, lpCmd, lpBinding, lpError);
+            }
+          if (lpHandler->bDeprecated)
+            {
+              fprintf(stderr, "[int/w] using deprecated command: %s\n",
+                      lpHandler->lpszCmdName);
+            }
+          LPSINVPROC lpfnProc = lpBinding->lpfnProc;
+          if (lpfnProc == NULL && lpBinding->bUnresolved)
+            {
+              lpfnProc = ResolveLazyProc(lpCtx->lpLangEntry,
+                                         lpBinding,
+                                         lpCmd->srcInfo,
+                                         lpError);
+              if (lpfnProc == NULL)
+                {
+                  return FALSE;
+                }
+            }
+          if (lpfnProc != NULL)
+            {
+              lpfnProc((LPCSTR*)lpCmd->aszArgs);
+            }
+          lpCtx->lpCurCmd = lpCmd->lpNext;
+          return TRUE;
+        }
+      case BIND_WCALL:
+        {
+          WCALLHANDLER *lpHandler = lpBinding->lpWCall;
+          if (lpHandler->bDeprecated)
+            {
+              fprintf(stderr,
+                      "[int/w] using deprecated command: %s\n",
+                      lpHandler->lpszCmdName);
+            }
+          if (lpHandler->lpfnHandlerProc == NULL)
+            {
+              lpCtx->lpCurCmd = lpCmd->lpNext;
+              return TRUE;
+            }
+
+          LPCOMMAND pNextCmd = lpHandler->lpfnHandlerProc
+            (
+              lpCtx->lpProgram,
+              lpCtx->lpUserContext,
+              lpCmd,
+              lpError
+            );
+          if (IsError(lpError))
+            {
+              return 0;
+            }
+          if (pNextCmd == lpCtx->lpLanguage->lpTermCmd)
+            {
+              return 0;
+            }
+          lpCtx->lpCurCmd = pNextCmd ? pNextCmd : lpCmd->lpNext;
+          return 1;
+        }
+      case BIND_FUSED:
+        return RunFused(lpCtx, lpCmd, lpBinding, lpError);
+      case BIND_ROUTED:
+        return RunBinding(lpCtx,
+                          lpCmd,
+                          RouteBinding(lpCtx->lpDispatch,
+                                       lpBinding,
+                                       lpCmd->lpszCmd),
+                          lpError);
+      case BIND_FALLBACK:
+        break;
+    }
+
+  if (lpCtx->lpLanguage->lpfnFallbackProc == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_UNKNOWN_CMD, lpCmd->srcInfo, NULL,
+                "`%s` is not recognized as an internal or external "
+                "command, operable lpProgram or batch file",
+                lpCmd->lpszCmd);
+      return 0;
+    }
+
+  LPCOMMAND pNextCmd = lpCtx->lpLanguage->lpfnFallbackProc
+    (
+      lpCtx->lpProgram,
+      lpCtx->lpUserContext,
+      lpCmd,
+      lpError
+    );
+
+  if (pNextCmd == lpCtx->lpLanguage->lpTermCmd)
+    {
+      ErrPrintf(lpError, PL2ERR_UNKNOWN_CMD, lpCmd->srcInfo, NULL,
+                "`%s` is not recognized as an internal or external "
+                "command, operable lpProgram or batch file",
+                lpCmd->lpszCmd);
+      return 0;
+    }
+
+  if (IsError(lpError))
+    {
+      return 0;
+    }
+  if (pNextCmd == lpCtx->lpLanguage->lpTermCmd)
+    {
+      return 0;
+    }
+
+  lpCtx->lpCurCmd = pNextCmd ? pNextCmd : lpCmd->lpNext;
+  return 1;
+}
+
+static BOOL HandleFlatCommand(LPRUNCONTEXT lpCtx,
+                              DWORD nIdx,
+                              LPERROR lpError)
+{
+  if (nIdx == FLAT_NONE)
+    {
+      return FALSE;
+    }
+
+  /* once handlers hold views they may have renamed them or changed
+     their arguments, so the view is what runs */
+  LPFLATPROGRAM lpFlat = lpCtx->lpFlat;
+  if (lpCtx->alpViews != NULL)
+    {
+      if (!HandleCommand(lpCtx, lpCtx->alpViews[nIdx], lpError))
+        {
+          return FALSE;
+        }
+      return FlatFollow(lpCtx, lpCtx->lpCurCmd,
+                        lpFlat->aCommands[nIdx].nNext);
+    }
+
+  LPDISPATCHTABLE lpTable = lpCtx->lpDispatch;
+  BINDING *lpBinding = NULL;
+  BINDKIND kind;
+  if (lpTable != NULL)
+    {
+      DWORDLONG dwlBinding = lpFlat->adwlBindings[nIdx];
+      if (BINDING_SERIAL(dwlBinding) != lpTable->dwSerial)
+        {
+          dwlBinding = MAKE_BINDING
+            (
+              lpTable->dwSerial,
+              ResolveAtom(lpTable,
+                          lpFlat->adwAtoms[nIdx],
+                          FlatCmdName(lpFlat, nIdx))
+            );
+          if (!lpCtx->bShared)
+            {
+              lpFlat->adwlBindings[nIdx] = dwlBinding;
+            }
+        }
+      lpBinding = &lpTable->aBindings[BINDING_INDEX(dwlBinding)];
+      kind = lpBinding->kind;
+    }
+  else if (lpFlat->adwAtoms[nIdx] == ATOM_LANGUAGE)
+    {
+      kind = BIND_LANGUAGE;
+    }
+  else if (lpFlat->adwAtoms[nIdx] == ATOM_ABORT)
+    {
+      return FALSE;
+    }
+  else
+    {
+      ErrPrintf(lpError, PL2ERR_NO_LANG, FlatSrcInfo(lpFlat, nIdx), NULL,
+                "no language loaded to execute user command");
+      return FALSE;
+    }
+
+  switch (kind)
+    {
+      case BIND_ABORT:
+        return FALSE;
+      case BIND_LANGUAGE:
+      case BIND_SINVOKE:
+        {
+          if (kind == BIND_SINVOKE
+              && lpBinding->lpfnBatchProc != NULL)
+            {
+              return RunFlatSinvokeBatch(lpCtx, nIdx, lpBinding, lpError);
+            }
+          LPCSTR aszInline[FLAT_INLINE_ARGS];
+          LPCSTR *aszArgs = FlatCmdArgs(lpFlat, nIdx, aszInline);
+          if (aszArgs == NULL)
+            {
+              ErrPrintf(lpError, PL2ERR_MALLOC, FlatSrcInfo(lpFlat, nIdx),
+                        NULL, "run: cannot allocate argument vector");
+              return FALSE;
+            }
+          if (kind == BIND_LANGUAGE)
+            {
+              BOOL bLoaded = LoadLanguage(lpCtx,
+                                          aszArgs,
+                                          FlatSrcInfo(lpFlat, nIdx),
+                                          lpError);
+              FreeFlatCmdArgs(aszArgs, aszInline);
+              if (!bLoaded)
+                {
+                  return FALSE;
+                }
+              return FlatAdvance(lpCtx, nIdx);
+            }
+
+          SINVHANDLER *lpHandler = lpBinding->lpSinvoke;
+          if (lpHandler->bDeprecated)
+            {
+              fprintf(stderr, "[int/w] using deprecated command: %s\n",
+                      lpHandler->lpszCmdName);
+            }
+          LPSINVPROC lpfnProc = lpBinding->lpfnProc;
+          if (lpfnProc == NULL && lpBinding->bUnresolved)
+            {
+              lpfnProc = ResolveLazyProc(lpCtx->lpLangEntry,
+                                         lpBinding,
+                                         FlatSrcInfo(lpFlat, nIdx),
+                                         lpError);
+              if (lpfnProc == NULL)
+                {
+                  FreeFlatCmdArgs(aszArgs, aszInline);
+                  return FALSE;
+                }
+            }
+          if (lpfnProc != NULL)
+            {
+              lpfnProc(aszArgs);
+            }
+          FreeFlatCmdArgs(aszArgs, aszInline);
+          return FlatAdvance(lpCtx, nIdx);
+        }
+      case BIND_FUSED:
+        return RunFlatFused(lpCtx, nIdx, lpBinding, lpError);
+      case BIND_WCALL:
+      case BIND_ROUTED:
+      case BIND_FALLBACK:
+        break;
+    }
+
+  /* WCALL and fallback handlers see the program through LPCOMMAND
+     views and may return any of them, or a command of their own */
+  if (!RunViews(lpCtx, lpError))
+    {
+      return FALSE;
+    }
+  LPCOMMAND lpView = lpCtx->alpViews[nIdx];
+  if (!lpCtx->bShared)
+    {
+      lpView->dwlBinding = lpFlat->adwlBindings[nIdx];
+    }
+  if (!RunBinding(lpCtx, lpView, lpBinding, lpError))
+    {
+      return FALSE;
+    }
+  return FlatFollow(lpCtx, lpCtx->lpCurCmd, lpFlat->aCommands[nIdx].nNext);
+}
+
+static BOOL RunSinvokeBatch(LPRUNCONTEXT lpCtx,
+                            LPCOMMAND lpCmd,
+                            BINDING *lpBinding,
+                            LPERROR lpError)
+{
+  SINVHANDLER *lpHandler = lpBinding->lpSinvoke;
+  if (!ReserveBatch(lpCtx, 0))
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, lpCmd->srcInfo, NULL,
+                "run: cannot allocate memory for command batch");
+      return FALSE;
+    }
+
+  /* sinvoke handlers cannot change the program, so the run is known
+     before any of it executes */
+  LPDISPATCHTABLE lpTable = lpCtx->lpDispatch;
+  DWORDLONG dwlBinding = lpCtx->bShared
+    ? MAKE_BINDING(lpTable->dwSerial, SharedBinding(lpCtx, lpCmd))
+    : lpCmd->dwlBinding;
+  DWORD nCount = 0;
+  LPCOMMAND iter = lpCmd;
+  do
+    {
+      lpCtx->aaszBatch[nCount++] = (LPCSTR*)iter->aszArgs;
+      iter = iter->lpNext;
+      if (iter != NULL && !lpCtx->bShared
+          && BINDING_SERIAL(iter->dwlBinding) != lpTable->dwSerial
+          && VerifyCommandAtom(lpCtx->lpProgram, iter) != ATOM_NONE)
+        {
+          BindCommand(lpTable, iter);
+        }
+    }
+  while (iter != NULL
+         && (lpCtx->bShared
+             ? BINDING_INDEX(dwlBinding) == SharedBinding(lpCtx, iter)
+             : iter->dwlBinding == dwlBinding)
+         && nCount < SINV_BATCH_MAX);
+
+  if (lpHandler->bDeprecated)
+    {
+      for (DWORD i = 0; i < nCount; i++)
+        {
+          fprintf(stderr, "[int/w] using deprecated command: %s\n",
+                  lpHandler->lpszCmdName);
+        }
+    }
+  lpBinding->lpfnBatchProc(lpCtx->aaszBatch, nCount);
+  lpCtx->nStepCommands = nCount;
+  lpCtx->lpCurCmd = iter;
+  return TRUE;
+}
+
+static BOOL RunFlatSinvokeBatch(LPRUNCONTEXT lpCtx,
+                                DWORD nIdx,
+                                BINDING *lpBinding,
+                                LPERROR lpError)
+{
+  SINVHANDLER *lpHandler = lpBinding->lpSinvoke;
+  /* the run ends where the binding changes, as at the head of a fused
+     window, which is bound to its FUSEDHANDLER */
+  LPFLATPROGRAM lpFlat = lpCtx->lpFlat;
+  DWORD nBinding = (DWORD)(lpBinding - lpCtx->lpDispatch->aBindings);
+  DWORD nCount = 1;
+  DWORD nLast = nIdx;
+  SIZE_T nArgs = lpFlat->aCommands[nIdx].nArgCount + 1;
+  for (DWORD i = lpFlat->aCommands[nIdx].nNext;
+       i != FLAT_NONE
+       && FlatBinding(lpCtx, i) == nBinding
+       && nCount < SINV_BATCH_MAX;
+       i = lpFlat->aCommands[i].nNext)
+    {
+      nArgs += lpFlat->aCommands[i].nArgCount + 1;
+      nLast = i;
+      ++nCount;
+    }
+  if (!ReserveBatch(lpCtx, nArgs))
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, FlatSrcInfo(lpFlat, nIdx), NULL,
+                "run: cannot allocate memory for command batch");
+      return FALSE;
+    }
+
+  LPCSTR *lpszArg = lpCtx->aszBatchArgs;
+  for (DWORD i = nIdx, j = 0;
+       j < nCount;
+       i = lpFlat->aCommands[i].nNext, j++)
+    {
+      const FLATCOMMAND *lpFlatCmd = &lpFlat->aCommands[i];
+      const DWORD *adwOffsets = lpFlat->adwArgOffsets + lpFlatCmd->nFirstArg;
+      lpCtx->aaszBatch[j] = lpszArg;
+      for (WORD k = 0; k < lpFlatCmd->nArgCount; k++)
+        {
+          *lpszArg++ = lpFlat->lpStrings + adwOffsets[k];
+        }
+      *lpszArg++ = NULL;
+      if (lpHandler->bDeprecated)
+        {
+          fprintf(stderr, "[int/w] using deprecated command: %s\n",
+                  lpHandler->lpszCmdName);
+        }
+    }
+  lpBinding->lpfnBatchProc(lpCtx->aaszBatch, nCount);
+  lpCtx->nStepCommands = nCount;
+  return FlatAdvance(lpCtx, nLast);
+}
+
+/* the binding index of flat command nIdx, without writing it back */
+static DWORD FlatBinding(LPRUNCONTEXT lpCtx, DWORD nIdx)
+{
+  LPDISPATCHTABLE lpTable = lpCtx->lpDispatch;
+  LPFLATPROGRAM lpFlat = lpCtx->lpFlat;
+  DWORDLONG dwlBinding = lpFlat->adwlBindings[nIdx];
+  if (BINDING_SERIAL(dwlBinding) == lpTable->dwSerial)
+    {
+      return BINDING_INDEX(dwlBinding);
+    }
+  return ResolveAtom(lpTable,
+                     lpFlat->adwAtoms[nIdx],
+                     FlatCmdName(lpFlat, nIdx));
+}
+
+static BOOL ReserveBatch(LPRUNCONTEXT lpCtx, SIZE_T nArgs)
+{
+  if (lpCtx->aaszBatch == NULL)
+    {
+      lpCtx->aaszBatch = (LPCSTR**)malloc(SINV_BATCH_MAX * sizeof(LPCSTR*));
+      if (lpCtx->aaszBatch == NULL)
+        {
+          return FALSE;
+        }
+    }
+  if (nArgs > lpCtx->nBatchArgCap)
+    {
+      SIZE_T nCap = lpCtx->nBatchArgCap != 0 ? lpCtx->nBatchArgCap : 1024;
+      while (nCap < nArgs)
+        {
+          nCap *= 2;
+        }
+      LPCSTR *aszArgs = (LPCSTR*)malloc(nCap * sizeof(LPCSTR));
+      if (aszArgs == NULL)
+        {
+          return FALSE;
+        }
+      free((LPVOID)lpCtx->aszBatchArgs);
+      lpCtx->aszBatchArgs = aszArgs;
+      lpCtx->nBatchArgCap = nCap;
+    }
+  return TRUE;
+}
+
+static BOOL RunFused(LPRUNCONTEXT lpCtx,
+                     LPCOMMAND lpCmd,
+                     BINDING *lpBinding,
+                     LPERROR lpError)
+{
+  if (!ReserveBatch(lpCtx, 0))
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, lpCmd->srcInfo, NULL,
+                "run: cannot allocate memory for command batch");
+      return FALSE;
+    }
+
+  /* a window handlers have relinked or renamed commands of since it
+     was fused runs command by command */
+  LPDISPATCHTABLE lpTable = lpCtx->lpDispatch;
+  LPCOMMAND iter = lpCmd;
+  for (DWORD i = 0; i < lpBinding->nMembers; i++, iter = iter->lpNext)
+    {
+      if (iter == NULL
+          || (i != 0
+              && !IsFusedMember(lpTable, lpBinding, i, iter->dwlBinding)))
+        {
+          return RunBinding(lpCtx,
+                            lpCmd,
+                            &lpTable->aBindings
+                              [BINDIDX_SINVOKE(lpTable,
+                                               lpBinding->anMembers[0])],
+                            lpError);
+        }
+      lpCtx->aaszBatch[i] = (LPCSTR*)iter->aszArgs;
+    }
+
+  WarnFusedDeprecated(lpCtx, lpBinding);
+  lpBinding->lpFused->lpfnFusedProc(lpCtx->aaszBatch, lpBinding->nMembers);
+  lpCtx->nStepCommands = lpBinding->nMembers;
+  lpCtx->lpCurCmd = iter;
+  return TRUE;
+}
+
+static BOOL RunFlatFused(LPRUNCONTEXT lpCtx,
+                         DWORD nIdx,
+                         BINDING *lpBinding,
+                         LPERROR lpError)
+{
+  /* without views the flat program is as BindProgram left it */
+  LPFLATPROGRAM lpFlat = lpCtx->lpFlat;
+  SIZE_T nArgs = 0;
+  for (DWORD i = 0; i < lpBinding->nMembers; i++)
+    {
+      nArgs += lpFlat->aCommands[nIdx + i].nArgCount + 1;
+    }
+  if (!ReserveBatch(lpCtx, nArgs))
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, FlatSrcInfo(lpFlat, nIdx), NULL,
+                "run: cannot allocate memory for command batch");
+      return FALSE;
+    }
+
+  LPCSTR *lpszArg = lpCtx->aszBatchArgs;
+  for (DWORD i = 0; i < lpBinding->nMembers; i++)
+    {
+      const FLATCOMMAND *lpFlatCmd = &lpFlat->aCommands[nIdx + i];
+      const DWORD *adwOffsets = lpFlat->adwArgOffsets + lpFlatCmd->nFirstArg;
+      lpCtx->aaszBatch[i] = lpszArg;
+      for (WORD k = 0; k < lpFlatCmd->nArgCount; k++)
+        {
+          *lpszArg++ = lpFlat->lpStrings + adwOffsets[k];
+        }
+      *lpszArg++ = NULL;
+    }
+  WarnFusedDeprecated(lpCtx, lpBinding);
+  lpBinding->lpFused->lpfnFusedProc(lpCtx->aaszBatch, lpBinding->nMembers);
+  lpCtx->nStepCommands = lpBinding->nMembers;
+  return FlatAdvance(lpCtx, nIdx + lpBinding->nMembers - 1);
+}
+
+static void WarnFusedDeprecated(LPRUNCONTEXT lpCtx, BINDING *lpBinding)
+{
+  if (!lpBinding->bDeprecatedMember)
+    {
+      return;
+    }
+  for (DWORD i = 0; i < lpBinding->nMembers; i++)
+    {
+      SINVHANDLER *lpHandler =
+        &lpCtx->lpLanguage->aSinvokeHandlers[lpBinding->anMembers[i]];
+      if (lpHandler->bDeprecated)
+        {
+          fprintf(stderr, "[int/w] using deprecated command: %s\n",
+                  lpHandler->lpszCmdName);
+        }
+    }
+}
+
+static BOOL IsFusedMember(LPDISPATCHTABLE lpTable,
+                          BINDING *lpBinding,
+                          DWORD nMember,
+                          DWORDLONG dwlBinding)
+{
+  return dwlBinding == MAKE_BINDING
+    (
+      lpTable->dwSerial,
+      BINDIDX_SINVOKE(lpTable, lpBinding->anMembers[nMember])
+    );
+}
+
+/* the longest window of any fused handler, 0 when there is none */
+static DWORD MaxFusedMembers(LPDISPATCHTABLE lpTable)
+{
+  DWORD nMax = 0;
+  for (DWORD f = 0; f < lpTable->lpIndex->nFusedCount; f++)
+    {
+      DWORD nMembers = lpTable->aBindings[BINDIDX_FUSED(lpTable, f)].nMembers;
+      if (nMembers > nMax)
+        {
+          nMax = nMembers;
+        }
+    }
+  return nMax;
+}
+
+/* the first fused handler a window starting with a command bound to
+   dwlBinding may match, chained through anFusedNext */
+static DWORD FirstFused(LPDISPATCHTABLE lpTable, DWORDLONG dwlBinding)
+{
+  DWORD nIndex = BINDING_INDEX(dwlBinding);
+  if (BINDING_SERIAL(dwlBinding) != lpTable->dwSerial
+      || nIndex < BINDIDX_SINVOKE(lpTable, 0)
+      || nIndex >= BINDIDX_WCALL(lpTable, 0))
+    {
+      return DISPATCH_NONE;
+    }
+  return lpTable->lpIndex->anFusedHead[nIndex - BINDIDX_SINVOKE(lpTable, 0)];
+}
+
+/* binds the first command of each window of bound flat commands
+   matching a fused handler to it, leaving the others as they are so
+   that jumps to them still work; flat commands follow each other in
+   index order */
+static DWORD FuseFlatProgram(LPDISPATCHTABLE lpTable, LPFLATPROGRAM lpFlat)
+{
+  DWORD nWindows = 0;
+  DWORD nCommands = lpFlat->nCommands;
+  DWORDLONG *adwlBindings = lpFlat->adwlBindings;
+  const DWORD *anFusedNext = lpTable->lpIndex->anFusedNext;
+  BINDING *aFused = &lpTable->aBindings[BINDIDX_FUSED(lpTable, 0)];
+  for (DWORD i = 0; i < nCommands; i++)
+    {
+      for (DWORD f = FirstFused(lpTable, adwlBindings[i]);
+           f != DISPATCH_NONE;
+           f = anFusedNext[f])
+        {
+          DWORD nMembers = aFused[f].nMembers;
+          if (nMembers > nCommands - i)
+            {
+              continue;
+            }
+          DWORD j = 1;
+          while (j < nMembers
+                 && IsFusedMember(lpTable, &aFused[f], j,
+                                  adwlBindings[i + j]))
+            {
+              j++;
+            }
+          if (j == nMembers)
+            {
+              adwlBindings[i] = MAKE_BINDING(lpTable->dwSerial,
+                                             BINDIDX_FUSED(lpTable, f));
+              nWindows++;
+              i += nMembers - 1;
+              break;
+            }
+        }
+    }
+  return nWindows;
+}
+
+/* FuseFlatProgram for the window starting at lpHead, all of which is
+   bound already; *lpnSkip counts down the rest of the last window */
+static DWORD FuseWindow(LPDISPATCHTABLE lpTable,
+                        LPCOMMAND lpHead,
+                        DWORD *lpnSkip)
+{
+  if (*lpnSkip != 0)
+    {
+      (*lpnSkip)--;
+      return 0;
+    }
+  for (DWORD f = FirstFused(lpTable, lpHead->dwlBinding);
+       f != DISPATCH_NONE;
+       f = lpTable->lpIndex->anFusedNext[f])
+    {
+      DWORD nBinding = BINDIDX_FUSED(lpTable, f);
+      BINDING *lpBinding = &lpTable->aBindings[nBinding];
+      LPCOMMAND iter = lpHead->lpNext;
+      DWORD j = 1;
+      while (j < lpBinding->nMembers
+             && iter != NULL
+             && IsFusedMember(lpTable, lpBinding, j, iter->dwlBinding))
+        {
+          iter = iter->lpNext;
+          j++;
+        }
+      if (j == lpBinding->nMembers)
+        {
+          lpHead->dwlBinding = MAKE_BINDING(lpTable->dwSerial, nBinding);
+          *lpnSkip = lpBinding->nMembers - 1;
+          return 1;
+        }
+    }
+  return 0;
+}
+
+static BOOL FlatAdvance(LPRUNCONTEXT lpCtx, DWORD nIdx)
+{
+  LPFLATPROGRAM lpFlat = lpCtx->lpFlat;
+  DWORD nNext = lpFlat->aCommands[nIdx].nNext;
+  if (lpCtx->alpViews == NULL)
+    {
+      lpCtx->nCurIdx = nNext;
+      return TRUE;
+    }
+  /* once handlers hold views they may have relinked them */
+  return FlatFollow(lpCtx, lpCtx->alpViews[nIdx]->lpNext, nNext);
+}
+
+static BOOL FlatFollow(LPRUNCONTEXT lpCtx,
+                       LPCOMMAND lpNext,
+                       DWORD nExpected)
+{
+  LPFLATPROGRAM lpFlat = lpCtx->lpFlat;
+  if (lpNext == NULL)
+    {
+      lpCtx->nCurIdx = FLAT_NONE;
+      return TRUE;
+    }
+  if (nExpected != FLAT_NONE && lpCtx->alpViews[nExpected] == lpNext)
+    {
+      lpCtx->nCurIdx = nExpected;
+      return TRUE;
+    }
+
+  DWORD nIdx = FindViewIndex(lpFlat, lpNext);
+  if (nIdx == FLAT_NONE)
+    {
+      /* a spliced-in command, continue on the linked views from here */
+      lpCtx->lpFlat = NULL;
+      lpCtx->lpCurCmd = lpNext;
+      return TRUE;
+    }
+  lpCtx->nCurIdx = nIdx;
+  return TRUE;
+}
+
+static BOOL RunViews(LPRUNCONTEXT lpCtx, LPERROR lpError)
+{
+  if (lpCtx->alpViews != NULL)
+    {
+      return TRUE;
+    }
+  /* the first run of a shared program to need them builds them for all */
+  if (lpCtx->bShared)
+    {
+      AcquireSRWLockExclusive(&s_viewLock);
+    }
+  BOOL bRet = MaterializeViews(lpCtx->lpProgram, lpError);
+  lpCtx->alpViews = lpCtx->lpFlat->alpViews;
+  if (lpCtx->bShared)
+    {
+      ReleaseSRWLockExclusive(&s_viewLock);
+    }
+  return bRet;
+}
+
+static DWORD VerifyCommandAtom(LPPROGRAM lpProgram, LPCOMMAND lpCmd)
+{
+  /* only done before binding: a handler may have spliced in commands
+     of another program, or renamed one and reset just its dwlBinding */
+  LPCSTR lpszName = AtomName(lpProgram, lpCmd->dwAtom);
+  if (lpszName == NULL || strcmp(lpszName, lpCmd->lpszCmd) != 0)
+    {
+      lpCmd->dwAtom = GetCommandAtom(lpProgram, lpCmd->lpszCmd);
+    }
+  return lpCmd->dwAtom;
+}
+
+static void BindCommand(LPDISPATCHTABLE lpTable, LPCOMMAND lpCmd)
+{
+  lpCmd->dwlBinding = MAKE_BINDING
+    (
+      lpTable->dwSerial,
+      ResolveAtom(lpTable, lpCmd->dwAtom, lpCmd->lpszCmd)
+    );
+}
+
+/* binds the program and fuses its windows, see FUSEDHANDLER; returns
+   how many windows the run starts on */
+static DWORD BindProgram(LPRUNCONTEXT lpCtx)
+{
+  LPDISPATCHTABLE lpTable = lpCtx->lpDispatch;
+  DWORD nMaxMembers = MaxFusedMembers(lpTable);
+  DWORD nFlatWindows = 0;
+  LPFLATPROGRAM lpFlat = lpCtx->lpProgram->lpFlat;
+  if (lpFlat != NULL)
+    {
+      for (DWORD i = 0; i < lpFlat->nCommands; i++)
+        {
+          lpFlat->adwlBindings[i] = MAKE_BINDING
+            (
+              lpTable->dwSerial,
+              ResolveAtom(lpTable,
+                          lpFlat->adwAtoms[i],
+                          FlatCmdName(lpFlat, i))
+            );
+        }
+      if (nMaxMembers != 0)
+        {
+          nFlatWindows = FuseFlatProgram(lpTable, lpFlat);
+        }
+    }
+
+  /* a command that cannot be interned now is bound by HandleCommand.
+     Windows are fused trailing the binding by the longest of them, on
+     commands still in cache */
+  DWORD nWindows = 0;
+  DWORD nSkip = 0;
+  DWORD nAhead = 0;
+  LPCOMMAND lpHead = lpCtx->lpProgram->lpCommands;
+  for (LPCOMMAND iter = lpCtx->lpProgram->lpCommands;
+       iter != NULL;
+       iter = iter->lpNext)
+    {
+      if (VerifyCommandAtom(lpCtx->lpProgram, iter) != ATOM_NONE)
+        {
+          BindCommand(lpTable, iter);
+        }
+      if (nMaxMembers == 0)
+        {
+          continue;
+        }
+      if (++nAhead < nMaxMembers)
+        {
+          continue;
+        }
+      nWindows += FuseWindow(lpTable, lpHead, &nSkip);
+      lpHead = lpHead->lpNext;
+    }
+  for (; nMaxMembers != 0 && lpHead != NULL; lpHead = lpHead->lpNext)
+    {
+      nWindows += FuseWindow(lpTable, lpHead, &nSkip);
+    }
+  return lpCtx->lpFlat != NULL ? nFlatWindows : nWindows;
+}
+
+static DWORD SharedCommandAtom(LPPROGRAM lpProgram, LPCOMMAND lpCmd)
+{
+  /* VerifyCommandAtom without writing to the program; a name it has no
+     atom for cannot name a handler either */
+  LPCSTR lpszName = AtomName(lpProgram, lpCmd->dwAtom);
+  if (lpszName != NULL && !strcmp(lpszName, lpCmd->lpszCmd))
+    {
+      return lpCmd->dwAtom;
+    }
+  return FindAtom(lpProgram->lpAtoms, lpCmd->lpszCmd);
+}
+
+static DWORD SharedBinding(LPRUNCONTEXT lpCtx, LPCOMMAND lpCmd)
+{
+  return ResolveAtom(lpCtx->lpDispatch,
+                     SharedCommandAtom(lpCtx->lpProgram, lpCmd),
+                     lpCmd->lpszCmd);
+}
+
+static BOOL LoadLanguage(LPRUNCONTEXT lpCtx,
+                         LPCSTR *aszArgs,
+                         SRCINFO srcInfo,
+                         LPERROR lpError)
+{
+  LONGLONG nTraceStart = TraceBegin();
+  BOOL bLoaded = LoadLanguageModule(lpCtx, aszArgs, srcInfo, lpError);
+  TraceEnd(nTraceStart, "language", "LoadLanguage", aszArgs[0]);
+  return bLoaded;
+}
+
+static BOOL LoadLanguageModule(LPRUNCONTEXT lpCtx,
+                               LPCSTR *aszArgs,
+                               SRCINFO srcInfo,
+                               LPERROR lpError)
+{
+  if (lpCtx->lpLanguage != NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_LOAD_LANG, srcInfo, NULL,
+                "language: another language already loaded");
+      return FALSE;
+    }
+
+  WORD nArgCount = 0;
+  while (aszArgs[nArgCount] != NULL)
+    {
+      nArgCount++;
+    }
+  if (nArgCount != 2)
+    {
+      ErrPrintf(lpError, PL2ERR_LOAD_LANG, srcInfo, NULL,
+                "language: expected 2 argument, got %u",
+                nArgCount);
+      return FALSE;
+    }
+
+  LPCSTR lpszLangId = aszArgs[0];
+  SEMVER langVer = ParseSemVer(aszArgs[1], lpError);
+  if (IsError(lpError)) 
     {
-      *lpnOutput *= 10;
-      *lpnOutput += lpszSrc[0] - '0';
-      ++lpszSrc;
+      return FALSE;
     }
-  return lpszSrc;
-}
 
-static void ParseSemVerPostfix(LPCSTR lpszSrc,
-                               LPSTR lpszOutput,
-                               LPERROR lpError)
-{
-  assert(lpszSrc[0] == '-');
-  ++lpszSrc;
-  if (lpszSrc[0] == '\0')
+  /* a language that built no LPLANGUAGE may be followed by another */
+  if (lpCtx->lpLangEntry != NULL)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0), NULL,
-                "empty semver postfix");
-      return;
+      ReleaseLanguage(lpCtx->lpLangEntry);
     }
-  for (size_t i = 0; i < SEMVER_POSTFIX_LEN - 1; i++)
+  lpCtx->lpLangEntry = AcquireLanguage(lpszLangId,
+                                       langVer,
+                                       lpCtx->bLazyEasyLoad,
+                                       srcInfo,
+                                       lpError);
+  if (lpCtx->lpLangEntry == NULL)
     {
-      if (!(*lpszOutput++ = *lpszSrc++))
+      return FALSE;
+    }
+  lpCtx->lpLanguage = lpCtx->lpLangEntry->lpLanguage;
+
+  if (lpCtx->lpLanguage != NULL && lpCtx->lpLanguage->lpfnInitProc != NULL)
+    {
+      LONGLONG nTraceStart = TraceBegin();
+      lpCtx->lpUserContext = lpCtx->lpLanguage->lpfnInitProc(lpError);
+      TraceEnd(nTraceStart, "language", "InitProc", NULL);
+      if (IsError(lpError))
         {
-          return;
+          lpError->srcInfo = srcInfo;
+          return FALSE;
         }
     }
-  if (lpszSrc[0] != '\0')
+
+  /* bound once lpfnInitProc has set the language up */
+  if (lpCtx->lpLanguage != NULL)
     {
-      ErrPrintf(lpError, PL2ERR_SEMVER_PARSE,
-                SourceInfo(NULL, 0), NULL,
-                "semver postfix too long");
-      return;
+      LONGLONG nTraceStart = TraceBegin();
+      lpCtx->lpDispatch = CreateDispatchTable(lpCtx->lpProgram,
+                                              lpCtx->lpLanguage,
+                                              lpCtx->lpLangEntry->lpIndex,
+                                              lpCtx->lpLangEntry->alpLazyProcs,
+                                              lpError);
+      if (IsError(lpError))
+        {
+          lpError->srcInfo = srcInfo;
+          return FALSE;
+        }
+      CHAR szDetail[32];
+      if (!lpCtx->bShared)
+        {
+          lpCtx->nFusedWindows = BindProgram(lpCtx);
+        }
+      sprintf(szDetail, "%lu windows fused",
+              (unsigned long)lpCtx->nFusedWindows);
+      TraceEnd(nTraceStart, "language", "BindProgram",
+               lpCtx->nFusedWindows != 0 ? szDetail : NULL);
     }
+
+  return TRUE;
 }
 
-/*** ----------------------------- Run ----------------------------- ***/
+static BOOL MayJumpBack(LPLANGUAGE lpLanguage)
+{
+  /* only WCALL and fallback handlers get to pick the next command */
+  return lpLanguage != NULL
+         && (lpLanguage->lpfnFallbackProc != NULL
+             || (lpLanguage->aWCallHandlers != NULL
+                 && !IS_EMPTY_CMD(&lpLanguage->aWCallHandlers[0])));
+}
 
-typedef struct stRunContext
+/*** ------------------------- Threaded code ------------------------ ***/
+
+/* RunThreaded takes steps until a language is loaded, then decodes the
+   program into one cell per command, and one past the last, and goes
+   from cell to cell through computed goto where the compiler has it,
+   or a switch. A cell of a sinvoke handler calls it directly and the
+   built-ins have cells of their own; every other command takes one
+   step of HandleCommand or HandleFlatCommand, after which the run goes
+   on at the cell of the command the step left it at. The program is
+   decoded again after `language`, the bindings of its commands having
+   changed. */
+
+#if defined(__GNUC__)
+#define THREADED_GOTO
+#endif
+
+typedef enum
 {
-  LPPROGRAM lpProgram;
-  LPCOMMAND lpCurCmd;
-  LPVOID lpUserContext;
+  OP_STEP         = 0, /* a step of HandleCommand or HandleFlatCommand */
+  OP_SINVOKE      = 1, /* lpfnProc with the arguments of lpCmd */
+  OP_FLAT_SINVOKE = 2, /* lpfnProc with aszArgs */
+  OP_LANGUAGE     = 3, /* built-in `language`, decodes the program again */
+  OP_ABORT        = 4, /* built-in `abort` */
+  OP_END          = 5  /* past the last command */
+} OPCODE;
 
-  HMODULE hModule;
-  LPLANGUAGE lpLanguage;
-  BOOL bOwnLanguage;
-} *LPRUNCONTEXT;
+typedef struct stCell
+{
+#ifdef THREADED_GOTO
+  const void *lpLabel;
+#endif
+  OPCODE opcode;
+  LPSINVPROC lpfnProc;
+  LPCSTR *aszArgs;
+  /* a command of a linked program and its binding when decoded; one
+     rebound since takes a step instead */
+  LPCOMMAND lpCmd;
+  DWORDLONG dwlBinding;
+} CELL;
 
-static LPRUNCONTEXT CreateRunContext(LPPROGRAM lpProgram);
-static void DestroyRunContext(LPRUNCONTEXT lpCtx);
-static BOOL HandleCommand(LPRUNCONTEXT lpContext,
-                          LPCOMMAND lpCmd,
-                          LPERROR lpError);
-static BOOL LoadLanguage(LPRUNCONTEXT lpContext,
-                         LPCOMMAND lpCmd,
-                         LPERROR lpError);
-static LPLANGUAGE EasyLoad(HMODULE hModule,
-                           LPCSTR *aszCmdNames,
-                           LPERROR lpError);
+typedef struct stThreadedCode
+{
+  /* nCells + 1 cells, the last one OP_END */
+  CELL *aCells;
+  DWORD nCells;
+  /* cells of lpFlat indices rather than commands */
+  BOOL bFlat;
+  /* argument vectors of the OP_FLAT_SINVOKE cells */
+  LPCSTR *aszArgs;
+  /* cells of a linked program by command address, made the first time
+     a step does not go on to the next cell */
+  DWORD *anByCmd;
+  DWORD nByCmdMask;
+} THREADEDCODE;
 
-void RunProgram(LPPROGRAM lpProgram, LPERROR lpError)
+typedef enum
 {
-  LPRUNCONTEXT lpContext = CreateRunContext(lpProgram);
-  if (lpContext == NULL)
+  THREADED_ENDED  = 0, /* the run is over */
+  THREADED_DECODE = 1, /* decode again and go on */
+  THREADED_STEPS  = 2  /* the steps take over the rest of the run */
+} THREADEDEXIT;
+
+static BOOL DecodeProgram(LPRUNCONTEXT lpCtx, THREADEDCODE *lpCode);
+static BOOL DecodeLinked(LPRUNCONTEXT lpCtx, THREADEDCODE *lpCode);
+static BOOL DecodeFlat(LPRUNCONTEXT lpCtx, THREADEDCODE *lpCode);
+static OPCODE DecodeBinding(LPDISPATCHTABLE lpTable,
+                            DWORDLONG dwlBinding,
+                            CELL *lpCell);
+static void DropThreadedCode(THREADEDCODE *lpCode);
+static DWORD HashCell(LPCOMMAND lpCmd);
+static BOOL ThreadedPosition(LPRUNCONTEXT lpCtx,
+                             THREADEDCODE *lpCode,
+                             DWORD nNext,
+                             DWORD *lpnCell);
+static THREADEDEXIT RunCells(LPRUNCONTEXT lpCtx,
+                             THREADEDCODE *lpCode,
+                             DWORD nCell,
+                             LPERROR lpError);
+
+/* returns FALSE when the steps are to run the rest of the program,
+   which they do as well if it runs out of memory */
+static BOOL RunThreaded(LPRUNCONTEXT lpCtx, LPERROR lpError)
+{
+  /* the steps stop after the first command on an error set already */
+  if (IsError(lpError))
     {
-      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0),
-                NULL, "run: cannot allocate memory for run context");
-      return;
+      return FALSE;
+    }
+  for (;;)
+    {
+      /* commands before the language have no bindings to decode */
+      while (lpCtx->lpDispatch == NULL)
+        {
+          if (!RunStep(lpCtx, lpError) || IsError(lpError))
+            {
+              return TRUE;
+            }
+          if (lpCtx->bSuspended)
+            {
+              WaitSuspended(lpCtx);
+            }
+        }
+
+      THREADEDCODE code;
+      DWORD nCell;
+      if (!DecodeProgram(lpCtx, &code))
+        {
+          return FALSE;
+        }
+      THREADEDEXIT result = ThreadedPosition(lpCtx, &code, 0, &nCell)
+        ? RunCells(lpCtx, &code, nCell, lpError)
+        : THREADED_STEPS;
+      DropThreadedCode(&code);
+      if (result != THREADED_DECODE)
+        {
+          return result == THREADED_ENDED;
+        }
+      if (lpCtx->bSuspended)
+        {
+          WaitSuspended(lpCtx);
+        }
     }
+}
 
-  while (HandleCommand(lpContext, lpContext->lpCurCmd, lpError))
+static BOOL DecodeProgram(LPRUNCONTEXT lpCtx, THREADEDCODE *lpCode)
+{
+  lpCode->aCells = NULL;
+  lpCode->nCells = 0;
+  lpCode->bFlat = lpCtx->lpFlat != NULL;
+  lpCode->aszArgs = NULL;
+  lpCode->anByCmd = NULL;
+  lpCode->nByCmdMask = 0;
+  BOOL bRet = lpCode->bFlat ? DecodeFlat(lpCtx, lpCode)
+                            : DecodeLinked(lpCtx, lpCode);
+  if (!bRet)
     {
-      if (IsError(lpError))
+      DropThreadedCode(lpCode);
+      return FALSE;
+    }
+  lpCode->aCells[lpCode->nCells].opcode = OP_END;
+  lpCode->aCells[lpCode->nCells].lpCmd = NULL;
+  return TRUE;
+}
+
+static BOOL DecodeLinked(LPRUNCONTEXT lpCtx, THREADEDCODE *lpCode)
+{
+  /* grown as the list is walked, the program keeps no count */
+  DWORD nCap = 0;
+  DWORD nCells = 0;
+  for (LPCOMMAND iter = lpCtx->lpProgram->lpCommands;
+       ;
+       iter = iter->lpNext)
+    {
+      if (nCells == nCap)
+        {
+          nCap = nCap != 0 ? nCap * 2 : ATOM_MIN_SLOTS;
+          CELL *aCells = (CELL*)realloc(lpCode->aCells,
+                                        nCap * sizeof(CELL));
+          if (aCells == NULL)
+            {
+              return FALSE;
+            }
+          lpCode->aCells = aCells;
+        }
+      if (iter == NULL)
         {
           break;
         }
+      CELL *lpCell = &lpCode->aCells[nCells++];
+      lpCell->lpfnProc = NULL;
+      lpCell->aszArgs = NULL;
+      lpCell->lpCmd = iter;
+      lpCell->dwlBinding = iter->dwlBinding;
+      lpCell->opcode = DecodeBinding(lpCtx->lpDispatch, iter->dwlBinding,
+                                     lpCell);
+    }
+  lpCode->nCells = nCells;
+  return TRUE;
+}
+
+static BOOL DecodeFlat(LPRUNCONTEXT lpCtx, THREADEDCODE *lpCode)
+{
+  LPFLATPROGRAM lpFlat = lpCtx->lpFlat;
+  DWORD nCells = lpFlat->nCommands;
+  SIZE_T nArgs = (SIZE_T)lpFlat->nArgs + nCells;
+  lpCode->aCells = (CELL*)malloc((nCells + 1) * sizeof(CELL));
+  lpCode->aszArgs = nArgs != 0
+    ? (LPCSTR*)malloc(nArgs * sizeof(LPCSTR))
+    : NULL;
+  if (lpCode->aCells == NULL || (nArgs != 0 && lpCode->aszArgs == NULL))
+    {
+      return FALSE;
     }
+  lpCode->nCells = nCells;
 
-  DestroyRunContext(lpContext);
+  LPCSTR *lpszArg = lpCode->aszArgs;
+  for (DWORD i = 0; i < nCells; i++)
+    {
+      CELL *lpCell = &lpCode->aCells[i];
+      lpCell->lpfnProc = NULL;
+      lpCell->aszArgs = NULL;
+      lpCell->lpCmd = NULL;
+      lpCell->dwlBinding = 0;
+      lpCell->opcode = DecodeBinding(lpCtx->lpDispatch,
+                                     lpFlat->adwlBindings[i],
+                                     lpCell);
+      if (lpCell->opcode != OP_SINVOKE)
+        {
+          continue;
+        }
+      /* flat bindings only change with the language, which decodes the
+         program again, but the commands of a compiled program need not
+         follow each other */
+      const FLATCOMMAND *lpFlatCmd = &lpFlat->aCommands[i];
+      if (lpFlatCmd->nNext != (i + 1 < nCells ? i + 1 : FLAT_NONE))
+        {
+          lpCell->opcode = OP_STEP;
+          continue;
+        }
+      const DWORD *adwOffsets = lpFlat->adwArgOffsets
+                                + lpFlatCmd->nFirstArg;
+      lpCell->opcode = OP_FLAT_SINVOKE;
+      lpCell->aszArgs = lpszArg;
+      for (WORD k = 0; k < lpFlatCmd->nArgCount; k++)
+        {
+          *lpszArg++ = lpFlat->lpStrings + adwOffsets[k];
+        }
+      *lpszArg++ = NULL;
+    }
+  return TRUE;
 }
 
-static LPRUNCONTEXT CreateRunContext(LPPROGRAM lpProgram)
+static OPCODE DecodeBinding(LPDISPATCHTABLE lpTable,
+                            DWORDLONG dwlBinding,
+                            CELL *lpCell)
 {
-  LPRUNCONTEXT ret = (LPRUNCONTEXT)malloc(sizeof(struct stRunContext));
-  if (ret == NULL)
+  /* a command not bound yet binds in its step */
+  if (BINDING_SERIAL(dwlBinding) != lpTable->dwSerial)
     {
-      return NULL;
+      return OP_STEP;
+    }
+  BINDING *lpBinding = &lpTable->aBindings[BINDING_INDEX(dwlBinding)];
+  switch (lpBinding->kind)
+    {
+      case BIND_LANGUAGE:
+        return OP_LANGUAGE;
+      case BIND_ABORT:
+        return OP_ABORT;
+      case BIND_SINVOKE:
+        /* batches, warnings and lazy lookups are left to the step */
+        if (lpBinding->lpfnBatchProc != NULL
+            || lpBinding->lpSinvoke->bDeprecated
+            || lpBinding->lpfnProc == NULL)
+          {
+            return OP_STEP;
+          }
+        lpCell->lpfnProc = lpBinding->lpfnProc;
+        return OP_SINVOKE;
+      default:
+        return OP_STEP;
     }
+}
 
-  ret->lpProgram = lpProgram;
-  ret->lpCurCmd = lpProgram->lpCommands;
-  ret->lpUserContext = NULL;
-  ret->hModule = NULL;
-  ret->lpLanguage = NULL;
-  return ret;
+static void DropThreadedCode(THREADEDCODE *lpCode)
+{
+  free(lpCode->aCells);
+  free((LPVOID)lpCode->aszArgs);
+  free(lpCode->anByCmd);
 }
 
-static void DestroyRunContext(LPRUNCONTEXT lpCtx)
+static DWORD HashCell(LPCOMMAND lpCmd)
+{
+  return (DWORD)((ULONGLONG)(ULONG_PTR)lpCmd * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+/* the cell the last step left the run at, most often nNext; FALSE when
+   it has no cell, as a command spliced in by a handler, or out of
+   memory */
+static BOOL ThreadedPosition(LPRUNCONTEXT lpCtx,
+                             THREADEDCODE *lpCode,
+                             DWORD nNext,
+                             DWORD *lpnCell)
+{
+  if (lpCode->bFlat)
+    {
+      /* gone over to its views at a spliced-in command */
+      if (lpCtx->lpFlat == NULL)
+        {
+          return FALSE;
+        }
+      *lpnCell = lpCtx->nCurIdx != FLAT_NONE ? lpCtx->nCurIdx
+                                             : lpCode->nCells;
+      return TRUE;
+    }
+
+  LPCOMMAND lpCmd = lpCtx->lpCurCmd;
+  if (lpCmd == NULL)
+    {
+      *lpnCell = lpCode->nCells;
+      return TRUE;
+    }
+  if (nNext < lpCode->nCells && lpCode->aCells[nNext].lpCmd == lpCmd)
+    {
+      *lpnCell = nNext;
+      return TRUE;
+    }
+  if (lpCode->anByCmd == NULL)
+    {
+      DWORD nSlots = ATOM_MIN_SLOTS;
+      while (nSlots < lpCode->nCells * 2)
+        {
+          nSlots *= 2;
+        }
+      lpCode->anByCmd = (DWORD*)malloc(nSlots * sizeof(DWORD));
+      if (lpCode->anByCmd == NULL)
+        {
+          return FALSE;
+        }
+      lpCode->nByCmdMask = nSlots - 1;
+      memset(lpCode->anByCmd, 0xff, nSlots * sizeof(DWORD));
+      for (DWORD i = 0; i < lpCode->nCells; i++)
+        {
+          DWORD j = HashCell(lpCode->aCells[i].lpCmd)
+                    & lpCode->nByCmdMask;
+          while (lpCode->anByCmd[j] != DISPATCH_NONE)
+            {
+              j = (j + 1) & lpCode->nByCmdMask;
+            }
+          lpCode->anByCmd[j] = i;
+        }
+    }
+
+  DWORD j = HashCell(lpCmd) & lpCode->nByCmdMask;
+  while (lpCode->anByCmd[j] != DISPATCH_NONE)
+    {
+      if (lpCode->aCells[lpCode->anByCmd[j]].lpCmd == lpCmd)
+        {
+          *lpnCell = lpCode->anByCmd[j];
+          return TRUE;
+        }
+      j = (j + 1) & lpCode->nByCmdMask;
+    }
+  return FALSE;
+}
+
+#ifdef THREADED_GOTO
+#define CELL_CASE(op, label) label:
+#define NEXT_CELL() goto *lpCell->lpLabel
+#else
+#define CELL_CASE(op, label) case op:
+#define NEXT_CELL() continue
+#endif
+
+static THREADEDEXIT RunCells(LPRUNCONTEXT lpCtx,
+                             THREADEDCODE *lpCode,
+                             DWORD nCell,
+                             LPERROR lpError)
 {
-  if (lpCtx->hModule != NULL) 
+  CELL *aCells = lpCode->aCells;
+  CELL *lpCell = &aCells[nCell];
+  DWORD nIdx;
+#ifdef THREADED_GOTO
+  static const void *const s_aLabels[] =
     {
-      if (lpCtx->lpLanguage != NULL)
+      &&op_step, &&op_sinvoke, &&op_flat_sinvoke,
+      &&op_language, &&op_abort, &&op_end
+    };
+  for (DWORD i = 0; i <= lpCode->nCells; i++)
+    {
+      aCells[i].lpLabel = s_aLabels[aCells[i].opcode];
+    }
+  NEXT_CELL();
+#else
+  for (;;)
+    {
+      switch (lpCell->opcode)
         {
-          if (lpCtx->lpLanguage->lpfnAtexitProc != NULL)
+#endif
+          CELL_CASE(OP_SINVOKE, op_sinvoke)
+            {
+              LPCOMMAND lpCmd = lpCell->lpCmd;
+              if (lpCmd->dwlBinding != lpCell->dwlBinding)
+                {
+                  goto op_step;
+                }
+              lpCell->lpfnProc((LPCSTR*)lpCmd->aszArgs);
+              if (lpCmd->lpNext == lpCell[1].lpCmd && !lpCtx->bSuspended)
+                {
+                  ++lpCell;
+                  NEXT_CELL();
+                }
+              lpCtx->lpCurCmd = lpCmd->lpNext;
+              goto settle;
+            }
+
+          CELL_CASE(OP_FLAT_SINVOKE, op_flat_sinvoke)
+            {
+              /* handlers holding views may have renamed them */
+              if (lpCtx->alpViews != NULL)
+                {
+                  goto op_step;
+                }
+              lpCell->lpfnProc(lpCell->aszArgs);
+              if (!lpCtx->bSuspended)
+                {
+                  ++lpCell;
+                  NEXT_CELL();
+                }
+              FlatAdvance(lpCtx, (DWORD)(lpCell - aCells));
+              goto settle;
+            }
+
+#ifndef THREADED_GOTO
+          case OP_STEP:
+#endif
+        op_step:
+            {
+              nIdx = (DWORD)(lpCell - aCells);
+              if (!(lpCtx->lpFlat != NULL
+                    ? HandleFlatCommand(lpCtx, nIdx, lpError)
+                    : HandleCommand(lpCtx, lpCell->lpCmd, lpError))
+                  || IsError(lpError))
+                {
+                  return THREADED_ENDED;
+                }
+              goto settle;
+            }
+
+          CELL_CASE(OP_LANGUAGE, op_language)
+            {
+              nIdx = (DWORD)(lpCell - aCells);
+              if (!(lpCtx->lpFlat != NULL
+                    ? HandleFlatCommand(lpCtx, nIdx, lpError)
+                    : HandleCommand(lpCtx, lpCell->lpCmd, lpError))
+                  || IsError(lpError))
+                {
+                  return THREADED_ENDED;
+                }
+              return THREADED_DECODE;
+            }
+
+          CELL_CASE(OP_ABORT, op_abort)
+            {
+              if (lpCell->lpCmd != NULL
+                  && lpCell->lpCmd->dwlBinding != lpCell->dwlBinding)
+                {
+                  goto op_step;
+                }
+              return THREADED_ENDED;
+            }
+
+          CELL_CASE(OP_END, op_end)
             {
-              lpCtx->lpLanguage->lpfnAtexitProc(lpCtx->lpUserContext);
+              return THREADED_ENDED;
             }
-          if (lpCtx->bOwnLanguage)
+
+        settle:
+          if (lpCtx->bSuspended)
+            {
+              WaitSuspended(lpCtx);
+            }
+          if (!ThreadedPosition(lpCtx, lpCode,
+                                (DWORD)(lpCell - aCells) + 1, &nCell))
             {
-              free(lpCtx->lpLanguage->aSinvokeHandlers);
-              free(lpCtx->lpLanguage->aWCallHandlers);
-              free(lpCtx->lpLanguage);
+              return THREADED_STEPS;
             }
-          lpCtx->lpLanguage = NULL;
+          lpCell = &aCells[nCell];
+          NEXT_CELL();
+#ifndef THREADED_GOTO
         }
-      if (FreeLibrary(lpCtx->hModule) == 0)
-        {
-        fprintf(stderr, "[int/e] error invoking FreeLibrary: %ld\n",
-                GetLastError());
-      }
     }
-  free(lpCtx);
+#endif
 }
 
-static BOOL HandleCommand(LPRUNCONTEXT lpCtx,
-                          LPCOMMAND lpCmd,
-                          LPERROR lpError)
+#undef CELL_CASE
+#undef NEXT_CELL
+
+/*** ---------------------------- Sessions -------------------------- ***/
+
+#define SESSION_MIN_TEXT 4096
+
+struct stSession
 {
-  if (lpCmd == NULL)
+  LPPARSECONTEXT lpParse;
+  LPRUNCONTEXT lpCtx;
+
+  /* cbFill bytes of text not parsed yet, always followed by a `\0` */
+  PCHAR pcText;
+  SIZE_T cbText;
+  SIZE_T cbFill;
+  BOOL bEnded;
+};
+
+static void SkipFedText(LPSESSION lpSession);
+
+LPSESSION OpenSession(LPCSTR lpszFileName,
+                      const RUNOPTIONS *lpOptions,
+                      WORD nParseBufferSize,
+                      LPERROR lpError)
+{
+  LPSESSION ret = (LPSESSION)malloc(sizeof(struct stSession));
+  PCHAR pcText = (PCHAR)malloc(SESSION_MIN_TEXT);
+  LPPARSECONTEXT lpParse = pcText != NULL
+    ? CreateParseContext(pcText, nParseBufferSize)
+    : NULL;
+  LPRUNCONTEXT lpCtx = lpParse != NULL && ret != NULL
+    ? CreateRunContext(&lpParse->lpProgram, lpOptions)
+    : NULL;
+  if (lpCtx == NULL)
+    {
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(lpszFileName, 0), NULL,
+                "session: cannot allocate memory for session");
+      free(lpParse);
+      free(pcText);
+      free(ret);
+      return NULL;
+    }
+
+  pcText[0] = '\0';
+  if (lpszFileName != NULL)
+    {
+      lpParse->srcInfo.lpszFileName = lpszFileName;
+    }
+  lpParse->bCopyStrings = TRUE;
+  lpParse->bPartial = TRUE;
+
+  ret->lpParse = lpParse;
+  ret->lpCtx = lpCtx;
+  ret->pcText = pcText;
+  ret->cbText = SESSION_MIN_TEXT - 1;
+  ret->cbFill = 0;
+  ret->bEnded = FALSE;
+  return ret;
+}
+
+BOOL FeedSession(LPSESSION lpSession,
+                 LPCSTR lpszText,
+                 SIZE_T cbText,
+                 LPERROR lpError)
+{
+  LPPARSECONTEXT lpParse = lpSession->lpParse;
+  LPRUNCONTEXT lpCtx = lpSession->lpCtx;
+  if (lpSession->bEnded)
+    {
+      return FALSE;
+    }
+
+  /* as in a stream, the text parsed so far makes way for the new */
+  SyncLine(lpParse);
+  SIZE_T cbKeep = lpSession->cbFill - lpParse->nSrcIdx;
+  memmove(lpSession->pcText, lpSession->pcText + lpParse->nSrcIdx, cbKeep);
+  lpParse->nSrcIdx = 0;
+  lpParse->nLineIdx = 0;
+  lpSession->cbFill = cbKeep;
+
+  /* a `\0` in the text ends it, as it does for ParseProgram */
+  PCHAR pcNul = cbText != 0 ? (PCHAR)memchr(lpszText, '\0', cbText) : NULL;
+  if (pcNul != NULL)
+    {
+      cbText = (SIZE_T)(pcNul - lpszText);
+    }
+  if (cbKeep + cbText > lpSession->cbText)
+    {
+      SIZE_T cbNew = lpSession->cbText * 2 + 1;
+      while (cbNew - 1 < cbKeep + cbText)
+        {
+          cbNew *= 2;
+        }
+      PCHAR pcText = (PCHAR)realloc(lpSession->pcText, cbNew);
+      if (pcText == NULL)
+        {
+          ErrPrintf(lpError, PL2ERR_MALLOC, CurSrcInfo(lpParse), NULL,
+                    "session: cannot allocate memory for fed text");
+          return TRUE;
+        }
+      lpSession->pcText = lpParse->lpszSrc = pcText;
+      lpSession->cbText = cbNew - 1;
+    }
+  if (cbText != 0)
     {
-      return FALSE;
+      memcpy(lpSession->pcText + cbKeep, lpszText, cbText);
+      lpSession->cbFill += cbText;
     }
+  lpSession->pcText[lpSession->cbFill] = '\0';
 
-  if (!strcmp(lpCmd->lpszCmd, "language"))
+  if (lpCtx->lpCurCmd == NULL && !MayJumpBack(lpCtx->lpLanguage))
     {
-      return LoadLanguage(lpCtx, lpCmd, lpError);
+      DropCommands(&lpParse->lpProgram);
+      lpParse->lpListTail = NULL;
     }
-  else if (!strcmp(lpCmd->lpszCmd, "abort"))
+  LPCOMMAND lpTail = lpParse->lpListTail;
+  while (lpTail != NULL && lpTail->lpNext != NULL)
     {
-      return FALSE;
+      lpTail = lpTail->lpNext;
     }
+  lpParse->lpListTail = lpTail;
 
-  if (lpCtx->lpLanguage == NULL)
+  LONGLONG nTraceStart = TraceBegin();
+  lpParse->bPartial = cbText != 0;
+  lpParse->bNeedInput = FALSE;
+  ParseSource(lpParse, lpError);
+
+  /* commands before a bad one still run, its error is reported after
+     them */
+  LPERROR lpParseError = NULL;
+  if (IsError(lpError))
     {
-      ErrPrintf(lpError, PL2ERR_NO_LANG, lpCmd->srcInfo, NULL,
-                "no language loaded to execute user command");
-      return FALSE;
+      lpParseError = ErrorBuffer(lpError->nErrorBufferSize);
+      if (lpParseError != NULL)
+        {
+          ErrPrintf(lpParseError, lpError->nLine, lpError->srcInfo,
+                    lpError->lpExtraData, "%s", ErrorReason(lpError));
+          lpError->nLine = 0;
+          lpError->lpExtraData = NULL;
+        }
+      SkipFedText(lpSession);
+    }
+  LPCOMMAND lpFirst = lpTail != NULL
+    ? lpTail->lpNext
+    : lpParse->lpProgram.lpCommands;
+  if (lpCtx->lpCurCmd == NULL)
+    {
+      lpCtx->lpCurCmd = lpFirst;
     }
 
-  for (SINVHANDLER *iter = lpCtx->lpLanguage->aSinvokeHandlers;
-       iter != NULL && !IS_EMPTY_SINVOKE_CMD(iter);
-       ++iter)
+  LPRUNCONTEXT lpOuter = EnterRun(lpCtx);
+  while (lpCtx->lpCurCmd != NULL && !IsError(lpError))
     {
-      if (!iter->bRemoved && !strcmp(lpCmd->lpszCmd, iter->lpszCmdName))
+      if (!StepRun(lpCtx, lpError))
         {
-          if (iter->bDeprecated)
-            {
-              fprintf(stderr, "[int/w] using deprecated command: %s\n",
-                      iter->lpszCmdName);
-            }
-          if (iter->lpfnHandlerProc != NULL)
-            {
-              iter->lpfnHandlerProc((LPCSTR*)lpCmd->aszArgs);
-            }
-          lpCtx->lpCurCmd = lpCmd->lpNext;
-          return TRUE;
+          lpSession->bEnded = !IsError(lpError);
+          break;
+        }
+      if (lpCtx->bSuspended)
+        {
+          WaitSuspended(lpCtx);
         }
     }
+  LeaveRun(lpOuter);
+  if (IsError(lpError))
+    {
+      /* the commands after the failing one are dropped with their text */
+      lpCtx->lpCurCmd = NULL;
+      SkipFedText(lpSession);
+      lpSession->bEnded = FALSE;
+    }
+  TraceEnd(nTraceStart, "run", "FeedSession", NULL);
 
-  for (WCALLHANDLER *iter = lpCtx->lpLanguage->aWCallHandlers;
-       iter != NULL && !IS_EMPTY_CMD(iter);
-       ++iter)
+  if (lpParseError != NULL)
     {
-      if (!iter->bRemoved && !strcmp(lpCmd->lpszCmd, iter->lpszCmdName))
+      if (!IsError(lpError))
         {
-          if (iter->lpszCmdName != NULL
-              && strcmp(lpCmd->lpszCmd, iter->lpszCmdName) != 0)
-            {
-              // Do nothing if so
-            }
-          else if (iter->lpfnRouterProc != NULL
-                   && !iter->lpfnRouterProc(lpCmd->lpszCmd))
-            {
-              // Do nothing if so
-            }
-          else
-            {
-              if (iter->bDeprecated)
-                {
-                  fprintf(stderr,
-                          "[int/w] using deprecated command: %s\n",
-                          iter->lpszCmdName);
-                }
-              if (iter->lpfnHandlerProc == NULL)
-                {
-                  lpCtx->lpCurCmd = lpCmd->lpNext;
-                  return TRUE;
-                }
-
-              LPCOMMAND pNextCmd = iter->lpfnHandlerProc
-                (
-                  lpCtx->lpProgram,
-                  lpCtx->lpUserContext,
-                  lpCmd,
-                  lpError
-                );
-              if (IsError(lpError))
-                {
-                  return 0;
-                }
-              if (pNextCmd == lpCtx->lpLanguage->lpTermCmd)
-                {
-                  return 0;
-                }
-              lpCtx->lpCurCmd = pNextCmd ? pNextCmd : lpCmd->lpNext;
-              return 1;
-            }
+          ErrPrintf(lpError, lpParseError->nLine, lpParseError->srcInfo,
+                    lpParseError->lpExtraData, "%s",
+                    ErrorReason(lpParseError));
         }
+      DropError(lpParseError);
     }
-
-  if (lpCtx->lpLanguage->lpfnFallbackProc == NULL)
+  if (cbText == 0)
     {
-      ErrPrintf(lpError, PL2ERR_UNKNOWN_CMD, lpCmd->srcInfo, NULL,
-                "`%s` is not recognized as an internal or external "
-                "command, operable lpProgram or batch file",
-                lpCmd->lpszCmd);
-      return 0;
+      lpSession->bEnded = TRUE;
     }
+  return !lpSession->bEnded;
+}
 
-  LPCOMMAND pNextCmd = lpCtx->lpLanguage->lpfnFallbackProc
-    (
-      lpCtx->lpProgram,
-      lpCtx->lpUserContext,
-      lpCmd,
-      lpError
-    );
+BOOL SessionNeedsInput(LPSESSION lpSession)
+{
+  return lpSession->lpParse->nSrcIdx < lpSession->cbFill;
+}
 
-  if (pNextCmd == lpCtx->lpLanguage->lpTermCmd)
-    {
-      ErrPrintf(lpError, PL2ERR_UNKNOWN_CMD, lpCmd->srcInfo, NULL,
-                "`%s` is not recognized as an internal or external "
-                "command, operable lpProgram or batch file",
-                lpCmd->lpszCmd);
-      return 0;
-    }
+void CloseSession(LPSESSION lpSession)
+{
+  DestroyRunContext(lpSession->lpCtx);
+  DropProgram(&lpSession->lpParse->lpProgram);
+  free(lpSession->lpParse);
+  free(lpSession->pcText);
+  free(lpSession);
+}
 
-  if (IsError(lpError))
+static void SkipFedText(LPSESSION lpSession)
+{
+  LPPARSECONTEXT lpParse = lpSession->lpParse;
+  lpParse->nSrcIdx = lpSession->cbFill;
+  SyncLine(lpParse);
+  SaveParsePoint(lpParse);
+  RestoreParsePoint(lpParse);
+}
+
+/*** --------------------------- Scheduler -------------------------- ***/
+
+/* steps a run takes before the next ready one gets its turn */
+#define SCHED_SLICE 256
+
+typedef struct stSchedRun
+{
+  struct stSchedRun *lpNext;
+  struct stScheduler *lpScheduler;
+  LPRUNCONTEXT lpCtx;
+  LPERROR lpError;
+  /* wait registered with the thread pool, or the deadline of a run
+     waiting without an object */
+  HANDLE hWait;
+  ULONGLONG nDeadline;
+} *LPSCHEDRUN;
+
+struct stScheduler
+{
+  HANDLE hPort;
+  LPSCHEDRUN lpReadyHead;
+  LPSCHEDRUN lpReadyTail;
+  /* binary heap on nDeadline */
+  LPSCHEDRUN *alpTimers;
+  DWORD nTimers;
+  DWORD nTimerCap;
+  /* runs not ended yet, and those of them waiting in the thread pool */
+  DWORD nRuns;
+  DWORD nWaits;
+};
+
+typedef enum
+{
+  SLICE_READY,
+  SLICE_SUSPENDED,
+  SLICE_ENDED
+} SLICERESULT;
+
+static SLICERESULT RunSlice(LPSCHEDRUN lpRun);
+static void MakeReady(LPSCHEDULER lpScheduler, LPSCHEDRUN lpRun);
+static void ParkRun(LPSCHEDULER lpScheduler, LPSCHEDRUN lpRun);
+static void EndRun(LPSCHEDULER lpScheduler, LPSCHEDRUN lpRun);
+static void PollScheduler(LPSCHEDULER lpScheduler, BOOL bBlock);
+static VOID CALLBACK WaitCallback(PVOID lpParam, BOOLEAN bTimedOut);
+static BOOL PushTimer(LPSCHEDULER lpScheduler, LPSCHEDRUN lpRun);
+static LPSCHEDRUN PopTimer(LPSCHEDULER lpScheduler);
+
+LPSCHEDULER CreateScheduler(LPERROR lpError)
+{
+  LPSCHEDULER ret = (LPSCHEDULER)malloc(sizeof(struct stScheduler));
+  if (ret == NULL)
     {
-      return 0;
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0), NULL,
+                "scheduler: cannot allocate memory for scheduler");
+      return NULL;
     }
-  if (pNextCmd == lpCtx->lpLanguage->lpTermCmd)
+  ret->hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+  if (ret->hPort == NULL)
     {
-      return 0;
+      ErrPrintf(lpError, PL2ERR_GENERAL, SourceInfo(NULL, 0), NULL,
+                "scheduler: cannot create completion port: %ld",
+                GetLastError());
+      free(ret);
+      return NULL;
     }
-
-  lpCtx->lpCurCmd = pNextCmd ? pNextCmd : lpCmd->lpNext;
-  return 1;
+  ret->lpReadyHead = NULL;
+  ret->lpReadyTail = NULL;
+  ret->alpTimers = NULL;
+  ret->nTimers = 0;
+  ret->nTimerCap = 0;
+  ret->nRuns = 0;
+  ret->nWaits = 0;
+  return ret;
 }
 
-static BOOL LoadLanguage(LPRUNCONTEXT lpCtx,
-                         LPCOMMAND lpCmd,
-                         LPERROR lpError)
+BOOL ScheduleProgram(LPSCHEDULER lpScheduler,
+                     LPPROGRAM lpProgram,
+                     const RUNOPTIONS *lpOptions,
+                     LPERROR lpError)
 {
-  if (lpCtx->lpLanguage != NULL)
+  LPSCHEDRUN lpRun = (LPSCHEDRUN)malloc(sizeof(struct stSchedRun));
+  LPRUNCONTEXT lpCtx = lpRun != NULL
+    ? CreateRunContext(lpProgram, lpOptions)
+    : NULL;
+  if (lpCtx == NULL)
     {
-      ErrPrintf(lpError, PL2ERR_LOAD_LANG, lpCmd->srcInfo, NULL,
-                "language: another language already loaded");
+      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0),
+                NULL, "run: cannot allocate memory for run context");
+      free(lpRun);
       return FALSE;
     }
+  lpRun->lpScheduler = lpScheduler;
+  lpRun->lpCtx = lpCtx;
+  lpRun->lpError = lpError;
+  lpRun->hWait = NULL;
+  lpRun->nDeadline = 0;
+  ++lpScheduler->nRuns;
+  MakeReady(lpScheduler, lpRun);
+  return TRUE;
+}
 
-  WORD nArgCount = CountCommandArgs(lpCmd);
-  if (nArgCount != 2)
+void RunScheduler(LPSCHEDULER lpScheduler)
+{
+  LONGLONG nTraceStart = TraceBegin();
+  while (lpScheduler->nRuns != 0)
     {
-      ErrPrintf(lpError, PL2ERR_LOAD_LANG, lpCmd->srcInfo, NULL,
-                "language: expected 2 argument, got %u",
-                nArgCount);
-      return FALSE;
+      LPSCHEDRUN lpRun = lpScheduler->lpReadyHead;
+      if (lpRun == NULL)
+        {
+          PollScheduler(lpScheduler, TRUE);
+          continue;
+        }
+      lpScheduler->lpReadyHead = lpRun->lpNext;
+      if (lpScheduler->lpReadyHead == NULL)
+        {
+          lpScheduler->lpReadyTail = NULL;
+        }
+
+      switch (RunSlice(lpRun))
+        {
+          case SLICE_READY:
+            MakeReady(lpScheduler, lpRun);
+            break;
+          case SLICE_SUSPENDED:
+            ParkRun(lpScheduler, lpRun);
+            break;
+          case SLICE_ENDED:
+            EndRun(lpScheduler, lpRun);
+            break;
+        }
+      /* waits that ended meanwhile queue up behind the ready runs */
+      if (lpScheduler->nWaits != 0 || lpScheduler->nTimers != 0)
+        {
+          PollScheduler(lpScheduler, FALSE);
+        }
     }
+  TraceEnd(nTraceStart, "run", "RunScheduler", NULL);
+}
 
-  LPCSTR lpszLangId = lpCmd->aszArgs[0];
-  SEMVER langVer = ParseSemVer(lpCmd->aszArgs[1], lpError);
-  if (IsError(lpError)) 
+void DropScheduler(LPSCHEDULER lpScheduler)
+{
+  /* only runs that never got to wait can be left over */
+  while (lpScheduler->lpReadyHead != NULL)
     {
-      return FALSE;
+      LPSCHEDRUN lpRun = lpScheduler->lpReadyHead;
+      lpScheduler->lpReadyHead = lpRun->lpNext;
+      EndRun(lpScheduler, lpRun);
     }
-
-  static CHAR s_szBuffer[4096];
-  strcpy(s_szBuffer, "./lib");
-  strcat(s_szBuffer, lpszLangId);
-  strcat(s_szBuffer, ".dll");
-  lpCtx->hModule = LoadLibraryA(s_szBuffer);
-
-  if (lpCtx->hModule == NULL)
+  while (lpScheduler->nTimers != 0)
     {
-      ErrPrintf(lpError, PL2ERR_LOAD_LANG, lpCmd->srcInfo, NULL,
-                "language: cannot load language library `%s`: %ld",
-                lpszLangId, GetLastError());
-      return FALSE;
+      EndRun(lpScheduler, PopTimer(lpScheduler));
     }
+  CloseHandle(lpScheduler->hPort);
+  free(lpScheduler->alpTimers);
+  free(lpScheduler);
+}
 
-  LPLOADPROC lpfnLoadProc = (LPLOADPROC)GetProcAddress
-    (
-      lpCtx->hModule,
-      "LoadLanguageExtension"
-    );
-  if (lpfnLoadProc == NULL)
+static SLICERESULT RunSlice(LPSCHEDRUN lpRun)
+{
+  LPRUNCONTEXT lpCtx = lpRun->lpCtx;
+  SLICERESULT result = SLICE_ENDED;
+  LPRUNCONTEXT lpOuter = EnterRun(lpCtx);
+  for (DWORD i = 0; i < SCHED_SLICE; i++)
     {
-      LPEASYLOADPROC lpfnEasyLoadProc = (LPEASYLOADPROC)GetProcAddress
-        (
-          lpCtx->hModule,
-          "EasyLoadLanguageExtension"
-        );
-
-      if (lpfnEasyLoadProc == NULL)
+      if (!StepRun(lpCtx, lpRun->lpError) || IsError(lpRun->lpError))
         {
-          ErrPrintf(lpError, PL2ERR_LOAD_LANG, lpCmd->srcInfo, NULL,
-                    "language: cannot locate `%s` or `%s` "
-                    "on library `%s`: %ld",
-                    "LoadLanguageExtension",
-                    "EasyLoadLanguageExtension",
-                    lpszLangId,
-                    GetLastError());
-          return FALSE;
+          result = SLICE_ENDED;
+          break;
         }
-
-      lpCtx->lpLanguage = EasyLoad(lpCtx->hModule, lpfnEasyLoadProc(), lpError);
-      if (IsError(lpError))
+      if (lpCtx->bSuspended)
         {
-          lpError->srcInfo = lpCmd->srcInfo;
-          return FALSE;
+          result = SLICE_SUSPENDED;
+          break;
         }
-      lpCtx->bOwnLanguage = TRUE;
+      result = SLICE_READY;
+    }
+  LeaveRun(lpOuter);
+  return result;
+}
+
+static void MakeReady(LPSCHEDULER lpScheduler, LPSCHEDRUN lpRun)
+{
+  lpRun->lpNext = NULL;
+  if (lpScheduler->lpReadyTail != NULL)
+    {
+      lpScheduler->lpReadyTail->lpNext = lpRun;
     }
   else
     {
-      lpCtx->lpLanguage = lpfnLoadProc(langVer, lpError);
-      if (IsError(lpError))
-        {
-          lpError->srcInfo = lpCmd->srcInfo;
-          return FALSE;
-        }
-      lpCtx->bOwnLanguage = FALSE;
+      lpScheduler->lpReadyHead = lpRun;
     }
+  lpScheduler->lpReadyTail = lpRun;
+}
 
-  if (lpCtx->lpLanguage != NULL && lpCtx->lpLanguage->lpfnInitProc != NULL)
+static void ParkRun(LPSCHEDULER lpScheduler, LPSCHEDRUN lpRun)
+{
+  LPRUNCONTEXT lpCtx = lpRun->lpCtx;
+  lpCtx->bSuspended = FALSE;
+  if (lpCtx->hSuspendObject == NULL)
     {
-      lpCtx->lpUserContext = lpCtx->lpLanguage->lpfnInitProc(lpError);
-      if (IsError(lpError))
+      lpRun->nDeadline = lpCtx->dwSuspendMs == INFINITE
+        ? (ULONGLONG)-1
+        : GetTickCount64() + lpCtx->dwSuspendMs;
+      if (PushTimer(lpScheduler, lpRun))
         {
-          lpError->srcInfo = lpCmd->srcInfo;
-          return FALSE;
+          return;
         }
     }
+  else if (RegisterWaitForSingleObject(&lpRun->hWait,
+                                       lpCtx->hSuspendObject,
+                                       WaitCallback,
+                                       lpRun,
+                                       lpCtx->dwSuspendMs,
+                                       WT_EXECUTEONLYONCE))
+    {
+      ++lpScheduler->nWaits;
+      return;
+    }
 
-  lpCtx->lpCurCmd = lpCmd->lpNext;
-  return TRUE;
+  /* out of resources, the run waits on the scheduler thread instead */
+  lpCtx->bSuspended = TRUE;
+  WaitSuspended(lpCtx);
+  MakeReady(lpScheduler, lpRun);
 }
 
-static LPLANGUAGE EasyLoad(HMODULE hModule,
-                           LPCSTR *aszCmdNames,
-                           LPERROR lpError)
+static void EndRun(LPSCHEDULER lpScheduler, LPSCHEDRUN lpRun)
 {
-  if (aszCmdNames == NULL || aszCmdNames[0] == NULL)
+  DestroyRunContext(lpRun->lpCtx);
+  free(lpRun);
+  --lpScheduler->nRuns;
+}
+
+static void PollScheduler(LPSCHEDULER lpScheduler, BOOL bBlock)
+{
+  DWORD dwTimeout = bBlock ? INFINITE : 0;
+  if (bBlock && lpScheduler->nTimers != 0)
     {
-      return NULL;
+      ULONGLONG nNow = GetTickCount64();
+      ULONGLONG nDeadline = lpScheduler->alpTimers[0]->nDeadline;
+      dwTimeout = nDeadline <= nNow ? 0
+        : nDeadline - nNow >= INFINITE ? INFINITE - 1
+        : (DWORD)(nDeadline - nNow);
     }
 
-  WORD wCount = 0;
-  for (LPCSTR* iter = aszCmdNames; *iter != NULL; iter++)
+  DWORD dwTimedOut;
+  ULONG_PTR lpKey;
+  LPOVERLAPPED lpOverlapped;
+  while (lpScheduler->nWaits != 0
+         && GetQueuedCompletionStatus(lpScheduler->hPort,
+                                      &dwTimedOut,
+                                      &lpKey,
+                                      &lpOverlapped,
+                                      dwTimeout))
     {
-      ++wCount;
+      LPSCHEDRUN lpRun = (LPSCHEDRUN)lpKey;
+      UnregisterWaitEx(lpRun->hWait, NULL);
+      lpRun->hWait = NULL;
+      lpRun->lpCtx->dwSuspendResult = dwTimedOut ? WAIT_TIMEOUT
+                                                 : WAIT_OBJECT_0;
+      --lpScheduler->nWaits;
+      MakeReady(lpScheduler, lpRun);
+      dwTimeout = 0;
     }
-
-  LPLANGUAGE ret = (LPLANGUAGE)malloc(sizeof(struct stLanguage));
-  if (ret == NULL)
+  if (lpScheduler->nWaits == 0 && dwTimeout != 0
+      && lpScheduler->nTimers != 0)
     {
-      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0),
-                NULL,
-                "language: ezload: "
-                "cannot allocate memory for pl2w_Language");
-      return NULL;
+      /* no completion can end the wait, only the first timer */
+      Sleep(dwTimeout);
     }
 
-  ret->lpszLangName = "unknown";
-  ret->lpszLangInfo = "anonymous language loaded by ezload";
-  ret->lpTermCmd = NULL;
-  ret->lpfnInitProc = NULL;
-  ret->lpfnAtexitProc = NULL;
-  ret->aWCallHandlers = NULL;
-  ret->lpfnFallbackProc = NULL;
-  ret->aSinvokeHandlers = (SINVHANDLER*)malloc
-    (
-      sizeof(SINVHANDLER) * (wCount + 1)
-    );
-  if (ret->aSinvokeHandlers == NULL)
+  ULONGLONG nNow = GetTickCount64();
+  while (lpScheduler->nTimers != 0
+         && lpScheduler->alpTimers[0]->nDeadline <= nNow)
     {
-      ErrPrintf(lpError, PL2ERR_MALLOC, SourceInfo(NULL, 0),
-                NULL,
-                "langauge: EasyLoad: "
-                "cannot allocate memory for "
-                "LPLANGUAGE->aSinvokeHandlers");
-      free(ret);
-      return NULL;
+      LPSCHEDRUN lpRun = PopTimer(lpScheduler);
+      lpRun->lpCtx->dwSuspendResult = WAIT_TIMEOUT;
+      MakeReady(lpScheduler, lpRun);
     }
+}
 
-  memset(ret->aSinvokeHandlers, 0, (wCount + 1) * sizeof(SINVHANDLER));
-  static CHAR szNameBuffer[512];
-  for (WORD i = 0; i < wCount; i++)
+static VOID CALLBACK WaitCallback(PVOID lpParam, BOOLEAN bTimedOut)
+{
+  LPSCHEDRUN lpRun = (LPSCHEDRUN)lpParam;
+  PostQueuedCompletionStatus(lpRun->lpScheduler->hPort,
+                             bTimedOut ? 1 : 0,
+                             (ULONG_PTR)lpRun,
+                             NULL);
+}
+
+static BOOL PushTimer(LPSCHEDULER lpScheduler, LPSCHEDRUN lpRun)
+{
+  if (lpScheduler->nTimers == lpScheduler->nTimerCap)
     {
-      LPCSTR lpszCmdName = aszCmdNames[i];
-      if (strlen(lpszCmdName) > 504) {
-        ErrPrintf(lpError, PL2ERR_LOAD_LANG, SourceInfo(NULL, 0),
-                  NULL,
-                  "language: EasyLoad: "
-                  "name over 504 chars not supported");
-        free(ret->aSinvokeHandlers);
-        free(ret);
-        return NULL;
-      }
-      strcpy(szNameBuffer, "EL");
-      strncat(szNameBuffer, lpszCmdName, 504);
-      void *ptr = GetProcAddress(hModule, szNameBuffer);
-      if (ptr == NULL)
-        {
-          ErrPrintf(lpError, PL2ERR_LOAD_LANG, SourceInfo(NULL, 0),
-                    NULL,
-                    "language: ezload: cannot load function `%s`: %ld",
-                    szNameBuffer, GetLastError());
-          free(ret->aSinvokeHandlers);
-          free(ret);
-          return NULL;
+      DWORD nCap = lpScheduler->nTimerCap != 0
+        ? lpScheduler->nTimerCap * 2
+        : 64;
+      LPSCHEDRUN *alpTimers = (LPSCHEDRUN*)realloc
+        (
+          lpScheduler->alpTimers,
+          nCap * sizeof(LPSCHEDRUN)
+        );
+      if (alpTimers == NULL)
+        {
+          return FALSE;
         }
+      lpScheduler->alpTimers = alpTimers;
+      lpScheduler->nTimerCap = nCap;
+    }
 
-      ret->aSinvokeHandlers[i].lpszCmdName = lpszCmdName;
-      ret->aSinvokeHandlers[i].lpfnHandlerProc = (LPSINVPROC)ptr;
-      ret->aSinvokeHandlers[i].bDeprecated = FALSE;
-      ret->aSinvokeHandlers[i].bRemoved = FALSE;
+  LPSCHEDRUN *alpTimers = lpScheduler->alpTimers;
+  DWORD i = lpScheduler->nTimers++;
+  while (i != 0 && alpTimers[(i - 1) / 2]->nDeadline > lpRun->nDeadline)
+    {
+      alpTimers[i] = alpTimers[(i - 1) / 2];
+      i = (i - 1) / 2;
     }
+  alpTimers[i] = lpRun;
+  return TRUE;
+}
 
+static LPSCHEDRUN PopTimer(LPSCHEDULER lpScheduler)
+{
+  LPSCHEDRUN *alpTimers = lpScheduler->alpTimers;
+  LPSCHEDRUN ret = alpTimers[0];
+  LPSCHEDRUN lpLast = alpTimers[--lpScheduler->nTimers];
+  DWORD nCount = lpScheduler->nTimers;
+  DWORD i = 0;
+  for (;;)
+    {
+      DWORD nChild = i * 2 + 1;
+      if (nChild >= nCount)
+        {
+          break;
+        }
+      if (nChild + 1 < nCount
+          && alpTimers[nChild + 1]->nDeadline < alpTimers[nChild]->nDeadline)
+        {
+          ++nChild;
+        }
+      if (alpTimers[nChild]->nDeadline >= lpLast->nDeadline)
+        {
+          break;
+        }
+      alpTimers[i] = alpTimers[nChild];
+      i = nChild;
+    }
+  if (nCount != 0)
+    {
+      alpTimers[i] = lpLast;
+    }
   return ret;
 }
@@ -35,22 +35,43 @@ typedef enum
 typedef struct
 {
     LPCSTR lpszFileName;
-    WORD nLine;
+    DWORDLONG nLine;
 } SRCINFO;
 
-SRCINFO SourceInfo(LPCSTR lpszFileName, WORD nLine);
+SRCINFO SourceInfo(LPCSTR lpszFileName, DWORDLONG nLine);
 
 /*** -------------------------- PL2ERR ------------------------- ***/
 
+#define ERROR_MAX_ARGS  4
+#define ERROR_ARG_CHARS 128
+
+typedef union
+{
+  LONGLONG i;
+  double d;
+  LPCVOID p;
+} ERRARG;
+
 typedef struct stError
 {
   LPVOID lpExtraData;
   SRCINFO srcInfo;
   WORD nLine;
   WORD nErrorBufferSize;
+  /* a lazy error keeps the format of ErrPrintf and up to ERROR_MAX_ARGS
+     arguments, `%s` ones copied to szArgs, and only formats szReason in
+     ErrorReason; lpszFmt is NULL once szReason is up to date */
+  BOOL bLazy;
+  LPCSTR lpszFmt;
+  ERRARG aArgs[ERROR_MAX_ARGS];
+  CHAR szArgs[ERROR_ARG_CHARS];
   char szReason[0];
 } *LPERROR;
 
+/* bytes an error with an nBufferSize byte reason takes */
+#define ERROR_BUFFER_SIZE(nBufferSize) \
+  (sizeof(struct stError) + (nBufferSize))
+
 typedef enum
 {
   PL2ERR_NONE           = 0,  /* no error */
@@ -71,6 +92,20 @@ typedef enum
 
 LPERROR ErrorBuffer(WORD nBufferSize);
 
+/* sets up an error in cbBuffer bytes of caller memory, such as a stack
+   or thread-local array of ERROR_BUFFER_SIZE bytes; it is not passed
+   to DropError, and its lpExtraData is left to the caller. A lazy one
+   leaves formatting to ErrorReason, so errors that are only tested
+   with IsError and cleared cost no vsnprintf. NULL when cbBuffer is
+   too small */
+LPERROR InitError(LPVOID lpBuffer, SIZE_T cbBuffer, BOOL bLazy);
+
+/* a lazy error keeps lpszFmt itself, not a copy, so it must outlive the
+   error: a language's handlers formatting with their own strings leave
+   it pointing into the library, which EvictLanguages may unload. Call
+   ErrorReason before then. `%s` arguments are copied, and integers are
+   read as the type their length names, so `%ld` takes a long, which is
+   32 bits on Windows */
 void ErrPrintf(LPERROR lpError,
                WORD nLine,
                SRCINFO srcInfo,
@@ -80,6 +115,11 @@ void ErrPrintf(LPERROR lpError,
 
 void DropError(LPERROR lpError);
 
+/* szReason, formatted first if the error is lazy; formats that take
+   more arguments than a lazy error keeps, or ones it does not know,
+   are formatted right away by ErrPrintf */
+LPCSTR ErrorReason(LPERROR lpError);
+
 BOOL IsError(LPERROR lpError);
 
 /*** --------------------------- COMMAND --------------------------- ***/
@@ -90,11 +130,22 @@ typedef struct stCommand
   struct stCommand *lpNext;
 
   LPVOID lpExtraData;
+  BOOL bHeapAlloc;
+  /* atom of lpszCmd, see CommandAtom; reset to ATOM_NONE together with
+     dwlBinding */
+  DWORD dwAtom;
+  /* resolved handler, owned by the runner; reset to 0 after changing
+     lpszCmd of an existing command */
+  DWORDLONG dwlBinding;
   SRCINFO srcInfo;
   LPSTR lpszCmd;
   LPSTR aszArgs[0];
 } *LPCOMMAND;
 
+/* allocates the command on the heap. DropProgram releases the ones a
+   handler made during a run of the program, and all of them in a
+   program built by hand; a parsed program given new commands outside
+   of its runs gets them from CreateProgramCommand */
 LPCOMMAND CreateCommand(LPCOMMAND lpPrev,
                         LPCOMMAND lpNext,
                         LPVOID lpExtraData,
@@ -106,21 +157,172 @@ WORD CountCommandArgs(LPCOMMAND lpCmd);
 
 /*** ------------------------- pl2w_Program ------------------------ ***/
 
+struct stArenaBlock;
+struct stFlatProgram;
+struct stAtomTable;
+struct stLineIndex;
+
 struct stProgram
 {
   LPCOMMAND lpCommands;
+  struct stArenaBlock *lpArena;
+  struct stFlatProgram *lpFlat;
+  struct stAtomTable *lpAtoms;
+  struct stLineIndex *lpLines;
+  /* commands CreateCommand made during runs of the program and not
+     released yet; DropProgram only walks the commands for them while
+     there are any */
+  LONG nHeapCommands;
 };
 
 typedef struct stProgram *LPPROGRAM;
 typedef const struct stProgram *LPCPROGRAM;
 
+/* like CreateCommand, but the command is allocated from the arena of
+   lpProgram and released together with it by DropProgram */
+LPCOMMAND CreateProgramCommand(LPPROGRAM lpProgram,
+                               LPCOMMAND lpPrev,
+                               LPCOMMAND lpNext,
+                               LPVOID lpExtraData,
+                               SRCINFO srcInfo,
+                               LPSTR lpszCmd,
+                               LPSTR aszArgs[]);
+
 void InitProgram(LPPROGRAM lpProgram);
 LPPROGRAM ParseProgram(LPSTR lpszSource,
                        WORD nParseBufferSize,
                        LPERROR lpError);
+
+/* like ParseProgram, but a large source of cbSource bytes is cut at
+   line boundaries into up to nThreads chunks (0 means one per
+   processor) that are parsed at the same time; commands, line numbers
+   and errors come out the same */
+LPPROGRAM ParseProgramParallel(LPSTR lpszSource,
+                               SIZE_T cbSource,
+                               WORD nParseBufferSize,
+                               DWORD nThreads,
+                               LPERROR lpError);
+
+/* like ParseProgram, but lpszSource is never written to: commands get
+   copies of their strings, so the source can go on being edited */
+LPPROGRAM ParseProgramCopy(LPCSTR lpszSource,
+                           WORD nParseBufferSize,
+                           LPERROR lpError);
+
+/* brings lpProgram, parsed by ParseProgramCopy from lpszSource, up to
+   date with an edit replacing cbRemoved bytes at nEditStart with the
+   cbText bytes at lpszText. Only the commands on the lines the edit
+   touches are parsed again, together with the `?begin` block around
+   them; later commands keep their strings and bindings, and an index
+   of the program's lines keeps the cost of an edit down to the lines
+   it touches. The line numbers of later commands are moved by
+   SettleProgramLines, and the command list must not be changed by
+   hand between edits. lpszSource is the source before the edit and
+   is not changed. On an error lpProgram is left as it was. Flattened
+   programs cannot be reparsed, and replaced commands only release
+   their memory in DropProgram */
+BOOL ReparseProgram(LPPROGRAM lpProgram,
+                    LPCSTR lpszSource,
+                    SIZE_T nEditStart,
+                    SIZE_T cbRemoved,
+                    LPCSTR lpszText,
+                    SIZE_T cbText,
+                    WORD nParseBufferSize,
+                    LPERROR lpError);
+
+/* moves the srcInfo.nLine of the commands behind the edits made by
+   ReparseProgram since the last call to their new lines; this costs a
+   walk over those commands, so a run of edits pays for it once. Call
+   it before reading line numbers after an edit; RunProgram and
+   FlattenProgram call it themselves */
+void SettleProgramLines(LPPROGRAM lpProgram);
 void DropProgram(LPPROGRAM lpProgram);
 void DebugPrintProgram(LPCPROGRAM lpProgram);
 
+/* repacks lpProgram into one contiguous command array, with argument
+   offsets into a single string block, and releases the linked list;
+   RunProgram walks the array directly and rebuilds lpCommands as a
+   view only once a WCALL or fallback handler needs it. From then on
+   the views are what runs, so handlers may rename them or change their
+   arguments as in a linked program */
+BOOL FlattenProgram(LPPROGRAM lpProgram, LPERROR lpError);
+
+/*** ------------------------- Command atoms ------------------------ ***/
+
+#define ATOM_NONE     0   /* not interned yet */
+#define ATOM_LANGUAGE 1   /* built-in `language` */
+#define ATOM_ABORT    2   /* built-in `abort` */
+
+/* a small integer standing for lpszCmdName in lpProgram: equal names
+   get equal atoms for as long as the program lives, so handlers can
+   compare atoms instead of strings. Returns ATOM_NONE only when out
+   of memory */
+DWORD GetCommandAtom(LPPROGRAM lpProgram, LPCSTR lpszCmdName);
+
+/* the atom of lpCmd->lpszCmd for a command of lpProgram; parsed
+   commands come with theirs, others are interned on first use */
+DWORD CommandAtom(LPPROGRAM lpProgram, LPCOMMAND lpCmd);
+
+/* the name dwAtom was interned from, or NULL for an unknown atom */
+LPCSTR AtomName(LPPROGRAM lpProgram, DWORD dwAtom);
+
+/*** ----------------------- Compiled programs ---------------------- ***/
+
+/* writes lpProgram, flattened first, to a .pl2c file: its command,
+   argument and line tables plus a pool storing each distinct string
+   once, tagged with the PL2W_VER_* that wrote it */
+BOOL SaveCompiledProgram(LPPROGRAM lpProgram,
+                         LPCSTR lpszFileName,
+                         LPERROR lpError);
+
+/* maps a .pl2c file and runs it in place, with nothing parsed or
+   allocated per command; processes loading the same file share its
+   pages. Images written by another PL2W version are refused */
+LPPROGRAM LoadCompiledProgram(LPCSTR lpszFileName, LPERROR lpError);
+
+/*** ------------------------- Source files ------------------------- ***/
+
+/* a `\0`-terminated script; disk files are mapped copy-on-write, so
+   ParseProgram only gets private copies of the pages it writes to.
+   The source has to outlive every program parsed from it */
+typedef struct stSource
+{
+  LPSTR lpszSource;
+  SIZE_T cbSource;
+
+  HANDLE hMapping;
+  LPVOID lpView;
+} *LPSOURCE;
+
+/* lpszFileName `-` reads standard input; pipes and consoles are read
+   into memory instead of mapped */
+LPSOURCE OpenSource(LPCSTR lpszFileName, LPERROR lpError);
+void CloseSource(LPSOURCE lpSource);
+
+/*** --------------------------- Streaming -------------------------- ***/
+
+#define STREAM_DEFAULT_WINDOW (1024 * 1024)
+
+typedef struct stStream *LPSTREAM;
+
+/* parses commands from hFile a window of about cbWindow bytes at a
+   time (0 selects STREAM_DEFAULT_WINDOW); the window only grows when a
+   single command does not fit it. hFile stays owned by the caller */
+LPSTREAM OpenStream(HANDLE hFile,
+                    LPCSTR lpszFileName,
+                    SIZE_T cbWindow,
+                    WORD nParseBufferSize,
+                    LPERROR lpError);
+
+/* appends the commands of the next window to the stream program and
+   returns the first of them, or NULL at end of input or on error */
+LPCOMMAND ReadStreamCommands(LPSTREAM lpStream, LPERROR lpError);
+
+/* releases every command read so far */
+void ReleaseStreamCommands(LPSTREAM lpStream);
+LPPROGRAM GetStreamProgram(LPSTREAM lpStream);
+void CloseStream(LPSTREAM lpStream);
+
 /*** -------------------- Semantic-ver parsing  -------------------- ***/
 
 #define SEMVER_POSTFIX_LEN 15
@@ -143,13 +345,29 @@ BOOL IsCompatible(SEMVER expected, SEMVER actual);
 CMPRESULT CompareSemVer(SEMVER ver1, SEMVER ver2);
 void FormatSemVer(SEMVER ver, LPSTR lpszBuffer);
 
+/* the numeric part of a version as major << 32 | minor << 16 | patch,
+   so versions with the same postfix order as their keys do */
+typedef ULONGLONG SEMVERKEY;
+
+SEMVERKEY PackSemVer(SEMVER ver);
+CMPRESULT CompareSemVerKeys(SEMVERKEY lhs, SEMVERKEY rhs);
+BOOL IsCompatibleKey(SEMVERKEY expected, SEMVERKEY actual, BOOL bExact);
+
 /*** ------------------------ pl2w_Extension ----------------------- ***/
 
 typedef void (*LPSINVPROC)(LPCSTR aStrings[]);
+/* aaszArgs holds the argument vectors of nCount consecutive commands
+   bound to the same handler, in program order */
+typedef void (*LPSINVBATCHPROC)(LPCSTR *aaszArgs[], DWORD nCount);
+/* a command is bound to its handler once, when the language is loaded,
+   so a handler that renames a command has to reset its dwlBinding to 0
+   for the new name to be looked up */
 typedef LPCOMMAND (*LPWCALLPROC)(LPPROGRAM lpProgram,
                                  LPVOID lpUserContext,
                                  LPCOMMAND lpCommand,
                                  LPERROR lpError);
+/* asked every time a command with the handler's name runs, after
+   lpfnInitProc, so it may answer from state of its own */
 typedef BOOL (*LPROUTERPROC)(LPCSTR lpszCommand);
 
 typedef LPVOID (*LPINITPROC)(LPERROR lpError);
@@ -172,6 +390,16 @@ typedef struct
   BOOL bRemoved;
 } WCALLHANDLER;
 
+/* a fixed sequence of sinvoke commands the language runs in one call */
+typedef struct
+{
+  /* names of the commands in program order, NULL terminated; each has
+     to name a sinvoke handler */
+  LPCSTR *alpszCmdNames;
+  /* gets the argument vectors of the nCount commands of a window */
+  LPSINVBATCHPROC lpfnFusedProc;
+} FUSEDHANDLER;
+
 #define IS_EMPTY_SINVOKE_CMD(cmd) \
   ((cmd)->lpszCmdName == 0 && \
    (cmd)->lpfnHandlerProc == 0)
@@ -179,6 +407,7 @@ typedef struct
   ((cmd)->lpszCmdName == 0 \
    && (cmd)->lpfnRouterProc == 0 \
    && (cmd)->lpfnHandlerProc == 0)
+#define IS_EMPTY_FUSED(fused) ((fused)->alpszCmdNames == 0)
 
 typedef struct stLanguage
 {
@@ -194,13 +423,182 @@ typedef struct stLanguage
   LPWCALLPROC lpfnFallbackProc;
 } *LPLANGUAGE;
 
+/* each run of the sinvoke command lpszCmdName is handed over in one
+   call instead of calling its lpfnHandlerProc per command */
+typedef struct
+{
+  LPCSTR lpszCmdName;
+  LPSINVBATCHPROC lpfnBatchProc;
+} BATCHHANDLER;
+
+#define IS_EMPTY_BATCH(batch) ((batch)->lpszCmdName == 0)
+
+/* what a language offers beyond struct stLanguage, which languages
+   built before these existed do not know of. A language with any of
+   them exports a LPFEATURESPROC named LoadLanguageFeatures, and sets
+   cbSize to the sizeof(struct stLangFeatures) it was built with; fields
+   past cbSize are taken as NULL */
+typedef struct stLangFeatures
+{
+  DWORD cbSize;
+  /* optional, NULL name terminated */
+  BATCHHANDLER *aBatchHandlers;
+  /* optional; each window of commands matching one of these, the first
+     matching in table order, runs as one call to its lpfnFusedProc. A
+     jump into the middle of a window runs the rest of it command by
+     command. Programs run with bSharedProgram are not fused */
+  FUSEDHANDLER *aFusedHandlers;
+} *LPLANGFEATURES;
+
 typedef LPLANGUAGE (*LPLOADPROC)(SEMVER version,
                                  LPERROR lpError);
+/* called with what LoadLanguageExtension returned */
+typedef LPLANGFEATURES (*LPFEATURESPROC)(LPLANGUAGE lpLanguage);
 typedef LPCSTR* (*LPEASYLOADPROC)(void);
 
+/* a loaded language stays loaded, keyed by its id and version, so later
+   `language` commands asking for it only call its lpfnInitProc and
+   lpfnAtexitProc. Evicts lpszLangId, or every language when NULL; one
+   still running is unloaded when its last run ends. Returns how many
+   were evicted. A lazy error a language reported must be formatted with
+   ErrorReason before its language is unloaded */
+DWORD EvictLanguages(LPCSTR lpszLangId);
+
+/*** ----------------------- Language registry ---------------------- ***/
+
+/* `language <id> <ver>` loads the newest lib<id>-<semver>.dll that is
+   compatible with <ver> from the directories of the search path, and
+   lib<id>.dll when there is none. The search path is a `;` separated
+   list of directories, PL2W_LANG_PATH or `.` when NULL. Directories are
+   listed once per process, and the listings are kept in lpszCacheFile,
+   PL2W_LANG_CACHE or pl2w-langs.cache in the temporary directory when
+   NULL, until the modification time of the directory changes. Takes
+   effect with the next `language` command */
+BOOL SetLanguagePath(LPCSTR lpszSearchPath, LPCSTR lpszCacheFile);
+
+/* the library `language <id> <ver>` would load, copied to lpszPath of
+   MAX_PATH chars, and its version, or ZeroVersion for lib<id>.dll, to
+   lpFound when not NULL. FALSE when the search path has none */
+BOOL ResolveLanguage(LPCSTR lpszLangId,
+                     SEMVER ver,
+                     LPSTR lpszPath,
+                     SEMVER *lpFound);
+
+/*** ---------------------------- Tracing --------------------------- ***/
+
+/* records Chrome trace-event spans for source loading, parsing,
+   language loading and runs, and one per executed command when
+   bCommands is set, until StopTrace writes them to lpszFileName as
+   JSON. Threads record into buffers of their own; without a StopTrace
+   the file is written at exit. PL2W_TRACE=<file> starts a trace for
+   the whole process, PL2W_TRACE_COMMANDS=1 adding commands. Returns
+   FALSE if a trace is already running or out of memory */
+BOOL StartTrace(LPCSTR lpszFileName, BOOL bCommands);
+
+/* call once no thread records any more */
+void StopTrace(void);
+
 /*** ----------------------------- Run ----------------------------- ***/
 
+/* callers set cbSize to the sizeof(RUNOPTIONS) they were built with;
+   fields past cbSize are taken as NULL or FALSE, so options added later
+   stay off for callers that do not know of them */
+typedef struct
+{
+  DWORD cbSize;
+  /* where a per-handler and per-line execution profile is written when
+     the run ends, "-" meaning standard error; NULL falls back to the
+     PL2W_PROFILE environment variable, and profiling is off when
+     neither is set */
+  LPCSTR lpszProfileFile;
+  /* lpProgram may be run by several threads at once: the run keeps all
+     handler bindings to itself and writes nothing to the program, and
+     its handlers must not change it either */
+  BOOL bSharedProgram;
+  /* an EasyLoad language looks up each EL<name> symbol when the command
+     is first run instead of all of them when it is loaded, so a missing
+     one is only reported once a command needs it */
+  BOOL bLazyEasyLoad;
+  /* RunProgramEx decodes the program into threaded code once a language
+     is loaded and runs that, with the same results and errors; ignored
+     when profiling or tracing commands and with bSharedProgram, and by
+     RunStreamEx, sessions and ScheduleProgram */
+  BOOL bThreadedCode;
+} RUNOPTIONS;
+
 void RunProgram(LPPROGRAM lpProgram, LPERROR lpError);
+void RunProgramEx(LPPROGRAM lpProgram,
+                  const RUNOPTIONS *lpOptions,
+                  LPERROR lpError);
+
+/* runs lpStream while reading it; executed commands are released after
+   each window unless the language has WCALL or fallback handlers, which
+   may jump back to them */
+void RunStream(LPSTREAM lpStream, LPERROR lpError);
+void RunStreamEx(LPSTREAM lpStream,
+                 const RUNOPTIONS *lpOptions,
+                 LPERROR lpError);
+
+/*** ---------------------------- Sessions -------------------------- ***/
+
+/* a run fed source text piece by piece, as from an interactive prompt;
+   its language stays loaded and initialized from one piece to the
+   next */
+typedef struct stSession *LPSESSION;
+
+LPSESSION OpenSession(LPCSTR lpszFileName,
+                      const RUNOPTIONS *lpOptions,
+                      WORD nParseBufferSize,
+                      LPERROR lpError);
+
+/* parses the cbText bytes at lpszText after the text fed so far and
+   runs each command they complete; a command still open, such as a
+   line without its newline or a `?begin` block, waits for more text.
+   cbText 0 ends the input and runs what is left. On a parse or runtime
+   error the rest of the text fed so far is dropped and the session
+   goes on. Returns FALSE once the session has ended, by `abort`, by the
+   language or at the end of input */
+BOOL FeedSession(LPSESSION lpSession,
+                 LPCSTR lpszText,
+                 SIZE_T cbText,
+                 LPERROR lpError);
+
+/* TRUE while fed text waits for the rest of its command */
+BOOL SessionNeedsInput(LPSESSION lpSession);
+void CloseSession(LPSESSION lpSession);
+
+/*** --------------------------- Scheduler -------------------------- ***/
+
+/* A handler may suspend the run it is called from: it calls SuspendRun
+   and returns as usual, and the run goes on once hObject is signaled or
+   dwMilliseconds have passed, with the command the handler returned. A
+   NULL hObject just waits dwMilliseconds, INFINITE waits for hObject
+   without a timeout. Under a scheduler other runs go on meanwhile, any
+   other run blocks its thread. Returns FALSE outside of a handler */
+BOOL SuspendRun(HANDLE hObject, DWORD dwMilliseconds);
+
+/* WAIT_OBJECT_0 or WAIT_TIMEOUT for how the last wait of the current
+   run ended */
+DWORD GetSuspendResult(void);
+
+/* runs many programs on one thread, switching to another run whenever
+   one suspends; waits are registered with the thread pool and reported
+   through an I/O completion port */
+typedef struct stScheduler *LPSCHEDULER;
+
+LPSCHEDULER CreateScheduler(LPERROR lpError);
+
+/* lpProgram starts at the next RunScheduler; errors of its run go to
+   lpError, which must outlive it. A program scheduled more than once
+   wants bSharedProgram, its runs take turns on its commands */
+BOOL ScheduleProgram(LPSCHEDULER lpScheduler,
+                     LPPROGRAM lpProgram,
+                     const RUNOPTIONS *lpOptions,
+                     LPERROR lpError);
+
+/* returns once every scheduled run has ended */
+void RunScheduler(LPSCHEDULER lpScheduler);
+void DropScheduler(LPSCHEDULER lpScheduler);
 
 #ifdef __cplusplus
 } /* extern "C" */